@@ -323,7 +323,7 @@ namespace box2d
 					std::vector<b2Vec2> v;
 					v.reserve(num_elements);
 					for(int n = 0; n != num_elements; ++n) {
-						ASSERT_LOG(shape["box"][n].is_list() && shape["box"][n].num_elements() > 2, 
+						ASSERT_LOG(shape["box"][n].is_list() && shape["box"][n].num_elements() >= 2, 
 							"Inner elements must be lists of at least two elements.");
 						v.push_back(b2Vec2(float(shape["box"][n][0].as_decimal().as_float()),
 							float(shape["box"][n][1].as_decimal().as_float())));
@@ -391,9 +391,9 @@ namespace box2d
 				bool loop = shape["loop"].as_bool(false);
 				std::vector<b2Vec2> vertices;
 				for(size_t n = 0; n < shape["vertices"].num_elements(); ++n) {
-					ASSERT_LOG(shape["vertices"][n].is_list() && shape["vertices"][n].num_elements() > 2, 
-						"Inner items on vertices must be lists of length > 2.");
-					vertices.push_back(b2Vec2(float32(shape["vertices"][n][0].as_decimal().as_float()), float32(shape["vertex3"][n][1].as_decimal().as_float())));
+					ASSERT_LOG(shape["vertices"][n].is_list() && shape["vertices"][n].num_elements() >= 2, 
+						"Inner items on vertices must be lists of at least two elements.");
+					vertices.push_back(b2Vec2(float32(shape["vertices"][n][0].as_decimal().as_float()), float32(shape["vertices"][n][1].as_decimal().as_float())));
 				}
 				if(loop) {
 					chain_shape->CreateLoop(&vertices[0], vertices.size());
@@ -722,7 +722,7 @@ namespace box2d
 
 	variant body::fix_write()
 	{
-		variant_builder res;
+		std::vector<variant> res;
 		std::vector<boost::shared_ptr<b2FixtureDef> >::const_iterator it = fix_defs_.begin();
 		while(it != fix_defs_.end()) {
 			variant_builder fix;
@@ -738,10 +738,10 @@ namespace box2d
 			fix.add("filter", filter.build());
 			fix.add("shape", shape_write((*it)->shape));
 			
-			res.add("fixtures", fix.build());
+			res.push_back(fix.build());
 			++it;
 		}
-		return res.build();
+		return variant(&res);
 	}
 
 	variant body::shape_write(const b2Shape* shape)
@@ -41,10 +41,17 @@ std::vector<int> completed_tasks;
 
 std::map<int, task> task_map;
 
+struct incremental_task {
+	boost::function<bool()> step;
+	boost::function<void()> on_complete;
+};
+
+std::vector<incremental_task> incremental_tasks;
+
 void run_task(boost::function<void()> job, int task_id)
 {
 	job();
-	threading::lock(*completed_tasks_mutex);
+	threading::lock lck(*completed_tasks_mutex);
 	completed_tasks.push_back(task_id);
 }
 
@@ -57,7 +64,7 @@ manager::manager()
 
 manager::~manager()
 {
-	while(task_map.empty() == false) {
+	while(task_map.empty() == false || incremental_tasks.empty() == false) {
 		pump();
 	}
 }
@@ -69,11 +76,17 @@ void submit(boost::function<void()> job, boost::function<void()> on_complete)
 	++next_task_id;
 }
 
+void submit_incremental(boost::function<bool()> step, boost::function<void()> on_complete)
+{
+	incremental_task t = { step, on_complete };
+	incremental_tasks.push_back(t);
+}
+
 void pump()
 {
 	std::vector<int> completed;
 	{
-		threading::lock(*completed_tasks_mutex);
+		threading::lock lck(*completed_tasks_mutex);
 		completed.swap(completed_tasks);
 	}
 
@@ -81,6 +94,17 @@ void pump()
 		task_map[t].on_complete();
 		task_map.erase(t);
 	}
+
+	//steps may submit more tasks, so work on a copy of the tasks.
+	std::vector<incremental_task> tasks;
+	tasks.swap(incremental_tasks);
+	foreach(incremental_task& t, tasks) {
+		if(t.step()) {
+			t.on_complete();
+		} else {
+			incremental_tasks.push_back(t);
+		}
+	}
 }
 
 }
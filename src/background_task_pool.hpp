@@ -31,6 +31,11 @@ void pump();
 
 void submit(boost::function<void()> job, boost::function<void()> on_complete);
 
+//submits a job which can't be run away from the main thread. Instead step
+//is called once each time pump() is called until it returns true, and
+//then on_complete is called.
+void submit_incremental(boost::function<bool()> step, boost::function<void()> on_complete);
+
 }
 
 #endif
@@ -14,12 +14,20 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+
 #include "asserts.hpp"
 #include "collision_utils.hpp"
+#include "custom_object_type.hpp"
 #include "foreach.hpp"
 #include "geometry.hpp"
 #include "level.hpp"
 #include "object_events.hpp"
+#include "preferences.hpp"
+#include "random.hpp"
+#include "unit_test.hpp"
+
+PREF_BOOL(solid_point_masks, true, "Test objects' solid points against the level a row at a time rather than point by point");
 
 namespace {
 std::map<std::string, int> solid_dimensions;
@@ -74,12 +82,11 @@ bool point_standable(const level& lvl, const entity& e, int x, int y, collision_
 
 	const point pt(x, y);
 
-	const std::vector<entity_ptr>& chars = lvl.get_solid_chars();
+	std::vector<entity*> chars;
+	lvl.get_solid_chars_in_rect(rect(x, y, 1, 1), chars);
 
-	for(std::vector<entity_ptr>::const_iterator i = chars.begin();
-	    i != chars.end(); ++i) {
-		const entity_ptr& obj = *i;
-		if(&e == obj.get()) {
+	foreach(entity* obj, chars) {
+		if(&e == obj) {
 			continue;
 		}
 
@@ -87,7 +94,7 @@ bool point_standable(const level& lvl, const entity& e, int x, int y, collision_
 			const rect& platform_rect = obj->platform_rect_at(pt.x);
 			if(point_in_rect(pt, platform_rect) && obj->platform()) {
 				if(info) {
-					info->collide_with = obj;
+					info->collide_with = entity_ptr(obj);
 					info->friction = obj->surface_friction();
 					info->traction = obj->surface_traction();
 					info->adjust_y = y - platform_rect.y();
@@ -114,7 +121,7 @@ bool point_standable(const level& lvl, const entity& e, int x, int y, collision_
 
 		if(solid && solid->solid_at(x - obj->x(), y - obj->y(), info ? &info->collide_with_area_id : NULL)) {
 			if(info) {
-				info->collide_with = obj;
+				info->collide_with = entity_ptr(obj);
 				info->friction = obj->surface_friction();
 				info->traction = obj->surface_traction();
 			}
@@ -136,11 +143,12 @@ bool entity_collides(level& lvl, const entity& e, MOVE_DIRECTION dir, collision_
 		return true;
 	}
 
-	const std::vector<entity_ptr>& solid_chars = lvl.get_solid_chars();
-	for(std::vector<entity_ptr>::const_iterator obj = solid_chars.begin(); obj != solid_chars.end(); ++obj) {
-		if(obj->get() != &e && entity_collides_with_entity(e, **obj, info)) {
+	std::vector<entity*> solid_chars;
+	lvl.get_solid_chars_in_rect(e.solid_rect(), solid_chars);
+	foreach(entity* obj, solid_chars) {
+		if(obj != &e && entity_collides_with_entity(e, *obj, info)) {
 			if(info) {
-				info->collide_with = *obj;
+				info->collide_with = entity_ptr(obj);
 			}
 			return true;
 		}
@@ -285,7 +293,18 @@ bool entity_collides_with_level(const level& lvl, const entity& e, MOVE_DIRECTIO
 	}
 
 	foreach(const const_solid_map_ptr& m, s->solid()) {
-		if(lvl.solid(e, m->dir(dir), info ? &info->surf_info : NULL)) {
+		if(g_solid_point_masks) {
+			if(lvl.solid_count(e, m->dir_mask(dir, e.face_right()), true)) {
+				if(info) {
+					//find which surface we hit the same way the points
+					//would, so the surface is the one they'd report.
+					lvl.solid(e, m->dir(dir), &info->surf_info);
+					info->read_surf_info();
+				}
+
+				return true;
+			}
+		} else if(lvl.solid(e, m->dir(dir), info ? &info->surf_info : NULL)) {
 			if(info) {
 				info->read_surf_info();
 			}
@@ -307,6 +326,11 @@ int entity_collides_with_level_count(const level& lvl, const entity& e, MOVE_DIR
 	const frame& f = e.current_frame();
 	int count = 0;
 	foreach(const const_solid_map_ptr& m, s->solid()) {
+		if(g_solid_point_masks) {
+			count += lvl.solid_count(e, m->dir_mask(dir, e.face_right()), false);
+			continue;
+		}
+
 		const std::vector<point>& points = m->dir(dir);
 		foreach(const point& p, points) {
 			const int xpos = e.face_right() ? e.x() + p.x : e.x() + f.width() - 1 - p.x;
@@ -436,6 +460,120 @@ bool place_entity_in_level_with_large_displacement(level& lvl, entity& e)
 	return true;
 }
 
+namespace {
+
+//the 64 bits of a mask row starting at pixel x. Pixels outside the
+//row are transparent.
+uint64_t mask_row_bits(const frame::opacity_mask& mask, const uint64_t* row, int x)
+{
+	if(x >= mask.width || x <= -64) {
+		return 0;
+	}
+
+	if(x < 0) {
+		return row[0] << -x;
+	}
+
+	const int word = x/64;
+	const int shift = x%64;
+	uint64_t result = row[word] >> shift;
+	if(shift != 0 && word+1 < mask.words_per_row) {
+		result |= row[word+1] << (64 - shift);
+	}
+
+	return result;
+}
+
+//tests if any pixel sampled in the given area is opaque in both
+//objects, sampling every 'stride' pixels in each direction starting at
+//the area's top left and including its bottom and right edges. A NULL
+//mask means every pixel of that object counts as opaque. Rows are tested
+//64 pixels at a time by shifting and ANDing the objects' masks.
+bool opaque_pixels_overlap(const rect& area, int stride,
+                           const frame::opacity_mask* mask_a, int ax, int ay,
+                           const frame::opacity_mask* mask_b, int bx, int by)
+{
+	ASSERT_LOG(stride == 1 || stride == 2, "Illegal pixel stride: " << stride);
+	const uint64_t sample_bits = stride == 2 ? 0x5555555555555555ULL : ~uint64_t(0);
+
+	for(int y = area.y(); y <= area.y2(); y += stride) {
+		const uint64_t* row_a = NULL;
+		if(mask_a) {
+			if(y - ay < 0 || y - ay >= mask_a->height) {
+				continue;
+			}
+
+			row_a = mask_a->row(y - ay);
+		}
+
+		const uint64_t* row_b = NULL;
+		if(mask_b) {
+			if(y - by < 0 || y - by >= mask_b->height) {
+				continue;
+			}
+
+			row_b = mask_b->row(y - by);
+		}
+
+		for(int x = area.x(); x <= area.x2(); x += 64) {
+			uint64_t bits = sample_bits;
+			const int remaining = area.x2() - x + 1;
+			if(remaining < 64) {
+				bits &= (uint64_t(1) << remaining) - 1;
+			}
+
+			if(row_a) {
+				bits &= mask_row_bits(*mask_a, row_a, x - ax);
+			}
+
+			if(row_b) {
+				bits &= mask_row_bits(*mask_b, row_b, x - bx);
+			}
+
+			if(bits) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+//the same test as opaque_pixels_overlap() done pixel by pixel with
+//frame::is_alpha(), for frames without opacity masks.
+bool opaque_pixels_overlap_slow(const rect& area, int stride,
+                                const entity& a, const frame& fa, bool check_alpha_a,
+                                const entity& b, const frame& fb, bool check_alpha_b)
+{
+	const int time_a = a.time_in_frame();
+	const int time_b = b.time_in_frame();
+	for(int y = area.y(); y <= area.y2(); y += stride) {
+		for(int x = area.x(); x <= area.x2(); x += stride) {
+			if((!check_alpha_a || !fa.is_alpha(x - a.x(), y - a.y(), time_a, a.face_right())) &&
+			   (!check_alpha_b || !fb.is_alpha(x - b.x(), y - b.y(), time_b, b.face_right()))) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool opaque_pixels_overlap(const rect& area, int stride,
+                           const entity& a, const frame& fa, bool check_alpha_a,
+                           const entity& b, const frame& fb, bool check_alpha_b)
+{
+	const frame::opacity_mask* mask_a = check_alpha_a ? fa.get_opacity_mask(a.time_in_frame(), a.face_right()) : NULL;
+	const frame::opacity_mask* mask_b = check_alpha_b ? fb.get_opacity_mask(b.time_in_frame(), b.face_right()) : NULL;
+	if(check_alpha_a && !mask_a || check_alpha_b && !mask_b) {
+		return opaque_pixels_overlap_slow(area, stride, a, fa, check_alpha_a, b, fb, check_alpha_b);
+	}
+
+	return opaque_pixels_overlap(area, stride, mask_a, a.x(), a.y(), mask_b, b.x(), b.y());
+}
+
+}
+
 int entity_user_collision(const entity& a, const entity& b, collision_pair* areas_colliding, int buf_size)
 {
 	const frame& fa = a.current_frame();
@@ -454,23 +592,13 @@ int entity_user_collision(const entity& a, const entity& b, collision_pair* area
 		foreach(const frame::collision_area& area_b, fb.collision_areas()) {
 			rect rect_b = b.calculate_collision_rect(fb, area_b);
 			if(rects_intersect(rect_a, rect_b)) {
-				const int time_a = a.time_in_frame();
-				const int time_b = b.time_in_frame();
-
 				//we only check every other pixel, since this gives us
 				//enough accuracy and is 4x faster.
 				const int Stride = 2;
-				bool found = false;
 				const rect intersection = intersection_rect(rect_a, rect_b);
-				for(int y = intersection.y(); y <= intersection.y2() && !found; y += Stride) {
-					for(int x = intersection.x(); x <= intersection.x2(); x += Stride) {
-						if((area_a.no_alpha_check || !fa.is_alpha(x - a.x(), y - a.y(), time_a, a.face_right())) &&
-						   (area_b.no_alpha_check || !fb.is_alpha(x - b.x(), y - b.y(), time_b, b.face_right()))) {
-							found = true;
-							break;
-						}
-					}
-				}
+				const bool found = opaque_pixels_overlap(intersection, Stride,
+				                       a, fa, !area_a.no_alpha_check,
+				                       b, fb, !area_b.no_alpha_check);
 
 				if(found) {
 					++result;
@@ -540,20 +668,8 @@ bool entity_user_collision_specific_areas(const entity& a, const std::string& ar
 		return false;
 	}
 
-	const int time_a = a.time_in_frame();
-	const int time_b = b.time_in_frame();
-
 	const rect intersection = intersection_rect(rect_a, rect_b);
-	for(int y = intersection.y(); y <= intersection.y2(); ++y) {
-		for(int x = intersection.x(); x <= intersection.x2(); ++x) {
-			if(!fa.is_alpha(x - a.x(), y - a.y(), time_a, a.face_right()) &&
-			   !fb.is_alpha(x - b.x(), y - b.y(), time_b, b.face_right())) {
-				return true;
-			}
-		}
-	}
-
-	return false;
+	return opaque_pixels_overlap(intersection, 1, a, fa, true, b, fb, true);
 }
 
 namespace {
@@ -599,6 +715,65 @@ int get_collision_event_id(const std::string& area)
 	return cache[area];
 }
 
+//an entity taking part in user collision detection, along with the
+//bounding box of all its collision areas.
+struct user_collision_candidate {
+	entity* e;
+	rect bounds;
+	int index;
+};
+
+bool compare_candidates_by_x(const user_collision_candidate& a, const user_collision_candidate& b)
+{
+	return a.bounds.x() < b.bounds.x() || a.bounds.x() == b.bounds.x() && a.index < b.index;
+}
+
+//finds the pairs of entities, as indexes into chars, whose collision
+//areas might overlap using sweep and prune along the x axis. The
+//pairs are returned in the order a pairwise loop over chars would visit
+//them, so that collision events are generated in the same order.
+void find_user_collision_pairs(const std::vector<entity_ptr>& chars, std::vector<std::pair<int, int> >& pairs)
+{
+	std::vector<user_collision_candidate> candidates;
+	candidates.reserve(chars.size());
+	for(int n = 0; n != chars.size(); ++n) {
+		const entity& e = *chars[n];
+		const frame& f = e.current_frame();
+		rect bounds;
+		foreach(const frame::collision_area& area, f.collision_areas()) {
+			bounds = rect_union(bounds, e.calculate_collision_rect(f, area));
+		}
+
+		//an entity whose collision areas are all empty can't collide.
+		if(bounds.w() == 0 || bounds.h() == 0) {
+			continue;
+		}
+
+		user_collision_candidate c = { chars[n].get(), bounds, n };
+		candidates.push_back(c);
+	}
+
+	std::sort(candidates.begin(), candidates.end(), compare_candidates_by_x);
+
+	for(std::vector<user_collision_candidate>::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+		for(std::vector<user_collision_candidate>::const_iterator j = i + 1; j != candidates.end() && j->bounds.x() < i->bounds.x2(); ++j) {
+			const entity& a = *i->e;
+			const entity& b = *j->e;
+			if((a.weak_collide_dimensions()&b.collide_dimensions()) == 0 &&
+			   (a.collide_dimensions()&b.weak_collide_dimensions()) == 0) {
+				//the objects do not share a dimension, and so can't collide.
+				continue;
+			}
+
+			if(rects_intersect(i->bounds, j->bounds)) {
+				pairs.push_back(std::pair<int, int>(std::min(i->index, j->index), std::max(i->index, j->index)));
+			}
+		}
+	}
+
+	std::sort(pairs.begin(), pairs.end());
+}
+
 }
 
 void detect_user_collisions(level& lvl)
@@ -616,32 +791,31 @@ void detect_user_collisions(level& lvl)
 
 	static const int CollideObjectID = get_object_event_id("collide_object");
 
+	//only run the narrow phase on pairs whose collision areas overlap.
+	std::vector<std::pair<int, int> > pairs;
+	find_user_collision_pairs(chars, pairs);
+
 	const int MaxCollisions = 16;
 	collision_pair collision_buf[MaxCollisions];
-	for(std::vector<entity_ptr>::const_iterator i = chars.begin(); i != chars.end(); ++i) {
-		for(std::vector<entity_ptr>::const_iterator j = i + 1; j != chars.end(); ++j) {
-			const entity_ptr& a = *i;
-			const entity_ptr& b = *j;
-			if(a == b ||
-			   (a->weak_collide_dimensions()&b->collide_dimensions()) == 0 &&
-			   (a->collide_dimensions()&b->weak_collide_dimensions()) == 0) {
-				//the objects do not share a dimension, and so can't collide.
-				continue;
-			}
+	for(std::vector<std::pair<int, int> >::const_iterator i = pairs.begin(); i != pairs.end(); ++i) {
+		const entity_ptr& a = chars[i->first];
+		const entity_ptr& b = chars[i->second];
+		if(a == b) {
+			continue;
+		}
 
-			int ncollisions = entity_user_collision(*a, *b, collision_buf, MaxCollisions);
-			if(ncollisions > MaxCollisions) {
-				ncollisions = MaxCollisions;
-			}
+		int ncollisions = entity_user_collision(*a, *b, collision_buf, MaxCollisions);
+		if(ncollisions > MaxCollisions) {
+			ncollisions = MaxCollisions;
+		}
 
-			for(int n = 0; n != ncollisions; ++n) {
-				{
-					collision_info[collision_key(a, collision_buf[n].first)].push_back(collision_key(b, collision_buf[n].second));
-				}
+		for(int n = 0; n != ncollisions; ++n) {
+			{
+				collision_info[collision_key(a, collision_buf[n].first)].push_back(collision_key(b, collision_buf[n].second));
+			}
 
-				{
-					collision_info[collision_key(b, collision_buf[n].second)].push_back(collision_key(a, collision_buf[n].first));
-				}
+			{
+				collision_info[collision_key(b, collision_buf[n].second)].push_back(collision_key(a, collision_buf[n].first));
 			}
 		}
 	}
@@ -685,17 +859,302 @@ bool is_flightpath_clear(const level& lvl, const entity& e, const rect& area)
 		return false;
 	}
 
-	const std::vector<entity_ptr>& v = lvl.get_solid_chars();
-	for(std::vector<entity_ptr>::const_iterator obj = v.begin();
-	    obj != v.end(); ++obj) {
-		if(obj->get() == &e) {
+	std::vector<entity*> v;
+	lvl.get_solid_chars_in_rect(area, v);
+	foreach(const entity* obj, v) {
+		if(obj == &e) {
 			continue;
 		}
 
-		if(rects_intersect(area, (*obj)->solid_rect())) {
+		if(rects_intersect(area, obj->solid_rect())) {
 			return false;
 		}
 	}
 
 	return true;
 }
+
+namespace {
+//the area covered by a rect as it moves up to 'distance' pixels in a
+//direction.
+rect sweep_rect(const rect& r, MOVE_DIRECTION dir, int distance)
+{
+	switch(dir) {
+	case MOVE_UP: return rect(r.x(), r.y() - distance, r.w(), r.h() + distance);
+	case MOVE_DOWN: return rect(r.x(), r.y(), r.w(), r.h() + distance);
+	case MOVE_LEFT: return rect(r.x() - distance, r.y(), r.w() + distance, r.h());
+	case MOVE_RIGHT: return rect(r.x(), r.y(), r.w() + distance, r.h());
+	default: return r;
+	}
+}
+
+bool swept_path_clear(const level& lvl, const entity& e, MOVE_DIRECTION dir, int distance, int feet_width)
+{
+	const bool check_solid = e.solid() != NULL;
+	const bool check_feet = feet_width >= 0;
+
+	const rect solid_area = sweep_rect(e.solid_rect(), dir, distance);
+	const rect feet_area = sweep_rect(rect::from_coordinates(e.feet_x() - feet_width, e.feet_y(), e.feet_x() + feet_width, e.feet_y()), dir, distance);
+
+	if(check_solid && !e.allow_level_collisions() && lvl.may_be_solid_in_rect(solid_area)) {
+		return false;
+	}
+
+	if(check_feet && lvl.may_be_standable_in_rect(feet_area)) {
+		return false;
+	}
+
+	std::vector<entity*> chars;
+	lvl.get_solid_chars_in_rect(rect_union(solid_area, feet_area), chars);
+	foreach(const entity* obj, chars) {
+		if(obj == &e) {
+			continue;
+		}
+
+		const bool shares_dimension =
+		    (e.solid_dimensions()&obj->weak_solid_dimensions()) != 0 ||
+		    (e.weak_solid_dimensions()&obj->solid_dimensions()) != 0;
+
+		if(check_solid && shares_dimension && rects_intersect(solid_area, obj->solid_rect())) {
+			return false;
+		}
+
+		if(check_feet) {
+			//a platform's surface may be offset vertically anywhere along
+			//its width, so any platform found above or below the feet
+			//counts.
+			const rect& platform = obj->platform_rect();
+			if(obj->platform() && platform.x() < feet_area.x2() && feet_area.x() < platform.x2()) {
+				return false;
+			}
+
+			if(shares_dimension && rects_intersect(feet_area, obj->solid_rect())) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+}
+
+int entity_clear_distance(const level& lvl, const entity& e, MOVE_DIRECTION dir, int max_distance, int feet_width)
+{
+	if(max_distance <= 0 || swept_path_clear(lvl, e, dir, max_distance, feet_width)) {
+		return std::max(max_distance, 0);
+	}
+
+	//the path is clear for 'low' pixels but not for 'high'.
+	int low = 0, high = max_distance;
+	if(!swept_path_clear(lvl, e, dir, 0, feet_width)) {
+		return 0;
+	}
+
+	while(high - low > 1) {
+		const int mid = (low + high)/2;
+		if(swept_path_clear(lvl, e, dir, mid, feet_width)) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+int standable_clear_distance(const level& lvl, const entity& e, int x1, int x2, int y, int dir, int max_distance)
+{
+	if(max_distance <= 0) {
+		return 0;
+	}
+
+	if(x1 > x2) {
+		std::swap(x1, x2);
+	}
+
+	const int y1 = dir < 0 ? y - max_distance : y;
+	std::vector<entity*> chars;
+	lvl.get_solid_chars_in_rect(rect(x1, y1, x2 - x1 + 1, max_distance + 1), chars);
+	foreach(const entity* obj, chars) {
+		if(obj == &e) {
+			continue;
+		}
+
+		const rect area = rect_union(obj->solid_rect(), obj->platform_rect());
+		if(area.x() <= x2 && x1 < area.x2()) {
+			return 0;
+		}
+	}
+
+	int result = max_distance;
+	const int xs[] = {x1, x2};
+	foreach(int x, xs) {
+		const int distance = lvl.standable_distance(x, y, dir, result);
+		if(distance != -1) {
+			result = distance;
+		}
+	}
+
+	return result;
+}
+
+namespace {
+frame::opacity_mask random_opacity_mask(int width, int height)
+{
+	frame::opacity_mask mask;
+	mask.width = width;
+	mask.height = height;
+	mask.words_per_row = std::max(1, (width + 63)/64);
+	mask.bits.resize(mask.words_per_row*height);
+	for(int y = 0; y != height; ++y) {
+		for(int x = 0; x != width; ++x) {
+			if(rng::generate()%8 == 0) {
+				mask.bits[y*mask.words_per_row + x/64] |= uint64_t(1) << (x%64);
+			}
+		}
+	}
+
+	return mask;
+}
+
+bool mask_pixel_opaque(const frame::opacity_mask* mask, int x, int y)
+{
+	if(!mask) {
+		return true;
+	}
+
+	if(x < 0 || y < 0 || x >= mask->width || y >= mask->height) {
+		return false;
+	}
+
+	return (mask->row(y)[x/64] >> (x%64))&1;
+}
+}
+
+UNIT_TEST(opaque_pixels_overlap)
+{
+	for(int n = 0; n != 2000; ++n) {
+		const frame::opacity_mask a = random_opacity_mask(1 + rng::generate()%150, 1 + rng::generate()%40);
+		const frame::opacity_mask b = random_opacity_mask(1 + rng::generate()%150, 1 + rng::generate()%40);
+		const int bx = rng::generate()%200 - 100;
+		const int by = rng::generate()%60 - 30;
+		const rect area(rng::generate()%200 - 100, rng::generate()%60 - 30, rng::generate()%150, rng::generate()%40);
+		const int stride = 1 + n%2;
+		const frame::opacity_mask* mask_a = n%5 == 0 ? NULL : &a;
+		const frame::opacity_mask* mask_b = n%7 == 0 ? NULL : &b;
+
+		bool expected = false;
+		for(int y = area.y(); y <= area.y2() && !expected; y += stride) {
+			for(int x = area.x(); x <= area.x2(); x += stride) {
+				if(mask_pixel_opaque(mask_a, x, y) && mask_pixel_opaque(mask_b, x - bx, y - by)) {
+					expected = true;
+					break;
+				}
+			}
+		}
+
+		CHECK_EQ(opaque_pixels_overlap(area, stride, mask_a, 0, 0, mask_b, bx, by), expected);
+	}
+}
+
+namespace {
+//tests every frame with collision areas of an object type against
+//itself mirrored at a range of offsets, as user collisions do.
+void benchmark_frame_overlaps(int benchmark_iterations, const std::string& type, bool use_masks)
+{
+	const_custom_object_type_ptr t = custom_object_type::get_or_die(type);
+	std::vector<const frame*> frames;
+	foreach(const variant& id, t->available_frames().as_list()) {
+		const frame& f = t->get_frame(id.as_string());
+		if(f.get_opacity_mask(0, true)) {
+			frames.push_back(&f);
+		}
+	}
+
+	ASSERT_LOG(!frames.empty(), "Object " << type << " has no frames with collision areas");
+
+	BENCHMARK_LOOP {
+		foreach(const frame* f, frames) {
+			for(int offset = 0; offset < f->width(); offset += 4) {
+				const rect area(offset, 0, f->width() - offset, f->height());
+				if(use_masks) {
+					opaque_pixels_overlap(area, 2, f->get_opacity_mask(0, true), 0, 0, f->get_opacity_mask(0, false), offset, 0);
+				} else {
+					bool found = false;
+					for(int y = area.y(); y <= area.y2() && !found; y += 2) {
+						for(int x = area.x(); x <= area.x2(); x += 2) {
+							if(!f->is_alpha(x, y, 0, true) && !f->is_alpha(x - offset, y, 0, false)) {
+								found = true;
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+}
+
+BENCHMARK_ARG(frame_overlap_pixel_by_pixel, const std::string& type)
+{
+	benchmark_frame_overlaps(benchmark_iterations, type, false);
+}
+
+BENCHMARK_ARG_CALL_COMMAND_LINE(frame_overlap_pixel_by_pixel);
+
+BENCHMARK_ARG(frame_overlap_opacity_masks, const std::string& type)
+{
+	benchmark_frame_overlaps(benchmark_iterations, type, true);
+}
+
+BENCHMARK_ARG_CALL_COMMAND_LINE(frame_overlap_opacity_masks);
+
+namespace {
+//tests every solid object in a level for collisions with the level in
+//every direction, where the objects stand.
+void benchmark_level_collisions(int benchmark_iterations, const std::string& file, bool use_masks)
+{
+	static std::map<std::string, boost::intrusive_ptr<level> > levels;
+	boost::intrusive_ptr<level>& lvl = levels[file];
+	if(!lvl) {
+		lvl.reset(new level(file));
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+	}
+
+	const bool old_use_masks = g_solid_point_masks;
+	g_solid_point_masks = use_masks;
+
+	BENCHMARK_LOOP {
+		foreach(const entity_ptr& e, lvl->get_chars()) {
+			if(!e->solid()) {
+				continue;
+			}
+
+			for(int dir = 0; dir <= MOVE_NONE; ++dir) {
+				entity_collides_with_level(*lvl, *e, static_cast<MOVE_DIRECTION>(dir), NULL);
+				entity_collides_with_level_count(*lvl, *e, static_cast<MOVE_DIRECTION>(dir));
+			}
+		}
+	}
+
+	g_solid_point_masks = old_use_masks;
+}
+}
+
+BENCHMARK_ARG(level_collisions_point_lists, const std::string& file)
+{
+	benchmark_level_collisions(benchmark_iterations, file, false);
+}
+
+BENCHMARK_ARG_CALL(level_collisions_point_lists, nenes_house_lists, "to-nenes-house.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(level_collisions_point_lists);
+
+BENCHMARK_ARG(level_collisions_point_masks, const std::string& file)
+{
+	benchmark_level_collisions(benchmark_iterations, file, true);
+}
+
+BENCHMARK_ARG_CALL(level_collisions_point_masks, nenes_house_masks, "to-nenes-house.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(level_collisions_point_masks);
@@ -117,4 +117,19 @@ void detect_user_collisions(level& lvl);
 
 bool is_flightpath_clear(const level& lvl, const entity& e, const rect& area);
 
+//function which finds how many pixels, up to max_distance, an entity can
+//move in the direction given by 'dir' without entity_collides() finding
+//a collision at any position along the way. If feet_width is not
+//negative, the entity also can't be standing, with feet that wide, at
+//any of those positions. The result is conservative: the entity might
+//be able to move further than the distance returned.
+int entity_clear_distance(const level& lvl, const entity& e, MOVE_DIRECTION dir, int max_distance, int feet_width=-1);
+
+//function which finds how many pixels can be skipped, moving from y in
+//direction dir (1 for down, -1 for up), before point_standable() could be
+//true at x1 or x2 for the entity. Returns max_distance if it is false for
+//that whole distance, and 0 if there are objects in those columns the
+//entity might stand on.
+int standable_clear_distance(const level& lvl, const entity& e, int x1, int x2, int y, int dir, int max_distance);
+
 #endif
@@ -93,6 +93,10 @@ int32_t remote_highest_confirmed[MAX_PLAYERS];
 
 std::map<int, int> our_checksums;
 
+//whether the state of the level has been dumped since the checksums
+//stopped matching.
+bool desync_dumped;
+
 int starting_cycles;
 int nplayers = 1;
 int local_player;
@@ -210,6 +214,7 @@ void new_level(int level_starting_cycles, int level_nplayers, int level_local_pl
 	starting_cycles = level_starting_cycles;
 	nplayers = level_nplayers;
 	local_player = level_local_player;
+	desync_dumped = false;
 	foreach(std::vector<ControlFrame>& v, controls) {
 		v.clear();
 	}
@@ -224,10 +229,11 @@ void new_level(int level_starting_cycles, int level_nplayers, int level_local_pl
 }
 
 
-local_controls_lock::local_controls_lock(unsigned char state)
+local_controls_lock::local_controls_lock(unsigned char state, const std::string& user)
 {
 	ControlFrame ctrl;
 	ctrl.keys = state;
+	ctrl.user = user;
 	local_control_locks.push(ctrl);
 }
 
@@ -403,6 +409,18 @@ void get_control_status(int cycle, int player, bool* output, const std::string**
 	}
 }
 
+bool last_local_controls(unsigned char* keys, std::string* user)
+{
+	if(local_player < 0 || local_player >= nplayers || controls[local_player].empty()) {
+		return false;
+	}
+
+	const ControlFrame& frame = controls[local_player].back();
+	*keys = frame.keys;
+	*user = frame.user;
+	return true;
+}
+
 void set_delay(int value)
 {
 	delay = value;
@@ -451,6 +469,10 @@ void read_control_packet(const char* buf, size_t len)
 			std::cerr << "CHECKSUM MATCH FOR " << current_cycle << ": " << checksum << "\n";
 		} else {
 			std::cerr << "CHECKSUM DID NOT MATCH FOR " << current_cycle << ": " << checksum << " VS " << our_checksums[current_cycle-1] << "\n";
+			if(!desync_dumped) {
+				desync_dumped = true;
+				level::current().dump_desync_state(current_cycle-1);
+			}
 		}
 
 	}
@@ -19,6 +19,7 @@
 
 #include <boost/scoped_ptr.hpp>
 
+#include <string>
 #include <vector>
 #include <cstddef>
 
@@ -55,7 +56,7 @@ void new_level(int starting_cycle, int nplayers, int local_player);
 //of its scope.
 class local_controls_lock {
 public:
-	explicit local_controls_lock(unsigned char state=0);
+	explicit local_controls_lock(unsigned char state=0, const std::string& user=std::string());
 	~local_controls_lock();
 };
 
@@ -82,6 +83,10 @@ void unread_local_controls();
 void ignore_current_keypresses();
 
 void get_control_status(int cycle, int player, bool* output, const std::string** user=NULL);
+
+//the controls read by the last call to read_local_controls(). Returns
+//false if no local controls have been read.
+bool last_local_controls(unsigned char* keys, std::string* user);
 void set_delay(int delay);
 
 void read_control_packet(const char* buf, size_t len);
@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 
@@ -51,6 +52,7 @@
 #include "object_events.hpp"
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
+#include "random.hpp"
 #include "raster.hpp"
 #include "string_utils.hpp"
 #include "surface_formula.hpp"
@@ -61,6 +63,8 @@
 #include "sound.hpp"
 #include "widget_factory.hpp"
 
+extern bool g_headless;
+
 class active_property_scope {
 	const custom_object& obj_;
 	int prev_prop_;
@@ -83,6 +87,8 @@ public:
 	}
 };
 
+PREF_BOOL(swept_collisions, true, "Skip per-pixel collision checks along stretches of an object's movement which are known to be clear");
+
 namespace {
 
 const int widget_zorder_draw_later_threshold = 1000;
@@ -390,13 +396,13 @@ custom_object::custom_object(variant node)
 	set_mouseover_delay(node["mouseover_delay"].as_int(0));
 
 #if defined(USE_SHADERS)
-	if(node.has_key("shader")) {
+	if(node.has_key("shader") && !g_headless) {
 		shader_.reset(new gles2::shader_program(node["shader"]));
 	} else if(type_->shader()) {
 		shader_.reset(new gles2::shader_program(*type_->shader()));
 	}
 
-	if(node.has_key("effects")) {
+	if(node.has_key("effects") && !g_headless) {
 		variant effects = node["effects"];
 		for(int n = 0; n != effects.num_elements(); ++n) {
 			effects_.push_back(new gles2::shader_program(effects[n]));
@@ -470,6 +476,8 @@ custom_object::custom_object(variant node)
 			}
 		}
 
+		update_property_hash(e.storage_slot);
+
 		if(!get_property_data(e.storage_slot).is_null()) {
 			properties_requiring_dynamic_initialization_.erase(std::remove(properties_requiring_dynamic_initialization_.begin(), properties_requiring_dynamic_initialization_.end(), i), properties_requiring_dynamic_initialization_.end());
 		}
@@ -531,6 +539,7 @@ custom_object::custom_object(const std::string& type, int x, int y, bool face_ri
 		}
 
 		get_property_data(i->second.storage_slot) = deep_copy_variant(i->second.default_value);
+		update_property_hash(i->second.storage_slot);
 	}
 
 	get_all().insert(this);
@@ -623,6 +632,7 @@ custom_object::custom_object(const custom_object& o) :
 	property_data_(deep_copy_property_data(o.property_data_)),
 
 	active_property_(-1),
+	property_hash_(o.property_hash_),
 	last_hit_by_(o.last_hit_by_),
 	last_hit_by_anim_(o.last_hit_by_anim_),
 	current_animation_id_(o.current_animation_id_),
@@ -740,6 +750,7 @@ void custom_object::init_properties()
 		reference_counted_object_pin_norelease pin(this);
 		get_property_data(i->second.storage_slot) = i->second.init->execute(*this);
 		if(i->second.is_weak) { get_property_data(i->second.storage_slot).weaken(); }
+		update_property_hash(i->second.storage_slot);
 	}
 }
 
@@ -890,6 +901,12 @@ variant custom_object::write() const
 	res.add("x", x());
 	res.add("y", y());
 
+	//positions are kept in hundredths of a pixel, which x and y round off.
+	if(centi_x()%100 || centi_y()%100) {
+		res.add("centi_x", centi_x());
+		res.add("centi_y", centi_y());
+	}
+
 	if(rotate_z_ != decimal()) {
 		res.add("rotate", rotate_z_);
 	}
@@ -1175,6 +1192,204 @@ variant custom_object::write() const
 	return res.build();
 }
 
+namespace {
+//mixes the bits of a hash so that hashes of similar values don't cancel
+//out when combined.
+unsigned int mix_hash(unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+//hashes are FNV-1a over values of fixed width, so machines on different
+//platforms hash the same state to the same value.
+unsigned int hash_bytes(unsigned int h, uint64_t value, int nbytes)
+{
+	for(int n = 0; n != nbytes; ++n) {
+		h = (h ^ static_cast<unsigned int>(value & 0xff))*16777619u;
+		value >>= 8;
+	}
+
+	return h;
+}
+
+unsigned int hash_string(unsigned int h, const std::string& str)
+{
+	foreach(char c, str) {
+		h = (h ^ static_cast<unsigned char>(c))*16777619u;
+	}
+
+	return h;
+}
+
+unsigned int hash_string(const std::string& str)
+{
+	return hash_string(2166136261u, str);
+}
+
+unsigned int hash_variant(unsigned int h, const variant& value)
+{
+	h = hash_bytes(h, value.type(), 1);
+	switch(value.type()) {
+	case variant::VARIANT_TYPE_BOOL:
+		return hash_bytes(h, value.as_bool(), 1);
+	case variant::VARIANT_TYPE_INT:
+		return hash_bytes(h, static_cast<uint32_t>(value.as_int()), 4);
+	case variant::VARIANT_TYPE_DECIMAL:
+		return hash_bytes(h, static_cast<uint64_t>(value.as_decimal().value()), 8);
+	case variant::VARIANT_TYPE_STRING:
+		return hash_string(h, value.as_string());
+	case variant::VARIANT_TYPE_LIST:
+		h = hash_bytes(h, value.num_elements(), 4);
+		for(int n = 0; n != value.num_elements(); ++n) {
+			h = hash_variant(h, value[n]);
+		}
+
+		return h;
+	case variant::VARIANT_TYPE_MAP: {
+		const std::map<variant, variant>& m = value.as_map();
+		h = hash_bytes(h, m.size(), 4);
+		for(std::map<variant, variant>::const_iterator i = m.begin(); i != m.end(); ++i) {
+			h = hash_variant(hash_variant(h, i->first), i->second);
+		}
+
+		return h;
+	}
+	default:
+		//objects and functions are only hashed by type, since their
+		//identity isn't the same on other machines.
+		return h;
+	}
+}
+
+//lists and maps can be changed in place by FFL without the property
+//being set, so they're hashed when the hash is taken.
+bool hashed_on_read(const variant& value)
+{
+	return value.is_list() || value.is_map();
+}
+}
+
+property_state_hash::property_state_hash() : hash_(0), read_hash_(0), read_hash_mutation_count_(0), read_hash_valid_(false)
+{}
+
+void property_state_hash::update(int slot, const variant& value)
+{
+	if(hashes_.size() <= slot) {
+		hashes_.resize(slot+1);
+	}
+
+	const bool on_read = hashed_on_read(value);
+	std::vector<int>::iterator i = std::lower_bound(slots_hashed_on_read_.begin(), slots_hashed_on_read_.end(), slot);
+	const bool listed = i != slots_hashed_on_read_.end() && *i == slot;
+	if(on_read && !listed) {
+		slots_hashed_on_read_.insert(i, slot);
+	} else if(!on_read && listed) {
+		slots_hashed_on_read_.erase(i);
+	}
+
+	if(on_read || listed) {
+		read_hash_valid_ = false;
+	}
+
+	const unsigned int h = on_read ? 0 : value_hash(slot, value);
+	hash_ ^= hashes_[slot] ^ h;
+	hashes_[slot] = h;
+}
+
+void property_state_hash::clear()
+{
+	hashes_.clear();
+	slots_hashed_on_read_.clear();
+	hash_ = 0;
+	read_hash_valid_ = false;
+}
+
+unsigned int property_state_hash::hash(const std::vector<variant>& values) const
+{
+	if(!read_hash_valid_ || read_hash_mutation_count_ != variant::mutation_count()) {
+		read_hash_ = 0;
+		foreach(int slot, slots_hashed_on_read_) {
+			read_hash_ ^= value_hash(slot, values[slot]);
+		}
+
+		read_hash_mutation_count_ = variant::mutation_count();
+		read_hash_valid_ = true;
+	}
+
+	return hash_ ^ read_hash_;
+}
+
+unsigned int property_state_hash::value_hash(int slot, const variant& value)
+{
+	return mix_hash(hash_variant(2166136261u, value) + slot*0x9e3779b9);
+}
+
+void custom_object::update_property_hash(int slot)
+{
+	property_hash_.update(slot, property_data_[slot]);
+}
+
+void custom_object::rehash_properties()
+{
+	property_hash_.clear();
+	for(int n = 0; n != property_data_.size(); ++n) {
+		update_property_hash(n);
+	}
+}
+
+unsigned int custom_object::state_hash() const
+{
+	//the properties are kept hashed as they're set; the rest is only a
+	//few values, so is hashed each time.
+	unsigned int h = property_hash_.hash(property_data_);
+	const int values[] = { centi_x(), centi_y(), velocity_x_, velocity_y_, time_in_frame_, hitpoints_, face_right(), upside_down() };
+	foreach(int value, values) {
+		h = mix_hash(h + value);
+	}
+
+	return mix_hash(h ^ hash_string(frame_name_));
+}
+
+variant custom_object::write_state_hash() const
+{
+	variant_builder res;
+	res.add("type", type_->id());
+	res.add("label", label());
+	res.add("hash", state_hash());
+	res.add("x", centi_x());
+	res.add("y", centi_y());
+	res.add("velocity_x", velocity_x_);
+	res.add("velocity_y", velocity_y_);
+	res.add("frame", frame_name_);
+	res.add("time_in_frame", time_in_frame_);
+	res.add("hitpoints", hitpoints_);
+	res.add("face_right", face_right());
+	res.add("upside_down", upside_down());
+
+	//simple values are written as they are, anything else as its hash.
+	std::map<variant, variant> properties;
+	foreach(const custom_object_type::property_entry& e, type_->slot_properties()) {
+		if(e.storage_slot < 0) {
+			continue;
+		}
+
+		const variant value = get_property_data(e.storage_slot);
+		if(value.is_null() || value.is_bool() || value.is_numeric() || value.is_string()) {
+			properties[variant(e.id)] = value;
+		} else {
+			properties[variant(e.id)] = variant(property_state_hash::value_hash(e.storage_slot, value));
+		}
+	}
+
+	res.add("properties", variant(&properties));
+	return res.build();
+}
+
 void custom_object::setup_drawing() const
 {
 	if(distortion_) {
@@ -1527,6 +1742,8 @@ void custom_object::process(level& lvl)
 		return;
 	}
 
+	mark_changed();
+
 #if defined(USE_BOX2D)
 	box2d::world_ptr world = box2d::world::our_world_ptr();
 	if(body_) {
@@ -1901,6 +2118,18 @@ void custom_object::process(level& lvl)
 	bool is_stuck = false;
 
 	collide = false;
+
+	//find how far we can move vertically before there's anything we could
+	//collide with or land on. Steps within that distance don't need to check
+	//for collisions.
+	const int swept_start_y = y();
+	int swept_clear_y = -1;
+	if(g_swept_collisions && effective_velocity_y && !type_->object_level_collisions() && !type_->ignore_collide()) {
+		const int max_distance = (std::abs(effective_velocity_y) + 99)/100;
+		const int feet_width = effective_velocity_y > 0 && has_feet() ? std::max(type_->feet_width(), 0) : -1;
+		swept_clear_y = entity_clear_distance(lvl, *this, effective_velocity_y > 0 ? MOVE_DOWN : MOVE_UP, max_distance, feet_width);
+	}
+
 	int move_left;
 	for(move_left = std::abs(effective_velocity_y); move_left > 0 && !collide && !type_->ignore_collide(); move_left -= 100) {
 		const int dir = effective_velocity_y > 0 ? 1 : -1;
@@ -1916,6 +2145,10 @@ void custom_object::process(level& lvl)
 			break;
 		}
 
+		if(std::abs(y() - swept_start_y) <= swept_clear_y) {
+			continue;
+		}
+
 		if(type_->object_level_collisions() && non_solid_entity_collides_with_level(lvl, *this)) {
 			handle_event(OBJECT_EVENT_COLLIDE_LEVEL);
 		}
@@ -2045,6 +2278,17 @@ void custom_object::process(level& lvl)
 
 	bool horizontal_landed = false;
 
+	//as with vertical movement, find how far we can move before we could
+	//collide with something or start standing. Objects that are standing on
+	//another object follow it, so always do the full checks.
+	const int swept_start_x = x();
+	int swept_clear_x = 0;
+	if(g_swept_collisions && effective_velocity_x && !standing_on_ && !type_->object_level_collisions() && !type_->ignore_collide()) {
+		const int max_distance = (std::abs(effective_velocity_x) + 99)/100;
+		const int feet_width = has_feet() ? std::max(type_->feet_width(), 0) : -1;
+		swept_clear_x = entity_clear_distance(lvl, *this, effective_velocity_x > 0 ? MOVE_RIGHT : MOVE_LEFT, max_distance, feet_width);
+	}
+
 	//we go through up to two passes of moving an object horizontally. On the
 	//first pass, we are 'optimistic' and move the object along, assuming there
 	//will be no collisions. Then at the end of the pass we see if the object is
@@ -2057,6 +2301,17 @@ void custom_object::process(level& lvl)
 
 
 		for(move_left = std::abs(effective_velocity_x); move_left > 0 && !collide && !type_->ignore_collide(); move_left -= 100) {
+			if(std::abs(x() - swept_start_x) < swept_clear_x) {
+				//both where we are and where this step takes us are clear, so
+				//we won't collide or change whether we're standing.
+				const int dir = effective_velocity_x > 0 ? 1 : -1;
+				if(!move_centipixels(std::min(move_left, 100)*dir, 0)) {
+					break;
+				}
+
+				continue;
+			}
+
 			if(type_->object_level_collisions() && non_solid_entity_collides_with_level(lvl, *this)) {
 				handle_event(OBJECT_EVENT_COLLIDE_LEVEL);
 			}
@@ -2700,6 +2955,8 @@ void custom_object::being_added()
 
 void custom_object::set_animated_schedule(boost::shared_ptr<AnimatedMovement> movement)
 {
+	mark_changed();
+
 	assert(movement.get() != NULL);
 	animated_movement_.push_back(movement);
 }
@@ -2888,10 +3145,7 @@ decimal calculate_velocity_angle(int velocity_x, int velocity_y)
 
 variant two_element_variant_list(const variant& a, const variant&b) 
 {
-	std::vector<variant> v;
-	v.push_back(a);
-	v.push_back(b);
-	return variant(&v);
+	return variant::create_list(a, b);
 }
 }
 
@@ -3034,8 +3288,9 @@ variant custom_object::get_value_by_slot(int slot) const
 	case CUSTOM_OBJECT_PLATFORM_MOTION_X: return variant(platform_motion_x());
 	case CUSTOM_OBJECT_REGISTRY:          return variant(preferences::registry());
 	case CUSTOM_OBJECT_GLOBALS:           return variant(global_vars().get());
-	case CUSTOM_OBJECT_VARS:              return variant(vars_.get());
-	case CUSTOM_OBJECT_TMP:               return variant(tmp_vars_.get());
+	//the variables can be modified through the callable returned.
+	case CUSTOM_OBJECT_VARS:              mark_changed(); return variant(vars_.get());
+	case CUSTOM_OBJECT_TMP:               mark_changed(); return variant(tmp_vars_.get());
 	case CUSTOM_OBJECT_GROUP:             return variant(group());
 	case CUSTOM_OBJECT_ROTATE:            return variant(rotate_z_);
 	case CUSTOM_OBJECT_ROTATE_X:            return variant(rotate_x_);
@@ -3508,6 +3763,8 @@ void custom_object::get_inputs(std::vector<game_logic::formula_input>* inputs) c
 
 void custom_object::set_value(const std::string& key, const variant& value)
 {
+	mark_changed();
+
 	const int slot = custom_object_callable::get_key_slot(key);
 	if(slot != -1) {
 		set_value_by_slot(slot, value);
@@ -3649,6 +3906,8 @@ void custom_object::set_value(const std::string& key, const variant& value)
 		} else {
 			draw_area_.reset();
 		}
+
+		spatial_index_changed();
 	} else if(key == "scale") {
 		draw_scale_.reset(new decimal(value.as_decimal()));
 		if(draw_scale_->as_int() == 1 && draw_scale_->fractional() == 0) {
@@ -3661,6 +3920,8 @@ void custom_object::set_value(const std::string& key, const variant& value)
 			ASSERT_LOG(value.is_null(), "BAD ACTIVATION AREA: " << value.to_debug_string());
 			activation_area_.reset();
 		}
+
+		spatial_index_changed();
 	} else if(key == "clip_area") {
 		if(value.is_list() && value.num_elements() == 4) {
 			clip_area_.reset(new rect(value[0].as_int(), value[1].as_int(), value[2].as_int(), value[3].as_int()));
@@ -3753,6 +4014,8 @@ void custom_object::set_value(const std::string& key, const variant& value)
 			set_y(new_value);
 			parallax_scale_millis_->second = v;
 		}
+
+		spatial_index_changed();
 	} else if(key == "type") {
 		const_custom_object_type_ptr p = custom_object_type::get(value.as_string());
 		if(p) {
@@ -3779,6 +4042,7 @@ void custom_object::set_value(const std::string& key, const variant& value)
 		}
 	} else if(key == "use_absolute_screen_coordinates") {
 		use_absolute_screen_coordinates_ = value.as_bool();
+		spatial_index_changed();
 	} else if(key == "mouseover_delay") {
 		set_mouseover_delay(value.as_int());
 #if defined(USE_BOX2D)
@@ -3813,6 +4077,8 @@ void custom_object::set_value(const std::string& key, const variant& value)
 
 void custom_object::set_value_by_slot(int slot, const variant& value)
 {
+	mark_changed();
+
 	switch(slot) {
 	case CUSTOM_OBJECT_DATA: {
 		ASSERT_LOG(active_property_ >= 0, "Illegal access of 'data' in object when not in writable property");
@@ -3821,6 +4087,8 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 			get_property_data(active_property_).weaken();
 		}
 
+		update_property_hash(active_property_);
+
 		//see if this initializes a property that requires dynamic
 		//initialization and if so mark is as now initialized.
 		for(auto itor = properties_requiring_dynamic_initialization_.begin(); itor != properties_requiring_dynamic_initialization_.end(); ++itor) {
@@ -3879,6 +4147,8 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 				if(j->second.is_weak) { get_property_data(j->second.storage_slot).weaken(); }
 			}
 
+			rehash_properties();
+
 			//set the animation to the default animation for the new type.
 			set_frame(type_->default_frame().id());
 			//std::cerr << "SET TYPE WHEN CHANGING TO '" << type_->id() << "'\n";
@@ -4320,6 +4590,7 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 			draw_area_.reset();
 		}
 
+		spatial_index_changed();
 		break;
 
 	case CUSTOM_OBJECT_SCALE:
@@ -4332,7 +4603,7 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 	
 	case CUSTOM_OBJECT_ACTIVATION_BORDER:
 		activation_border_ = value.as_int();
-	
+		spatial_index_changed();
 		break;
 
 			
@@ -4344,6 +4615,7 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 			activation_area_.reset();
 		}
 
+		spatial_index_changed();
 		break;
 	
 	case CUSTOM_OBJECT_CLIP_AREA:
@@ -4358,6 +4630,7 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 
 	case CUSTOM_OBJECT_ALWAYS_ACTIVE:
 		always_active_ = value.as_bool();
+		spatial_index_changed();
 		break;
 			
 	case CUSTOM_OBJECT_VARIATIONS:
@@ -4557,11 +4830,13 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 		for(int n = 0; n != value.num_elements(); ++n) {
 			platform_offsets_.push_back(value[n].as_int());
 		}
+		spatial_index_changed();
 		break;
 	}
 
 	case CUSTOM_OBJECT_USE_ABSOLUTE_SCREEN_COORDINATES: {
 		use_absolute_screen_coordinates_ = value.as_bool();
+		spatial_index_changed();
 		break;
 	}
 
@@ -4783,6 +5058,7 @@ void custom_object::set_value_by_slot(int slot, const variant& value)
 			} else if(e.storage_slot >= 0) {
 				get_property_data(e.storage_slot) = value;
 				if(e.is_weak) { get_property_data(e.storage_slot).weaken(); }
+				update_property_hash(e.storage_slot);
 			} else {
 				ASSERT_LOG(false, "Attempt to set const property: " << debug_description() << "." << e.id);
 			}
@@ -4884,6 +5160,8 @@ void custom_object::set_frame_no_adjustments(const std::string& name)
 
 void custom_object::set_frame_no_adjustments(const frame& new_frame)
 {
+	mark_changed();
+
 	frame_.reset(&new_frame);
 	frame_name_ = new_frame.id();
 	time_in_frame_ = 0;
@@ -4986,6 +5264,43 @@ bool custom_object::is_active(const rect& screen_area) const
 	return false;
 }
 
+bool custom_object::spatial_index_area(rect* area) const
+{
+	//objects whose activity doesn't just depend on where their frame is
+	//are considered by every query.
+	if(always_active() || type_->goes_inactive_only_when_standing() ||
+	   activation_area_ || text_ || draw_area_ || use_absolute_screen_coordinates_) {
+		return false;
+	}
+
+	if(parallax_scale_millis_.get() != NULL &&
+	   (parallax_scale_millis_->first != 1000 || parallax_scale_millis_->second != 1000)) {
+		return false;
+	}
+
+	//the frame determines whether the object is active and where it is
+	//drawn, while the solid area determines its midpoint.
+	const int border = std::max(activation_border_, 0);
+	const rect r = rect_union(frame_rect(), solid_rect());
+	*area = rect(r.x() - border, r.y() - border, r.w() + border*2, r.h() + border*2);
+	return true;
+}
+
+rect custom_object::solid_index_area() const
+{
+	if(platform_offsets_.empty() || platform_rect().w() == 0) {
+		return entity::solid_index_area();
+	}
+
+	//the platform can be found anywhere between its highest and lowest
+	//offsets.
+	const int min_offset = std::min(0, *std::min_element(platform_offsets_.begin(), platform_offsets_.end()));
+	const int max_offset = std::max(0, *std::max_element(platform_offsets_.begin(), platform_offsets_.end()));
+	const rect area = platform_rect();
+	const rect platform(area.x(), area.y() + min_offset, area.w(), area.h() + max_offset - min_offset);
+	return rect_union(solid_rect(), platform);
+}
+
 bool custom_object::move_to_standing(level& lvl, int max_displace)
 {
 	int start_y = y();
@@ -5031,8 +5346,16 @@ bool custom_object::move_to_standing_internal(level& lvl, int max_displace)
 			}
 			return true;
 		}
-		
-		set_pos(x(), y() + 1);
+
+		//skip over positions where we can't possibly be standing.
+		int skip = 0;
+		if(has_feet() && max_displace - n > 1) {
+			const int width = std::max(type_->feet_width(), 0);
+			skip = standable_clear_distance(lvl, *this, feet_x() - width, feet_x() + width, feet_y() + 1, 1, max_displace - n - 1);
+		}
+
+		set_pos(x(), y() + 1 + skip);
+		n += skip;
 	}
 	
 	set_pos(x(), start_y);
@@ -5149,6 +5472,8 @@ bool custom_object::handle_event_internal(int event, const formula_callable* con
 		return false;
 	}
 
+	mark_changed();
+
 	const die_event_scope die_scope(event, currently_handling_die_event_);
 	if(hitpoints_ <= 0 && !currently_handling_die_event_) {
 		return false;
@@ -5251,42 +5576,86 @@ void custom_object::resolve_delayed_events()
 	delayed_commands_.clear();
 }
 
+namespace {
+const game_logic::command_callable* as_slot_mutation(const variant& v, int* slot, const variant** value, bool* add)
+{
+	if(!v.is_callable() || v.as_callable()->command_type() != game_logic::formula_callable::FORMULA_COMMAND) {
+		return NULL;
+	}
+
+	const game_logic::command_callable* cmd = static_cast<const game_logic::command_callable*>(v.as_callable());
+	return cmd->get_slot_mutation(slot, value, add) ? cmd : NULL;
+}
+
+//applies the run of commands starting at list[begin] which only set or add
+//to slots of obj, returning how many commands were applied.
+int execute_slot_mutations(custom_object& obj, const variant& list, int begin)
+{
+	const int num_elements = list.num_elements();
+	const game_logic::command_callable* cmd = NULL;
+	int n = begin;
+	try {
+		fatal_assert_scope scope;
+		int slot;
+		const variant* value;
+		bool add;
+		while(n != num_elements && (cmd = as_slot_mutation(list[n], &slot, &value, &add))) {
+			obj.mutate_value_by_slot(slot, add ? obj.query_value_by_slot(slot) + *value : *value);
+			++n;
+		}
+	} catch(fatal_assert_failure_exception& e) {
+		if(cmd->get_expression()) {
+			ASSERT_FATAL(e.msg << "\nERROR ENCOUNTERED WHILE RUNNING COMMAND GENERATED BY THIS EXPRESSION:\n" << cmd->get_expression()->debug_pinpoint_location());
+		} else {
+			ASSERT_FATAL(e.msg);
+		}
+	}
+
+	return n - begin;
+}
+}
+
 bool custom_object::execute_command(const variant& var)
 {
+	mark_changed();
+
 	bool result = true;
 	if(var.is_null()) { return result; }
 	if(var.is_list()) {
 		const int num_elements = var.num_elements();
-		for(int n = 0; n != num_elements; ++n) {
-			result = execute_command(var[n]) && result;
-		}
-	} else {
-		game_logic::command_callable* cmd = var.try_convert<game_logic::command_callable>();
-		if(cmd != NULL) {
-			cmd->run_command(*this);
-		} else {
-			custom_object_command_callable* cmd = var.try_convert<custom_object_command_callable>();
-			if(cmd != NULL) {
-				cmd->run_command(level::current(), *this);
-			} else {
-				entity_command_callable* cmd = var.try_convert<entity_command_callable>();
-				if(cmd != NULL) {
-					cmd->run_command(level::current(), *this);
-				} else {
-					swallow_object_command_callable* cmd = var.try_convert<swallow_object_command_callable>();
-					if(cmd) {
-						result = false;
-					} else {
-						swallow_mouse_command_callable* cmd = var.try_convert<swallow_mouse_command_callable>();
-						if(cmd) {
-							swallow_mouse_event_ = true;
-						} else {
-							ASSERT_LOG(false, "COMMAND WAS EXPECTED, BUT FOUND: " << var.to_debug_string() << "\nFORMULA INFO: " << output_formula_error_info() << "\n");
-						}
-					}
-				}
+		for(int n = 0; n != num_elements; ) {
+			const int nmutations = execute_slot_mutations(*this, var, n);
+			if(nmutations > 0) {
+				n += nmutations;
+				continue;
 			}
+
+			result = execute_command(var[n]) && result;
+			++n;
 		}
+
+		return result;
+	}
+
+	const game_logic::formula_callable* callable = var.is_callable() ? var.as_callable() : NULL;
+	switch(callable ? callable->command_type() : game_logic::formula_callable::NOT_A_COMMAND) {
+	case game_logic::formula_callable::FORMULA_COMMAND:
+		static_cast<const game_logic::command_callable*>(callable)->run_command(*this);
+		break;
+	case game_logic::formula_callable::CUSTOM_OBJECT_COMMAND:
+		static_cast<const custom_object_command_callable*>(callable)->run_command(level::current(), *this);
+		break;
+	case game_logic::formula_callable::ENTITY_COMMAND:
+		static_cast<const entity_command_callable*>(callable)->run_command(level::current(), *this);
+		break;
+	case game_logic::formula_callable::SWALLOW_OBJECT_COMMAND:
+		result = false;
+		break;
+	case game_logic::formula_callable::SWALLOW_MOUSE_COMMAND:
+		swallow_mouse_event_ = true;
+		break;
+	default:
+		ASSERT_LOG(false, "COMMAND WAS EXPECTED, BUT FOUND: " << var.to_debug_string() << "\nFORMULA INFO: " << output_formula_error_info() << "\n");
 	}
 
 	return result;
@@ -5303,9 +5672,8 @@ int custom_object::slope_standing_on(int range) const
 	int ypos = feet_y();
 
 
-	for(int n = 0; !level::current().standable(xpos, ypos) && n != 10; ++n) {
-		++ypos;
-	}
+	const int ground_distance = level::current().standable_distance(xpos, ypos, 1, 9);
+	ypos += ground_distance == -1 ? 10 : ground_distance;
 
 	if(range == 1) {
 		if(level::current().standable(xpos + forward, ypos - 1) &&
@@ -5324,11 +5692,10 @@ int custom_object::slope_standing_on(int range) const
 			return 0;
 		}
 
-		int y1 = find_ground_level(level::current(), xpos + forward*range, ypos, range+1);
-		int y2 = find_ground_level(level::current(), xpos - forward*range, ypos, range+1);
-		while((y1 == INT_MIN || y2 == INT_MIN) && range > 0) {
-			y1 = find_ground_level(level::current(), xpos + forward*range, ypos, range+1);
-			y2 = find_ground_level(level::current(), xpos - forward*range, ypos, range+1);
+		int rise = 0;
+		bool found = level::current().ground_slope(xpos, ypos, range, &rise);
+		while(!found && range > 0) {
+			found = level::current().ground_slope(xpos, ypos, range, &rise);
 			--range;
 		}
 
@@ -5336,7 +5703,7 @@ int custom_object::slope_standing_on(int range) const
 			return 0;
 		}
 
-		const int dy = y2 - y1;
+		const int dy = -rise*forward;
 		const int dx = range*2;
 		return (dy*45)/dx;
 	}
@@ -5370,6 +5737,8 @@ game_logic::const_formula_ptr custom_object::get_event_handler(int key) const
 
 void custom_object::set_event_handler(int key, game_logic::const_formula_ptr f)
 {
+	mark_changed();
+
 	if(size_t(key) >= event_handlers_.size()) {
 		event_handlers_.resize(key+1);
 	}
@@ -5575,6 +5944,8 @@ void custom_object::remove_particle_system(const std::string& key)
 
 void custom_object::set_text(const std::string& text, const std::string& font, int size, int align)
 {
+	mark_changed();
+
 	text_.reset(new custom_object_text);
 	text_->text = text;
 	text_->font = graphical_font::get(font);
@@ -5583,6 +5954,7 @@ void custom_object::set_text(const std::string& text, const std::string& font, i
 	text_->alpha = 255;
 	ASSERT_LOG(text_->font, "UNKNOWN FONT: " << font);
 	text_->dimensions = text_->font->dimensions(text_->text, size);
+	spatial_index_changed();
 }
 
 bool custom_object::boardable_vehicle() const
@@ -5649,6 +6021,8 @@ void custom_object::unboard_vehicle()
 
 void custom_object::set_blur(const blur_info* blur)
 {
+	mark_changed();
+
 	if(blur) {
 		if(blur_) {
 			blur_->copy_settings(*blur); 
@@ -5662,6 +6036,8 @@ void custom_object::set_blur(const blur_info* blur)
 
 void custom_object::set_sound_volume(const int sound_volume)
 {
+	mark_changed();
+
 	sound::change_volume(this, sound_volume);
 	sound_volume_ = sound_volume;
 }
@@ -5673,6 +6049,8 @@ bool custom_object::allow_level_collisions() const
 
 void custom_object::set_platform_area(const rect& area)
 {
+	mark_changed();
+
 	if(area.w() <= 0 || area.h() <= 0) {
 		platform_area_.reset(new rect(area));
 		platform_solid_info_ = const_solid_info_ptr();
@@ -5721,6 +6099,8 @@ bool custom_object::appears_at_difficulty(int difficulty) const
 
 void custom_object::set_parent(entity_ptr e, const std::string& pivot_point)
 {
+	mark_changed();
+
 	parent_ = e;
 	parent_pivot_ = pivot_point;
 
@@ -5872,6 +6252,8 @@ void custom_object::update_type(const_custom_object_type_ptr old_type,
 		frame_.reset(&type_->get_frame(frame_name_));
 	}
 
+	spatial_index_changed();
+
 	std::map<std::string, particle_system_ptr> systems;
 	systems.swap(particle_systems_);
 	for(std::map<std::string, particle_system_ptr>::const_iterator i = systems.begin(); i != systems.end(); ++i) {
@@ -6011,6 +6393,56 @@ int custom_object::current_rotation() const
 	return rotate_z_.as_int();
 }
 
+UNIT_TEST(property_state_hash) {
+	std::map<variant, variant> items_map;
+	items_map[variant("a")] = variant(1);
+
+	std::vector<variant> values;
+	values.push_back(variant(0));
+	values.push_back(variant(&items_map));
+	values.push_back(variant("abc"));
+
+	property_state_hash hash;
+	for(int n = 0; n != values.size(); ++n) {
+		hash.update(n, values[n]);
+	}
+
+	const unsigned int original_hash = hash.hash(values);
+	values[0] = variant(5);
+	hash.update(0, values[0]);
+	const unsigned int set_hash = hash.hash(values);
+	CHECK_NE(set_hash, original_hash);
+
+	//changing a map in place, as FFL's set and add do, changes the hash
+	//even though the property isn't set.
+	values[1].add_attr_mutation(variant("a"), variant(2));
+	CHECK_NE(hash.hash(values), set_hash);
+
+	values[1].add_attr_mutation(variant("a"), variant(1));
+	CHECK_EQ(hash.hash(values), set_hash);
+
+	//hashes must be the same on every platform.
+	CHECK_EQ(property_state_hash::value_hash(0, variant(5)), 0x3eb4d141u);
+	CHECK_NE(property_state_hash::value_hash(0, variant(5)), property_state_hash::value_hash(1, variant(5)));
+
+	values[0] = variant(0);
+	hash.update(0, values[0]);
+	CHECK_EQ(hash.hash(values), original_hash);
+
+	//so does changing a map nested inside a property's map.
+	std::map<variant, variant> inner_map, outer_map;
+	inner_map[variant("b")] = variant(1);
+	outer_map[variant("inner")] = variant(&inner_map);
+	values.push_back(variant(&outer_map));
+	hash.update(3, values[3]);
+	const unsigned int nested_hash = hash.hash(values);
+	CHECK_EQ(hash.hash(values), nested_hash);
+
+	variant inner = values[3][variant("inner")];
+	inner.add_attr_mutation(variant("b"), variant(2));
+	CHECK_NE(hash.hash(values), nested_hash);
+}
+
 BENCHMARK(custom_object_spike) {
 	static level* lvl = NULL;
 	if(!lvl) {	
@@ -6058,3 +6490,84 @@ BENCHMARK_ARG(custom_object_handle_event, const std::string& object_event)
 BENCHMARK_ARG_CALL(custom_object_handle_event, ant_non_exist, "ant_black:blahblah");
 
 BENCHMARK_ARG_CALL_COMMAND_LINE(custom_object_handle_event);
+
+namespace {
+//runs a level for a cycle with swept collisions turned on or off.
+void process_level_cycle(level& lvl, bool swept)
+{
+	const bool old_swept = g_swept_collisions;
+	g_swept_collisions = swept;
+	lvl.set_as_current_level();
+	lvl.process();
+	g_swept_collisions = old_swept;
+}
+}
+
+UTILITY(compare_swept_collisions)
+{
+	//runs each level given twice side by side, once with per-pixel
+	//collision checks and once with swept collisions, and reports the first
+	//cycle where any object ends up in a different position.
+	int ncycles = 1000;
+	std::vector<std::string> files;
+	foreach(const std::string& arg, args) {
+		if(arg.size() > 9 && std::string(arg.begin(), arg.begin() + 9) == "--cycles=") {
+			ncycles = atoi(arg.c_str() + 9);
+		} else {
+			files.push_back(arg);
+		}
+	}
+
+	if(files.empty()) {
+		module::get_files_in_dir(preferences::level_path(), &files);
+	}
+
+	int nfailures = 0;
+	foreach(const std::string& file, files) {
+		boost::intrusive_ptr<level> reference(new level(file));
+		boost::intrusive_ptr<level> swept(new level(file));
+		reference->finish_loading();
+		swept->finish_loading();
+
+		bool diverged = false;
+		for(int cycle = 0; cycle != ncycles && !diverged; ++cycle) {
+			const unsigned int seed = rng::get_seed();
+			process_level_cycle(*reference, false);
+			const unsigned int reference_seed = rng::get_seed();
+
+			rng::set_seed(seed);
+			process_level_cycle(*swept, true);
+			if(rng::get_seed() != reference_seed) {
+				std::cerr << file << ": random number generator diverged on cycle " << cycle << "\n";
+				diverged = true;
+			}
+
+			foreach(const entity_ptr& e, reference->get_chars()) {
+				const_entity_ptr other = swept->get_entity_by_label(e->label());
+				if(!other) {
+					std::cerr << file << ": object " << e->label() << " missing with swept collisions on cycle " << cycle << "\n";
+					diverged = true;
+				} else if(other->centi_x() != e->centi_x() || other->centi_y() != e->centi_y()) {
+					std::cerr << file << ": object " << e->label() << " (" << e->debug_description() << ") at (" << e->centi_x() << "," << e->centi_y() << ") but (" << other->centi_x() << "," << other->centi_y() << ") with swept collisions on cycle " << cycle << "\n";
+					diverged = true;
+				}
+			}
+
+			if(reference->get_chars().size() != swept->get_chars().size()) {
+				std::cerr << file << ": " << reference->get_chars().size() << " objects but " << swept->get_chars().size() << " with swept collisions on cycle " << cycle << "\n";
+				diverged = true;
+			}
+
+			rng::set_seed(reference_seed);
+		}
+
+		if(diverged) {
+			++nfailures;
+		} else {
+			std::cerr << file << ": OK\n";
+		}
+	}
+
+	std::cerr << (files.size() - nfailures) << "/" << files.size() << " levels match\n";
+	ASSERT_EQ(nfailures, 0);
+}
@@ -51,6 +51,38 @@ class level;
 
 struct custom_object_text;
 
+//hashes of the values of an object's properties, kept up to date as
+//they're set so the hash of all of them is cheap to take. Lists and maps
+//may be changed in place without being set, so those are hashed when the
+//hash is taken, unless no map or list has been changed in place since
+//they were last hashed.
+class property_state_hash
+{
+public:
+	property_state_hash();
+
+	//call whenever the value in a slot is set.
+	void update(int slot, const variant& value);
+	void clear();
+
+	//the hash of all the values, which must be the ones last passed to
+	//update().
+	unsigned int hash(const std::vector<variant>& values) const;
+
+	//the hash of a value in a slot, which is the same on every platform.
+	static unsigned int value_hash(int slot, const variant& value);
+private:
+	std::vector<unsigned int> hashes_;
+	std::vector<int> slots_hashed_on_read_;
+	unsigned int hash_;
+
+	//the combined hash of the slots hashed on read, if it's valid, and
+	//variant::mutation_count() when it was taken.
+	mutable unsigned int read_hash_;
+	mutable unsigned int read_hash_mutation_count_;
+	mutable bool read_hash_valid_;
+};
+
 class custom_object : public entity
 {
 public:
@@ -76,6 +108,8 @@ public:
 	//and allows us to do any final setup such as finding our parent.
 	void finish_loading(level* lvl);
 	virtual variant write() const;
+	virtual unsigned int state_hash() const;
+	virtual variant write_state_hash() const;
 	virtual void setup_drawing() const;
 	virtual void draw(int x, int y) const;
 	virtual void draw_later(int x, int y) const;
@@ -138,6 +172,8 @@ public:
 	void die();
 	void die_with_no_event();
 	virtual bool is_active(const rect& screen_area) const;
+	virtual bool spatial_index_area(rect* area) const;
+	virtual rect solid_index_area() const;
 	bool dies_on_inactive() const;
 	bool always_active() const;
 	bool move_to_standing(level& lvl, int max_displace=10000);
@@ -214,7 +250,7 @@ public:
 
 	void set_blur(const blur_info* blur);
 	void set_sound_volume(const int volume);
-	void set_zsub_order(const int zsub_order) {zsub_order_ = zsub_order;}
+	void set_zsub_order(const int zsub_order) {zsub_order_ = zsub_order; mark_changed();}
 	
 	bool execute_command(const variant& var);
 
@@ -235,7 +271,7 @@ public:
 	int min_difficulty() const { return min_difficulty_; }
 	int max_difficulty() const { return max_difficulty_; }
 
-	void set_difficulty(int min, int max) { min_difficulty_ = min; max_difficulty_ = max; }
+	void set_difficulty(int min, int max) { min_difficulty_ = min; max_difficulty_ = max; mark_changed(); }
 
 	void update_type(const_custom_object_type_ptr old_type,
 	                 const_custom_object_type_ptr new_type);
@@ -421,6 +457,12 @@ private:
 	std::vector<variant> property_data_;
 	mutable int active_property_;
 
+	//the hash of the properties, which goes into state_hash(). Call
+	//update_property_hash() whenever a property's value is set.
+	void update_property_hash(int slot);
+	void rehash_properties();
+	property_state_hash property_hash_;
+
 	//a stack of items that serve as the 'value' parameter, used in
 	//property setters.
 	mutable std::stack<variant> value_stack_;
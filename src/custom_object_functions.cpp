@@ -1683,7 +1683,15 @@ FUNCTION_DEF(find_point_object_can_stand_on, 6, 7, "find_point_object_can_stand_
 	const int dy = args()[5]->evaluate(variables).as_int();
 	const int niterations = args().size() > 6 ? args()[6]->evaluate(variables).as_int() : 1000;
 
-	for(int n = 0; n < niterations; ++n) {
+	int n = 0;
+	if(dx == 0 && (dy == 1 || dy == -1)) {
+		//searching straight up or down, so skip to where the level could
+		//first be stood on.
+		n = standable_clear_distance(*lvl, *obj, x, x, y, dy, niterations - 1);
+		y += n*dy;
+	}
+
+	for(; n < niterations; ++n) {
 		if(point_standable(*lvl, *obj, x, y)) {
 			std::vector<variant> result;
 			result.reserve(2);
@@ -43,6 +43,7 @@ public:
 	void set_expression(const game_logic::formula_expression* expr);
 
 	bool is_command() const { return true; }
+	COMMAND_TYPE command_type() const { return ENTITY_COMMAND; }
 
 private:
 	virtual void execute(level& lvl, entity& ob) const = 0;
@@ -63,6 +64,7 @@ public:
 	void set_expression(const game_logic::formula_expression* expr);
 
 	bool is_command() const { return true; }
+	COMMAND_TYPE command_type() const { return CUSTOM_OBJECT_COMMAND; }
 
 private:
 	virtual void execute(level& lvl, custom_object& ob) const = 0;
@@ -78,6 +80,7 @@ private:
 class swallow_object_command_callable : public game_logic::formula_callable {
 public:
 	bool is_command() const { return true; }
+	COMMAND_TYPE command_type() const { return SWALLOW_OBJECT_COMMAND; }
 private:
 	variant get_value(const std::string& key) const { return variant(); }
 	void get_inputs(std::vector<game_logic::formula_input>* inputs) const {}
@@ -86,6 +89,7 @@ private:
 class swallow_mouse_command_callable : public game_logic::formula_callable {
 public:
 	bool is_command() const { return true; }
+	COMMAND_TYPE command_type() const { return SWALLOW_MOUSE_COMMAND; }
 private:
 	variant get_value(const std::string& key) const { return variant(); }
 	void get_inputs(std::vector<game_logic::formula_input>* inputs) const {}
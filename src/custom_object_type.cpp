@@ -43,6 +43,8 @@
 #include "variant_callable.hpp"
 #include "variant_utils.hpp"
 
+extern bool g_headless;
+
 using game_logic::formula_callable_definition;
 using game_logic::formula_callable_definition_ptr;
 
@@ -1533,11 +1535,11 @@ custom_object_type::custom_object_type(const std::string& id, variant node, cons
 	game_logic::register_formula_callable_definition("object_type", callable_definition_);
 
 #if defined(USE_SHADERS)
-	if(node.has_key("shader")) {
+	if(node.has_key("shader") && !g_headless) {
 		shader_.reset(new gles2::shader_program(node["shader"]));
 	}
 
-	if(node.has_key("effects")) {
+	if(node.has_key("effects") && !g_headless) {
 		effects_.clear();
 		for(size_t n = 0; n < node["effects"].num_elements(); ++n) {
 			effects_.push_back(gles2::shader_program_ptr(new gles2::shader_program(node["effects"][n])));
@@ -29,8 +29,8 @@
 #include "variant_utils.hpp"
 
 entity::entity(variant node)
-  : x_(node["x"].as_int()*100),
-    y_(node["y"].as_int()*100),
+  : x_(node.has_key("centi_x") ? node["centi_x"].as_int() : node["x"].as_int()*100),
+    y_(node.has_key("centi_y") ? node["centi_y"].as_int() : node["y"].as_int()*100),
 	prev_feet_x_(INT_MIN), prev_feet_y_(INT_MIN),
 	last_move_x_(0), last_move_y_(0),
 	face_right_(node["face_right"].as_bool(true)),
@@ -64,6 +64,11 @@ entity::entity(int x, int y, bool face_right)
 	}
 }
 
+entity::~entity()
+{
+	entity_grid::entity_destroyed(this);
+}
+
 void entity::add_to_level()
 {
 	last_move_x_ = last_move_y_ = 0;
@@ -116,6 +121,7 @@ int entity::last_move_y() const
 void entity::set_platform_motion_x(int value)
 {
 	platform_motion_x_ = value;
+	mark_changed();
 }
 
 int entity::map_platform_pos(int xpos) const
@@ -143,6 +149,8 @@ int entity::platform_motion_x() const
 
 void entity::process(level& lvl)
 {
+	mark_changed();
+
 	if(prev_feet_x_ != INT_MIN) {
 		last_move_x_ = feet_x() - prev_feet_x_;
 		last_move_y_ = feet_y() - prev_feet_y_;
@@ -169,12 +177,15 @@ void entity::set_face_right(bool facing)
 void entity::set_upside_down(bool facing)
 {
 	upside_down_ = facing;
+	mark_changed();
 }
 
 void entity::calculate_solid_rect()
 {
 	const frame& f = current_frame();
 
+	mark_changed();
+
 	frame_rect_ = rect(x(), y(), f.width(), f.height());
 	
 	solid_ = calculate_solid();
@@ -207,6 +218,25 @@ void entity::calculate_solid_rect()
 	} else {
 		platform_rect_ = rect();
 	}
+
+	entity_grid::entity_moved(this);
+}
+
+void entity::set_last_backup(const entity_ptr& copy) const
+{
+	//entities which are never copied are their own backup, and mustn't
+	//keep a reference to themselves.
+	backup_state_.last_copy = copy.get() == this ? entity_ptr() : copy;
+	backup_state_.changed = false;
+}
+
+rect entity::solid_index_area() const
+{
+	if(!solid_ && !platform_) {
+		return rect();
+	}
+
+	return rect_union(solid_rect_, platform_rect_);
 }
 
 rect entity::body_rect() const
@@ -303,10 +333,15 @@ void entity::generate_current(const entity& target, int* velocity_x, int* veloci
 void entity::add_scheduled_command(int cycle, variant cmd)
 {
 	scheduled_commands_.push_back(ScheduledCommand(cycle, cmd));
+	mark_changed();
 }
 
 std::vector<variant> entity::pop_scheduled_commands()
 {
+	if(!scheduled_commands_.empty()) {
+		mark_changed();
+	}
+
 	std::vector<variant> result;
 	std::vector<ScheduledCommand>::iterator i = scheduled_commands_.begin();
 	while(i != scheduled_commands_.end()) {
@@ -324,12 +359,14 @@ std::vector<variant> entity::pop_scheduled_commands()
 void entity::set_current_generator(current_generator* generator)
 {
 	current_generator_ = current_generator_ptr(generator);
+	mark_changed();
 }
 
 void entity::set_attached_objects(const std::vector<entity_ptr>& v)
 {
 	if(v != attached_objects_) {
 		attached_objects_ = v;
+		mark_changed();
 	}
 }
 
@@ -365,6 +402,7 @@ void entity::set_control_status(const std::string& key, bool value)
 
 	const int index = k - keys;
 	controls_[index] = value;
+	mark_changed();
 }
 
 void entity::read_controls(int cycle)
@@ -398,6 +436,7 @@ point entity::pivot(const std::string& name, bool reverse_facing) const
 void entity::set_spawned_by(const std::string& key)
 {
 	spawned_by_ = key;
+	mark_changed();
 }
 
 const std::string& entity::spawned_by() const
@@ -408,6 +447,7 @@ const std::string& entity::spawned_by() const
 void entity::set_mouse_over_area(const rect& area)
 {
 	mouse_over_area_ = area;
+	mark_changed();
 }
 
 const rect& entity::mouse_over_area() const
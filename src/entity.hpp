@@ -25,6 +25,7 @@
 #include "current_generator.hpp"
 #include "editor_variable_info.hpp"
 #include "entity_fwd.hpp"
+#include "entity_grid.hpp"
 #include "formula_callable.hpp"
 #include "formula_callable_definition_fwd.hpp"
 #include "formula_fwd.hpp"
@@ -49,13 +50,20 @@ public:
 	static entity_ptr build(variant node);
 	explicit entity(variant node);
 	entity(int x, int y, bool face_right);
-	virtual ~entity() {}
+	virtual ~entity();
 
 	virtual void validate_properties() {}
 	virtual void add_to_level();
 
 	virtual void finish_loading(level*) {}
 	virtual variant write() const = 0;
+
+	//a hash of the object's state, compared between the machines in a
+	//multiplayer game to find when they get out of sync, and the values
+	//that go into it, to find what differs when they do.
+	virtual unsigned int state_hash() const = 0;
+	virtual variant write_state_hash() const = 0;
+
 	virtual void setup_drawing() const {}
 	virtual void draw(int x, int y) const = 0;
 	virtual void draw_later(int x, int y) const = 0;
@@ -68,7 +76,7 @@ public:
 	virtual bool execute_command(const variant& var) = 0;
 
 	const std::string& label() const { return label_; }
-	void set_label(const std::string& lb) { label_ = lb; }
+	void set_label(const std::string& lb) { label_ = lb; mark_changed(); }
 	void set_distinct_label();
 
 	virtual void shift_position(int x, int y) { x_ += x*100; y_ += y*100; prev_feet_x_ += x; prev_feet_y_ += y; calculate_solid_rect(); }
@@ -100,7 +108,7 @@ public:
 	virtual int velocity_y() const { return 0; }
 
 	int group() const { return group_; }
-	void set_group(int group) { group_ = group; }
+	void set_group(int group) { group_ = group; mark_changed(); }
 
 	virtual bool is_standable(int x, int y, int* friction=NULL, int* traction=NULL, int* adjust_y=NULL) const { return false; }
 
@@ -164,6 +172,15 @@ public:
 	virtual bool is_active(const rect& screen_area) const = 0;
 	virtual bool dies_on_inactive() const { return false; } 
 	virtual bool always_active() const { return false; } 
+
+	//if the entity can only be active or found by spatial queries in a
+	//bounded area, sets *area to that area and returns true. Returns
+	//false if the entity must be considered by every spatial query.
+	virtual bool spatial_index_area(rect* area) const { return false; }
+
+	//the area collision tests may find the entity's solid or platform area
+	//in. Empty if the entity is neither solid nor a platform.
+	virtual rect solid_index_area() const;
 	
 	virtual formula_callable* vars() { return NULL; }
 	virtual const formula_callable* vars() const { return NULL; }
@@ -174,7 +191,7 @@ public:
 	//object is focused.
 	virtual int vertical_look() const { return 0; }
 
-	void set_id(int id) { id_ = id; }
+	void set_id(int id) { id_ = id; mark_changed(); }
 	int get_id() const { return id_; }
 
 	bool respawn() const { return respawn_; }
@@ -225,6 +242,17 @@ public:
 	virtual void map_entities(const std::map<entity_ptr, entity_ptr>& m) {}
 	virtual void cleanup_references() {}
 
+	//the copy of this entity in its level's latest backup, if the entity
+	//hasn't changed since it was made. NULL otherwise.
+	entity_ptr unchanged_backup() const { return backup_state_.changed ? entity_ptr() : backup_state_.last_copy; }
+	entity_ptr last_backup() const { return backup_state_.last_copy; }
+	void set_last_backup(const entity_ptr& copy) const;
+
+	//called whenever something about the entity which is backed up might
+	//change, so the level knows to copy it again. Every function which
+	//changes such state must call it.
+	void mark_changed() const { backup_state_.changed = true; }
+
 	void add_scheduled_command(int cycle, variant cmd);
 	std::vector<variant> pop_scheduled_commands();
 
@@ -237,10 +265,10 @@ public:
 	virtual int hitpoints() const { return 1; }
 	virtual int max_hitpoints() const { return 1; }
 
-	void set_control_status_user(const variant& v) { controls_user_ = v; }
+	void set_control_status_user(const variant& v) { controls_user_ = v; mark_changed(); }
 	void set_control_status(const std::string& key, bool value);
-	void set_control_status(controls::CONTROL_ITEM ctrl, bool value) { controls_[ctrl] = value; }
-	void clear_control_status() { for(int n = 0; n != controls::NUM_CONTROLS; ++n) { controls_[n] = false; } }
+	void set_control_status(controls::CONTROL_ITEM ctrl, bool value) { controls_[ctrl] = value; mark_changed(); }
+	void clear_control_status() { for(int n = 0; n != controls::NUM_CONTROLS; ++n) { controls_[n] = false; } mark_changed(); }
 
 	virtual bool enter() const { return false; }
 
@@ -281,11 +309,11 @@ public:
 	virtual bool mouse_event_swallowed() const {return false;}
 
 	bool is_mouse_over_entity() const { return mouse_over_entity_; }
-	void set_mouse_over_entity(bool val=true) { mouse_over_entity_=val; }
-	void set_mouse_buttons(Uint8 buttons) { mouse_button_state_ = buttons; }
+	void set_mouse_over_entity(bool val=true) { mouse_over_entity_=val; mark_changed(); }
+	void set_mouse_buttons(Uint8 buttons) { mouse_button_state_ = buttons; mark_changed(); }
 	Uint8 get_mouse_buttons() const { return mouse_button_state_; }
 	bool is_being_dragged() const { return being_dragged_; }
-	void set_being_dragged(bool val=true) { being_dragged_ = val; }
+	void set_being_dragged(bool val=true) { being_dragged_ = val; mark_changed(); }
 	virtual bool get_clip_area(rect* clip_area) = 0;
 	void set_mouse_over_area(const rect& area);
 	const rect& mouse_over_area() const;
@@ -300,18 +328,18 @@ public:
 	virtual void being_added() = 0;
 
 	int get_mouseover_delay() const { return mouseover_delay_; }
-	void set_mouseover_delay(int dly) { mouseover_delay_ = dly; }
+	void set_mouseover_delay(int dly) { mouseover_delay_ = dly; mark_changed(); }
 	unsigned get_mouseover_trigger_cycle() const { return mouseover_trigger_cycle_; }
-	void set_mouseover_trigger_cycle(unsigned cyc) { mouseover_trigger_cycle_ = cyc; }
+	void set_mouseover_trigger_cycle(unsigned cyc) { mouseover_trigger_cycle_ = cyc; mark_changed(); }
 
 	bool truez() const { return true_z_; }
 	double tx() const { return tx_; }
 	double ty() const { return ty_; }
 	double tz() const { return tz_; }
-	void set_truez(bool en=false) { true_z_ = en; }
-	void set_tx(double x) { tx_ = x; }
-	void set_ty(double y) { ty_ = y; }
-	void set_tz(double z) { tz_ = z; }
+	void set_truez(bool en=false) { true_z_ = en; mark_changed(); }
+	void set_tx(double x) { tx_ = x; mark_changed(); }
+	void set_ty(double y) { ty_ = y; mark_changed(); }
+	void set_tz(double z) { tz_ = z; mark_changed(); }
 
 	rect calculate_collision_rect(const frame& f, const frame::collision_area& a) const;
 
@@ -320,20 +348,23 @@ protected:
 	virtual const_solid_info_ptr calculate_platform() const = 0;
 	void calculate_solid_rect();
 
+	//should be called when something changes spatial_index_area().
+	void spatial_index_changed() { entity_grid::entity_moved(this); }
+
 	bool control_status(controls::CONTROL_ITEM ctrl) const { return controls_[ctrl]; }
 	variant control_status_user() const { return controls_user_; }
 	void read_controls(int cycle);
 
 	void set_current_generator(current_generator* generator);
 
-	void set_respawn(bool value) { respawn_ = value; }
+	void set_respawn(bool value) { respawn_ = value; mark_changed(); }
 
 	//move the entity by a number of centi pixels. Returns true if its
 	//position is changed.
 	bool move_centipixels(int dx, int dy);
 
-	void set_solid_dimensions(unsigned int dim, unsigned int weak) { solid_dimensions_ = dim; weak_solid_dimensions_ = dim|weak; }
-	void set_collide_dimensions(unsigned int dim, unsigned int weak) { collide_dimensions_ = dim; weak_collide_dimensions_ = dim|weak; }
+	void set_solid_dimensions(unsigned int dim, unsigned int weak) { solid_dimensions_ = dim; weak_solid_dimensions_ = dim|weak; mark_changed(); }
+	void set_collide_dimensions(unsigned int dim, unsigned int weak) { collide_dimensions_ = dim; weak_collide_dimensions_ = dim|weak; mark_changed(); }
 
 	const std::vector<entity_ptr>& attached_objects() const { return attached_objects_; }
 
@@ -345,6 +376,8 @@ protected:
 	int prev_feet_y() const { return prev_feet_y_; }
 
 private:
+	friend class entity_grid;
+
 	virtual int current_rotation() const = 0;
 
 	std::string label_;
@@ -386,6 +419,21 @@ private:
 
 	//caches of commonly queried rects.
 	rect solid_rect_, frame_rect_, platform_rect_, prev_platform_rect_;
+
+	//where this entity is in each of its level's spatial indexes.
+	entity_grid_entry grid_entries_[NUM_SPATIAL_INDEXES];
+
+	//the entity's latest backup and whether it has changed since. A copy
+	//of an entity is always considered changed, and has no backup.
+	struct backup_state {
+		backup_state() : changed(true) {}
+		backup_state(const backup_state& o) : changed(true) {}
+		backup_state& operator=(const backup_state& o) { changed = true; last_copy.reset(); return *this; }
+		bool changed;
+		entity_ptr last_copy;
+	};
+
+	mutable backup_state backup_state_;
 	const_solid_info_ptr solid_;
 	const_solid_info_ptr platform_;
 
@@ -0,0 +1,370 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+
+#include "asserts.hpp"
+#include "entity.hpp"
+#include "entity_grid.hpp"
+#include "foreach.hpp"
+
+entity_grid_entry::entity_grid_entry()
+  : grid(NULL), x1(0), y1(0), x2(-1), y2(-1),
+    unbounded(false), dies_on_inactive(false), order(0), query_stamp(0)
+{}
+
+entity_grid_entry::entity_grid_entry(const entity_grid_entry& o)
+  : grid(NULL), x1(0), y1(0), x2(-1), y2(-1),
+    unbounded(false), dies_on_inactive(false), order(0), query_stamp(0)
+{}
+
+namespace {
+
+//the cell a coordinate is in, rounding towards negative infinity.
+int cell_coord(int n)
+{
+	if(n >= 0) {
+		return n/entity_grid::CellSize;
+	} else {
+		return -((-n + entity_grid::CellSize - 1)/entity_grid::CellSize);
+	}
+}
+
+struct cell_range {
+	int x1, y1, x2, y2;
+	bool unbounded;
+	bool dies_on_inactive;
+
+	bool operator==(const cell_range& o) const {
+		return unbounded == o.unbounded && dies_on_inactive == o.dies_on_inactive &&
+		       (unbounded || (x1 == o.x1 && y1 == o.y1 && x2 == o.x2 && y2 == o.y2));
+	}
+};
+
+cell_range calculate_cell_range(const entity& e, SPATIAL_INDEX index)
+{
+	cell_range res;
+	res.x1 = res.y1 = 0;
+	res.x2 = res.y2 = -1;
+
+	rect area;
+	if(index == SOLID_INDEX) {
+		res.dies_on_inactive = false;
+		res.unbounded = false;
+		area = e.solid_index_area();
+		if(area.w() == 0 || area.h() == 0) {
+			//the entity isn't solid, so it's kept in no cells.
+			return res;
+		}
+	} else {
+		res.dies_on_inactive = e.dies_on_inactive();
+		res.unbounded = !e.spatial_index_area(&area);
+		if(res.unbounded) {
+			return res;
+		}
+	}
+
+	//the area's bottom right edge is included, so that entities with
+	//empty frames may still be found at their position.
+	res.x1 = cell_coord(area.x());
+	res.y1 = cell_coord(area.y());
+	res.x2 = cell_coord(area.x2());
+	res.y2 = cell_coord(area.y2());
+
+	//very large entities would be in so many cells that it's cheaper to
+	//return them from every query.
+	if((res.x2 - res.x1 + 1)*(res.y2 - res.y1 + 1) > entity_grid::MaxCellsPerEntity) {
+		res.unbounded = true;
+	}
+
+	return res;
+}
+
+cell_range get_cell_range(const entity_grid_entry& entry)
+{
+	cell_range res;
+	res.x1 = entry.x1;
+	res.y1 = entry.y1;
+	res.x2 = entry.x2;
+	res.y2 = entry.y2;
+	res.unbounded = entry.unbounded;
+	res.dies_on_inactive = entry.dies_on_inactive;
+	return res;
+}
+
+void erase_entity(std::vector<entity*>& v, entity* e)
+{
+	std::vector<entity*>::iterator i = std::find(v.begin(), v.end(), e);
+	if(i != v.end()) {
+		*i = v.back();
+		v.pop_back();
+	}
+}
+
+}
+
+entity_grid::entity_grid(SPATIAL_INDEX index)
+  : index_(index), next_order_(0), query_stamp_(0), size_(0), valid_(false)
+{}
+
+entity_grid::~entity_grid()
+{
+	clear();
+}
+
+entity_grid::entity_grid(const entity_grid& o)
+  : index_(o.index_), next_order_(0), query_stamp_(0), size_(0), valid_(false)
+{}
+
+entity_grid& entity_grid::operator=(const entity_grid& o)
+{
+	clear();
+	index_ = o.index_;
+	valid_ = false;
+	return *this;
+}
+
+entity_grid_entry& entity_grid::entry(entity* e) const
+{
+	return e->grid_entries_[index_];
+}
+
+void entity_grid::clear()
+{
+	//every entity in the grid is still alive, since entities remove
+	//themselves when they are destroyed.
+	for(cell_map::iterator i = cells_.begin(); i != cells_.end(); ++i) {
+		foreach(entity* e, i->second) {
+			entry(e).grid = NULL;
+		}
+	}
+
+	foreach(entity* e, unbounded_) {
+		entry(e).grid = NULL;
+	}
+
+	foreach(entity* e, dies_on_inactive_) {
+		entry(e).grid = NULL;
+	}
+
+	cells_.clear();
+	unbounded_.clear();
+	dies_on_inactive_.clear();
+	next_order_ = 0;
+	size_ = 0;
+}
+
+void entity_grid::rebuild(const std::vector<entity_ptr>& chars)
+{
+	clear();
+	valid_ = true;
+	foreach(const entity_ptr& e, chars) {
+		insert(e.get());
+	}
+}
+
+void entity_grid::insert(entity* e)
+{
+	if(!valid_) {
+		return;
+	}
+
+	entity_grid_entry& e_entry = entry(e);
+	if(e_entry.grid == this) {
+		return;
+	}
+
+	if(e_entry.grid != NULL) {
+		//the entity is being moved from another level's grid, which no
+		//longer knows where it is.
+		e_entry.grid->remove(e);
+		e_entry.grid->invalidate();
+	}
+
+	e_entry.grid = this;
+	e_entry.order = next_order_++;
+	e_entry.query_stamp = 0;
+	++size_;
+
+	const cell_range range = calculate_cell_range(*e, index_);
+	e_entry.x1 = range.x1;
+	e_entry.y1 = range.y1;
+	e_entry.x2 = range.x2;
+	e_entry.y2 = range.y2;
+	e_entry.unbounded = range.unbounded;
+	e_entry.dies_on_inactive = range.dies_on_inactive;
+	add_to_cells(e);
+}
+
+void entity_grid::remove(entity* e)
+{
+	if(entry(e).grid != this) {
+		return;
+	}
+
+	remove_from_cells(e);
+	entry(e).grid = NULL;
+	--size_;
+}
+
+void entity_grid::add_to_cells(entity* e)
+{
+	const entity_grid_entry& e_entry = entry(e);
+	if(e_entry.dies_on_inactive) {
+		dies_on_inactive_.push_back(e);
+	}
+
+	if(e_entry.unbounded) {
+		unbounded_.push_back(e);
+		return;
+	}
+
+	for(int y = e_entry.y1; y <= e_entry.y2; ++y) {
+		for(int x = e_entry.x1; x <= e_entry.x2; ++x) {
+			cells_[cell_key(x, y)].push_back(e);
+		}
+	}
+}
+
+void entity_grid::remove_from_cells(entity* e)
+{
+	const entity_grid_entry& e_entry = entry(e);
+	if(e_entry.dies_on_inactive) {
+		erase_entity(dies_on_inactive_, e);
+	}
+
+	if(e_entry.unbounded) {
+		erase_entity(unbounded_, e);
+		return;
+	}
+
+	for(int y = e_entry.y1; y <= e_entry.y2; ++y) {
+		for(int x = e_entry.x1; x <= e_entry.x2; ++x) {
+			cell_map::iterator i = cells_.find(cell_key(x, y));
+			if(i == cells_.end()) {
+				continue;
+			}
+
+			erase_entity(i->second, e);
+			if(i->second.empty()) {
+				cells_.erase(i);
+			}
+		}
+	}
+}
+
+void entity_grid::entity_moved(entity* e)
+{
+	for(int index = 0; index != NUM_SPATIAL_INDEXES; ++index) {
+		entity_grid_entry& entry = e->grid_entries_[index];
+		if(entry.grid == NULL) {
+			continue;
+		}
+
+		const cell_range range = calculate_cell_range(*e, static_cast<SPATIAL_INDEX>(index));
+		if(range == get_cell_range(entry)) {
+			continue;
+		}
+
+		entry.grid->remove_from_cells(e);
+		entry.x1 = range.x1;
+		entry.y1 = range.y1;
+		entry.x2 = range.x2;
+		entry.y2 = range.y2;
+		entry.unbounded = range.unbounded;
+		entry.dies_on_inactive = range.dies_on_inactive;
+		entry.grid->add_to_cells(e);
+	}
+}
+
+void entity_grid::entity_destroyed(entity* e)
+{
+	for(int index = 0; index != NUM_SPATIAL_INDEXES; ++index) {
+		if(e->grid_entries_[index].grid != NULL) {
+			e->grid_entries_[index].grid->remove(e);
+		}
+	}
+}
+
+bool entity_grid::compare_order::operator()(const entity* a, const entity* b) const
+{
+	return a->grid_entries_[index].order < b->grid_entries_[index].order;
+}
+
+void entity_grid::query(const rect& area, std::vector<entity*>& result, bool include_dies_on_inactive) const
+{
+	ASSERT_LOG(valid_, "Querying an entity grid which needs to be rebuilt");
+
+	const unsigned int stamp = ++query_stamp_;
+	const size_t begin = result.size();
+
+	foreach(entity* e, unbounded_) {
+		entry(e).query_stamp = stamp;
+		result.push_back(e);
+	}
+
+	if(include_dies_on_inactive) {
+		foreach(entity* e, dies_on_inactive_) {
+			if(entry(e).query_stamp != stamp) {
+				entry(e).query_stamp = stamp;
+				result.push_back(e);
+			}
+		}
+	}
+
+	const int x1 = cell_coord(area.x());
+	const int y1 = cell_coord(area.y());
+	const int x2 = cell_coord(area.x2());
+	const int y2 = cell_coord(area.y2());
+
+	const size_t ncells = size_t(x2 - x1 + 1)*size_t(y2 - y1 + 1);
+	if(ncells > cells_.size()) {
+		//the area covers more cells than are occupied, so visit the
+		//occupied cells instead.
+		for(cell_map::const_iterator i = cells_.begin(); i != cells_.end(); ++i) {
+			const int x = i->first.first;
+			const int y = i->first.second;
+			if(x < x1 || x > x2 || y < y1 || y > y2) {
+				continue;
+			}
+
+			foreach(entity* e, i->second) {
+				if(entry(e).query_stamp != stamp) {
+					entry(e).query_stamp = stamp;
+					result.push_back(e);
+				}
+			}
+		}
+	} else {
+		for(int y = y1; y <= y2; ++y) {
+			for(int x = x1; x <= x2; ++x) {
+				cell_map::const_iterator i = cells_.find(cell_key(x, y));
+				if(i == cells_.end()) {
+					continue;
+				}
+
+				foreach(entity* e, i->second) {
+					if(entry(e).query_stamp != stamp) {
+						entry(e).query_stamp = stamp;
+						result.push_back(e);
+					}
+				}
+			}
+		}
+	}
+
+	std::sort(result.begin() + begin, result.end(), compare_order(index_));
+}
@@ -0,0 +1,148 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ENTITY_GRID_HPP_INCLUDED
+#define ENTITY_GRID_HPP_INCLUDED
+
+#include <utility>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+#include "entity_fwd.hpp"
+#include "geometry.hpp"
+
+class entity_grid;
+
+//the spatial indexes of a level an entity can be in at once.
+enum SPATIAL_INDEX {
+	//entities by the area they can be activated or found by spatial
+	//queries in, given by entity::spatial_index_area().
+	ACTIVATION_INDEX,
+
+	//solid and platform entities by the area collision tests can find
+	//them in, given by entity::solid_index_area(). Entities with neither
+	//are not stored.
+	SOLID_INDEX,
+
+	NUM_SPATIAL_INDEXES
+};
+
+//the record an entity keeps of where it is stored in an entity_grid.
+//Copying an entity never copies its membership of a grid.
+struct entity_grid_entry
+{
+	entity_grid_entry();
+	entity_grid_entry(const entity_grid_entry& o);
+	entity_grid_entry& operator=(const entity_grid_entry& o) { return *this; }
+
+	entity_grid* grid;
+
+	//the range of cells the entity is stored in, inclusive.
+	int x1, y1, x2, y2;
+
+	//true if the entity is in the grid's list of entities which every
+	//query returns instead of in any cells.
+	bool unbounded;
+	bool dies_on_inactive;
+
+	//the entity's position in the level's list of characters, relative to
+	//the other entities in the grid.
+	unsigned int order;
+
+	//the last query which returned this entity.
+	unsigned int query_stamp;
+};
+
+//A uniform grid of the entities in a level. Each entity is bucketed by the
+//area given for the index the grid is for. Entities whose area can't be
+//bounded -- because they are always active, drawn with parallax and so
+//on -- are kept in a list which every query returns.
+//
+//The grid keeps itself up to date as entities move: an entity notifies the
+//grids it is in whenever its position or frame changes.
+class entity_grid
+{
+public:
+	enum { CellSize = 256, MaxCellsPerEntity = 64 };
+
+	explicit entity_grid(SPATIAL_INDEX index=ACTIVATION_INDEX);
+	~entity_grid();
+
+	//copying a grid gives an empty grid which will be rebuilt before it
+	//is next queried, since an entity can only be in one grid at a time.
+	entity_grid(const entity_grid& o);
+	entity_grid& operator=(const entity_grid& o);
+
+	//true if the grid matches the characters it was last built from.
+	//A grid becomes invalid when it is told the list of characters changed
+	//in a way it can't follow, or when an entity is moved to another grid.
+	bool valid() const { return valid_; }
+	void invalidate() { valid_ = false; }
+
+	//rebuilds the grid from scratch out of the given characters, which
+	//is the order query results are returned in.
+	void rebuild(const std::vector<entity_ptr>& chars);
+
+	//adds an entity which has been appended to the end of the level's list
+	//of characters. Does nothing if the grid is invalid.
+	void insert(entity* e);
+	void remove(entity* e);
+
+	//finds all entities whose area intersects the given rect, in the
+	//order they appear in the level's list of characters. If
+	//include_dies_on_inactive is true, entities which die when inactive are
+	//included wherever they are.
+	void query(const rect& area, std::vector<entity*>& result, bool include_dies_on_inactive=false) const;
+
+	int size() const { return size_; }
+
+	//called by an entity when its position, the way it is activated or
+	//its solidity changes.
+	static void entity_moved(entity* e);
+
+	//called by an entity when it is destroyed.
+	static void entity_destroyed(entity* e);
+
+private:
+	struct compare_order {
+		explicit compare_order(SPATIAL_INDEX i) : index(i) {}
+		bool operator()(const entity* a, const entity* b) const;
+		SPATIAL_INDEX index;
+	};
+
+	entity_grid_entry& entry(entity* e) const;
+
+	void add_to_cells(entity* e);
+	void remove_from_cells(entity* e);
+	void clear();
+
+	SPATIAL_INDEX index_;
+
+	typedef std::pair<int, int> cell_key;
+	typedef boost::unordered_map<cell_key, std::vector<entity*> > cell_map;
+	cell_map cells_;
+
+	std::vector<entity*> unbounded_;
+	std::vector<entity*> dies_on_inactive_;
+
+	unsigned int next_order_;
+	mutable unsigned int query_stamp_;
+	int size_;
+	bool valid_;
+};
+
+#endif
@@ -0,0 +1,580 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <math.h>
+
+#include <boost/bind.hpp>
+
+#include "asserts.hpp"
+#include "flow_field.hpp"
+#include "foreach.hpp"
+#include "level.hpp"
+#include "pathfinding.hpp"
+#include "preferences.hpp"
+#include "unit_test.hpp"
+
+PREF_INT(flow_field_cells_per_frame, 20000, "Number of cells of flow fields to search each frame");
+
+namespace pathfinding
+{
+
+namespace {
+const float Unreached = std::numeric_limits<float>::max();
+
+//the moves out of a cell, arranged so the opposite of move n is move 7-n.
+//Move 8 is staying put, which is the move at the goal.
+const int Moves[9][2] = { {-1, -1}, {0, -1}, {1, -1}, {-1, 0}, {1, 0}, {-1, 1}, {0, 1}, {1, 1}, {0, 0} };
+const int StayMove = 8;
+
+}
+
+flow_field_cache::flow_field_cache()
+  : width_(0), height_(0), cell_width_(1), cell_height_(1), frame_(0)
+{}
+
+flow_field_cache::flow_field_cache(const flow_field_cache& o)
+  : width_(0), height_(0), cell_width_(1), cell_height_(1), frame_(0)
+{}
+
+flow_field_cache& flow_field_cache::operator=(const flow_field_cache& o)
+{
+	origin_ = point();
+	width_ = height_ = 0;
+	cell_width_ = cell_height_ = 1;
+	blocked_.clear();
+	fields_.clear();
+	return *this;
+}
+
+void flow_field_cache::set_grid(const point& origin, int width, int height, int cell_width, int cell_height)
+{
+	if(origin == origin_ && width == width_ && height == height_ &&
+	   cell_width == cell_width_ && cell_height == cell_height_) {
+		return;
+	}
+
+	ASSERT_LOG(cell_width > 0 && cell_height > 0, "Illegal flow field cell size: " << cell_width << "x" << cell_height);
+
+	origin_ = origin;
+	width_ = std::max(0, width);
+	height_ = std::max(0, height);
+	cell_width_ = cell_width;
+	cell_height_ = cell_height;
+	blocked_.assign(width_*height_, -1);
+	fields_.clear();
+}
+
+void flow_field_cache::invalidate(const rect& area)
+{
+	if(blocked_.empty() || area.w() <= 0 || area.h() <= 0) {
+		return;
+	}
+
+	const int x1 = std::max(0, floor_div(area.x() - origin_.x, cell_width_));
+	const int y1 = std::max(0, floor_div(area.y() - origin_.y, cell_height_));
+	const int x2 = std::min(width_ - 1, floor_div(area.x2() - 1 - origin_.x, cell_width_));
+	const int y2 = std::min(height_ - 1, floor_div(area.y2() - 1 - origin_.y, cell_height_));
+	if(x1 > x2 || y1 > y2) {
+		return;
+	}
+
+	for(int y = y1; y <= y2; ++y) {
+		std::fill(blocked_.begin() + y*width_ + x1, blocked_.begin() + y*width_ + x2 + 1, -1);
+	}
+
+	//a field which hasn't looked at the area yet will find it as it is
+	//now, so only fields which have need to start again. A field looks at
+	//the neighbours of the cells it reaches, which may be blocked or only
+	//touched diagonally, so it has looked one cell beyond its area.
+	foreach(const field_ptr& f, fields_) {
+		if(f->x1 - 1 <= x2 && f->x2 + 1 >= x1 && f->y1 - 1 <= y2 && f->y2 + 1 >= y1) {
+			start_field(*f);
+		}
+	}
+}
+
+void flow_field_cache::clear()
+{
+	std::fill(blocked_.begin(), blocked_.end(), -1);
+	fields_.clear();
+	frame_ = 0;
+}
+
+point flow_field_cache::cell_at(const point& p) const
+{
+	return point(floor_div(p.x - origin_.x, cell_width_), floor_div(p.y - origin_.y, cell_height_));
+}
+
+rect flow_field_cache::cell_area(const point& cell) const
+{
+	return rect(origin_.x + cell.x*cell_width_, origin_.y + cell.y*cell_height_, cell_width_, cell_height_);
+}
+
+bool flow_field_cache::busy() const
+{
+	foreach(const field_ptr& f, fields_) {
+		if(!f->open.empty()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void flow_field_cache::process(const cell_blocked_fn& blocked, int max_cells)
+{
+	++frame_;
+
+	std::vector<field_ptr>::iterator end = fields_.begin();
+	foreach(const field_ptr& f, fields_) {
+		if(frame_ - f->last_used <= MaxUnusedFrames) {
+			*end++ = f;
+		}
+	}
+
+	fields_.erase(end, fields_.end());
+
+	std::sort(fields_.begin(), fields_.end(), boost::bind(&field::last_used, _1) > boost::bind(&field::last_used, _2));
+	foreach(const field_ptr& f, fields_) {
+		if(max_cells <= 0) {
+			break;
+		}
+
+		max_cells -= search(*f, blocked, max_cells);
+	}
+}
+
+const flow_field_cache::field* flow_field_cache::settled_field(const point& goal, const point& cell, const cell_blocked_fn& blocked)
+{
+	if(cell.x < 0 || cell.y < 0 || cell.x >= width_ || cell.y >= height_) {
+		return NULL;
+	}
+
+	field& f = get_field(goal);
+	const int index = cell.y*width_ + cell.x;
+	if(!f.cost.empty() && !f.settled[index]) {
+		search(f, blocked, width_*height_, index);
+	}
+
+	return &f;
+}
+
+bool flow_field_cache::direction(const point& goal, const point& cell, const cell_blocked_fn& blocked, point* result)
+{
+	const field* f = settled_field(goal, cell, blocked);
+	const int index = cell.y*width_ + cell.x;
+	if(f == NULL || f->cost.empty() || !f->settled[index]) {
+		return false;
+	}
+
+	*result = point(Moves[f->move[index]][0], Moves[f->move[index]][1]);
+	return true;
+}
+
+double flow_field_cache::distance(const point& goal, const point& cell, const cell_blocked_fn& blocked)
+{
+	const field* f = settled_field(goal, cell, blocked);
+	const int index = cell.y*width_ + cell.x;
+	if(f == NULL || f->cost.empty() || !f->settled[index]) {
+		return -1.0;
+	}
+
+	return f->cost[index];
+}
+
+bool flow_field_cache::complete(const point& goal)
+{
+	return get_field(goal).open.empty();
+}
+
+flow_field_cache::field& flow_field_cache::get_field(const point& goal)
+{
+	foreach(const field_ptr& f, fields_) {
+		if(f->goal == goal) {
+			f->last_used = frame_;
+			return *f;
+		}
+	}
+
+	if(fields_.size() >= MaxFields) {
+		fields_.erase(std::min_element(fields_.begin(), fields_.end(), boost::bind(&field::last_used, _1) < boost::bind(&field::last_used, _2)));
+	}
+
+	field_ptr f(new field);
+	f->goal = goal;
+	f->last_used = frame_;
+	start_field(*f);
+	fields_.push_back(f);
+	return *f;
+}
+
+void flow_field_cache::start_field(field& f)
+{
+	f.open = std::priority_queue<field::open_entry, std::vector<field::open_entry>, std::greater<field::open_entry> >();
+	if(f.goal.x < 0 || f.goal.y < 0 || f.goal.x >= width_ || f.goal.y >= height_) {
+		//a goal off the grid can't be reached from anywhere.
+		f.cost.clear();
+		f.move.clear();
+		f.settled.clear();
+		f.x1 = f.y1 = 0;
+		f.x2 = f.y2 = -1;
+		return;
+	}
+
+	const int ncells = width_*height_;
+	f.cost.assign(ncells, Unreached);
+	f.move.assign(ncells, -1);
+	f.settled.assign(ncells, false);
+
+	const int index = f.goal.y*width_ + f.goal.x;
+	f.cost[index] = 0.0f;
+	f.move[index] = StayMove;
+	f.open.push(field::open_entry(0.0f, index));
+	f.x1 = f.x2 = f.goal.x;
+	f.y1 = f.y2 = f.goal.y;
+}
+
+bool flow_field_cache::cell_blocked(const cell_blocked_fn& blocked, int x, int y)
+{
+	if(x < 0 || y < 0 || x >= width_ || y >= height_) {
+		return true;
+	}
+
+	signed char& value = blocked_[y*width_ + x];
+	if(value == -1) {
+		value = blocked(x, y) ? 1 : 0;
+	}
+
+	return value == 1;
+}
+
+int flow_field_cache::search(field& f, const cell_blocked_fn& blocked, int max_cells, int target)
+{
+	const float diagonal_cost = sqrt(float(cell_width_*cell_width_ + cell_height_*cell_height_));
+	const int goal = f.goal.y*width_ + f.goal.x;
+
+	int count = 0;
+	while(count < max_cells && !f.open.empty()) {
+		const field::open_entry top = f.open.top();
+		f.open.pop();
+
+		const int current = top.second;
+		if(f.settled[current] || top.first > f.cost[current]) {
+			continue;
+		}
+
+		const int x = current%width_;
+		const int y = current/width_;
+		if(current == goal && cell_blocked(blocked, x, y)) {
+			continue;
+		}
+
+		f.settled[current] = true;
+		++count;
+
+		for(int m = 0; m != StayMove; ++m) {
+			const int dx = Moves[m][0], dy = Moves[m][1];
+			if(cell_blocked(blocked, x + dx, y + dy) ||
+			   (dx && dy && (cell_blocked(blocked, x + dx, y) || cell_blocked(blocked, x, y + dy)))) {
+				continue;
+			}
+
+			const int next = (y + dy)*width_ + x + dx;
+			if(f.settled[next]) {
+				continue;
+			}
+
+			const float cost = f.cost[current] + (dx && dy ? diagonal_cost : (dx ? cell_width_ : cell_height_));
+			if(cost < f.cost[next]) {
+				f.cost[next] = cost;
+
+				//agents in the next cell move back the way the search came.
+				f.move[next] = 7 - m;
+				f.open.push(field::open_entry(cost, next));
+				f.x1 = std::min(f.x1, x + dx);
+				f.x2 = std::max(f.x2, x + dx);
+				f.y1 = std::min(f.y1, y + dy);
+				f.y2 = std::max(f.y2, y + dy);
+			}
+		}
+
+		if(current == target) {
+			break;
+		}
+	}
+
+	return count;
+}
+
+namespace {
+bool level_cell_blocked(const level& lvl, const flow_field_cache& cache, int x, int y)
+{
+	const rect area = cache.cell_area(point(x, y));
+	return lvl.may_be_solid_in_rect(area) && lvl.solid(area);
+}
+
+//makes sure a level's flow fields are over its current boundaries.
+flow_field_cache& level_flow_fields(const level& lvl)
+{
+	flow_field_cache& cache = lvl.flow_fields();
+	const rect& b = lvl.boundaries();
+	const int x1 = floor_div(b.x(), TileSize);
+	const int y1 = floor_div(b.y(), TileSize);
+	const int x2 = floor_div(b.x2() - 1, TileSize);
+	const int y2 = floor_div(b.y2() - 1, TileSize);
+	cache.set_grid(point(x1*TileSize, y1*TileSize), x2 - x1 + 1, y2 - y1 + 1, TileSize, TileSize);
+	return cache;
+}
+}
+
+variant flow_field_direction(boost::intrusive_ptr<level> lvl, const point& goal, const point& pos)
+{
+	flow_field_cache& cache = level_flow_fields(*lvl);
+	point dir;
+	if(!cache.direction(cache.cell_at(goal), cache.cell_at(pos), boost::bind(level_cell_blocked, boost::cref(*lvl), boost::cref(cache), _1, _2), &dir)) {
+		return variant();
+	}
+
+	return variant::create_list(variant(dir.x), variant(dir.y));
+}
+
+void process_flow_fields(const level& lvl)
+{
+	flow_field_cache& cache = level_flow_fields(lvl);
+	cache.process(boost::bind(level_cell_blocked, boost::cref(lvl), boost::cref(cache), _1, _2), g_flow_field_cells_per_frame);
+}
+
+}
+
+UNIT_TEST(flow_field_matches_distance_map) {
+	for(int test = 0; test != 20; ++test) {
+		const int width = 5 + rand()%40, height = 5 + rand()%40;
+		std::vector<bool> blocked(width*height);
+		for(int n = 0; n != blocked.size(); ++n) {
+			blocked[n] = rand()%100 < 25;
+		}
+
+		const pathfinding::occupancy_grid grid(width, height, blocked, 16, 16);
+		const pathfinding::cell_blocked_fn blocked_fn = [&](int x, int y) { return grid.blocked(x, y); };
+
+		pathfinding::flow_field_cache cache;
+		cache.set_grid(point(), width, height, 16, 16);
+
+		const point goal(rand()%width, rand()%height);
+		point dir;
+		cache.direction(goal, goal, blocked_fn, &dir);
+
+		//the field is found a few cells at a time.
+		int frames = 0;
+		while(cache.busy()) {
+			cache.process(blocked_fn, 50);
+			++frames;
+		}
+
+		CHECK(cache.complete(goal), "flow field not complete");
+
+		//a field found only by queries gives the same answers as one found
+		//a slice at a time by process().
+		pathfinding::flow_field_cache queried;
+		queried.set_grid(point(), width, height, 16, 16);
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				point queried_dir, processed_dir;
+				const bool queried_found = queried.direction(goal, point(x, y), blocked_fn, &queried_dir);
+				CHECK_EQ(queried_found, cache.direction(goal, point(x, y), blocked_fn, &processed_dir));
+				CHECK(!queried_found || queried_dir == processed_dir, "queried flow field differs from processed one at " << x << "," << y);
+				CHECK_EQ(queried.distance(goal, point(x, y), blocked_fn), cache.distance(goal, point(x, y), blocked_fn));
+			}
+		}
+
+		std::vector<double> distances;
+		pathfinding::grid_distance_map(grid, goal, &distances);
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				const double expected = distances[y*width + x];
+				const double found = cache.distance(goal, point(x, y), blocked_fn);
+				if(expected == std::numeric_limits<double>::max()) {
+					CHECK(found < 0.0, "flow field reaches unreachable cell " << x << "," << y);
+					CHECK(!cache.direction(goal, point(x, y), blocked_fn, &dir), "flow field has direction for unreachable cell");
+					continue;
+				}
+
+				CHECK(fabs(found - expected) < 0.01, "flow field distance " << found << " where best is " << expected);
+
+				//following the field must reach the goal at the cost it gives.
+				point p(x, y);
+				double cost = 0.0;
+				for(int steps = 0; p != goal; ++steps) {
+					CHECK(steps < width*height, "following flow field doesn't reach goal");
+					CHECK(cache.direction(goal, p, blocked_fn, &dir), "flow field has no direction for reachable cell");
+					CHECK(dir != point(0, 0), "flow field stops before the goal");
+					CHECK(!grid.blocked(p.x + dir.x, p.y + dir.y), "flow field moves into blocked cell");
+					CHECK(!dir.x || !dir.y || (!grid.blocked(p.x + dir.x, p.y) && !grid.blocked(p.x, p.y + dir.y)), "flow field cuts a corner");
+					cost += dir.x && dir.y ? sqrt(512.0) : 16.0;
+					p.x += dir.x;
+					p.y += dir.y;
+				}
+
+				CHECK(fabs(cost - expected) < 0.01, "following flow field costs " << cost << " where best is " << expected);
+			}
+		}
+	}
+}
+
+UNIT_TEST(flow_field_invalidate) {
+	const int width = 10, height = 3;
+	std::vector<bool> blocked(width*height, false);
+	const pathfinding::cell_blocked_fn blocked_fn = [&](int x, int y) { return blocked[y*width + x]; };
+
+	pathfinding::flow_field_cache cache;
+	cache.set_grid(point(), width, height, 32, 32);
+	const point goal(9, 1);
+	//the field is searched as far as a query needs without processing.
+	CHECK_EQ(cache.distance(goal, point(0, 1), blocked_fn), 9*32);
+
+	//a wall across the grid cuts off the goal once it's invalidated.
+	blocked[0*width + 5] = blocked[1*width + 5] = blocked[2*width + 5] = true;
+	cache.invalidate(rect(5*32, 0, 32, 96));
+	cache.process(blocked_fn, 1000);
+	CHECK(cache.distance(goal, point(0, 1), blocked_fn) < 0.0, "flow field goes through wall");
+	CHECK(cache.distance(goal, point(6, 1), blocked_fn) > 0.0, "flow field lost cells on goal's side of wall");
+}
+
+UNIT_TEST(flow_field_unblock) {
+	const int width = 10, height = 3;
+	std::vector<bool> blocked(width*height, false);
+	const pathfinding::cell_blocked_fn blocked_fn = [&](int x, int y) { return blocked[y*width + x]; };
+
+	//the field never reaches the wall, only looks at it from beside it.
+	blocked[0*width + 5] = blocked[1*width + 5] = blocked[2*width + 5] = true;
+
+	pathfinding::flow_field_cache cache;
+	cache.set_grid(point(), width, height, 32, 32);
+	const point goal(9, 1);
+	cache.distance(goal, point(0, 1), blocked_fn);
+	cache.process(blocked_fn, 1000);
+	CHECK(cache.distance(goal, point(0, 1), blocked_fn) < 0.0, "flow field goes through wall");
+
+	//opening the wall lets the field through once it's invalidated.
+	blocked[1*width + 5] = false;
+	cache.invalidate(rect(5*32, 32, 32, 32));
+	cache.process(blocked_fn, 1000);
+	CHECK_EQ(cache.distance(goal, point(0, 1), blocked_fn), 9*32);
+}
+
+namespace {
+//moves agents towards a goal through a flow field each frame, with the
+//goal moving every second.
+void benchmark_flow_field_agents(int benchmark_iterations, pathfinding::flow_field_cache& cache, const pathfinding::cell_blocked_fn& blocked, const std::vector<point>& open_cells, int nagents)
+{
+	if(open_cells.empty()) {
+		return;
+	}
+
+	srand(0);
+	std::vector<point> agents;
+	for(int n = 0; n != nagents; ++n) {
+		agents.push_back(open_cells[rand()%open_cells.size()]);
+	}
+
+	point goal = open_cells[rand()%open_cells.size()];
+	int frame = 0;
+	BENCHMARK_LOOP {
+		if(++frame%60 == 0) {
+			goal = open_cells[rand()%open_cells.size()];
+		}
+
+		foreach(point& agent, agents) {
+			point dir;
+			if(cache.direction(goal, agent, blocked, &dir)) {
+				agent.x += dir.x;
+				agent.y += dir.y;
+			}
+		}
+
+		cache.process(blocked, g_flow_field_cells_per_frame);
+	}
+}
+}
+
+BENCHMARK(flow_field_500_agents_grid)
+{
+	const int width = 256, height = 256;
+	std::vector<bool> blocked(width*height);
+	std::vector<point> open_cells;
+	srand(0);
+	for(int n = 0; n != blocked.size(); ++n) {
+		blocked[n] = rand()%100 < 20;
+		if(!blocked[n]) {
+			open_cells.push_back(point(n%width, n/width));
+		}
+	}
+
+	pathfinding::flow_field_cache cache;
+	cache.set_grid(point(), width, height, 32, 32);
+	const pathfinding::cell_blocked_fn blocked_fn = [&](int x, int y) { return blocked[y*width + x]; };
+	benchmark_flow_field_agents(benchmark_iterations, cache, blocked_fn, open_cells, 500);
+}
+
+BENCHMARK_ARG(flow_field_500_agents, const std::string& file)
+{
+	static std::map<std::string, boost::intrusive_ptr<level> > levels;
+	boost::intrusive_ptr<level>& lvl = levels[file];
+	if(!lvl) {
+		lvl.reset(new level(file));
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+	}
+
+	srand(0);
+	const rect& b = lvl->boundaries();
+	std::vector<point> agents;
+	for(int tries = 0; agents.size() < 501 && tries < 100000; ++tries) {
+		const point p(b.x() + rand()%std::max(1, b.w()), b.y() + rand()%std::max(1, b.h()));
+		if(!lvl->solid(rect(p.x - p.x%TileSize, p.y - p.y%TileSize, TileSize, TileSize))) {
+			agents.push_back(p);
+		}
+	}
+
+	if(agents.size() < 2) {
+		return;
+	}
+
+	//the first agent is the one the others chase.
+	int frame = 0;
+	BENCHMARK_LOOP {
+		point& goal = agents.front();
+		if(++frame%60 == 0) {
+			goal = agents[1 + rand()%(agents.size() - 1)];
+		}
+
+		for(int n = 1; n < agents.size(); ++n) {
+			const variant dir = pathfinding::flow_field_direction(lvl, goal, agents[n]);
+			if(dir.is_list()) {
+				agents[n].x += dir[0].as_int()*TileSize;
+				agents[n].y += dir[1].as_int()*TileSize;
+			}
+		}
+
+		pathfinding::process_flow_fields(*lvl);
+	}
+}
+
+BENCHMARK_ARG_CALL(flow_field_500_agents, stairway_flow_field, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(flow_field_500_agents);
@@ -0,0 +1,156 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FLOW_FIELD_HPP_INCLUDED
+#define FLOW_FIELD_HPP_INCLUDED
+
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "geometry.hpp"
+#include "hierarchical_pathfinding.hpp"
+#include "variant.hpp"
+
+class level;
+
+namespace pathfinding
+{
+
+//Flow fields for many agents heading to the same place. For each goal
+//cell a field holds the cost of the best path from every cell of the grid
+//to the goal, and which neighbouring cell to move to next, so any number
+//of agents can look up their next move in constant time.
+//
+//Fields are found with Dijkstra's algorithm spreading out from the goal.
+//process(), which is called once a frame, advances the searches a slice
+//at a time. A query about a cell the search hasn't settled yet continues
+//the search until it has, so the answer never depends on how much of the
+//field process() has found. This keeps game logic deterministic.
+//
+//Fields are kept for each goal cell until they go unused. Changing the
+//solidity of an area discards the fields which have searched it. Copying a
+//cache gives an empty cache, like hierarchical_graph.
+//
+//Fields aren't part of a level's saved state, so a level restored from a
+//backup or a replay keyframe starts its fields again. It gets the same
+//answers, since they depend only on the solidity of the level.
+class flow_field_cache
+{
+public:
+	enum { MaxFields = 32, MaxUnusedFrames = 300 };
+
+	flow_field_cache();
+	flow_field_cache(const flow_field_cache& o);
+	flow_field_cache& operator=(const flow_field_cache& o);
+
+	//sets the grid the fields are over, as hierarchical_graph::set_grid()
+	//does. All fields are discarded if the grid changes.
+	void set_grid(const point& origin, int width, int height, int cell_width, int cell_height);
+
+	void invalidate(const rect& area);
+
+	//discards all fields, leaving the cache as it is when a level loads.
+	void clear();
+
+	//true if there are fields which process() still has to search.
+	bool busy() const;
+
+	//searches up to max_cells cells of the fields still being found,
+	//the most recently used first, and drops fields which have gone
+	//unused.
+	void process(const cell_blocked_fn& blocked, int max_cells);
+
+	//the move to make from a cell towards a goal, as a step of -1, 0 or 1
+	//in each direction, starting a field for the goal if there isn't one.
+	//Returns false if the goal can't be reached from the cell. At the goal
+	//the step is (0,0).
+	bool direction(const point& goal, const point& cell, const cell_blocked_fn& blocked, point* result);
+
+	//the cost of the best path from a cell to the goal, or a negative
+	//number if the goal can't be reached from it.
+	double distance(const point& goal, const point& cell, const cell_blocked_fn& blocked);
+
+	//true if the field for a goal has been completely searched.
+	bool complete(const point& goal);
+
+	int num_fields() const { return fields_.size(); }
+
+	const point& origin() const { return origin_; }
+	int cell_width() const { return cell_width_; }
+	int cell_height() const { return cell_height_; }
+	point cell_at(const point& p) const;
+	rect cell_area(const point& cell) const;
+private:
+	struct field {
+		point goal;
+
+		//the cost of the best path found so far from each cell, and the
+		//direction to leave each cell in as an index into the table of
+		//moves, or -1 if the cell hasn't been reached.
+		std::vector<float> cost;
+		std::vector<signed char> move;
+		std::vector<bool> settled;
+
+		typedef std::pair<float, int> open_entry;
+		std::priority_queue<open_entry, std::vector<open_entry>, std::greater<open_entry> > open;
+
+		//the area of cells the search has reached.
+		int x1, y1, x2, y2;
+
+		int last_used;
+	};
+
+	typedef boost::shared_ptr<field> field_ptr;
+
+	field& get_field(const point& goal);
+	void start_field(field& f);
+	bool cell_blocked(const cell_blocked_fn& blocked, int x, int y);
+
+	//searches up to max_cells cells of a field, returning how many it did.
+	//Stops early once the cell at index 'target' is settled, if it's given.
+	int search(field& f, const cell_blocked_fn& blocked, int max_cells, int target=-1);
+
+	//the field for a goal, searched until it settles a cell, or NULL if
+	//the cell is off the grid.
+	const field* settled_field(const point& goal, const point& cell, const cell_blocked_fn& blocked);
+
+	point origin_;
+	int width_, height_;
+	int cell_width_, cell_height_;
+
+	//the solidity of each cell, looked up as it's needed: -1 if unknown,
+	//otherwise 0 or 1.
+	std::vector<signed char> blocked_;
+
+	std::vector<field_ptr> fields_;
+	int frame_;
+};
+
+//finds the move to make from a point of a level towards a goal, as a
+//list of the x and y steps, or null if the goal can't be reached.
+variant flow_field_direction(boost::intrusive_ptr<level> lvl, const point& goal, const point& pos);
+
+//advances the searches for a level's flow fields. Called once a frame.
+void process_flow_fields(const level& lvl);
+
+}
+
+#endif
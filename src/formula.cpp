@@ -36,6 +36,7 @@
 #include "formula_interface.hpp"
 #include "formula_object.hpp"
 #include "formula_tokenizer.hpp"
+#include "formula_vm.hpp"
 #include "i18n.hpp"
 #include "lua_iface.hpp"
 #include "map_utils.hpp"
@@ -139,6 +140,11 @@ namespace game_logic
 		return get_variant_type_from_value(v_);
 	}
 
+	bool variant_expression::compile_vm(formula_vm::builder& b, int target) const {
+		b.emit(formula_vm::OP_LOAD_CONST, target, b.add_constant(v_));
+		return true;
+	}
+
 	command_callable::command_callable() : expr_(NULL)
 	{
 	}
@@ -319,6 +325,16 @@ private:
 	//reference to the list, so that we can allow static evaluation
 	//not to be fooled.
 	variant static_evaluate(const formula_callable& variables) const {
+		if(items_.size() <= 4) {
+			//short lists are stored inline, so avoid building a vector.
+			variant res[4];
+			for(int n = 0; n != items_.size(); ++n) {
+				res[n] = items_[n]->evaluate(variables);
+			}
+
+			return variant::create_list(res, res + items_.size());
+		}
+
 		std::vector<variant> res;
 		res.reserve(items_.size());
 		for(std::vector<expression_ptr>::const_iterator i = items_.begin(); i != items_.end(); ++i) {
@@ -332,6 +348,25 @@ private:
 		return static_evaluate(variables);
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		//registers are allocated as a stack, so these are contiguous.
+		int first_reg = 0;
+		for(int n = 0; n != items_.size(); ++n) {
+			const int reg = b.allocate_register();
+			if(n == 0) {
+				first_reg = reg;
+			}
+		}
+
+		for(int n = 0; n != items_.size(); ++n) {
+			b.compile(*items_[n], first_reg + n);
+		}
+
+		b.emit(formula_vm::OP_MAKE_LIST, target, first_reg, items_.size());
+		b.free_registers(items_.size());
+		return true;
+	}
+
 	std::vector<const_expression_ptr> get_children() const {
 		return std::vector<const_expression_ptr>(items_.begin(), items_.end());
 	}
@@ -404,6 +439,50 @@ private:
 		return variant(&result);
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		using namespace formula_vm;
+
+		if(generators_.empty()) {
+			return false;
+		}
+
+		const int ngenerators = generators_.size();
+		const int first_reg = b.allocate_register();
+		for(int n = 1; n < ngenerators; ++n) {
+			b.allocate_register();
+		}
+
+		int index = 0;
+		for(std::map<std::string, expression_ptr>::const_iterator i = generators_.begin(); i != generators_.end(); ++i) {
+			b.compile(*i->second, first_reg + index++);
+		}
+
+		const int compr = b.add_comprehension(base_slot_, ngenerators);
+		const int begin = b.emit(OP_COMPR_BEGIN, compr, first_reg);
+		const int loop = b.emit(OP_COMPR_BIND, compr);
+
+		const int value_reg = b.allocate_register();
+		std::vector<int> filter_jumps;
+		foreach(const expression_ptr& filter, filters_) {
+			b.compile(*filter, value_reg);
+			filter_jumps.push_back(b.emit(OP_JMP_IF_FALSE, 0, value_reg));
+		}
+
+		b.compile(*expr_, value_reg);
+		b.emit(OP_COMPR_PUSH, compr, value_reg);
+
+		foreach(int jump, filter_jumps) {
+			b.set_jump_target(jump, b.pos());
+		}
+
+		b.emit(OP_COMPR_NEXT, compr, loop);
+		b.set_jump_target(begin, b.pos());
+		b.emit(OP_COMPR_END, compr, target);
+
+		b.free_registers(ngenerators + 1);
+		return true;
+	}
+
 	static bool increment_vec(std::vector<int>& v, const std::vector<int>& max_values) {
 		int index = 0;
 		while(index != v.size()) {
@@ -569,6 +648,12 @@ private:
 		}
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		b.compile(*operand_, target);
+		b.emit(op_ == NOT ? formula_vm::OP_NOT : formula_vm::OP_NEG, target, target);
+		return true;
+	}
+
 	std::vector<const_expression_ptr> get_children() const {
 		std::vector<const_expression_ptr> result;
 		result.push_back(operand_);
@@ -630,6 +715,11 @@ private:
 		return v_;
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		b.emit(formula_vm::OP_LOAD_CONST, target, b.add_constant(v_));
+		return true;
+	}
+
 	variant_type_ptr get_variant_type() const {
 		return variant_type::get_type(v_.type());
 	}
@@ -678,6 +768,11 @@ private:
 		return variables.query_value_by_slot(slot_);
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		b.emit(formula_vm::OP_LOAD_SLOT, target, slot_);
+		return true;
+	}
+
 	variant_type_ptr get_variant_type() const {
 		return callable_def_->get_entry(slot_)->variant_type;
 	}
@@ -1189,7 +1284,8 @@ private:
 class dot_expression : public formula_expression {
 public:
 	dot_expression(expression_ptr left, expression_ptr right, const_formula_callable_definition_ptr right_def)
-	: formula_expression("_dot"), left_(left), right_(right), right_def_(right_def)
+	: formula_expression("_dot"), left_(left), right_(right), right_def_(right_def),
+	  right_key_(variant::create_atom(right->str()))
 	{}
 	const_formula_callable_definition_ptr get_type_definition() const {
 		return right_->get_type_definition();
@@ -1202,7 +1298,7 @@ private:
 				formula_callable_ptr lc(new list_callable(left));	
 				return right_->evaluate(*lc);
 			} else if(left.is_map()) {
-				return left[variant(right_->str())];
+				return left[right_key_];
 			}
 
 			ASSERT_LOG(!left.is_null(), "CALL OF DOT OPERATOR ON NULL VALUE: '" << left_->str() << "': " << debug_pinpoint_location());
@@ -1280,6 +1376,9 @@ private:
 	//the definition used to evaluate right_. i.e. the type of the value
 	//returned from left_.
 	const_formula_callable_definition_ptr right_def_;
+
+	//the key used to look up right_ when left_ evaluates to a map.
+	variant right_key_;
 };
 
 class square_bracket_expression : public formula_expression { //TODO
@@ -1458,6 +1557,14 @@ private:
 		return right_->evaluate(variables);
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		b.compile(*left_, target);
+		const int jump = b.emit(formula_vm::OP_JMP_IF_FALSE, 0, target);
+		b.compile(*right_, target);
+		b.set_jump_target(jump, b.pos());
+		return true;
+	}
+
 	variant_type_ptr get_variant_type() const {
 		return get_variant_type_and_or(left_, right_);
 	}
@@ -1515,6 +1622,14 @@ private:
 		return right_->evaluate(variables);
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		b.compile(*left_, target);
+		const int jump = b.emit(formula_vm::OP_JMP_IF_TRUE, 0, target);
+		b.compile(*right_, target);
+		b.set_jump_target(jump, b.pos());
+		return true;
+	}
+
 	variant_type_ptr get_variant_type() const {
 		return get_variant_type_and_or(left_, right_, true);
 	}
@@ -1555,6 +1670,11 @@ private:
 		return variant();
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		b.emit(formula_vm::OP_LOAD_CONST, target, b.add_constant(variant()));
+		return true;
+	}
+
 	variant_type_ptr get_variant_type() const {
 		return variant_type::get_type(variant::VARIANT_TYPE_NULL);
 	}
@@ -1659,6 +1779,38 @@ private:
 		}
 	}
 	
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		formula_vm::OPCODE opcode;
+		switch(op_) {
+		case OP_ADD: opcode = formula_vm::OP_ADD; break;
+		case OP_SUB: opcode = formula_vm::OP_SUB; break;
+		case OP_MUL: opcode = formula_vm::OP_MUL; break;
+		case OP_DIV: opcode = formula_vm::OP_DIV; break;
+		case OP_MOD: opcode = formula_vm::OP_MOD; break;
+		case OP_POW: opcode = formula_vm::OP_POW; break;
+		case OP_EQ: opcode = formula_vm::OP_EQ; break;
+		case OP_NEQ: opcode = formula_vm::OP_NEQ; break;
+		case OP_LT: opcode = formula_vm::OP_LT; break;
+		case OP_LTE: opcode = formula_vm::OP_LTE; break;
+		case OP_GT: opcode = formula_vm::OP_GT; break;
+		case OP_GTE: opcode = formula_vm::OP_GTE; break;
+
+		//'in', dice rolls and the rare un-optimized and/or are left
+		//to the tree interpreter.
+		default:
+			return false;
+		}
+
+		//evaluate the left side into the target and the right side into
+		//a temporary, so the target may be used by the operands.
+		const int right_reg = b.allocate_register();
+		b.compile(*left_, target);
+		b.compile(*right_, right_reg);
+		b.emit(opcode, target, target, right_reg);
+		b.free_registers(1);
+		return true;
+	}
+
 	static int dice_roll(int num_rolls, int faces) {
 		int res = 0;
 		while(faces > 0 && num_rolls-- > 0) {
@@ -1987,6 +2139,14 @@ private:
 		return body_->evaluate(*wrapped_variables);
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const {
+		const int where = b.add_where(info_.get(), &info_->names, info_->base_slot, info_->entries);
+		b.emit(formula_vm::OP_PUSH_WHERE, where);
+		b.compile(*body_, target);
+		b.emit(formula_vm::OP_POP_SCOPE);
+		return true;
+	}
+
 	std::vector<const_expression_ptr> get_children() const {
 		std::vector<const_expression_ptr> result;
 		result.push_back(body_);
@@ -2543,7 +2703,7 @@ void parse_set_args(const variant& formula_str, const token* i1, const token* i2
 
 				if(i1 - beg == 1 && beg->type == TOKEN_IDENTIFIER) {
 					//make it so that {a: 4} is the same as {'a': 4}
-					res->push_back(expression_ptr(new variant_expression(variant(std::string(beg->begin, beg->end)))));
+					res->push_back(expression_ptr(new variant_expression(variant::create_atom(std::string(beg->begin, beg->end)))));
 				} else {
 					res->push_back(parse_expression(formula_str, beg,i1, symbols, callable_def));
 				}
@@ -3501,6 +3661,14 @@ formula::formula(const variant& val, function_symbol_table* symbols, const_formu
 		expr_ = expression_ptr(new null_expression());
 	}	
 
+	if(formula_vm::enabled()) {
+		program_ = formula_vm::compile(expr_);
+		foreach(BaseCase& base, base_expr_) {
+			base.guard_program = formula_vm::compile(base.guard);
+			base.expr_program = formula_vm::compile(base.expr);
+		}
+	}
+
 	str_.add_formula_using_this(this);
 
 #ifndef NO_EDITOR
@@ -3656,7 +3824,8 @@ int formula::guard_matches(const formula_callable& variables) const
 	if(base_expr_.empty() == false) {
 		int index = 0;
 		foreach(const BaseCase& b, base_expr_) {
-			if(b.guard->evaluate(variables).as_bool()) {
+			const variant result = b.guard_program ? b.guard_program->execute(variables) : b.guard->evaluate(variables);
+			if(result.as_bool()) {
 				return index;
 			}
 
@@ -3686,8 +3855,36 @@ int formula::raw_guard_matches(const formula_callable& variables) const
 formula::non_static_context::non_static_context() { old_value_ = in_static_context; in_static_context = 0; }
 formula::non_static_context::~non_static_context() { in_static_context = old_value_; }
 
+namespace {
+//how many formulas this thread is executing with a lazily tracked call
+//stack.
+VARIANT_THREAD_LOCAL int lazy_call_stack_depth = 0;
+
+struct lazy_call_stack_depth_scope {
+	lazy_call_stack_depth_scope() { ++lazy_call_stack_depth; }
+	~lazy_call_stack_depth_scope() { --lazy_call_stack_depth; }
+};
+}
+
 variant formula::execute(const formula_callable& variables) const
 {
+	if(g_ffl_lazy_call_stack && lazy_call_stack_depth == 0) {
+		//The call stack isn't being tracked, so errors must unwind through
+		//the expressions to reconstruct it. Make asserts throw rather than
+		//abort on the spot, and report them here in the outermost formula.
+		lazy_call_stack_depth_scope depth_scope;
+		clear_unwound_call_stack();
+		try {
+			fatal_assert_scope scope;
+			return execute(variables);
+		} catch(fatal_assert_failure_exception& e) {
+			ASSERT_FATAL(e.msg << "\nFFL CALL STACK:\n" << get_call_stack());
+		} catch(validation_failure_exception& e) {
+			e.msg += "\nFFL CALL STACK:\n" + get_call_stack();
+			throw;
+		}
+	}
+
 	//We want to track the 'last executed' formula in last_executed_formula,
 	//so we can use it for debugging purposes if there's a problem.
 	//If one formula calls another, we want to restore the old value after
@@ -3710,7 +3907,14 @@ variant formula::execute(const formula_callable& variables) const
 
 		const int nguard = guard_matches(variables);
 
-		variant result = (nguard == -1 ? expr_ : base_expr_[nguard].expr)->evaluate(variables);
+		variant result;
+		if(nguard == -1) {
+			result = program_ ? program_->execute(variables) : expr_->evaluate(variables);
+		} else {
+			const BaseCase& base = base_expr_[nguard];
+			result = base.expr_program ? base.expr_program->execute(variables) : base.expr->evaluate(variables);
+		}
+
 		--execution_stack;
 		if(prev_executed) {
 			last_executed_formula = prev_executed;
@@ -3889,6 +4093,106 @@ BENCHMARK(formula_map_bench) {
 	}
 }
 
+namespace {
+struct lazy_call_stack_scope {
+	lazy_call_stack_scope() : old_value_(g_ffl_lazy_call_stack) { g_ffl_lazy_call_stack = true; }
+	~lazy_call_stack_scope() { g_ffl_lazy_call_stack = old_value_; }
+	bool old_value_;
+};
+}
+
+//versions of formula_list_comprehension_bench and formula_map_bench that
+//don't track the call stack, to measure the cost of tracking it.
+BENCHMARK(formula_list_comprehension_bench_lazy_call_stack) {
+	lazy_call_stack_scope lazy_stack;
+	formula f(variant("[x*x + 5 | x <- range(input)]"));
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("input", variant(1000));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+BENCHMARK(formula_map_bench_lazy_call_stack) {
+	lazy_call_stack_scope lazy_stack;
+	formula f(variant("map(range(input), value*value + 5)"));
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("input", variant(1000));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+UNIT_TEST(formula_lazy_call_stack) {
+	lazy_call_stack_scope lazy_stack;
+	//the bad index comes from a variable so the error isn't found when
+	//the formula is parsed.
+	const std::string bad_expression = "1 + [1,2,3][input]";
+	formula f(variant("def f(n) n*2; f(" + bad_expression + ")"));
+	map_formula_callable_ptr callable(new map_formula_callable);
+	callable->add("input", variant(5));
+	bool error = false;
+	try {
+		assert_recover_scope recover;
+		f.execute(*callable);
+	} catch(validation_failure_exception& e) {
+		error = true;
+		CHECK(e.msg.find("FFL CALL STACK") != std::string::npos, "no call stack reported: " << e.msg);
+	}
+
+	CHECK(error, "lazy call stack formula didn't fail");
+	CHECK_EQ(formula(variant("def f(n) n*2; f(4)")).execute(), variant(8));
+}
+
+UNIT_TEST(formula_lazy_call_stack_discards_caught_frames) {
+	lazy_call_stack_scope lazy_stack;
+
+	//frames left behind by an exception which was caught must not be
+	//reported once another expression starts evaluating.
+	formula caught(variant("'caught_frame' + input"));
+	record_unwound_call_stack_frame(caught.expr().get());
+	CHECK(get_call_stack().find("caught_frame") != std::string::npos, "frame wasn't recorded");
+
+	map_formula_callable_ptr callable(new map_formula_callable);
+	callable->add("input", variant(2));
+	CHECK_EQ(formula(variant("input*2")).execute(*callable), variant(4));
+	CHECK(get_call_stack().find("caught_frame") == std::string::npos, "stale frame reported: " << get_call_stack());
+}
+
+BENCHMARK(formula_map_construct_bench) {
+	formula f(variant("{a: input, b: input+1, c: input+2, d: input+3, e: input+4, f: input+5, g: input+6, h: input+7, i: input+8, j: input+9}"));
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("input", variant(1000));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+BENCHMARK(formula_map_lookup_bench) {
+	formula f(variant("m.a + m.c + m.e + m.g + m.i + m.j + m.h + m.f + m.d + m.b"));
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("m", formula(variant("{a: 1, b: 2, c: 3, d: 4, e: 5, f: 6, g: 7, h: 8, i: 9, j: 10}")).execute());
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+BENCHMARK(formula_doc_lookup_bench) {
+	std::map<variant,variant> m;
+	std::vector<std::string> keys;
+	for(int n = 0; n != 40; ++n) {
+		keys.push_back(formatter() << "attribute_" << n);
+		m[variant(keys.back())] = variant(n);
+	}
+
+	const variant doc(&m);
+	BENCHMARK_LOOP {
+		for(int n = 0; n != keys.size(); ++n) {
+			doc[keys[n]];
+		}
+	}
+}
+
 BENCHMARK(formula_recurse_sort) {
 	formula f(variant(
 "def my_qsort(items) if(size(items) <= 1, items,"
@@ -3951,4 +4255,79 @@ BENCHMARK(formula_add) {
 	}
 }
 
+UNIT_TEST(formula_vm_matches_interpreter) {
+	const char* formulas[] = {
+		"1 + 2*3 - 4/2",
+		"(5 + 4.5)*17 + 12*9 - 5/2",
+		"7 % 3 + 2^10",
+		"if(3 > 4, 'a', 3 <= 4, 'b', 'c')",
+		"if(1 = 2, 5)",
+		"not (1 != 2) or -(3 + 1) < 0",
+		"0 and 5",
+		"[x*x + 5 | x <- range(10), x%2 = 1]",
+		"[a + b | a <- [1,2], b <- [10,20]]",
+		"[x | x <- []]",
+		"a + b where a = 4, b = a*2",
+		"[x + y | x <- [1,2,3]] where y = 10",
+		"5 in [4,5,6]",
+		"[1, 'two', [3.5]]",
+		"3/0 > 1000",
+	};
+
+	for(int n = 0; n != sizeof(formulas)/sizeof(*formulas); ++n) {
+		const variant str(formulas[n]);
+		const variant expected = formula(str).execute();
+
+		formula_vm::enabled_scope vm_scope;
+		const variant result = formula(str).execute();
+		CHECK(result == expected, formulas[n] << ": " << result.write_json() << " != " << expected.write_json());
+	}
+}
+
+BENCHMARK(formula_list_comprehension_bench_vm) {
+	formula_vm::enabled_scope vm_scope;
+	formula f(variant("[x*x + 5 | x <- range(input)]"));
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("input", variant(1000));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+BENCHMARK(formula_recursion_vm) {
+	formula_vm::enabled_scope vm_scope;
+	formula f(variant(
+"def my_index(ls, item, n)"
+"base ls = []: -1 "
+"base ls[0] = item: n "
+"recursive: my_index(ls[1:], item, n+1);"
+"my_index(range(1000001), pos, 0)"));
+
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("pos", variant(100000));
+	BENCHMARK_LOOP {
+		CHECK_EQ(f.execute(*callable), variant(100000));
+	}
+}
+
+BENCHMARK(formula_if_vm) {
+	formula_vm::enabled_scope vm_scope;
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("x", variant(1));
+	static formula f(variant("if(x, 1, 0)"));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
+BENCHMARK(formula_add_vm) {
+	formula_vm::enabled_scope vm_scope;
+	static map_formula_callable* callable = new map_formula_callable;
+	callable->add("x", variant(1));
+	static formula f(variant("x+1"));
+	BENCHMARK_LOOP {
+		f.execute(*callable);
+	}
+}
+
 }
@@ -24,6 +24,7 @@
 #include "formula_fwd.hpp"
 #include "formula_function.hpp"
 #include "formula_tokenizer.hpp"
+#include "formula_vm.hpp"
 #include "variant.hpp"
 #include "variant_type.hpp"
 
@@ -116,6 +117,9 @@ private:
 	variant str_;
 	expression_ptr expr_;
 
+	//if formulas are being compiled, the bytecode for expr_.
+	formula_vm::program_ptr program_;
+
 	const_formula_callable_definition_ptr def_;
 
 	//for recursive function formulae, we have base cases along with
@@ -123,6 +127,7 @@ private:
 	struct BaseCase {
 		//raw_guard is the guard without wrapping in the global where.
 		expression_ptr raw_guard, guard, expr;
+		formula_vm::program_ptr guard_program, expr_program;
 	};
 	std::vector<BaseCase> base_expr_;
 
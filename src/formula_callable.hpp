@@ -102,6 +102,19 @@ public:
 	virtual bool is_command() const { return false; }
 	virtual bool is_cairo_op() const { return false; }
 
+	//the kind of command this is, so that code executing commands can
+	//tell them apart without RTTI.
+	enum COMMAND_TYPE {
+		NOT_A_COMMAND,
+		FORMULA_COMMAND,          //a game_logic::command_callable
+		ENTITY_COMMAND,           //an entity_command_callable
+		CUSTOM_OBJECT_COMMAND,    //a custom_object_command_callable
+		SWALLOW_OBJECT_COMMAND,   //a swallow_object_command_callable
+		SWALLOW_MOUSE_COMMAND,    //a swallow_mouse_command_callable
+	};
+
+	virtual COMMAND_TYPE command_type() const { return NOT_A_COMMAND; }
+
 	void perform_visit_values(formula_callable_visitor& visitor) {
 		visit_values(visitor);
 	}
@@ -241,8 +254,15 @@ public:
 	void run_command(formula_callable& context) const;
 
 	void set_expression(const formula_expression* expr);
+	const formula_expression* get_expression() const { return expr_; }
 
 	bool is_command() const { return true; }
+	COMMAND_TYPE command_type() const { return FORMULA_COMMAND; }
+
+	//if running this command only sets (or adds to, if *add is set to
+	//true) a slot of the context, returns true and gives the slot and
+	//value. Lets runs of these commands be applied in a batch.
+	virtual bool get_slot_mutation(int* slot, const variant** value, bool* add) const { return false; }
 private:
 	virtual void execute(formula_callable& context) const = 0;
 	variant get_value(const std::string& key) const { return variant(); }
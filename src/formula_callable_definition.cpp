@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 
+#include <boost/unordered_map.hpp>
+
 #include "foreach.hpp"
 #include "formula_callable_definition.hpp"
 #include "formula_object.hpp"
@@ -50,24 +52,21 @@ namespace
 class simple_definition : public formula_callable_definition
 {
 public:
-	simple_definition() : base_(NULL)
+	simple_definition() : base_(NULL), index_is_flat_(false)
 	{}
 
 	int get_slot(const std::string& key) const {
-		int index = 0;
-		foreach(const entry& e, entries_) {
-			if(e.id == key) {
-				return base_num_slots() + index;
-			}
+		const slot_index_map::const_iterator itor = slot_index_.find(key);
+		if(index_is_flat_) {
+			return itor != slot_index_.end() ? itor->second : -1;
+		}
 
-			++index;
+		if(itor != slot_index_.end()) {
+			return base_num_slots() + itor->second;
 		}
 
 		if(base_) {
-			int result = base_->get_slot(key);
-			if(result != -1) {
-				return result;
-			}
+			return base_->get_slot(key);
 		}
 
 		return -1;
@@ -131,11 +130,52 @@ public:
 
 	const entry* get_default_entry() const { return default_entry_.get(); }
 
+	//builds the lookup index used by get_slot(). Must be called once all
+	//entries have been added. If every definition in the base chain is a
+	//simple_definition the chain can't change any more, so we flatten it
+	//into a single table of absolute slots. Otherwise (e.g. the base is a
+	//custom_object_callable which can still grow) we only index our own
+	//entries and defer to the base for misses.
+	void finalize() {
+		slot_index_.clear();
+
+		int index = 0;
+		foreach(const entry& e, entries_) {
+			//earlier entries shadow later ones with the same id.
+			slot_index_.insert(std::pair<std::string, int>(e.id, index));
+			++index;
+		}
+
+		const simple_definition* base = dynamic_cast<const simple_definition*>(base_.get());
+		if(!base_ || (base && base->index_is_flat_)) {
+			const int nbase = base_num_slots();
+			for(slot_index_map::iterator i = slot_index_.begin(); i != slot_index_.end(); ++i) {
+				i->second += nbase;
+			}
+
+			if(base) {
+				//our own entries shadow the base's entries.
+				slot_index_.insert(base->slot_index_.begin(), base->slot_index_.end());
+			}
+
+			index_is_flat_ = true;
+		} else {
+			index_is_flat_ = false;
+		}
+	}
+
 private:
 	int base_num_slots() const { return base_ ? base_->num_slots() : 0; }
 	const_formula_callable_definition_ptr base_;
 	std::vector<entry> entries_;
 
+	//maps ids to slots. If index_is_flat_ is true this covers the whole
+	//base chain and holds absolute slots, otherwise it holds only our own
+	//entries, relative to base_num_slots().
+	typedef boost::unordered_map<std::string, int> slot_index_map;
+	slot_index_map slot_index_;
+	bool index_is_flat_;
+
 	boost::shared_ptr<entry> default_entry_;
 };
 
@@ -220,6 +260,7 @@ formula_callable_definition_ptr create_formula_callable_definition(const std::st
 		++i1;
 	}
 
+	def->finalize();
 	return formula_callable_definition_ptr(def);
 }
 
@@ -232,6 +273,7 @@ formula_callable_definition_ptr create_formula_callable_definition(const formula
 		++i1;
 	}
 
+	def->finalize();
 	return formula_callable_definition_ptr(def);
 }
 
@@ -241,6 +283,7 @@ formula_callable_definition_ptr create_map_formula_callable_definition(variant_t
 	formula_callable_definition::entry e("");
 	e.set_variant_type(value_type);
 	def->set_default(e);
+	def->finalize();
 	return formula_callable_definition_ptr(def);
 }
 
@@ -350,3 +393,55 @@ COMMAND_LINE_UTILITY(document_builtins)
 
 	std::cout << "\n";
 }
+
+UNIT_TEST(formula_callable_definition_slot_lookup)
+{
+	using namespace game_logic;
+
+	const std::string base_ids[] = { "a", "b", "c" };
+	const std::string derived_ids[] = { "d", "b", "e", "d" };
+
+	const_formula_callable_definition_ptr base = create_formula_callable_definition(base_ids, base_ids + 3);
+	const_formula_callable_definition_ptr derived = create_formula_callable_definition(derived_ids, derived_ids + 4, base);
+
+	CHECK_EQ(derived->num_slots(), 7);
+	CHECK_EQ(derived->get_slot("a"), 0);
+	CHECK_EQ(derived->get_slot("c"), 2);
+	CHECK_EQ(derived->get_slot("b"), 4);
+	CHECK_EQ(derived->get_slot("d"), 3);
+	CHECK_EQ(derived->get_slot("e"), 5);
+	CHECK_EQ(derived->get_slot("f"), -1);
+}
+
+BENCHMARK(formula_callable_definition_get_slot)
+{
+	using namespace game_logic;
+
+	std::vector<std::string> base_ids, ids;
+	for(int n = 0; n != 100; ++n) {
+		char buf[64];
+		sprintf(buf, "base_property_%d", n);
+		base_ids.push_back(buf);
+	}
+
+	for(int n = 0; n != 200; ++n) {
+		char buf[64];
+		sprintf(buf, "property_%d", n);
+		ids.push_back(buf);
+	}
+
+	const_formula_callable_definition_ptr base = create_formula_callable_definition(&base_ids[0], &base_ids[0] + base_ids.size());
+	const_formula_callable_definition_ptr def = create_formula_callable_definition(&ids[0], &ids[0] + ids.size(), base);
+
+	std::vector<std::string> keys = ids;
+	keys.insert(keys.end(), base_ids.begin(), base_ids.end());
+	keys.push_back("no_such_property");
+
+	int nkey = 0;
+	BENCHMARK_LOOP {
+		def->get_slot(keys[nkey]);
+		if(++nkey == keys.size()) {
+			nkey = 0;
+		}
+	}
+}
@@ -47,6 +47,7 @@
 #include "dialog.hpp"
 #include "debug_console.hpp"
 #include "draw_primitive.hpp"
+#include "flow_field.hpp"
 #include "foreach.hpp"
 #include "formatter.hpp"
 #include "formula.hpp"
@@ -55,9 +56,11 @@
 #include "formula_callable_utils.hpp"
 #include "formula_function.hpp"
 #include "formula_function_registry.hpp"
+#include "formula_vm.hpp"
 #include "formula_object.hpp"
 #include "geometry.hpp"
 #include "hex_map.hpp"
+#include "hierarchical_pathfinding.hpp"
 #include "lua_iface.hpp"
 #include "md5.hpp"
 #include "rectangle_rotator.hpp"
@@ -486,6 +489,32 @@ END_FUNCTION_DEF(md5)
 			return args()[nargs-1]->evaluate(variables);
 		}
 
+		bool compile_vm(formula_vm::builder& b, int target) const {
+			using namespace formula_vm;
+
+			const int nargs = args().size();
+			std::vector<int> end_jumps;
+			for(int n = 0; n < nargs-1; n += 2) {
+				b.compile(*args()[n], target);
+				const int next_jump = b.emit(OP_JMP_IF_FALSE, 0, target);
+				b.compile(*args()[n+1], target);
+				end_jumps.push_back(b.emit(OP_JMP));
+				b.set_jump_target(next_jump, b.pos());
+			}
+
+			if(nargs%2 == 0) {
+				b.emit(OP_LOAD_CONST, target, b.add_constant(variant()));
+			} else {
+				b.compile(*args()[nargs-1], target);
+			}
+
+			foreach(int jump, end_jumps) {
+				b.set_jump_target(jump, b.pos());
+			}
+
+			return true;
+		}
+
 
 		variant_type_ptr get_variant_type() const {
 			std::vector<variant_type_ptr> types;
@@ -1880,6 +1909,50 @@ FUNCTION_DEF(plot_path, 6, 9, "plot_path(level, from_x, from_y, to_x, to_y, heur
 	return variant(pathfinding::a_star_find_path(lvl, src, dst, heuristic, weight_expr, callable, tile_size_x, tile_size_y));
 END_FUNCTION_DEF(plot_path)
 
+FUNCTION_DEF(plot_grid_path, 5, 8, "plot_grid_path(level, from_x, from_y, to_x, to_y, (optional) weight_expr, (optional) tile_size_x, (optional) tile_size_y) -> list : Like plot_path, but much faster. Returns a list of points to get from (from_x, from_y) to (to_x, to_y), moving diagonally only where neither tile beside the move is solid. weight_expr is given the tile midpoints a and b and must never be less than the distance between them; null means that distance.")
+	int tile_size_x = TileSize;
+	int tile_size_y = TileSize;
+	expression_ptr weight_expr = expression_ptr();
+	variant curlevel = args()[0]->evaluate(variables);
+	level_ptr lvl = curlevel.try_convert<level>();
+	ASSERT_LOG(lvl, "plot_grid_path called without a level");
+	if(args().size() > 5) {
+		variant literal;
+		if(!args()[5]->is_literal(literal) || !literal.is_null()) {
+			weight_expr = args()[5];
+		}
+	}
+	if(args().size() == 7) {
+		tile_size_y = tile_size_x = args()[6]->evaluate(variables).as_int();
+	} else if(args().size() == 8) {
+		tile_size_x = args()[6]->evaluate(variables).as_int();
+		tile_size_y = args()[7]->evaluate(variables).as_int();
+	}
+	ASSERT_LOG(tile_size_x > 0 && tile_size_y > 0, "Illegal tile size given to plot_grid_path: (" << tile_size_x << "," << tile_size_y << ")");
+	point src(args()[1]->evaluate(variables).as_int(), args()[2]->evaluate(variables).as_int());
+	point dst(args()[3]->evaluate(variables).as_int(), args()[4]->evaluate(variables).as_int());
+	boost::intrusive_ptr<map_formula_callable> callable(new map_formula_callable(&variables));
+	return variant(pathfinding::grid_a_star_find_path(lvl, src, dst, weight_expr, callable, tile_size_x, tile_size_y));
+END_FUNCTION_DEF(plot_grid_path)
+
+FUNCTION_DEF(plot_hierarchical_path, 5, 5, "plot_hierarchical_path(level, from_x, from_y, to_x, to_y) -> list : Returns a list of points to get from (from_x, from_y) to (to_x, to_y) through tiles of the level, as plot_grid_path does. Uses a graph of the level which is kept between calls, so long paths are found much faster, but may be slightly longer than the best path.")
+	variant curlevel = args()[0]->evaluate(variables);
+	level_ptr lvl = curlevel.try_convert<level>();
+	ASSERT_LOG(lvl, "plot_hierarchical_path called without a level");
+	point src(args()[1]->evaluate(variables).as_int(), args()[2]->evaluate(variables).as_int());
+	point dst(args()[3]->evaluate(variables).as_int(), args()[4]->evaluate(variables).as_int());
+	return pathfinding::hierarchical_find_path(lvl, src, dst);
+END_FUNCTION_DEF(plot_hierarchical_path)
+
+FUNCTION_DEF(flow_field_direction, 5, 5, "flow_field_direction(level, goal_x, goal_y, x, y) -> [int,int]|null : The step, of -1, 0 or 1 in each direction, to take from the tile at (x, y) towards the tile at (goal_x, goal_y). Every caller heading to the same goal tile shares one flow field. Returns null if the goal can't be reached.")
+	variant curlevel = args()[0]->evaluate(variables);
+	level_ptr lvl = curlevel.try_convert<level>();
+	ASSERT_LOG(lvl, "flow_field_direction called without a level");
+	point goal(args()[1]->evaluate(variables).as_int(), args()[2]->evaluate(variables).as_int());
+	point pos(args()[3]->evaluate(variables).as_int(), args()[4]->evaluate(variables).as_int());
+	return pathfinding::flow_field_direction(lvl, goal, pos);
+END_FUNCTION_DEF(flow_field_direction)
+
 FUNCTION_DEF(sort, 1, 2, "sort(list, criteria): Returns a nicely-ordered list. If you give it an optional formula such as 'a>b' it will sort it according to that. This example favours larger numbers first instead of the default of smaller numbers first.")
 	variant list = args()[0]->evaluate(variables);
 	std::vector<variant> vars;
@@ -3402,6 +3475,13 @@ public:
 		obj.mutate_value_by_slot(slot_, value_);
 	}
 
+	bool get_slot_mutation(int* slot, const variant** value, bool* add) const {
+		*slot = slot_;
+		*value = &value_;
+		*add = false;
+		return true;
+	}
+
 	void set_value(const variant& value) { value_ = value; }
 
 private:
@@ -3462,6 +3542,13 @@ public:
 		obj.mutate_value_by_slot(slot_, obj.query_value_by_slot(slot_) + value_);
 	}
 
+	bool get_slot_mutation(int* slot, const variant** value, bool* add) const {
+		*slot = slot_;
+		*value = &value_;
+		*add = true;
+		return true;
+	}
+
 	void set_value(const variant& value) { value_ = value; }
 
 private:
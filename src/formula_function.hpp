@@ -35,6 +35,10 @@
 
 namespace game_logic {
 
+namespace formula_vm {
+class builder;
+}
+
 class formula_expression;
 typedef boost::intrusive_ptr<formula_expression> expression_ptr;
 typedef boost::intrusive_ptr<const formula_expression> const_expression_ptr;
@@ -66,6 +70,16 @@ public:
 
 	variant evaluate(const formula_callable& variables) const {
 #if !TARGET_OS_IPHONE
+		if(g_ffl_lazy_call_stack) {
+			clear_unwound_call_stack();
+			try {
+				return execute(variables);
+			} catch(...) {
+				record_unwound_call_stack_frame(this);
+				throw;
+			}
+		}
+
 		++ntimes_called_;
 		call_stack_manager manager(this, &variables);
 #endif
@@ -74,6 +88,16 @@ public:
 
 	variant evaluate_with_member(const formula_callable& variables, std::string& id, variant* variant_id=NULL) const {
 #if !TARGET_OS_IPHONE
+		if(g_ffl_lazy_call_stack) {
+			clear_unwound_call_stack();
+			try {
+				return execute_member(variables, id, variant_id);
+			} catch(...) {
+				record_unwound_call_stack_frame(this);
+				throw;
+			}
+		}
+
 		call_stack_manager manager(this, &variables);
 #endif
 		return execute_member(variables, id, variant_id);
@@ -83,6 +107,13 @@ public:
 		static_error_analysis();
 	}
 
+	//lowers this expression to bytecode which writes its result into
+	//register 'target'. Returns false without emitting anything if the
+	//expression has no native lowering.
+	bool compile_to_vm(formula_vm::builder& b, int target) const {
+		return compile_vm(b, target);
+	}
+
 	virtual expression_ptr optimize() const {
 		return expression_ptr();
 	}
@@ -130,6 +161,7 @@ protected:
 private:
 	virtual variant execute(const formula_callable& variables) const = 0;
 	virtual void static_error_analysis() const {}
+	virtual bool compile_vm(formula_vm::builder& b, int target) const { return false; }
 	virtual const_formula_callable_definition_ptr get_modified_definition_based_on_result(bool result, const_formula_callable_definition_ptr current_def, variant_type_ptr expression_is_this_type) const { return NULL; }
 
 	virtual std::vector<const_expression_ptr> get_children() const { return std::vector<const_expression_ptr>(); }
@@ -288,6 +320,8 @@ private:
 		return v_;
 	}
 
+	bool compile_vm(formula_vm::builder& b, int target) const;
+
 	virtual variant_type_ptr get_variant_type() const;
 	
 	variant v_;
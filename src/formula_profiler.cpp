@@ -56,27 +56,56 @@ struct InstrumentationRecord {
 };
 
 std::map<const char*, InstrumentationRecord> g_instrumentation;
+
+//totals kept since enable_instrumentation_totals() was called, which
+//aren't cleared each frame.
+bool totals_on = false;
+std::map<std::string, instrumentation_total> g_instrumentation_totals;
 }
 
 instrument::instrument(const char* id) : id_(id)
 {
-	if(profiler_on) {
+	if(profiler_on || totals_on) {
 		gettimeofday(&tv_, NULL);
 	}
 }
 
 instrument::~instrument()
 {
-	if(profiler_on) {
+	if(profiler_on || totals_on) {
 		struct timeval end_tv;
 		gettimeofday(&end_tv, NULL);
 		const int time_us = (end_tv.tv_sec - tv_.tv_sec)*1000000 + (end_tv.tv_usec - tv_.tv_usec);
-		InstrumentationRecord& r = g_instrumentation[id_];
-		r.time_us += (end_tv.tv_sec - tv_.tv_sec)*1000000 + (end_tv.tv_usec - tv_.tv_usec);
-		r.nsamples++;
+		if(profiler_on) {
+			InstrumentationRecord& r = g_instrumentation[id_];
+			r.time_us += time_us;
+			r.nsamples++;
+		}
+
+		if(totals_on) {
+			instrumentation_total& t = g_instrumentation_totals[id_];
+			t.time_us += time_us;
+			t.calls++;
+		}
 	}
 }
 
+void enable_instrumentation_totals()
+{
+	totals_on = true;
+}
+
+std::vector<instrumentation_total> get_instrumentation_totals()
+{
+	std::vector<instrumentation_total> result;
+	for(std::map<std::string, instrumentation_total>::const_iterator i = g_instrumentation_totals.begin(); i != g_instrumentation_totals.end(); ++i) {
+		result.push_back(i->second);
+		result.back().id = i->first;
+	}
+
+	return result;
+}
+
 void dump_instrumentation()
 {
 	static struct timeval prev_call;
@@ -198,6 +227,9 @@ manager::manager(const char* output_file)
 		profiler_on = true;
 		output_fname = output_file;
 
+		//the profiler samples the FFL call stack, so it must be tracked.
+		g_ffl_lazy_call_stack = false;
+
 		init_call_stack(65536);
 
 #if defined(_WINDOWS) || TARGET_OS_IPHONE
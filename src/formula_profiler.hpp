@@ -18,6 +18,7 @@
 #define FORMULA_PROFILER_HPP_INCLUDED
 
 #include <string>
+#include <vector>
 
 #ifdef DISABLE_FORMULA_PROFILER
 
@@ -49,6 +50,15 @@ class suspend_scope
 
 inline std::string get_profile_summary() { return ""; }
 
+struct instrumentation_total {
+	std::string id;
+	long long time_us;
+	int calls;
+};
+
+inline void enable_instrumentation_totals() {}
+inline std::vector<instrumentation_total> get_instrumentation_totals() { return std::vector<instrumentation_total>(); }
+
 }
 
 #else
@@ -113,6 +123,18 @@ private:
 
 std::string get_profile_summary();
 
+struct instrumentation_total {
+	std::string id;
+	long long time_us;
+	int calls;
+};
+
+//times instrumented scopes from now on, even when the profiler isn't
+//running, adding up the time spent in each for
+//get_instrumentation_totals().
+void enable_instrumentation_totals();
+std::vector<instrumentation_total> get_instrumentation_totals();
+
 }
 
 #endif
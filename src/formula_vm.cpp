@@ -0,0 +1,544 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <sstream>
+
+#include <boost/scoped_ptr.hpp>
+
+#include "asserts.hpp"
+#include "decimal.hpp"
+#include "foreach.hpp"
+#include "formula_callable_utils.hpp"
+#include "formula_vm.hpp"
+#include "preferences.hpp"
+
+PREF_BOOL(ffl_vm, false, "Compile FFL formulas to bytecode and run them on the register VM");
+
+namespace game_logic
+{
+
+namespace formula_vm
+{
+
+bool enabled()
+{
+	return g_ffl_vm;
+}
+
+bool set_enabled(bool value)
+{
+	const bool old_value = g_ffl_vm;
+	g_ffl_vm = value;
+	return old_value;
+}
+
+namespace
+{
+
+//the number of registers we keep on the C++ stack. Programs which need
+//more than this allocate their register file on the heap.
+const int InlineRegisters = 16;
+
+//a where scope which evaluates its entries lazily using their compiled
+//programs. Behaves identically to where_variables in formula.cpp.
+class where_scope : public formula_callable
+{
+public:
+	where_scope(const formula_callable& base, const_program_ptr p, int index)
+	  : formula_callable(false), base_(&base), program_(p), info_(p->wheres()[index])
+	{}
+private:
+	variant get_value_by_slot(int slot) const {
+		if(slot >= info_.base_slot) {
+			slot -= info_.base_slot;
+			if(slot < results_cache_.size() && results_cache_[slot].is_null() == false) {
+				return results_cache_[slot];
+			}
+
+			variant result = info_.entries[slot]->execute(*base_);
+			if(results_cache_.size() <= slot) {
+				results_cache_.resize(slot+1);
+			}
+
+			results_cache_[slot] = result;
+			return result;
+		}
+
+		return base_->query_value_by_slot(slot);
+	}
+
+	variant get_value(const std::string& key) const {
+		const variant result = base_->query_value(key);
+		if(result.is_null()) {
+			std::vector<std::string>::const_iterator i = std::find(info_.names->begin(), info_.names->end(), key);
+			if(i != info_.names->end()) {
+				return get_value_by_slot(info_.base_slot + (i - info_.names->begin()));
+			}
+		}
+
+		return result;
+	}
+
+	boost::intrusive_ptr<const formula_callable> base_;
+
+	//the scope may outlive the execution that created it, e.g. if it is
+	//captured by a closure, so it keeps the program alive.
+	const_program_ptr program_;
+	const program::where_info& info_;
+	mutable std::vector<variant> results_cache_;
+};
+
+struct comprehension_state {
+	std::vector<variant> lists;
+	std::vector<int> indexes;
+	std::vector<variant*> args;
+	boost::intrusive_ptr<slot_formula_callable> callable;
+	std::vector<variant> result;
+};
+
+//execution state that is only needed by programs which use scopes.
+struct frame_scopes {
+	std::vector<const_formula_callable_ptr> scopes;
+	std::vector<comprehension_state> comprehensions;
+};
+
+const char* opcode_name(OPCODE op)
+{
+	switch(op) {
+	case OP_LOAD_CONST: return "LOAD_CONST";
+	case OP_LOAD_SLOT: return "LOAD_SLOT";
+	case OP_MOVE: return "MOVE";
+	case OP_EVAL: return "EVAL";
+	case OP_NOT: return "NOT";
+	case OP_NEG: return "NEG";
+	case OP_ADD: return "ADD";
+	case OP_SUB: return "SUB";
+	case OP_MUL: return "MUL";
+	case OP_DIV: return "DIV";
+	case OP_MOD: return "MOD";
+	case OP_POW: return "POW";
+	case OP_EQ: return "EQ";
+	case OP_NEQ: return "NEQ";
+	case OP_LT: return "LT";
+	case OP_LTE: return "LTE";
+	case OP_GT: return "GT";
+	case OP_GTE: return "GTE";
+	case OP_MAKE_LIST: return "MAKE_LIST";
+	case OP_JMP: return "JMP";
+	case OP_JMP_IF_FALSE: return "JMP_IF_FALSE";
+	case OP_JMP_IF_TRUE: return "JMP_IF_TRUE";
+	case OP_PUSH_WHERE: return "PUSH_WHERE";
+	case OP_POP_SCOPE: return "POP_SCOPE";
+	case OP_COMPR_BEGIN: return "COMPR_BEGIN";
+	case OP_COMPR_BIND: return "COMPR_BIND";
+	case OP_COMPR_PUSH: return "COMPR_PUSH";
+	case OP_COMPR_NEXT: return "COMPR_NEXT";
+	case OP_COMPR_END: return "COMPR_END";
+	case OP_RETURN: return "RETURN";
+	}
+
+	return "UNKNOWN";
+}
+
+variant run_program(const program& p, const formula_callable& variables, variant* regs);
+
+}
+
+variant program::execute(const formula_callable& variables) const
+{
+#if !TARGET_OS_IPHONE
+	if(g_ffl_lazy_call_stack) {
+		clear_unwound_call_stack();
+		try {
+			return run(variables);
+		} catch(...) {
+			record_unwound_call_stack_frame(source_.get());
+			throw;
+		}
+	}
+
+	call_stack_manager manager(source_.get(), &variables);
+#endif
+
+	return run(variables);
+}
+
+variant program::run(const formula_callable& variables) const
+{
+	if(num_registers_ <= InlineRegisters) {
+		variant regs[InlineRegisters];
+		return run_program(*this, variables, regs);
+	}
+
+	std::vector<variant> regs(num_registers_);
+	return run_program(*this, variables, &regs[0]);
+}
+
+namespace
+{
+
+bool increment_indexes(std::vector<int>& v, const std::vector<variant>& lists)
+{
+	int index = 0;
+	while(index != v.size()) {
+		if(++v[index] < lists[index].num_elements()) {
+			return true;
+		}
+
+		v[index] = 0;
+		++index;
+	}
+
+	return false;
+}
+
+variant run_program(const program& p, const formula_callable& variables, variant* regs)
+{
+	const instruction* code = &p.code()[0];
+	const formula_callable* callable = &variables;
+
+	boost::scoped_ptr<frame_scopes> scopes;
+
+	int pc = 0;
+	for(;;) {
+		const instruction& i = code[pc++];
+		switch(i.op) {
+		case OP_LOAD_CONST:
+			regs[i.a] = p.constants()[i.b];
+			break;
+		case OP_LOAD_SLOT:
+			regs[i.a] = callable->query_value_by_slot(i.b);
+			break;
+		case OP_MOVE:
+			regs[i.a] = regs[i.b];
+			break;
+		case OP_EVAL:
+			regs[i.a] = p.fallbacks()[i.b]->evaluate(*callable);
+			break;
+		case OP_NOT:
+			regs[i.a] = variant::from_bool(!regs[i.b].as_bool());
+			break;
+		case OP_NEG:
+			regs[i.a] = -regs[i.b];
+			break;
+		case OP_ADD:
+			regs[i.a] = regs[i.b] + regs[i.c];
+			break;
+		case OP_SUB:
+			if(regs[i.b].is_int() && regs[i.c].is_int()) {
+				regs[i.a] = variant(regs[i.b].as_int() - regs[i.c].as_int());
+			} else {
+				regs[i.a] = regs[i.b] - regs[i.c];
+			}
+			break;
+		case OP_MUL:
+			if(regs[i.b].is_int() && regs[i.c].is_int()) {
+				regs[i.a] = variant(regs[i.b].as_int() * regs[i.c].as_int());
+			} else {
+				regs[i.a] = regs[i.b] * regs[i.c];
+			}
+			break;
+		case OP_DIV:
+			//matches the divide-by-zero guard in operator_expression.
+			if(regs[i.c] == variant(0)) {
+				regs[i.a] = regs[i.b] / variant(decimal::epsilon());
+			} else {
+				regs[i.a] = regs[i.b] / regs[i.c];
+			}
+			break;
+		case OP_MOD:
+			regs[i.a] = regs[i.b] % regs[i.c];
+			break;
+		case OP_POW:
+			regs[i.a] = regs[i.b] ^ regs[i.c];
+			break;
+		case OP_EQ:
+			regs[i.a] = variant::from_bool(regs[i.b] == regs[i.c]);
+			break;
+		case OP_NEQ:
+			regs[i.a] = variant::from_bool(regs[i.b] != regs[i.c]);
+			break;
+		case OP_LT:
+			if(regs[i.b].is_int() && regs[i.c].is_int()) {
+				regs[i.a] = variant::from_bool(regs[i.b].as_int() < regs[i.c].as_int());
+			} else {
+				regs[i.a] = variant::from_bool(regs[i.b] < regs[i.c]);
+			}
+			break;
+		case OP_LTE:
+			if(regs[i.b].is_int() && regs[i.c].is_int()) {
+				regs[i.a] = variant::from_bool(regs[i.b].as_int() <= regs[i.c].as_int());
+			} else {
+				regs[i.a] = variant::from_bool(regs[i.b] <= regs[i.c]);
+			}
+			break;
+		case OP_GT:
+			if(regs[i.b].is_int() && regs[i.c].is_int()) {
+				regs[i.a] = variant::from_bool(regs[i.b].as_int() > regs[i.c].as_int());
+			} else {
+				regs[i.a] = variant::from_bool(regs[i.b] > regs[i.c]);
+			}
+			break;
+		case OP_GTE:
+			if(regs[i.b].is_int() && regs[i.c].is_int()) {
+				regs[i.a] = variant::from_bool(regs[i.b].as_int() >= regs[i.c].as_int());
+			} else {
+				regs[i.a] = variant::from_bool(regs[i.b] >= regs[i.c]);
+			}
+			break;
+		case OP_MAKE_LIST: {
+			regs[i.a] = variant::create_list(regs + i.b, regs + i.b + i.c);
+			break;
+		}
+		case OP_JMP:
+			pc = i.a;
+			break;
+		case OP_JMP_IF_FALSE:
+			if(!regs[i.b].as_bool()) {
+				pc = i.a;
+			}
+			break;
+		case OP_JMP_IF_TRUE:
+			if(regs[i.b].as_bool()) {
+				pc = i.a;
+			}
+			break;
+		case OP_PUSH_WHERE: {
+			if(!scopes) {
+				scopes.reset(new frame_scopes);
+			}
+
+			scopes->scopes.push_back(const_formula_callable_ptr(new where_scope(*callable, const_program_ptr(&p), i.a)));
+			callable = scopes->scopes.back().get();
+			break;
+		}
+		case OP_POP_SCOPE:
+			scopes->scopes.pop_back();
+			callable = scopes->scopes.empty() ? &variables : scopes->scopes.back().get();
+			break;
+		case OP_COMPR_BEGIN: {
+			if(!scopes) {
+				scopes.reset(new frame_scopes);
+			}
+
+			if(scopes->comprehensions.empty()) {
+				scopes->comprehensions.resize(p.comprehensions().size());
+			}
+
+			const program::comprehension_info& info = p.comprehensions()[i.a];
+			comprehension_state& state = scopes->comprehensions[i.a];
+			state.lists.assign(regs + i.b, regs + i.b + info.num_generators);
+			state.indexes.assign(info.num_generators, 0);
+			state.result.clear();
+			state.args.clear();
+
+			state.callable.reset(new slot_formula_callable);
+			state.callable->set_fallback(callable);
+			state.callable->set_base_slot(info.base_slot);
+			state.callable->reserve(info.num_generators);
+			for(int n = 0; n != info.num_generators; ++n) {
+				state.callable->add(variant());
+				state.args.push_back(&state.callable->back_direct_access());
+			}
+
+			scopes->scopes.push_back(state.callable);
+			callable = state.callable.get();
+
+			foreach(const variant& list, state.lists) {
+				if(list.num_elements() == 0) {
+					pc = i.c;
+					break;
+				}
+			}
+			break;
+		}
+		case OP_COMPR_BIND: {
+			comprehension_state& state = scopes->comprehensions[i.a];
+			for(int n = 0; n != state.indexes.size(); ++n) {
+				*state.args[n] = state.lists[n][state.indexes[n]];
+			}
+			break;
+		}
+		case OP_COMPR_PUSH:
+			scopes->comprehensions[i.a].result.push_back(regs[i.b]);
+			break;
+		case OP_COMPR_NEXT: {
+			comprehension_state& state = scopes->comprehensions[i.a];
+			if(increment_indexes(state.indexes, state.lists)) {
+				pc = i.b;
+			}
+			break;
+		}
+		case OP_COMPR_END: {
+			comprehension_state& state = scopes->comprehensions[i.a];
+			std::vector<variant> result;
+			result.swap(state.result);
+			regs[i.b] = variant(&result);
+
+			state.lists.clear();
+			state.args.clear();
+			state.callable.reset();
+
+			scopes->scopes.pop_back();
+			callable = scopes->scopes.empty() ? &variables : scopes->scopes.back().get();
+			break;
+		}
+		case OP_RETURN:
+			return regs[i.a];
+		}
+	}
+}
+
+}
+
+std::string program::debug_output() const
+{
+	std::ostringstream s;
+	s << "registers: " << num_registers_ << "\n";
+	for(int n = 0; n != code_.size(); ++n) {
+		const instruction& i = code_[n];
+		s << n << ": " << opcode_name(i.op) << " " << i.a << " " << i.b << " " << i.c;
+		if(i.op == OP_LOAD_CONST) {
+			s << " (" << constants_[i.b].write_json() << ")";
+		} else if(i.op == OP_EVAL) {
+			s << " (" << fallbacks_[i.b]->str() << ")";
+		}
+		s << "\n";
+	}
+
+	return s.str();
+}
+
+builder::builder(const_expression_ptr source)
+  : program_(new program), next_register_(0), num_native_(0)
+{
+	program_->source_ = source;
+}
+
+void builder::compile(const formula_expression& expr, int target)
+{
+	if(expr.compile_to_vm(*this, target)) {
+		return;
+	}
+
+	program_->fallbacks_.push_back(const_expression_ptr(&expr));
+	emit(OP_EVAL, target, program_->fallbacks_.size()-1);
+}
+
+int builder::allocate_register()
+{
+	const int result = next_register_++;
+	program_->num_registers_ = std::max(program_->num_registers_, next_register_);
+	return result;
+}
+
+void builder::free_registers(int count)
+{
+	next_register_ -= count;
+	ASSERT_LOG(next_register_ >= 0, "Freed too many VM registers");
+}
+
+int builder::add_constant(const variant& v)
+{
+	program_->constants_.push_back(v);
+	return program_->constants_.size()-1;
+}
+
+int builder::emit(OPCODE op, int a, int b, int c)
+{
+	if(op != OP_EVAL && op != OP_RETURN) {
+		++num_native_;
+	}
+
+	program_->code_.push_back(instruction(op, a, b, c));
+	return program_->code_.size()-1;
+}
+
+void builder::set_jump_target(int instr, int target)
+{
+	instruction& i = program_->code_[instr];
+	switch(i.op) {
+	case OP_JMP:
+	case OP_JMP_IF_FALSE:
+	case OP_JMP_IF_TRUE:
+		i.a = target;
+		break;
+	case OP_COMPR_BEGIN:
+		i.c = target;
+		break;
+	case OP_COMPR_NEXT:
+		i.b = target;
+		break;
+	default:
+		ASSERT_LOG(false, "Instruction is not a jump: " << opcode_name(i.op));
+	}
+}
+
+int builder::add_where(const reference_counted_object* owner, const std::vector<std::string>* names, int base_slot, const std::vector<expression_ptr>& entries)
+{
+	program::where_info info;
+	info.names = names;
+	info.base_slot = base_slot;
+	foreach(const expression_ptr& e, entries) {
+		builder b(e);
+		const int result = b.allocate_register();
+		b.compile(*e, result);
+		info.entries.push_back(b.finish(result));
+	}
+
+	program_->keep_alive_.push_back(boost::intrusive_ptr<const reference_counted_object>(owner));
+	program_->wheres_.push_back(info);
+	return program_->wheres_.size()-1;
+}
+
+int builder::add_comprehension(int base_slot, int num_generators)
+{
+	program::comprehension_info info;
+	info.base_slot = base_slot;
+	info.num_generators = num_generators;
+	program_->comprehensions_.push_back(info);
+	return program_->comprehensions_.size()-1;
+}
+
+program_ptr builder::finish(int result_register)
+{
+	emit(OP_RETURN, result_register);
+	program_ptr result = program_;
+	program_.reset();
+	return result;
+}
+
+program_ptr compile(const_expression_ptr expr)
+{
+	variant literal;
+	if(!expr || expr->is_literal(literal)) {
+		return program_ptr();
+	}
+
+	builder b(expr);
+	const int result = b.allocate_register();
+	b.compile(*expr, result);
+	if(b.num_native_instructions() == 0) {
+		return program_ptr();
+	}
+
+	return b.finish(result);
+}
+
+}
+
+}
@@ -0,0 +1,188 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FORMULA_VM_HPP_INCLUDED
+#define FORMULA_VM_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+
+#include "formula_callable.hpp"
+#include "formula_function.hpp"
+#include "reference_counted_object.hpp"
+#include "variant.hpp"
+
+//A compact bytecode representation of FFL expressions, executed on a
+//register machine. Expressions are lowered by calling
+//formula_expression::compile_to_vm(); any expression which has no native
+//lowering is embedded as an OP_EVAL instruction which calls back into
+//the tree interpreter, so every expression can be compiled.
+namespace game_logic
+{
+
+namespace formula_vm
+{
+
+//returns true if formulas should be compiled to bytecode when parsed.
+bool enabled();
+
+//sets whether formulas will be compiled to bytecode. Returns the old value.
+bool set_enabled(bool value);
+
+struct enabled_scope {
+	explicit enabled_scope(bool value=true) : old_value_(set_enabled(value)) {}
+	~enabled_scope() { set_enabled(old_value_); }
+	bool old_value_;
+};
+
+enum OPCODE {
+	OP_LOAD_CONST,       //a = constants[b]
+	OP_LOAD_SLOT,        //a = callable.query_value_by_slot(b)
+	OP_MOVE,             //a = b
+	OP_EVAL,             //a = fallbacks[b]->evaluate(callable)
+	OP_NOT,              //a = not b
+	OP_NEG,              //a = -b
+	OP_ADD,              //a = b + c
+	OP_SUB,              //a = b - c
+	OP_MUL,              //a = b * c
+	OP_DIV,              //a = b / c
+	OP_MOD,              //a = b % c
+	OP_POW,              //a = b ^ c
+	OP_EQ,               //a = b = c
+	OP_NEQ,              //a = b != c
+	OP_LT,               //a = b < c
+	OP_LTE,              //a = b <= c
+	OP_GT,               //a = b > c
+	OP_GTE,              //a = b >= c
+	OP_MAKE_LIST,        //a = [b, b+1, ... b+c-1]
+	OP_JMP,              //jump to a
+	OP_JMP_IF_FALSE,     //if not b jump to a
+	OP_JMP_IF_TRUE,      //if b jump to a
+	OP_PUSH_WHERE,       //push the where scope wheres[a]
+	OP_POP_SCOPE,        //pop the innermost where/comprehension scope
+	OP_COMPR_BEGIN,      //start comprehension a over the lists in registers
+	                     //b..b+n-1. Jump to c if any list is empty.
+	OP_COMPR_BIND,       //bind the current element of each list in
+	                     //comprehension a to the comprehension's scope.
+	OP_COMPR_PUSH,       //append register b to the result of comprehension a
+	OP_COMPR_NEXT,       //advance comprehension a; jump to b if not done.
+	OP_COMPR_END,        //b = result of comprehension a; pop its scope.
+	OP_RETURN,           //return register a
+};
+
+struct instruction {
+	instruction(OPCODE o, int aa, int bb, int cc) : op(o), a(aa), b(bb), c(cc) {}
+	OPCODE op;
+	int a, b, c;
+};
+
+class program;
+typedef boost::intrusive_ptr<program> program_ptr;
+typedef boost::intrusive_ptr<const program> const_program_ptr;
+
+class program : public reference_counted_object
+{
+public:
+	struct where_info {
+		const std::vector<std::string>* names;
+		int base_slot;
+		std::vector<program_ptr> entries;
+	};
+
+	struct comprehension_info {
+		int base_slot;
+		int num_generators;
+	};
+
+	variant execute(const formula_callable& variables) const;
+
+	const_expression_ptr source() const { return source_; }
+	int num_registers() const { return num_registers_; }
+	const std::vector<instruction>& code() const { return code_; }
+	const std::vector<variant>& constants() const { return constants_; }
+	const std::vector<const_expression_ptr>& fallbacks() const { return fallbacks_; }
+	const std::vector<where_info>& wheres() const { return wheres_; }
+	const std::vector<comprehension_info>& comprehensions() const { return comprehensions_; }
+
+	std::string debug_output() const;
+
+private:
+	friend class builder;
+	program() : num_registers_(0)
+	{}
+
+	variant run(const formula_callable& variables) const;
+
+	std::vector<instruction> code_;
+	std::vector<variant> constants_;
+	std::vector<const_expression_ptr> fallbacks_;
+	std::vector<where_info> wheres_;
+	std::vector<comprehension_info> comprehensions_;
+	int num_registers_;
+	const_expression_ptr source_;
+
+	//holds on to the where info structures referenced by wheres_.
+	std::vector<boost::intrusive_ptr<const reference_counted_object> > keep_alive_;
+};
+
+class builder
+{
+public:
+	explicit builder(const_expression_ptr source);
+
+	//compiles the expression, writing its result into register target.
+	void compile(const formula_expression& expr, int target);
+
+	int allocate_register();
+	void free_registers(int count);
+
+	int add_constant(const variant& v);
+
+	//emits an instruction, returning its position in the code.
+	int emit(OPCODE op, int a=0, int b=0, int c=0);
+
+	//the position the next instruction will be emitted at.
+	int pos() const { return program_->code_.size(); }
+
+	//sets the jump target of the instruction at position 'instr'.
+	void set_jump_target(int instr, int target);
+
+	int add_where(const reference_counted_object* owner, const std::vector<std::string>* names, int base_slot, const std::vector<expression_ptr>& entries);
+	int add_comprehension(int base_slot, int num_generators);
+
+	//the number of instructions that were lowered natively rather than
+	//being delegated to the tree interpreter.
+	int num_native_instructions() const { return num_native_; }
+
+	program_ptr finish(int result_register);
+
+private:
+	program_ptr program_;
+	int next_register_;
+	int num_native_;
+};
+
+//compiles an expression to bytecode. Returns NULL if the expression has
+//no native lowering at all and so would not benefit from compilation.
+program_ptr compile(const_expression_ptr expr);
+
+}
+
+}
+
+#endif
@@ -44,6 +44,8 @@
 
 PREF_FLOAT(global_frame_scale, 2.0, "Sets the global frame scales for all frames in all animations");
 
+extern bool g_headless;
+
 namespace {
 
 	std::set<frame*>& palette_frames() {
@@ -310,6 +312,8 @@ frame::frame(variant node)
 		build_alpha();
 	}
 
+	build_opacity_masks();
+
 	std::vector<std::string> palettes = parse_variant_list_or_csv_string(node["palettes"]);
 	foreach(const std::string& p, palettes) {
 		palettes_recognized_.push_back(graphics::get_palette_id(p));
@@ -354,6 +358,12 @@ frame::frame(variant node)
 		}
 	}
 
+	//there's no GL to make buffers with when headless, and nothing will be
+	//drawn anyway.
+	if(g_headless) {
+		return;
+	}
+
 	if(node.has_key("obj")) {
 		if(node["obj"].is_string()) {
 			std::vector<obj::obj_data> odata;
@@ -692,6 +702,61 @@ void frame::build_alpha()
 	}
 }
 
+void frame::build_opacity_masks()
+{
+	opacity_masks_.clear();
+	if(collision_areas_.empty()) {
+		return;
+	}
+
+	const int w = width();
+	const int h = height();
+	const int words_per_row = std::max(1, (w + 63)/64);
+
+	opacity_masks_.resize(nframes_*2);
+	for(int n = 0; n < nframes_; ++n) {
+		for(int facing = 0; facing != 2; ++facing) {
+			opacity_mask& mask = opacity_masks_[n*2 + facing];
+			mask.width = w;
+			mask.height = h;
+			mask.words_per_row = words_per_row;
+			mask.bits.resize(std::max(1, words_per_row*h));
+
+			if(alpha_.empty()) {
+				//is_alpha() considers every pixel transparent.
+				continue;
+			}
+
+			for(int y = 0; y != h; ++y) {
+				uint64_t* row = &mask.bits[y*words_per_row];
+				for(int x = 0; x != w; ++x) {
+					//the same lookup get_alpha_itor() does.
+					int xpos = facing == 0 ? x : w - x - 1;
+					int ypos = y;
+					xpos /= scale_;
+					ypos /= scale_;
+					xpos += n*img_rect_.w();
+
+					const int index = ypos*img_rect_.w()*nframes_ + xpos;
+					ASSERT_INDEX_INTO_VECTOR(index, alpha_);
+					if(!alpha_[index]) {
+						row[x/64] |= uint64_t(1) << (x%64);
+					}
+				}
+			}
+		}
+	}
+}
+
+const frame::opacity_mask* frame::get_opacity_mask(int time, bool face_right) const
+{
+	if(opacity_masks_.empty()) {
+		return NULL;
+	}
+
+	return &opacity_masks_[frame_number(time)*2 + (face_right ? 0 : 1)];
+}
+
 bool frame::is_alpha(int x, int y, int time, bool face_right) const
 {
 	std::vector<bool>::const_iterator itor = get_alpha_itor(x, y, time, face_right);
@@ -19,6 +19,8 @@
 
 #include <boost/array.hpp>
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 
@@ -71,6 +73,20 @@ public:
 	std::vector<bool>::const_iterator get_alpha_itor(int x, int y, int time, bool face_right) const;
 	const std::vector<bool>& get_alpha_buf() const { return alpha_; }
 
+	//which pixels of one frame, in one facing, are opaque according to
+	//is_alpha(). Each row is packed into 64-bit words: bit x%64 of word
+	//x/64 is set if the pixel at x is opaque. Bits past the width are 0.
+	struct opacity_mask {
+		int width, height, words_per_row;
+		std::vector<uint64_t> bits;
+
+		const uint64_t* row(int y) const { return &bits[y*words_per_row]; }
+	};
+
+	//the opacity mask for the frame shown at the given time. Masks are only
+	//built for frames with collision areas; returns NULL for other frames.
+	const opacity_mask* get_opacity_mask(int time, bool face_right) const;
+
 	void draw_into_blit_queue(graphics::blit_queue& blit, int x, int y, bool face_right=true, bool upside_down=false, int time=0) const;
 	void draw(int x, int y, bool face_right=true, bool upside_down=false, int time=0, GLfloat rotate=0) const;
 	void draw(int x, int y, bool face_right, bool upside_down, int time, GLfloat rotate, GLfloat scale) const;
@@ -191,6 +207,10 @@ private:
 	void build_alpha_from_frame_info();
 	void build_alpha();
 	std::vector<bool> alpha_;
+
+	//masks for each frame, facing right followed by facing left.
+	void build_opacity_masks();
+	std::vector<opacity_mask> opacity_masks_;
 	bool force_no_alpha_;
 
 	bool no_remove_alpha_borders_;
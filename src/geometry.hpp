@@ -155,4 +155,14 @@ inline bool operator!=(const rect& a, const rect& b) {
 
 std::ostream& operator<<(std::ostream& s, const rect& r);
 
+//division rounding towards negative infinity.
+inline int floor_div(int n, int d)
+{
+	if(n >= 0) {
+		return n/d;
+	} else {
+		return -((-n + d - 1)/d);
+	}
+}
+
 #endif
@@ -29,6 +29,8 @@
 #include "module.hpp"
 #include "variant_utils.hpp"
 
+extern bool g_headless;
+
 namespace hex {
 
 static const int HexTileSize = 72;
@@ -50,7 +52,7 @@ hex_map::hex_map(variant node)
 	height_ = tiles_.size()/width_;
 
 #ifdef USE_SHADERS
-	if(node.has_key("shader")) {
+	if(node.has_key("shader") && !g_headless) {
 		shader_.reset(new gles2::shader_program(node["shader"]));
 	} else {
 		shader_.reset();
@@ -27,6 +27,7 @@
 #include "module.hpp"
 #include "variant_utils.hpp"
 
+extern bool g_headless;
 
 namespace hex {
 
@@ -281,7 +282,9 @@ void hex_object::set_value(const std::string& key, const variant& value)
 	if(key == "shader") {
 		ASSERT_LOG(value.is_map() && value.has_key("program"), 
 			"shader must be specified by map having a \"program\" attribute");
-		shader_.reset(new gles2::shader_program(value));
+		if(!g_headless) {
+			shader_.reset(new gles2::shader_program(value));
+		}
 #endif
 	}
 }
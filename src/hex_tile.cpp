@@ -364,7 +364,7 @@ tile_type::tile_type(const std::string& id, variant node)
 			static const std::string Directions[] = { "n", "ne", "se", "s", "sw", "nw" };
 			const std::string* dir_str = std::find(Directions, Directions+6, d);
 			const int index = dir_str - Directions;
-			ASSERT_LOG(index < 6, "Unrecognized direction string: " << p.first << " " << p.first.debug_location());
+			ASSERT_LOG(index < 6, "Unrecognized direction string: " << p.first << " " << p.second.debug_location());
 
 			dirmap = dirmap | (1 << index);
 
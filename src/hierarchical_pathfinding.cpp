@@ -0,0 +1,780 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
+#include <math.h>
+#include <queue>
+
+#include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "asserts.hpp"
+#include "foreach.hpp"
+#include "hierarchical_pathfinding.hpp"
+#include "level.hpp"
+#include "pathfinding.hpp"
+#include "unit_test.hpp"
+
+namespace pathfinding
+{
+
+namespace {
+//entrances narrower than this get a single node in their middle, and wider
+//ones a node at each end.
+const int MaxSingleNodeEntrance = 6;
+
+const double Unreachable = std::numeric_limits<double>::max();
+}
+
+hierarchical_graph::hierarchical_graph()
+  : width_(0), height_(0), cell_width_(1), cell_height_(1),
+    clusters_wide_(0), clusters_high_(0)
+{}
+
+hierarchical_graph::hierarchical_graph(const hierarchical_graph& o)
+  : width_(0), height_(0), cell_width_(1), cell_height_(1),
+    clusters_wide_(0), clusters_high_(0)
+{}
+
+hierarchical_graph& hierarchical_graph::operator=(const hierarchical_graph& o)
+{
+	origin_ = point();
+	width_ = height_ = 0;
+	cell_width_ = cell_height_ = 1;
+	clusters_wide_ = clusters_high_ = 0;
+	clusters_.clear();
+	dirty_clusters_.clear();
+	return *this;
+}
+
+void hierarchical_graph::set_grid(const point& origin, int width, int height, int cell_width, int cell_height)
+{
+	if(origin == origin_ && width == width_ && height == height_ &&
+	   cell_width == cell_width_ && cell_height == cell_height_) {
+		return;
+	}
+
+	ASSERT_LOG(cell_width > 0 && cell_height > 0, "Illegal hierarchical graph cell size: " << cell_width << "x" << cell_height);
+
+	origin_ = origin;
+	width_ = std::max(0, width);
+	height_ = std::max(0, height);
+	cell_width_ = cell_width;
+	cell_height_ = cell_height;
+	clusters_wide_ = (width_ + ClusterSize - 1)/ClusterSize;
+	clusters_high_ = (height_ + ClusterSize - 1)/ClusterSize;
+
+	clusters_.clear();
+	clusters_.resize(clusters_wide_*clusters_high_);
+	for(int n = 0; n != clusters_.size(); ++n) {
+		cluster& c = clusters_[n];
+		c.x = (n%clusters_wide_)*ClusterSize;
+		c.y = (n/clusters_wide_)*ClusterSize;
+		c.w = std::min<int>(ClusterSize, width_ - c.x);
+		c.h = std::min<int>(ClusterSize, height_ - c.y);
+	}
+
+	dirty_clusters_.clear();
+	for(int n = 0; n != clusters_.size(); ++n) {
+		dirty_clusters_.push_back(n);
+	}
+}
+
+void hierarchical_graph::invalidate(const rect& area)
+{
+	if(clusters_.empty() || area.w() <= 0 || area.h() <= 0) {
+		return;
+	}
+
+	const int x1 = std::max(0, floor_div(floor_div(area.x() - origin_.x, cell_width_), ClusterSize));
+	const int y1 = std::max(0, floor_div(floor_div(area.y() - origin_.y, cell_height_), ClusterSize));
+	const int x2 = std::min(clusters_wide_ - 1, floor_div(floor_div(area.x2() - 1 - origin_.x, cell_width_), ClusterSize));
+	const int y2 = std::min(clusters_high_ - 1, floor_div(floor_div(area.y2() - 1 - origin_.y, cell_height_), ClusterSize));
+
+	for(int y = y1; y <= y2; ++y) {
+		for(int x = x1; x <= x2; ++x) {
+			const int index = y*clusters_wide_ + x;
+			if(!clusters_[index].dirty) {
+				clusters_[index].dirty = true;
+				dirty_clusters_.push_back(index);
+			}
+		}
+	}
+}
+
+void hierarchical_graph::invalidate_all()
+{
+	for(int n = 0; n != clusters_.size(); ++n) {
+		if(!clusters_[n].dirty) {
+			clusters_[n].dirty = true;
+			dirty_clusters_.push_back(n);
+		}
+	}
+}
+
+point hierarchical_graph::cell_at(const point& p) const
+{
+	return point(floor_div(p.x - origin_.x, cell_width_), floor_div(p.y - origin_.y, cell_height_));
+}
+
+rect hierarchical_graph::cell_area(const point& cell) const
+{
+	return rect(origin_.x + cell.x*cell_width_, origin_.y + cell.y*cell_height_, cell_width_, cell_height_);
+}
+
+point hierarchical_graph::cell_midpoint(const point& cell) const
+{
+	return point(origin_.x + cell.x*cell_width_ + cell_width_/2,
+	             origin_.y + cell.y*cell_height_ + cell_height_/2);
+}
+
+int hierarchical_graph::num_nodes() const
+{
+	int result = 0;
+	foreach(const cluster& c, clusters_) {
+		result += c.nodes.size();
+	}
+
+	return result;
+}
+
+int hierarchical_graph::cluster_index_at(int x, int y) const
+{
+	return (y/ClusterSize)*clusters_wide_ + x/ClusterSize;
+}
+
+int hierarchical_graph::node_index(const cluster& c, const point& cell) const
+{
+	std::vector<point>::const_iterator i = std::find(c.nodes.begin(), c.nodes.end(), cell);
+	return i == c.nodes.end() ? -1 : i - c.nodes.begin();
+}
+
+bool hierarchical_graph::is_entrance(const point& a, const point& b) const
+{
+	//entrances are stored by the cluster on the left or above.
+	const point& first = (a.x < b.x || a.y < b.y) ? a : b;
+	const cluster& c = clusters_[cluster_index_at(first.x, first.y)];
+	const std::vector<point>& entrances = a.x != b.x ? c.right_entrances : c.bottom_entrances;
+	return std::find(entrances.begin(), entrances.end(), first) != entrances.end();
+}
+
+void hierarchical_graph::update(const cell_blocked_fn& blocked)
+{
+	if(dirty_clusters_.empty()) {
+		return;
+	}
+
+	std::vector<int> dirty;
+	dirty.swap(dirty_clusters_);
+
+	foreach(int index, dirty) {
+		cluster& c = clusters_[index];
+		c.blocked.resize(c.w*c.h);
+		for(int y = 0; y != c.h; ++y) {
+			for(int x = 0; x != c.w; ++x) {
+				c.blocked[y*c.w + x] = blocked(c.x + x, c.y + y);
+			}
+		}
+
+		c.dirty = false;
+	}
+
+	//the entrances on every border of a changed cluster, and so the nodes
+	//of the clusters on the other side of them, have to be found again.
+	std::vector<int> changed_nodes;
+	foreach(int index, dirty) {
+		const int x = index%clusters_wide_;
+		const int y = index/clusters_wide_;
+		find_entrances(index, true);
+		find_entrances(index, false);
+		if(x > 0) {
+			find_entrances(index - 1, true);
+		}
+
+		if(y > 0) {
+			find_entrances(index - clusters_wide_, false);
+		}
+
+		const int neighbours[] = { index, x > 0 ? index - 1 : -1, x + 1 < clusters_wide_ ? index + 1 : -1,
+		                           y > 0 ? index - clusters_wide_ : -1, y + 1 < clusters_high_ ? index + clusters_wide_ : -1 };
+		foreach(int n, neighbours) {
+			if(n != -1 && !clusters_[n].nodes_dirty) {
+				clusters_[n].nodes_dirty = true;
+				changed_nodes.push_back(n);
+			}
+		}
+	}
+
+	foreach(int index, changed_nodes) {
+		find_distances(clusters_[index]);
+	}
+}
+
+void hierarchical_graph::find_entrances(int index, bool right)
+{
+	cluster& c = clusters_[index];
+	std::vector<point>& entrances = right ? c.right_entrances : c.bottom_entrances;
+	entrances.clear();
+
+	const int x = index%clusters_wide_;
+	const int y = index/clusters_wide_;
+	if(right ? x + 1 >= clusters_wide_ : y + 1 >= clusters_high_) {
+		return;
+	}
+
+	const cluster& neighbour = clusters_[right ? index + 1 : index + clusters_wide_];
+	const int length = right ? c.h : c.w;
+	int start = -1;
+	for(int n = 0; n <= length; ++n) {
+		bool open = false;
+		if(n < length) {
+			if(right) {
+				open = !c.blocked[n*c.w + c.w - 1] && !neighbour.blocked[n*neighbour.w];
+			} else {
+				open = !c.blocked[(c.h - 1)*c.w + n] && !neighbour.blocked[n];
+			}
+		}
+
+		if(open && start == -1) {
+			start = n;
+		} else if(!open && start != -1) {
+			std::vector<int> positions;
+			if(n - start < MaxSingleNodeEntrance) {
+				positions.push_back((start + n - 1)/2);
+			} else {
+				positions.push_back(start);
+				positions.push_back(n - 1);
+			}
+
+			foreach(int pos, positions) {
+				entrances.push_back(right ? point(c.x + c.w - 1, c.y + pos) : point(c.x + pos, c.y + c.h - 1));
+			}
+
+			start = -1;
+		}
+	}
+}
+
+void hierarchical_graph::find_distances(cluster& c)
+{
+	const int index = cluster_index_at(c.x, c.y);
+	const int x = index%clusters_wide_;
+	const int y = index/clusters_wide_;
+
+	c.nodes = c.right_entrances;
+	foreach(const point& p, c.bottom_entrances) {
+		if(std::find(c.nodes.begin(), c.nodes.end(), p) == c.nodes.end()) {
+			c.nodes.push_back(p);
+		}
+	}
+
+	if(x > 0) {
+		foreach(const point& p, clusters_[index - 1].right_entrances) {
+			const point cell(p.x + 1, p.y);
+			if(std::find(c.nodes.begin(), c.nodes.end(), cell) == c.nodes.end()) {
+				c.nodes.push_back(cell);
+			}
+		}
+	}
+
+	if(y > 0) {
+		foreach(const point& p, clusters_[index - clusters_wide_].bottom_entrances) {
+			const point cell(p.x, p.y + 1);
+			if(std::find(c.nodes.begin(), c.nodes.end(), cell) == c.nodes.end()) {
+				c.nodes.push_back(cell);
+			}
+		}
+	}
+
+	const int nnodes = c.nodes.size();
+	c.distances.assign(nnodes*nnodes, Unreachable);
+
+	const occupancy_grid grid(c.w, c.h, c.blocked, cell_width_, cell_height_);
+	std::vector<double> distances;
+	for(int i = 0; i != nnodes; ++i) {
+		grid_distance_map(grid, point(c.nodes[i].x - c.x, c.nodes[i].y - c.y), &distances);
+		for(int j = 0; j != nnodes; ++j) {
+			c.distances[i*nnodes + j] = distances[(c.nodes[j].y - c.y)*c.w + c.nodes[j].x - c.x];
+		}
+	}
+
+	c.nodes_dirty = false;
+}
+
+double hierarchical_graph::refine(const cluster& c, const point& src, const point& dst, std::vector<point>* path) const
+{
+	const occupancy_grid grid(c.w, c.h, c.blocked, cell_width_, cell_height_);
+	std::vector<point> cells;
+	double cost = 0.0;
+	const bool found = grid_find_path(grid, point(src.x - c.x, src.y - c.y), point(dst.x - c.x, dst.y - c.y), &cells, grid_weight_fn(), true, &cost);
+	ASSERT_LOG(found, "Could not find path within cluster that the hierarchical graph says exists");
+
+	for(int n = 1; n < cells.size(); ++n) {
+		path->push_back(point(cells[n].x + c.x, cells[n].y + c.y));
+	}
+
+	return cost;
+}
+
+namespace {
+struct search_node {
+	search_node() : g(Unreachable), parent(-1), closed(false)
+	{}
+	double g;
+	int parent;
+	bool closed;
+};
+
+double octile_distance(int cell_width, int cell_height, const point& a, const point& b)
+{
+	const int dx = abs(a.x - b.x);
+	const int dy = abs(a.y - b.y);
+	const int diagonal = std::min(dx, dy);
+	return diagonal*sqrt(double(cell_width*cell_width + cell_height*cell_height)) +
+	       (dx - diagonal)*cell_width + (dy - diagonal)*cell_height;
+}
+}
+
+bool hierarchical_graph::find_path(const cell_blocked_fn& blocked, const point& src, const point& dst, std::vector<point>* path, double* cost)
+{
+	if(src.x < 0 || src.y < 0 || src.x >= width_ || src.y >= height_ ||
+	   dst.x < 0 || dst.y < 0 || dst.x >= width_ || dst.y >= height_) {
+		return false;
+	}
+
+	update(blocked);
+
+	const int src_index = cluster_index_at(src.x, src.y);
+	const int dst_index = cluster_index_at(dst.x, dst.y);
+	const cluster& src_cluster = clusters_[src_index];
+	const cluster& dst_cluster = clusters_[dst_index];
+
+	if(src_cluster.blocked[(src.y - src_cluster.y)*src_cluster.w + src.x - src_cluster.x] ||
+	   dst_cluster.blocked[(dst.y - dst_cluster.y)*dst_cluster.w + dst.x - dst_cluster.x]) {
+		return false;
+	}
+
+	if(src == dst) {
+		if(path) {
+			path->assign(1, src);
+		}
+
+		if(cost) {
+			*cost = 0.0;
+		}
+
+		return true;
+	}
+
+	//going through the graph's entrances can make a path between cells in
+	//the same or neighbouring clusters many times longer than it needs to
+	//be, so the area of those clusters is searched directly as well.
+	std::vector<point> local_path;
+	double local_cost = Unreachable;
+	if(abs(src_cluster.x - dst_cluster.x) <= ClusterSize && abs(src_cluster.y - dst_cluster.y) <= ClusterSize) {
+		const int x1 = std::min(src_cluster.x, dst_cluster.x);
+		const int y1 = std::min(src_cluster.y, dst_cluster.y);
+		const int x2 = std::max(src_cluster.x + src_cluster.w, dst_cluster.x + dst_cluster.w);
+		const int y2 = std::max(src_cluster.y + src_cluster.h, dst_cluster.y + dst_cluster.h);
+
+		std::vector<bool> area_blocked((x2 - x1)*(y2 - y1));
+		for(int y = y1; y != y2; ++y) {
+			for(int x = x1; x != x2; ++x) {
+				const cluster& c = clusters_[cluster_index_at(x, y)];
+				area_blocked[(y - y1)*(x2 - x1) + x - x1] = c.blocked[(y - c.y)*c.w + x - c.x];
+			}
+		}
+
+		const occupancy_grid grid(x2 - x1, y2 - y1, area_blocked, cell_width_, cell_height_);
+		if(grid_find_path(grid, point(src.x - x1, src.y - y1), point(dst.x - x1, dst.y - y1), &local_path, grid_weight_fn(), true, &local_cost)) {
+			foreach(point& p, local_path) {
+				p.x += x1;
+				p.y += y1;
+			}
+		} else {
+			local_cost = Unreachable;
+		}
+	}
+
+	//the costs from the ends of the path to every cell of their clusters,
+	//which join them to the graph for this search.
+	std::vector<double> src_distances, dst_distances;
+	grid_distance_map(occupancy_grid(src_cluster.w, src_cluster.h, src_cluster.blocked, cell_width_, cell_height_),
+	                  point(src.x - src_cluster.x, src.y - src_cluster.y), &src_distances);
+	grid_distance_map(occupancy_grid(dst_cluster.w, dst_cluster.h, dst_cluster.blocked, cell_width_, cell_height_),
+	                  point(dst.x - dst_cluster.x, dst.y - dst_cluster.y), &dst_distances);
+
+	typedef std::pair<double, int> open_entry;
+	std::priority_queue<open_entry, std::vector<open_entry>, std::greater<open_entry> > open;
+	boost::unordered_map<int, search_node> nodes;
+
+	const int start = src.y*width_ + src.x;
+	const int goal = dst.y*width_ + dst.x;
+	nodes[start].g = 0.0;
+	open.push(open_entry(octile_distance(cell_width_, cell_height_, src, dst), start));
+
+	std::vector<std::pair<point, double> > edges;
+	while(!open.empty()) {
+		const int current = open.top().second;
+		open.pop();
+
+		search_node& node = nodes[current];
+		if(node.closed) {
+			continue;
+		}
+
+		node.closed = true;
+		if(current == goal) {
+			break;
+		}
+
+		const double g = node.g;
+		const point cell(current%width_, current/width_);
+		const int cluster_index = cluster_index_at(cell.x, cell.y);
+		const cluster& c = clusters_[cluster_index];
+
+		edges.clear();
+		const int n = node_index(c, cell);
+		if(n != -1) {
+			const int nnodes = c.nodes.size();
+			for(int m = 0; m != nnodes; ++m) {
+				if(m != n && c.distances[n*nnodes + m] != Unreachable) {
+					edges.push_back(std::pair<point, double>(c.nodes[m], c.distances[n*nnodes + m]));
+				}
+			}
+
+			static const int dirs[4][2] = { {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+			for(int d = 0; d != 4; ++d) {
+				const point next(cell.x + dirs[d][0], cell.y + dirs[d][1]);
+				if(next.x < 0 || next.y < 0 || next.x >= width_ || next.y >= height_ ||
+				   cluster_index_at(next.x, next.y) == cluster_index) {
+					continue;
+				}
+
+				if(is_entrance(cell, next)) {
+					edges.push_back(std::pair<point, double>(next, dirs[d][0] ? cell_width_ : cell_height_));
+				}
+			}
+		}
+
+		if(current == start) {
+			foreach(const point& p, src_cluster.nodes) {
+				const double d = src_distances[(p.y - src_cluster.y)*src_cluster.w + p.x - src_cluster.x];
+				if(d != Unreachable) {
+					edges.push_back(std::pair<point, double>(p, d));
+				}
+			}
+		}
+
+		if(cluster_index == dst_index) {
+			const double d = dst_distances[(cell.y - dst_cluster.y)*dst_cluster.w + cell.x - dst_cluster.x];
+			if(d != Unreachable) {
+				edges.push_back(std::pair<point, double>(dst, d));
+			}
+		}
+
+		for(int e = 0; e != edges.size(); ++e) {
+			const int next = edges[e].first.y*width_ + edges[e].first.x;
+			search_node& next_node = nodes[next];
+			const double g_cost = g + edges[e].second;
+			if(!next_node.closed && g_cost < next_node.g) {
+				next_node.g = g_cost;
+				next_node.parent = current;
+				open.push(open_entry(g_cost + octile_distance(cell_width_, cell_height_, edges[e].first, dst), next));
+			}
+		}
+	}
+
+	boost::unordered_map<int, search_node>::const_iterator goal_node = nodes.find(goal);
+	const bool found = goal_node != nodes.end() && goal_node->second.closed;
+	if(!found && local_cost == Unreachable) {
+		return false;
+	}
+
+	if(path || cost) {
+		std::vector<point> result(1, src);
+		double total = 0.0;
+		if(found) {
+			std::vector<point> abstract_path;
+			for(int n = goal; n != -1; n = nodes[n].parent) {
+				abstract_path.push_back(point(n%width_, n/width_));
+			}
+
+			std::reverse(abstract_path.begin(), abstract_path.end());
+
+			//each step of the abstract path either crosses an entrance to a
+			//neighbouring cell, or is a path within a single cluster.
+			for(int n = 1; n < abstract_path.size(); ++n) {
+				const point& a = abstract_path[n-1];
+				const point& b = abstract_path[n];
+				const int cluster_index = cluster_index_at(a.x, a.y);
+				if(cluster_index != cluster_index_at(b.x, b.y)) {
+					result.push_back(b);
+					total += a.x != b.x ? cell_width_ : cell_height_;
+				} else {
+					total += refine(clusters_[cluster_index], a, b, &result);
+				}
+			}
+		}
+
+		if(!found || local_cost <= total) {
+			result.swap(local_path);
+			total = local_cost;
+		}
+
+		if(path) {
+			path->swap(result);
+		}
+
+		if(cost) {
+			*cost = total;
+		}
+	}
+
+	return true;
+}
+
+namespace {
+bool level_cell_blocked(const level& lvl, const hierarchical_graph& graph, int x, int y)
+{
+	const rect area = graph.cell_area(point(x, y));
+	return lvl.may_be_solid_in_rect(area) && lvl.solid(area);
+}
+
+//makes sure a level's graph is over its current boundaries.
+hierarchical_graph& level_graph(const level& lvl)
+{
+	hierarchical_graph& graph = lvl.hierarchical_path_graph();
+	const rect& b = lvl.boundaries();
+	const int x1 = floor_div(b.x(), TileSize);
+	const int y1 = floor_div(b.y(), TileSize);
+	const int x2 = floor_div(b.x2() - 1, TileSize);
+	const int y2 = floor_div(b.y2() - 1, TileSize);
+	graph.set_grid(point(x1*TileSize, y1*TileSize), x2 - x1 + 1, y2 - y1 + 1, TileSize, TileSize);
+	return graph;
+}
+}
+
+variant hierarchical_find_path(boost::intrusive_ptr<level> lvl, const point& src_pt1, const point& dst_pt1)
+{
+	std::vector<variant> result;
+	const rect& b = lvl->boundaries();
+	const point src_pt(std::min(std::max(src_pt1.x, b.x()), b.x2() - 1), std::min(std::max(src_pt1.y, b.y()), b.y2() - 1));
+	const point dst_pt(std::min(std::max(dst_pt1.x, b.x()), b.x2() - 1), std::min(std::max(dst_pt1.y, b.y()), b.y2() - 1));
+
+	hierarchical_graph& graph = level_graph(*lvl);
+	const point src = graph.cell_at(src_pt);
+	const point dst = graph.cell_at(dst_pt);
+	if(src == dst) {
+		return variant(&result);
+	}
+
+	std::vector<point> path;
+	if(!graph.find_path(boost::bind(level_cell_blocked, boost::cref(*lvl), boost::cref(graph), _1, _2), src, dst, &path)) {
+		return variant(&result);
+	}
+
+	foreach(const point& cell, path) {
+		result.push_back(variant::create_list(variant(graph.cell_midpoint(cell).x), variant(graph.cell_midpoint(cell).y)));
+	}
+
+	result.front() = variant::create_list(variant(src_pt.x), variant(src_pt.y));
+	result.back() = variant::create_list(variant(dst_pt.x), variant(dst_pt.y));
+	return variant(&result);
+}
+
+}
+
+namespace {
+//checks a path only moves between adjacent open cells without cutting
+//corners, and returns what it costs.
+double check_hierarchical_path(const std::vector<bool>& blocked, int width, int height, const std::vector<point>& path)
+{
+	const pathfinding::occupancy_grid grid(width, height, blocked, 16, 16);
+	double cost = 0.0;
+	for(int n = 1; n < path.size(); ++n) {
+		const int dx = path[n].x - path[n-1].x;
+		const int dy = path[n].y - path[n-1].y;
+		CHECK(abs(dx) <= 1 && abs(dy) <= 1 && (dx || dy), "path jumps from " << path[n-1].x << "," << path[n-1].y << " to " << path[n].x << "," << path[n].y);
+		CHECK(!grid.blocked(path[n].x, path[n].y), "path goes through blocked cell " << path[n].x << "," << path[n].y);
+		CHECK(!dx || !dy || (!grid.blocked(path[n-1].x + dx, path[n-1].y) && !grid.blocked(path[n-1].x, path[n-1].y + dy)), "path cuts a corner at " << path[n].x << "," << path[n].y);
+		cost += dx && dy ? sqrt(512.0) : 16.0;
+	}
+	return cost;
+}
+}
+
+UNIT_TEST(hierarchical_path_matches_grid_path) {
+	srand(0);
+	for(int test = 0; test != 40; ++test) {
+		const int width = 10 + rand()%60, height = 10 + rand()%60;
+		std::vector<bool> blocked(width*height);
+		for(int n = 0; n != blocked.size(); ++n) {
+			blocked[n] = rand()%100 < 25;
+		}
+
+		const pathfinding::occupancy_grid grid(width, height, blocked, 16, 16);
+		pathfinding::hierarchical_graph graph;
+		graph.set_grid(point(), width, height, 16, 16);
+		const pathfinding::cell_blocked_fn blocked_fn = [&](int x, int y) { return grid.blocked(x, y); };
+
+		for(int query = 0; query != 20; ++query) {
+			const point src(rand()%width, rand()%height);
+			const point dst(rand()%width, rand()%height);
+
+			std::vector<point> path;
+			double best_cost = 0.0, cost = 0.0;
+			const bool found = pathfinding::grid_find_path(grid, src, dst, NULL, pathfinding::grid_weight_fn(), true, &best_cost);
+			CHECK_EQ(graph.find_path(blocked_fn, src, dst, &path, &cost), found);
+			if(!found) {
+				continue;
+			}
+
+			CHECK(path.front() == src && path.back() == dst, "path doesn't join its ends");
+			CHECK(fabs(check_hierarchical_path(blocked, width, height, path) - cost) < 0.001, "hierarchical path cost is wrong");
+			CHECK(cost >= best_cost - 0.001 && cost <= best_cost*1.5 + 0.001, "hierarchical path costs " << cost << " where the best path costs " << best_cost);
+		}
+	}
+}
+
+UNIT_TEST(hierarchical_path_invalidate) {
+	//a corridor through the middle of a 3x1 row of clusters.
+	const int width = 48, height = 16;
+	std::vector<bool> blocked(width*height, true);
+	for(int x = 0; x != width; ++x) {
+		blocked[8*width + x] = false;
+	}
+
+	pathfinding::hierarchical_graph graph;
+	graph.set_grid(point(), width, height, 32, 32);
+	const pathfinding::cell_blocked_fn blocked_fn = [&](int x, int y) { return blocked[y*width + x]; };
+
+	std::vector<point> path;
+	CHECK(graph.find_path(blocked_fn, point(0, 8), point(47, 8), &path), "no path along corridor");
+	CHECK_EQ(path.size(), 48);
+
+	//blocking the corridor must be noticed once its cluster is invalidated.
+	blocked[8*width + 24] = true;
+	graph.invalidate(rect(24*32, 8*32, 32, 32));
+	CHECK(!graph.find_path(blocked_fn, point(0, 8), point(47, 8), &path), "path found through blocked corridor");
+
+	//and a detour found once it is opened up around the block.
+	blocked[7*width + 23] = blocked[7*width + 24] = blocked[7*width + 25] = false;
+	graph.invalidate(rect(23*32, 7*32, 96, 32));
+	CHECK(graph.find_path(blocked_fn, point(0, 8), point(47, 8), &path), "no path around block");
+	CHECK(std::find(path.begin(), path.end(), point(24, 7)) != path.end(), "path doesn't go around block");
+}
+
+namespace {
+boost::intrusive_ptr<level> load_benchmark_level(const std::string& file)
+{
+	static std::map<std::string, boost::intrusive_ptr<level> > levels;
+	boost::intrusive_ptr<level>& lvl = levels[file];
+	if(!lvl) {
+		lvl.reset(new level(file));
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+	}
+
+	return lvl;
+}
+
+//random pairs of points in open tiles of a level.
+std::vector<point> random_open_points(const level& lvl, int count)
+{
+	const rect& b = lvl.boundaries();
+	std::vector<point> result;
+	for(int tries = 0; result.size() < count && tries < count*100; ++tries) {
+		const point p(b.x() + rand()%std::max(1, b.w()), b.y() + rand()%std::max(1, b.h()));
+		const rect tile(p.x - p.x%TileSize, p.y - p.y%TileSize, TileSize, TileSize);
+		if(!lvl.solid(tile)) {
+			result.push_back(p);
+		}
+	}
+
+	return result;
+}
+}
+
+BENCHMARK_ARG(hierarchical_path_search, const std::string& file)
+{
+	boost::intrusive_ptr<level> lvl = load_benchmark_level(file);
+	srand(0);
+	const std::vector<point> points = random_open_points(*lvl, 1000);
+	if(points.size() < 2) {
+		return;
+	}
+
+	//build the graph before timing queries.
+	pathfinding::hierarchical_find_path(lvl, points[0], points[1]);
+
+	int n = 0;
+	BENCHMARK_LOOP {
+		pathfinding::hierarchical_find_path(lvl, points[n%points.size()], points[(n+1)%points.size()]);
+		n += 2;
+	}
+}
+
+BENCHMARK_ARG_CALL(hierarchical_path_search, stairway_hierarchical, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(hierarchical_path_search);
+
+//queries after changing a tile's solidity each time, which rebuilds the
+//clusters around the tile.
+BENCHMARK_ARG(hierarchical_path_search_changing, const std::string& file)
+{
+	boost::intrusive_ptr<level> lvl = load_benchmark_level(file);
+	srand(0);
+	const std::vector<point> points = random_open_points(*lvl, 1000);
+	if(points.size() < 2) {
+		return;
+	}
+
+	pathfinding::hierarchical_find_path(lvl, points[0], points[1]);
+
+	int n = 0;
+	BENCHMARK_LOOP {
+		const point& p = points[n%points.size()];
+		lvl->hierarchical_path_graph().invalidate(rect(p.x, p.y, 1, 1));
+		pathfinding::hierarchical_find_path(lvl, points[(n+1)%points.size()], points[(n+2)%points.size()]);
+		n += 3;
+	}
+}
+
+BENCHMARK_ARG_CALL(hierarchical_path_search_changing, stairway_hierarchical_changing, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(hierarchical_path_search_changing);
+
+BENCHMARK_ARG(grid_path_search_level, const std::string& file)
+{
+	boost::intrusive_ptr<level> lvl = load_benchmark_level(file);
+	srand(0);
+	const std::vector<point> points = random_open_points(*lvl, 1000);
+	if(points.size() < 2) {
+		return;
+	}
+
+	int n = 0;
+	game_logic::map_formula_callable_ptr callable(new game_logic::map_formula_callable);
+	BENCHMARK_LOOP {
+		pathfinding::grid_a_star_find_path(lvl, points[n%points.size()], points[(n+1)%points.size()], game_logic::expression_ptr(), callable, TileSize, TileSize);
+		n += 2;
+	}
+}
+
+BENCHMARK_ARG_CALL(grid_path_search_level, stairway_grid_level, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(grid_path_search_level);
@@ -0,0 +1,140 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HIERARCHICAL_PATHFINDING_HPP_INCLUDED
+#define HIERARCHICAL_PATHFINDING_HPP_INCLUDED
+
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/intrusive_ptr.hpp>
+
+#include "geometry.hpp"
+#include "variant.hpp"
+
+class level;
+
+namespace pathfinding
+{
+
+//tells whether the cell (x,y) of a grid is blocked.
+typedef boost::function<bool(int, int)> cell_blocked_fn;
+
+//A graph for finding paths across a large grid quickly, using
+//hierarchical pathfinding (HPA*). The grid is split into square clusters.
+//Wherever two neighbouring clusters have open cells on both sides of their
+//border there are entrances, and the graph stores the cost of the best
+//path inside each cluster between each pair of its entrances. A query
+//searches this graph, and then finds the path inside each cluster it
+//passes through.
+//
+//Paths found are usually within a few percent of the best path, but are
+//not guaranteed to be the best.
+//
+//Clusters are only rebuilt when they have been invalidated, so changing the
+//solidity of part of a level only costs rebuilding the clusters around it.
+//Copying a graph gives an empty graph, since a copy of a level may have
+//its solidity changed independently.
+class hierarchical_graph
+{
+public:
+	enum { ClusterSize = 16 };
+
+	hierarchical_graph();
+	hierarchical_graph(const hierarchical_graph& o);
+	hierarchical_graph& operator=(const hierarchical_graph& o);
+
+	//sets the grid the graph is over: width*height cells of the given
+	//size, with cell (0,0) having its top left corner at 'origin'. The graph
+	//is discarded if it was over a different grid.
+	void set_grid(const point& origin, int width, int height, int cell_width, int cell_height);
+
+	//marks the clusters overlapping an area, in pixels, as needing to be
+	//rebuilt.
+	void invalidate(const rect& area);
+	void invalidate_all();
+
+	//finds a path between two cells, using 'blocked' to rebuild any
+	//clusters which need it. The path includes both ends. Returns false
+	//if there is no path.
+	bool find_path(const cell_blocked_fn& blocked, const point& src, const point& dst, std::vector<point>* path, double* cost=NULL);
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	int cell_width() const { return cell_width_; }
+	int cell_height() const { return cell_height_; }
+
+	//the cell containing a pixel, and the area and midpoint of a cell in
+	//pixels.
+	point cell_at(const point& p) const;
+	rect cell_area(const point& cell) const;
+	point cell_midpoint(const point& cell) const;
+
+	//the number of entrance nodes in the graph, for diagnostics.
+	int num_nodes() const;
+private:
+	struct cluster {
+		cluster() : x(0), y(0), w(0), h(0), dirty(true), nodes_dirty(false)
+		{}
+
+		//the area of the grid the cluster covers, in cells.
+		int x, y, w, h;
+
+		//the cluster's cells, row by row.
+		std::vector<bool> blocked;
+
+		//the cells of this cluster which are entrances to the cluster to
+		//their right and below.
+		std::vector<point> right_entrances, bottom_entrances;
+
+		//every entrance cell of the cluster, and the cost of the best path
+		//within the cluster between each pair of them.
+		std::vector<point> nodes;
+		std::vector<double> distances;
+
+		bool dirty, nodes_dirty;
+	};
+
+	void update(const cell_blocked_fn& blocked);
+	void find_entrances(int cluster_index, bool right);
+	void find_distances(cluster& c);
+
+	int cluster_index_at(int x, int y) const;
+	int node_index(const cluster& c, const point& cell) const;
+
+	//true if there is an entrance between two cells in neighbouring
+	//clusters.
+	bool is_entrance(const point& a, const point& b) const;
+
+	//appends the cells of the best path within a cluster between two of its
+	//cells, not including the first one.
+	double refine(const cluster& c, const point& src, const point& dst, std::vector<point>* path) const;
+
+	point origin_;
+	int width_, height_;
+	int cell_width_, cell_height_;
+	int clusters_wide_, clusters_high_;
+	std::vector<cluster> clusters_;
+	std::vector<int> dirty_clusters_;
+};
+
+//finds a path between two points of a level through its hierarchical
+//graph, returning it as a list of points as grid_a_star_find_path does.
+variant hierarchical_find_path(boost::intrusive_ptr<level> lvl, const point& src, const point& dst);
+
+}
+
+#endif
@@ -139,6 +139,10 @@ struct JsonObject {
 	VAL_TYPE type;
 	variant name;
 
+	//where name is in the document, and where each key of obj is.
+	variant::debug_info name_info;
+	std::vector<std::pair<variant, variant::debug_info> > key_info;
+
 	variant base;
 	bool is_base;
 	bool is_call;
@@ -169,12 +173,16 @@ struct JsonObject {
 		}
 	}
 
-	void add(variant name, variant v) {
+	void add(variant name, variant v, const variant::debug_info* info=NULL) {
 		if(use_preprocessor && name.is_string() && name.as_string() == "@base") {
 			return;
 		}
 
 		if(type == VAL_OBJ) {
+			if(info && !is_deriving) {
+				key_info.push_back(std::pair<variant, variant::debug_info>(name, *info));
+			}
+
 			if(is_deriving) {
 				setup_base(v);
 				is_deriving = false;
@@ -216,6 +224,9 @@ struct JsonObject {
 		if(type == VAL_OBJ) {
 			variant v(&obj);
 			v.set_debug_info(info);
+			for(std::vector<std::pair<variant, variant::debug_info> >::const_iterator i = key_info.begin(); i != key_info.end(); ++i) {
+				v.set_key_debug_info(i->first, i->second);
+			}
 			return v;
 		} else {
 			variant v(&array);
@@ -315,6 +326,7 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 				const bool is_base = stack.back().is_base;
 				const bool is_call = stack.back().is_call;
 				variant name = stack.back().name;
+				const variant::debug_info name_info = stack.back().name_info;
 				variant v = stack.back().as_variant();
 				stack.pop_back();
 
@@ -325,14 +337,14 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 					std::map<std::string, json_macro_ptr>::const_iterator itor = macros->find(call_macro);
 					CHECK_PARSE(itor != macros->end(), "Could not find macro", t.begin - doc.c_str());
 
-					stack.back().add(name, itor->second->call(v));
+					stack.back().add(name, itor->second->call(v), &name_info);
 				} else if(begin_macro) {
 					(*macros)[name.as_string()].reset(new json_macro(std::string(begin_macro, t.end), *macros));
 					use_preprocessor = true;
 				} else if(use_preprocessor && v.is_map() && game_logic::wml_serializable_formula_callable::deserialize_obj(v, &v)) {
-					stack.back().add(name, v);
+					stack.back().add(name, v, &name_info);
 				} else {
-					stack.back().add(name, v);
+					stack.back().add(name, v, &name_info);
 				}
 				stack.back().require_comma = true;
 				break;
@@ -356,6 +368,7 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 
 				const char* begin_macro = stack.back().begin_macro;
 				variant name = stack.back().name;
+				const variant::debug_info name_info = stack.back().name_info;
 				variant v = stack.back().as_variant();
 				stack.pop_back();
 
@@ -363,7 +376,7 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 					(*macros)[name.as_string()].reset(new json_macro(std::string(begin_macro, t.end), *macros));
 					use_preprocessor = true;
 				} else {
-					stack.back().add(name, v);
+					stack.back().add(name, v, &name_info);
 				}
 				stack.back().require_comma = true;
 				break;
@@ -442,6 +455,12 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 
 				if(t.translate && v.is_string()) {
 					v = variant::create_translated_string(v.as_string());
+				} else if(stack.back().type == VAL_OBJ && v.is_string()) {
+					//intern object keys, so the maps we build compare keys
+					//quickly and share one copy of each key's text. Debug
+					//info would unshare the text, so the map records where
+					//each key is instead.
+					v = variant::create_atom(v.as_string());
 				}
 
 				if(stack.back().type == VAL_OBJ) {
@@ -450,8 +469,8 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 					}
 
 					stack.push_back(JsonObject(str_debug_info, use_preprocessor));
-					v.set_debug_info(str_debug_info);
 					stack.back().name = v;
+					stack.back().name_info = str_debug_info;
 					stack.back().require_colon = true;
 
 					if(is_macro) {
@@ -468,6 +487,7 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 				} else {
 					const char* begin_macro = stack.back().begin_macro;
 					variant name = stack.back().name;
+					const variant::debug_info name_info = stack.back().name_info;
 					v.set_debug_info(str_debug_info);
 					stack.pop_back();
 
@@ -475,7 +495,7 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 						(*macros)[name.as_string()].reset(new json_macro(std::string(begin_macro, t.end), *macros));
 						use_preprocessor = true;
 					} else {
-						stack.back().add(name, v);
+						stack.back().add(name, v, &name_info);
 					}
 					stack.back().require_comma = true;
 				}
@@ -508,8 +528,9 @@ variant parse_internal(const std::string& doc, const std::string& fname,
 					stack.back().require_comma = true;
 				} else {
 					variant name = stack.back().name;
+					const variant::debug_info name_info = stack.back().name_info;
 					stack.pop_back();
-					stack.back().add(name, v);
+					stack.back().add(name, v, &name_info);
 					stack.back().require_comma = true;
 				}
 
@@ -632,6 +653,20 @@ UNIT_TEST(json_base)
 	CHECK_EQ(v[0]["@base"].is_null(), true);
 }
 
+UNIT_TEST(json_keys_are_shared_atoms)
+{
+	variant v = parse("{abc: 1,\n xyz: {abc: 2}}");
+	variant key = v.get_keys()[0];
+	CHECK_EQ(key, variant("abc"));
+	CHECK_EQ(key.is_atom(), true);
+	CHECK_EQ(v["xyz"].get_keys()[0].is_atom(), true);
+
+	CHECK_EQ(v.get_key_debug_info(variant("abc")) != NULL, true);
+	CHECK_EQ(v.get_key_debug_info(variant("abc"))->line, 1);
+	CHECK_EQ(v.get_key_debug_info(variant("xyz"))->line, 2);
+	CHECK_EQ(v["xyz"].get_key_debug_info(variant("abc"))->line, 2);
+}
+
 UNIT_TEST(json_flatten)
 {
 	std::string doc = "[\"@flatten\", [0,1,2], [3,4,5]]";
@@ -22,6 +22,7 @@
 
 #include "IMG_savepng.h"
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
 #include "collision_utils.hpp"
 #include "controls.hpp"
 #include "draw_scene.hpp"
@@ -65,6 +66,8 @@
 
 #include "compat.hpp"
 
+extern bool g_headless;
+
 #ifndef NO_EDITOR
 std::set<level*>& get_all_levels_set() {
 	static std::set<level*> all;
@@ -203,6 +206,7 @@ level::level(const std::string& level_cfg, variant node)
 	  x_resolution_(0), y_resolution_(0),
 	  set_screen_resolution_on_entry_(false),
 	  highlight_layer_(INT_MIN),
+	  solid_grid_(SOLID_INDEX),
 	  num_compiled_tiles_(0),
 	  entered_portal_active_(false), save_point_x_(-1), save_point_y_(-1),
 	  editor_(false), show_foreground_(true), show_background_(true), dark_(false), dark_color_(graphics::color_transform(0, 0, 0, 255)), air_resistance_(0), water_resistance_(7), end_game_(false),
@@ -235,7 +239,7 @@ level::level(const std::string& level_cfg, variant node)
 	}
 
 #if defined(USE_SHADERS)
-	if(node.has_key("shader")) {
+	if(node.has_key("shader") && !g_headless) {
 		shader_.reset(new gles2::shader_program(node["shader"]));
 	} else {
 		shader_.reset();
@@ -360,6 +364,7 @@ level::level(const std::string& level_cfg, variant node)
 	std::cerr << "done building..." << SDL_GetTicks() << "\n";
 
 	int begin_tile_index = tiles_.size();
+	std::vector<const tile_map*> tile_maps_to_build;
 	foreach(variant tile_node, node["tile_map"].as_list()) {
 		variant tiles_value = tile_node["tiles"];
 		if(!tiles_value.is_string()) {
@@ -382,11 +387,13 @@ level::level(const std::string& level_cfg, variant node)
 		tile_map m(tile_node);
 		ASSERT_LOG(tile_maps_.count(m.zorder()) == 0, "repeated zorder in tile map: " << m.zorder());
 		tile_maps_[m.zorder()] = m;
-		const int before = tiles_.size();
-		tile_maps_[m.zorder()].build_tiles(&tiles_);
-		std::cerr << "LAYER " << m.zorder() << " BUILT " << (tiles_.size() - before) << " tiles\n";
+		tile_maps_to_build.push_back(&tile_maps_[m.zorder()]);
 	}
 
+	const int tiles_before_build = tiles_.size();
+	tile_map::build_tiles_in_parallel(tile_maps_to_build, &tiles_);
+	std::cerr << "BUILT " << (tiles_.size() - tiles_before_build) << " tiles in " << tile_maps_to_build.size() << " layers\n";
+
 	std::cerr << "done building tile_map..." << SDL_GetTicks() << "\n";
 
 	num_compiled_tiles_ = node["num_compiled_tiles"].as_int();
@@ -610,6 +617,8 @@ void level::read_compiled_tiles(variant node, std::vector<level_tile>::iterator&
 void level::load_character(variant c)
 {
 	chars_.push_back(entity::build(c));
+	char_grid_.invalidate();
+	solid_grid_.invalidate();
 	layers_.insert(chars_.back()->zorder());
 	if(!chars_.back()->is_human()) {
 		chars_.back()->set_id(chars_.size());
@@ -638,8 +647,6 @@ void level::load_character(variant c)
 	if(chars_.back()->label().empty() == false) {
 		chars_by_label_[chars_.back()->label()] = chars_.back();
 	}
-
-	solid_chars_.clear();
 }
 
 PREF_BOOL(respect_difficulty, false, "");
@@ -688,6 +695,7 @@ void level::finish_loading()
 
 		solid_.clear();
 		standable_.clear();
+		solid_area_changed(boundaries_);
 		tiles_.clear();
 		prepare_tiles_for_drawing();
 
@@ -812,6 +820,8 @@ void level::finish_loading()
 		}
 
 		chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
+		char_grid_.invalidate();
+		solid_grid_.invalidate();
 	}
 
 #if defined(USE_BOX2D)
@@ -913,20 +923,23 @@ std::map<const level*, level_tile_rebuild_info> tile_rebuild_map;
 void build_tiles_thread_function(level_tile_rebuild_info* info, std::map<int, tile_map> tile_maps, threading::mutex& sync) {
 	info->task_tiles.clear();
 
+	std::vector<const tile_map*> maps;
 	if(info->rebuild_tile_layers_worker_buffer.empty()) {
 		for(std::map<int, tile_map>::const_iterator i = tile_maps.begin();
 		    i != tile_maps.end(); ++i) {
-			i->second.build_tiles(&info->task_tiles);
+			maps.push_back(&i->second);
 		}
 	} else {
 		foreach(int layer, info->rebuild_tile_layers_worker_buffer) {
 			std::map<int, tile_map>::const_iterator itor = tile_maps.find(layer);
 			if(itor != tile_maps.end()) {
-				itor->second.build_tiles(&info->task_tiles);
+				maps.push_back(&itor->second);
 			}
 		}
 	}
 
+	tile_map::build_tiles_in_parallel(maps, &info->task_tiles);
+
 	threading::lock l(info->tile_rebuild_complete_mutex);
 	info->tile_rebuild_complete = true;
 }
@@ -942,6 +955,12 @@ void level::start_rebuild_tiles_in_background(const std::vector<int>& layers)
 {
 	level_tile_rebuild_info& info = tile_rebuild_map[this];
 
+	//if the only changes are small edits, splice in the tiles around them
+	//now rather than rebuilding whole layers.
+	if(!info.tile_rebuild_in_progress && rebuild_dirty_tiles(layers)) {
+		return;
+	}
+
 	//merge the new layers with any layers we already have queued up.
 	if(layers.empty() == false && (!info.tile_rebuild_queued || info.rebuild_tile_layers_buffer.empty() == false)) {
 		//add the layers we want to rebuild to those already requested.
@@ -963,6 +982,14 @@ void level::start_rebuild_tiles_in_background(const std::vector<int>& layers)
 	info.rebuild_tile_layers_worker_buffer = info.rebuild_tile_layers_buffer;
 	info.rebuild_tile_layers_buffer.clear();
 
+	if(info.rebuild_tile_layers_worker_buffer.empty()) {
+		dirty_tile_areas_.clear();
+	} else {
+		foreach(int layer, info.rebuild_tile_layers_worker_buffer) {
+			dirty_tile_areas_.erase(layer);
+		}
+	}
+
 	std::map<int, tile_map> worker_tile_maps = tile_maps_;
 	for(std::map<int, tile_map>::iterator i = worker_tile_maps.begin();
 	    i != worker_tile_maps.end(); ++i) {
@@ -1080,10 +1107,14 @@ void level::rebuild_tiles()
 	}
 
 	tiles_.clear();
-	for(std::map<int, tile_map>::iterator i = tile_maps_.begin(); i != tile_maps_.end(); ++i) {
-		i->second.build_tiles(&tiles_);
+	std::vector<const tile_map*> maps;
+	for(std::map<int, tile_map>::const_iterator i = tile_maps_.begin(); i != tile_maps_.end(); ++i) {
+		maps.push_back(&i->second);
 	}
 
+	tile_map::build_tiles_in_parallel(maps, &tiles_);
+
+	dirty_tile_areas_.clear();
 	complete_tiles_refresh();
 }
 
@@ -1093,6 +1124,7 @@ void level::complete_tiles_refresh()
 	std::cerr << "adding solids..." << (SDL_GetTicks() - start) << "\n";
 	solid_.clear();
 	standable_.clear();
+	solid_area_changed(boundaries_);
 
 	foreach(level_tile& t, tiles_) {
 		add_tile_solid(t);
@@ -1140,16 +1172,32 @@ void level::flip_variations(int xtile, int ytile, int delta)
 }
 
 namespace {
-struct TileInRect {
-	explicit TileInRect(const rect& r) : rect_(r)
-	{}
+//the smallest area of whole tiles covering r, with margin more tiles
+//around it.
+rect tile_aligned_area(const rect& r, int margin)
+{
+	const int x1 = (floor_div(r.x(), TileSize) - margin)*TileSize;
+	const int y1 = (floor_div(r.y(), TileSize) - margin)*TileSize;
+	const int x2 = (floor_div(r.x2() - 1, TileSize) + 1 + margin)*TileSize;
+	const int y2 = (floor_div(r.y2() - 1, TileSize) + 1 + margin)*TileSize;
+	return rect(x1, y1, x2 - x1, y2 - y1);
+}
 
-	bool operator()(const level_tile& t) const {
-		return point_in_rect(point(t.x, t.y), rect_);
-	}
+//the tiles of a zorder with their top left corner in the rows of an area.
+std::pair<std::vector<level_tile>::iterator, std::vector<level_tile>::iterator> tile_rows_in_area(std::vector<level_tile>& tiles, int zorder, const rect& area)
+{
+	level_tile begin, end;
+	begin.zorder = end.zorder = zorder;
+	begin.x = end.x = INT_MIN;
+	begin.y = area.y();
+	end.y = area.y2();
+	return std::make_pair(std::lower_bound(tiles.begin(), tiles.end(), begin, level_tile_zorder_pos_comparer()),
+	                      std::lower_bound(tiles.begin(), tiles.end(), end, level_tile_zorder_pos_comparer()));
+}
 
-	rect rect_;
-};
+//if editing a single tile changes tiles further away than this, the
+//layer is rebuilt in full in the background instead.
+const int MaxIncrementalRebuildTiles = 64*64;
 }
 
 void level::rebuild_tiles_rect(const rect& r)
@@ -1158,31 +1206,264 @@ void level::rebuild_tiles_rect(const rect& r)
 		return;
 	}
 
-	for(int x = r.x(); x < r.x2(); x += TileSize) {
-		for(int y = r.y(); y < r.y2(); y += TileSize) {
-			tile_pos pos(x/TileSize, y/TileSize);
-			solid_.erase(pos);
-			standable_.erase(pos);
+	std::vector<std::pair<int, rect> > areas;
+	for(std::map<int, tile_map>::const_iterator i = tile_maps_.begin(); i != tile_maps_.end(); ++i) {
+		areas.push_back(std::pair<int, rect>(i->first, tile_aligned_area(r, 0)));
+	}
+
+	rebuild_tiles_in_areas(areas);
+}
+
+void level::rebuild_tiles_in_areas(const std::vector<std::pair<int, rect> >& areas)
+{
+	std::set<int> zorders;
+	bool solid_colors_changed = false;
+	for(int n = 0; n != areas.size(); ++n) {
+		splice_layer_tiles(areas[n].first, areas[n].second, &zorders, &solid_colors_changed);
+	}
+
+	tiles_by_position_.clear();
+
+	for(int n = 0; n != areas.size(); ++n) {
+		refresh_tile_solids(areas[n].second);
+	}
+
+	//tiles drawn as solid colors are merged into rects across their layer,
+	//so if they change the layers have to be prepared for drawing again.
+	bool prepared = !solid_colors_changed;
+	for(int n = 0; n != areas.size() && prepared; ++n) {
+		foreach(int zorder, zorders) {
+			if(!splice_tiles_for_drawing(zorder, areas[n].second)) {
+				prepared = false;
+				break;
+			}
 		}
 	}
 
-	tiles_.erase(std::remove_if(tiles_.begin(), tiles_.end(), TileInRect(r)), tiles_.end());
+	if(!prepared) {
+		prepare_tiles_for_drawing();
+	}
+}
 
+void level::splice_layer_tiles(int layer, const rect& area, std::set<int>* zorders, bool* solid_colors_changed)
+{
 	std::vector<level_tile> tiles;
-	for(std::map<int, tile_map>::const_iterator i = tile_maps_.begin(); i != tile_maps_.end(); ++i) {
-		i->second.build_tiles(&tiles, &r);
+	std::map<int, tile_map>::const_iterator map_itor = tile_maps_.find(layer);
+	if(map_itor != tile_maps_.end()) {
+		map_itor->second.build_tiles(&tiles, &area);
 	}
 
-	foreach(level_tile& t, tiles) {
-		add_tile_solid(t);
-		tiles_.push_back(t);
+	std::sort(tiles.begin(), tiles.end(), level_tile_zorder_pos_comparer());
+
+	std::set<int> layer_zorders = layers_;
+	foreach(const level_tile& t, tiles) {
+		layer_zorders.insert(t.zorder);
 		layers_.insert(t.zorder);
+		if(!is_arcade_level() && t.object->solid_color()) {
+			*solid_colors_changed = true;
+		}
 	}
 
-	if(std::adjacent_find(tiles_.rbegin(), tiles_.rend(), level_tile_zorder_pos_comparer()) != tiles_.rend()) {
-		std::sort(tiles_.begin(), tiles_.end(), level_tile_zorder_pos_comparer());
+	std::vector<level_tile>::const_iterator new_tile = tiles.begin();
+	std::vector<level_tile> merged;
+	foreach(int zorder, layer_zorders) {
+		std::vector<level_tile>::const_iterator new_end = new_tile;
+		while(new_end != tiles.end() && new_end->zorder == zorder) {
+			++new_end;
+		}
+
+		const std::pair<std::vector<level_tile>::iterator, std::vector<level_tile>::iterator> range = tile_rows_in_area(tiles_, zorder, area);
+
+		//keep the tiles of the rows which weren't built from this layer in
+		//this area, and merge the new ones in with them.
+		merged.clear();
+		for(std::vector<level_tile>::const_iterator i = range.first; i != range.second; ++i) {
+			if(i->layer_from == layer && i->x >= area.x() && i->x < area.x2()) {
+				if(!is_arcade_level() && i->object->solid_color()) {
+					*solid_colors_changed = true;
+				}
+			} else {
+				merged.push_back(*i);
+			}
+		}
+
+		if(merged.size() == range.second - range.first && new_tile == new_end) {
+			continue;
+		}
+
+		const int kept = merged.size();
+		merged.insert(merged.end(), new_tile, new_end);
+		std::inplace_merge(merged.begin(), merged.begin() + kept, merged.end(), level_tile_zorder_pos_comparer());
+		new_tile = new_end;
+
+		if(merged.size() == range.second - range.first) {
+			std::copy(merged.begin(), merged.end(), range.first);
+		} else {
+			const int begin_index = range.first - tiles_.begin();
+			tiles_.erase(range.first, range.second);
+			tiles_.insert(tiles_.begin() + begin_index, merged.begin(), merged.end());
+		}
+
+		zorders->insert(zorder);
+	}
+}
+
+void level::refresh_tile_solids(const rect& area)
+{
+	//tiles may be wider or higher than a tile, and so have solid
+	//to the right of and below the area.
+	const rect solid_area = tile_aligned_area(rect(area.x(), area.y(), area.w() + widest_tile_, area.h() + highest_tile_), 0);
+	for(int y = solid_area.y(); y < solid_area.y2(); y += TileSize) {
+		for(int x = solid_area.x(); x < solid_area.x2(); x += TileSize) {
+			const tile_pos pos(x/TileSize, y/TileSize);
+			solid_.erase(pos);
+			standable_.erase(pos);
+		}
+	}
+
+	solid_area_changed(solid_area);
+
+	//add back the solid of every tile overlapping the area.
+	const rect tiles_area(solid_area.x() - widest_tile_, solid_area.y() - highest_tile_, solid_area.w() + widest_tile_, solid_area.h() + highest_tile_);
+	foreach(int zorder, layers_) {
+		const std::pair<std::vector<level_tile>::iterator, std::vector<level_tile>::iterator> range = tile_rows_in_area(tiles_, zorder, tiles_area);
+		for(std::vector<level_tile>::const_iterator i = range.first; i != range.second; ++i) {
+			if(i->x > tiles_area.x() && i->x < solid_area.x2()) {
+				add_tile_solid(*i);
+			}
+		}
 	}
-	prepare_tiles_for_drawing();
+}
+
+bool level::splice_tiles_for_drawing(int zorder, const rect& area)
+{
+	std::map<int, layer_blit_info>::iterator layer_itor = blit_cache_.find(zorder);
+	if(layer_itor == blit_cache_.end()) {
+		return false;
+	}
+
+	layer_blit_info& blit_info = layer_itor->second;
+
+	const std::pair<std::vector<level_tile>::iterator, std::vector<level_tile>::iterator> range = tile_rows_in_area(tiles_, zorder, area);
+	for(std::vector<level_tile>::iterator i = range.first; i != range.second; ++i) {
+		if(i->x >= area.x() && i->x < area.x2() && (i->x < blit_info.xbase || i->y < blit_info.ybase)) {
+			//the tile is outside the area the blit cache indexes.
+			return false;
+		}
+	}
+
+	for(int y = std::max(area.y(), blit_info.ybase); y < area.y2(); y += TileSize) {
+		const int ytile = (y - blit_info.ybase)/TileSize;
+		if(ytile >= blit_info.indexes.size()) {
+			break;
+		}
+
+		std::vector<layer_blit_info::IndexType>& indexes = blit_info.indexes[ytile];
+		for(int x = std::max(area.x(), blit_info.xbase); x < area.x2(); x += TileSize) {
+			const int xtile = (x - blit_info.xbase)/TileSize;
+			if(xtile >= indexes.size()) {
+				break;
+			}
+
+			if(indexes[xtile] != TILE_INDEX_TYPE_MAX) {
+				indexes[xtile] = TILE_INDEX_TYPE_MAX;
+				blit_info.unused_vertexes += 4;
+			}
+		}
+	}
+
+	for(std::vector<level_tile>::iterator i = range.first; i != range.second; ++i) {
+		level_tile& t = *i;
+		if(t.x < area.x() || t.x >= area.x2()) {
+			continue;
+		}
+
+		if(!editor_ && (t.x <= boundaries().x() - TileSize || t.y <= boundaries().y() - TileSize || t.x >= boundaries().x2() || t.y >= boundaries().y2())) {
+			continue;
+		}
+
+		t.draw_disabled = false;
+
+		blit_info.blit_vertexes.resize(blit_info.blit_vertexes.size() + 4);
+		const int npoints = level_object::calculate_tile_corners(&blit_info.blit_vertexes[blit_info.blit_vertexes.size() - 4], t);
+		if(npoints == 0) {
+			blit_info.blit_vertexes.resize(blit_info.blit_vertexes.size() - 4);
+			continue;
+		}
+
+		blit_info.vertex_texture_ids.push_back(t.object->texture().get_id());
+		if(blit_info.vertex_texture_ids.back() != blit_info.texture_id) {
+			blit_info.texture_id = GLuint(-1);
+		}
+
+		const int xtile = (t.x - blit_info.xbase)/TileSize;
+		const int ytile = (t.y - blit_info.ybase)/TileSize;
+		if(blit_info.indexes.size() <= ytile) {
+			blit_info.indexes.resize(ytile+1);
+		}
+
+		if(blit_info.indexes[ytile].size() <= xtile) {
+			blit_info.indexes[ytile].resize(xtile+1, TILE_INDEX_TYPE_MAX);
+		}
+
+		if(blit_info.indexes[ytile][xtile] != TILE_INDEX_TYPE_MAX) {
+			blit_info.unused_vertexes += 4;
+		}
+
+		blit_info.indexes[ytile][xtile] = (blit_info.blit_vertexes.size() - 4) * (t.object->is_opaque() ? 1 : -1);
+	}
+
+	//make draw_layer() work out which tiles are on the screen again.
+	blit_info.tile_positions = rect(INT_MIN, INT_MIN, 0, 0);
+
+	//once most of the vertexes are unused the layer is prepared again
+	//from scratch to compact them.
+	return blit_info.unused_vertexes*2 <= blit_info.blit_vertexes.size();
+}
+
+bool level::rebuild_dirty_tiles(const std::vector<int>& layers)
+{
+	if(editor_tile_updates_frozen_) {
+		return false;
+	}
+
+	std::vector<std::pair<int, rect> > areas;
+	for(std::map<int, rect>::const_iterator i = dirty_tile_areas_.begin(); i != dirty_tile_areas_.end(); ++i) {
+		if(!layers.empty() && std::count(layers.begin(), layers.end(), i->first) == 0) {
+			continue;
+		}
+
+		std::map<int, tile_map>::const_iterator map_itor = tile_maps_.find(i->first);
+		const int radius = map_itor != tile_maps_.end() ? map_itor->second.pattern_radius() : 0;
+		const rect area = tile_aligned_area(i->second, radius);
+		if((area.w()/TileSize)*(area.h()/TileSize) > MaxIncrementalRebuildTiles) {
+			return false;
+		}
+
+		areas.push_back(std::pair<int, rect>(i->first, area));
+	}
+
+	if(areas.empty()) {
+		return false;
+	}
+
+	const int begin_time = SDL_GetTicks();
+
+	rebuild_tiles_in_areas(areas);
+
+	for(int n = 0; n != areas.size(); ++n) {
+		dirty_tile_areas_.erase(areas[n].first);
+	}
+
+	std::cerr << "INCREMENTAL TILE REBUILD: " << (SDL_GetTicks() - begin_time) << "\n";
+
+	const std::vector<entity_ptr> chars = chars_;
+	foreach(const entity_ptr& e, chars) {
+		e->handle_event("level_tiles_refreshed");
+	}
+
+	++g_tile_rebuild_state_id;
+	return true;
 }
 
 std::string level::package() const
@@ -2578,6 +2859,11 @@ void level::process()
 
 	do_processing();
 
+	if(flow_fields_.num_fields()) {
+		formula_profiler::instrument instrumentation("FLOW_FIELDS");
+		pathfinding::process_flow_fields(*this);
+	}
+
 	if(speech_dialogs_.empty() == false) {
 		if(speech_dialogs_.top()->process()) {
 			speech_dialogs_.pop();
@@ -2627,8 +2913,24 @@ void level::set_active_chars()
 	const int screen_bottom = last_draw_position().y/100 + graphics::screen_height() + zoom_buffer;
 
 	const rect screen_area(screen_left, screen_top, screen_right - screen_left, screen_bottom - screen_top);
+
+	//only characters near the screen or which die when inactive need to be
+	//looked at; everything else is known to be inactive. They are visited
+	//in the same order as they appear in chars_.
+	std::vector<entity*> candidates;
+	if(controls::num_players() > 1) {
+		//in multiplayer all objects are active.
+		candidates.reserve(chars_.size());
+		foreach(const entity_ptr& c, chars_) {
+			candidates.push_back(c.get());
+		}
+	} else {
+		char_grid().query(screen_area, candidates, true);
+	}
+
 	active_chars_.clear();
-	foreach(entity_ptr& c, chars_) {
+	std::vector<entity_ptr> dead_chars;
+	foreach(entity* c, candidates) {
 		const bool is_active = c->is_active(screen_area) || c->use_absolute_screen_coordinates();
 
 		if(is_active) {
@@ -2646,18 +2948,49 @@ void level::set_active_chars()
 					chars_by_label_.erase(c->label());
 				}
 				
-				c = entity_ptr(); //can't delete it while iterating over the container, so we null it for later removal
+				dead_chars.push_back(c); //can't delete it while iterating over the candidates, so remove it afterwards
 			}
 		}
 	}
 
-	chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
+	if(!dead_chars.empty()) {
+		foreach(const entity_ptr& c, dead_chars) {
+			char_grid_.remove(c.get());
+			solid_grid_.remove(c.get());
+		}
+
+		std::sort(dead_chars.begin(), dead_chars.end());
+		std::vector<entity_ptr> remaining_chars;
+		remaining_chars.reserve(chars_.size());
+		foreach(const entity_ptr& c, chars_) {
+			if(!std::binary_search(dead_chars.begin(), dead_chars.end(), c)) {
+				remaining_chars.push_back(c);
+			}
+		}
+
+		chars_.swap(remaining_chars);
+	}
 
 	std::sort(active_chars_.begin(), active_chars_.end());
 	active_chars_.erase(std::unique(active_chars_.begin(), active_chars_.end()), active_chars_.end());
 	std::sort(active_chars_.begin(), active_chars_.end(), zorder_compare);
 }
 
+const entity_grid& level::char_grid() const
+{
+	if(!char_grid_.valid()) {
+		char_grid_.rebuild(chars_);
+	}
+
+	return char_grid_;
+}
+
+namespace {
+//the number of cycles of object state hashes kept in multiplayer games,
+//which has to cover the time it takes other players' checksums to arrive.
+const size_t MaxStateHashHistory = 250;
+}
+
 void level::do_processing()
 {
 	if(cycle_ == 0) {
@@ -2677,8 +3010,15 @@ void level::do_processing()
 	}
 
 	const int ticks = SDL_GetTicks();
-	set_active_chars();
-	detect_user_collisions(*this);
+	{
+		formula_profiler::instrument instrumentation("ACTIVE_CHARS");
+		set_active_chars();
+	}
+
+	{
+		formula_profiler::instrument instrumentation("USER_COLLISIONS");
+		detect_user_collisions(*this);
+	}
 
 	
 /*
@@ -2690,12 +3030,26 @@ void level::do_processing()
 	std::cerr << "\n";
 	*/
 
-	int checksum = 0;
-	foreach(const entity_ptr& e, chars_) {
-		checksum += e->x() + e->y();
-	}
+	//the checksum is only compared between the machines of a multiplayer
+	//game, so isn't worked out otherwise. Objects' hashes are summed so
+	//the checksum doesn't depend on their order.
+	if(controls::num_players() > 1) {
+		unsigned int checksum = 0;
+		state_hash_history_.push_back(cycle_state_hashes());
+		cycle_state_hashes& history = state_hash_history_.back();
+		history.cycle = cycle_;
+		history.hashes.reserve(chars_.size());
+		foreach(const entity_ptr& e, chars_) {
+			history.hashes.push_back(e->state_hash());
+			checksum += history.hashes.back();
+		}
 
-	controls::set_checksum(cycle_, checksum);
+		if(state_hash_history_.size() > MaxStateHashHistory) {
+			state_hash_history_.pop_front();
+		}
+
+		controls::set_checksum(cycle_, checksum);
+	}
 
 	const int ActivationDistance = 700;
 
@@ -2706,31 +3060,33 @@ void level::do_processing()
 		active_chars = chars_immune_from_time_freeze_;
 	}
 
-	while(!active_chars.empty()) {
-		new_chars_.clear();
-		foreach(const entity_ptr& c, active_chars) {
-			if(!c->destroyed() && (chars_by_label_.count(c->label()) || c->is_human())) {
-				c->process(*this);
-			}
-	
-			if(c->destroyed() && !c->is_human()) {
-				if(player_ && !c->respawn() && c->get_id() != -1) {
-					player_->is_human()->object_destroyed(id(), c->get_id());
+	{
+		formula_profiler::instrument instrumentation("OBJECTS");
+		while(!active_chars.empty()) {
+			new_chars_.clear();
+			foreach(const entity_ptr& c, active_chars) {
+				if(!c->destroyed() && (chars_by_label_.count(c->label()) || c->is_human())) {
+					c->process(*this);
 				}
 	
-				erase_char(c);
+				if(c->destroyed() && !c->is_human()) {
+					if(player_ && !c->respawn() && c->get_id() != -1) {
+						player_->is_human()->object_destroyed(id(), c->get_id());
+					}
+	
+					erase_char(c);
+				}
 			}
-		}
 
-		active_chars = new_chars_;
-		active_chars_.insert(active_chars_.end(), new_chars_.begin(), new_chars_.end());
+			active_chars = new_chars_;
+			active_chars_.insert(active_chars_.end(), new_chars_.begin(), new_chars_.end());
+		}
 	}
 
 	if(water_) {
+		formula_profiler::instrument instrumentation("WATER");
 		water_->process(*this);
 	}
-
-	solid_chars_.clear();
 }
 
 void level::erase_char(entity_ptr c)
@@ -2740,13 +3096,13 @@ void level::erase_char(entity_ptr c)
 		chars_by_label_.erase(c->label());
 	}
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), c), chars_.end());
+	char_grid_.remove(c.get());
+	solid_grid_.remove(c.get());
 	if(c->group() >= 0) {
 		assert(c->group() < groups_.size());
 		entity_group& group = groups_[c->group()];
 		group.erase(std::remove(group.begin(), group.end(), c), group.end());
 	}
-
-	solid_chars_.clear();
 }
 
 bool level::is_solid(const level_solid_map& map, const entity& e, const std::vector<point>& points, const surface_info** surf_info) const
@@ -2905,8 +3261,22 @@ bool level::solid(const entity& e, const std::vector<point>& points, const surfa
 	return is_solid(solid_, e, points, info);
 }
 
+int level::solid_count(const entity& e, const solid_point_mask& mask, bool first_only) const
+{
+	if(mask.bits.empty()) {
+		return 0;
+	}
+
+	const int x = mask.mirrored ? e.x() + e.current_frame().width() - mask.area.x2() : e.x() + mask.area.x();
+	return solid_.count_solid(&mask.bits[0], mask.words_per_row, mask.area.h(), x, e.y() + mask.area.y(), first_only);
+}
+
 bool level::solid(int xbegin, int ybegin, int w, int h, const surface_info** info) const
 {
+	if(info == NULL) {
+		return solid_.any_solid(xbegin, ybegin, w, h);
+	}
+
 	const int xend = xbegin + w;
 	const int yend = ybegin + h;
 
@@ -2923,7 +3293,10 @@ bool level::solid(int xbegin, int ybegin, int w, int h, const surface_info** inf
 
 bool level::solid(const rect& r, const surface_info** info) const
 {
-	//TODO: consider optimizing this function.
+	if(info == NULL) {
+		return solid_.any_solid(r.x(), r.y(), r.w(), r.h());
+	}
+
 	const int ybegin = r.y();
 	const int yend = r.y2();
 	const int xbegin = r.x();
@@ -2941,6 +3314,36 @@ bool level::solid(const rect& r, const surface_info** info) const
 }
 
 bool level::may_be_solid_in_rect(const rect& r) const
+{
+	return may_be_solid_in_rect(solid_, r);
+}
+
+bool level::may_be_standable_in_rect(const rect& r) const
+{
+	return may_be_solid_in_rect(solid_, r) || may_be_solid_in_rect(standable_, r);
+}
+
+int level::solid_distance(int x, int y, int dir, int max_search, bool value) const
+{
+	return solid_.column_distance(NULL, x, y, dir, max_search, value);
+}
+
+int level::standable_distance(int x, int y, int dir, int max_search, bool value) const
+{
+	return solid_.column_distance(&standable_, x, y, dir, max_search, value);
+}
+
+int level::ground_level(int x, int y, int max_search) const
+{
+	return solid_.ground_level(&standable_, x, y, max_search);
+}
+
+bool level::ground_slope(int x, int y, int range, int* rise) const
+{
+	return solid_.ground_slope(&standable_, x, y, range, rise);
+}
+
+bool level::may_be_solid_in_rect(const level_solid_map& map, const rect& r) const
 {
 	int x = r.x();
 	int y = r.y();
@@ -2962,7 +3365,7 @@ bool level::may_be_solid_in_rect(const rect& r) const
 
 	for(int ypos = 0; ypos < y2; ++ypos) {
 		for(int xpos = 0; xpos < x2; ++xpos) {
-			if(solid_.find(tile_pos(pos.first + xpos, pos.second + ypos))) {
+			if(map.find(tile_pos(pos.first + xpos, pos.second + ypos))) {
 				return true;
 			}
 		}
@@ -2979,6 +3382,14 @@ void level::set_solid_area(const rect& r, bool solid)
 			set_solid(solid_, x, y, 100, 100, 0, empty_info, solid);
 		}
 	}
+
+	solid_area_changed(r);
+}
+
+void level::solid_area_changed(const rect& r)
+{
+	hierarchical_path_graph_.invalidate(r);
+	flow_fields_.invalidate(r);
 }
 
 entity_ptr level::board(int x, int y) const
@@ -3096,6 +3507,16 @@ bool level::add_tile_rect_vector_internal(int zorder, int x1, int y1, int x2, in
 		}
 	}
 
+	if(changed) {
+		const rect area(x1, y1, x2 - x1, y2 - y1);
+		std::map<int, rect>::iterator dirty = dirty_tile_areas_.find(zorder);
+		if(dirty == dirty_tile_areas_.end()) {
+			dirty_tile_areas_[zorder] = area;
+		} else {
+			dirty->second = rect_union(dirty->second, area);
+		}
+	}
+
 	return changed;
 }
 
@@ -3286,6 +3707,10 @@ void level::add_tile_solid(const level_tile& t)
 	}
 
 	const const_level_object_ptr& obj = t.object;
+	if(obj->all_solid() || obj->has_solid()) {
+		solid_area_changed(rect(t.x, t.y, obj->width(), obj->height()));
+	}
+
 	if(obj->all_solid()) {
 		add_solid_rect(t.x, t.y, t.x + obj->width(), t.y + obj->height(), obj->friction(), obj->traction(), obj->damage(), obj->info());
 		return;
@@ -3395,18 +3820,22 @@ void level::remove_character(entity_ptr e)
 		chars_by_label_.erase(e->label());
 	}
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), e), chars_.end());
-	solid_chars_.erase(std::remove(solid_chars_.begin(), solid_chars_.end(), e), solid_chars_.end());
+	char_grid_.remove(e.get());
+	solid_grid_.remove(e.get());
 	active_chars_.erase(std::remove(active_chars_.begin(), active_chars_.end(), e), active_chars_.end());
 }
 
 std::vector<entity_ptr> level::get_characters_in_rect(const rect& r, int screen_xpos, int screen_ypos) const
 {
+	std::vector<entity*> candidates;
+	char_grid().query(r, candidates);
+
 	std::vector<entity_ptr> res;
-	foreach(entity_ptr c, chars_) {
+	foreach(entity* c, candidates) {
 		if(object_classification_hidden(*c)) {
 			continue;
 		}
-		custom_object* obj = dynamic_cast<custom_object*>(c.get());
+		custom_object* obj = dynamic_cast<custom_object*>(c);
 
 		const int xP = c->midpoint().x + ((c->parallax_scale_millis_x() - 1000)*screen_xpos)/1000 
 			+ (obj->use_absolute_screen_coordinates() ? screen_xpos : 0);
@@ -3422,8 +3851,11 @@ std::vector<entity_ptr> level::get_characters_in_rect(const rect& r, int screen_
 
 std::vector<entity_ptr> level::get_characters_at_point(int x, int y, int screen_xpos, int screen_ypos) const
 {
+	std::vector<entity*> candidates;
+	char_grid().query(rect(x, y, 1, 1), candidates);
+
 	std::vector<entity_ptr> result;
-	foreach(entity_ptr c, chars_) {
+	foreach(entity* c, candidates) {
 		if(object_classification_hidden(*c) || c->truez()) {
 			continue;
 		}
@@ -3532,7 +3964,6 @@ void level::set_solid(level_solid_map& map, int x, int y, int friction, int trac
 		pos.second--;
 		y += TileSize;
 	}
-	const int index = y*TileSize + x;
 	tile_solid_info& info = map.insert_or_find(pos);
 
 	if(info.info.damage >= 0) {
@@ -3544,14 +3975,14 @@ void level::set_solid(level_solid_map& map, int x, int y, int friction, int trac
 	if(solid) {
 		info.info.friction = friction;
 		info.info.traction = traction;
-		info.bitmap.set(index);
+		info.set_pixel(x, y, true);
 	} else {
 		if(info.all_solid) {
 			info.all_solid = false;
-			info.bitmap.set();
+			info.set_all_pixels();
 		}
 
-		info.bitmap.reset(index);
+		info.set_pixel(x, y, false);
 	}
 
 	if(info_str.empty() == false) {
@@ -3566,6 +3997,8 @@ void level::add_multi_player(entity_ptr p)
 	ASSERT_LOG(!g_player_type || g_player_type->match(variant(p.get())), "Player object being added to level does not match required player type. " << p->debug_description() << " is not a " << g_player_type->to_string());
 	players_.push_back(p);
 	chars_.push_back(p);
+	char_grid_.insert(p.get());
+	solid_grid_.insert(p.get());
 	if(p->label().empty() == false) {
 		chars_by_label_[p->label()] = p;
 	}
@@ -3618,14 +4051,12 @@ void level::add_player(entity_ptr p)
 	}
 
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), entity_ptr()), chars_.end());
+	char_grid_.invalidate();
+	solid_grid_.invalidate();
 }
 
 void level::add_character(entity_ptr p)
 {
-	if(solid_chars_.empty() == false && p->solid()) {
-		solid_chars_.push_back(p);
-	}
-
 	ASSERT_LOG(p->label().empty() == false, "Entity has no label");
 
 	if(p->label().empty() == false) {
@@ -3645,6 +4076,8 @@ void level::add_character(entity_ptr p)
 		add_player(p);
 	} else {
 		chars_.push_back(p);
+		char_grid_.insert(p.get());
+		solid_grid_.insert(p.get());
 	}
 
 	p->add_to_level();
@@ -4188,17 +4621,13 @@ void level::get_all_labels(std::vector<std::string>& labels) const
 	}
 }
 
-const std::vector<entity_ptr>& level::get_solid_chars() const
+void level::get_solid_chars_in_rect(const rect& r, std::vector<entity*>& result) const
 {
-	if(solid_chars_.empty()) {
-		foreach(const entity_ptr& e, chars_) {
-			if(e->solid() || e->platform()) {
-				solid_chars_.push_back(e);
-			}
-		}
+	if(!solid_grid_.valid()) {
+		solid_grid_.rebuild(chars_);
 	}
 
-	return solid_chars_;
+	solid_grid_.query(r, result);
 }
 
 void level::begin_movement_script(const std::string& key, entity& e)
@@ -4247,7 +4676,7 @@ void level::replay_from_cycle(int ncycle)
 	ASSERT_GE(index, 0);
 
 	const int cycle_to_play_until = cycle_;
-	restore_from_backup(*backups_[index]);
+	restore_from_backup(*backups_[index], backups_, index);
 	ASSERT_EQ(cycle_, ncycle);
 	backups_.erase(backups_.begin() + index, backups_.end());
 	while(cycle_ < cycle_to_play_until) {
@@ -4256,32 +4685,65 @@ void level::replay_from_cycle(int ncycle)
 	}
 }
 
-void level::backup()
-{
-	if(backups_.empty() == false && backups_.back()->cycle == cycle_) {
-		return;
-	}
+namespace {
+//the number of snapshots from one keyframe to the next. Restoring a
+//snapshot has to look back as far as its keyframe.
+const int BackupKeyframeInterval = 50;
 
-	std::map<entity_ptr, entity_ptr> entity_map;
+//the number of snapshots kept, which can be exceeded by up to a keyframe
+//interval since the oldest snapshots are dropped a keyframe at a time.
+const size_t MaxBackups = 250;
+}
+
+PREF_BOOL(delta_backups, true, "Only copy objects which have changed since the last cycle when backing up the level for rewinding");
+
+level::backup_snapshot_ptr level::make_backup_snapshot(bool keyframe, bool record)
+{
+	ASSERT_LOG(keyframe || record, "Snapshots which aren't recorded must be keyframes");
 
 	backup_snapshot_ptr snapshot(new backup_snapshot);
 	snapshot->rng_seed = rng::get_seed();
 	snapshot->cycle = cycle_;
+	snapshot->keyframe = keyframe;
 	snapshot->chars.reserve(chars_.size());
 
+	std::vector<entity_ptr> new_copies;
 
 	foreach(const entity_ptr& e, chars_) {
-		snapshot->chars.push_back(e->backup());
-		entity_map[e] = snapshot->chars.back();
+		entity_ptr copy;
+		if(!snapshot->keyframe) {
+			copy = e->unchanged_backup();
+		}
+
+		if(!copy) {
+			copy = e->backup();
+			new_copies.push_back(copy);
+
+			if(record) {
+				const entity_ptr previous = e->last_backup();
+				if(!snapshot->keyframe && previous) {
+					snapshot->replaced.push_back(std::pair<entity_ptr, entity_ptr>(previous, copy));
+				}
+
+				e->set_last_backup(copy);
+			}
+		}
 
-		if(snapshot->chars.back()->is_human()) {
-			snapshot->players.push_back(snapshot->chars.back());
+		snapshot->chars.push_back(copy);
+
+		if(copy->is_human()) {
+			snapshot->players.push_back(copy);
 			if(e == player_) {
-				snapshot->player = snapshot->players.back();
+				snapshot->player = copy;
 			}
 		}
 	}
 
+	std::map<entity_ptr, entity_ptr> entity_map;
+	for(size_t n = 0; n != chars_.size(); ++n) {
+		entity_map[chars_[n]] = snapshot->chars[n];
+	}
+
 	foreach(entity_group& g, groups_) {
 		snapshot->groups.push_back(entity_group());
 
@@ -4293,24 +4755,54 @@ void level::backup()
 		}
 	}
 
-	foreach(const entity_ptr& e, snapshot->chars) {
+	//copies shared with earlier snapshots were mapped when they were made.
+	foreach(const entity_ptr& e, new_copies) {
 		e->map_entities(entity_map);
 	}
 
 	snapshot->last_touched_player = last_touched_player_;
 
-	backups_.push_back(snapshot);
-	if(backups_.size() > 250) {
+	return snapshot;
+}
 
-		for(std::deque<backup_snapshot_ptr>::iterator i = backups_.begin();
-		    i != backups_.begin() + 1; ++i) {
-			foreach(const entity_ptr& e, (*i)->chars) {
-				//kill off any references this entity holds, to workaround
-				//circular references causing things to stick around.
-				e->cleanup_references();
+void level::backup()
+{
+	if(backups_.empty() == false && backups_.back()->cycle == cycle_) {
+		return;
+	}
+
+	int since_keyframe = 0;
+	bool found_keyframe = false;
+	for(std::deque<backup_snapshot_ptr>::const_reverse_iterator i = backups_.rbegin(); i != backups_.rend(); ++i) {
+		if((*i)->keyframe) {
+			found_keyframe = true;
+			break;
+		}
+
+		++since_keyframe;
+	}
+
+	const bool keyframe = !g_delta_backups || !found_keyframe || since_keyframe + 1 >= BackupKeyframeInterval;
+	backups_.push_back(make_backup_snapshot(keyframe, true));
+	if(backups_.size() > MaxBackups) {
+		//snapshots may share copies with any snapshot back to their
+		//keyframe, so drop everything before the second keyframe.
+		size_t end = 1;
+		while(end != backups_.size() && !backups_[end]->keyframe) {
+			++end;
+		}
+
+		if(end != backups_.size()) {
+			for(std::deque<backup_snapshot_ptr>::iterator i = backups_.begin();
+			    i != backups_.begin() + end; ++i) {
+				foreach(const entity_ptr& e, (*i)->chars) {
+					//kill off any references this entity holds, to workaround
+					//circular references causing things to stick around.
+					e->cleanup_references();
+				}
 			}
+			backups_.erase(backups_.begin(), backups_.begin() + end);
 		}
-		backups_.erase(backups_.begin(), backups_.begin() + 1);
 	}
 }
 
@@ -4329,7 +4821,7 @@ void level::reverse_one_cycle()
 		return;
 	}
 
-	restore_from_backup(*backups_.back());
+	restore_from_backup(*backups_.back(), backups_, backups_.size() - 1);
 	backups_.pop_back();
 }
 
@@ -4351,18 +4843,185 @@ void level::reverse_to_cycle(int ncycle)
 	reverse_one_cycle();
 }
 
-void level::restore_from_backup(backup_snapshot& snapshot)
+int level::num_backup_copies() const
+{
+	std::set<const entity*> copies;
+	foreach(const backup_snapshot_ptr& snapshot, backups_) {
+		foreach(const entity_ptr& e, snapshot->chars) {
+			copies.insert(e.get());
+		}
+	}
+
+	return copies.size();
+}
+
+void level::dump_desync_state(int cycle) const
+{
+	variant_builder res;
+	res.add("level", id_);
+	res.add("cycle", cycle);
+	res.add("current_cycle", cycle_);
+
+	foreach(const cycle_state_hashes& history, state_hash_history_) {
+		if(history.cycle == cycle) {
+			std::vector<variant> hashes;
+			foreach(unsigned int h, history.hashes) {
+				hashes.push_back(variant(h));
+			}
+
+			res.add("hashes", variant(&hashes));
+		}
+	}
+
+	std::vector<variant> objects;
+	foreach(const entity_ptr& e, chars_) {
+		objects.push_back(e->write_state_hash());
+	}
+
+	res.add("objects", variant(&objects));
+
+	const int slot = std::find(players_.begin(), players_.end(), player_) - players_.begin();
+	const std::string fname = formatter() << "desync-" << cycle << "-" << slot << ".cfg";
+	sys::write_file(fname, res.build().write_json());
+	std::cerr << "WROTE STATE OF " << objects.size() << " OBJECTS FOR CYCLE " << cycle << " TO " << fname << "\n";
+}
+
+namespace {
+//prints the values of two maps of object state which differ.
+void print_state_differences(const std::string& prefix, const variant& a, const variant& b)
+{
+	std::map<variant, variant> keys = a.as_map();
+	keys.insert(b.as_map().begin(), b.as_map().end());
+	for(std::map<variant, variant>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
+		if(i->first.as_string() == "hash" || i->first.as_string() == "label" || a[i->first] == b[i->first]) {
+			continue;
+		}
+
+		if(a[i->first].is_map() && b[i->first].is_map()) {
+			print_state_differences(prefix + i->first.as_string() + ".", a[i->first], b[i->first]);
+		} else {
+			std::cout << "    " << prefix << i->first.as_string() << ": " << a[i->first].write_json() << " VS " << b[i->first].write_json() << "\n";
+		}
+	}
+}
+}
+
+//compares the files written by level::dump_desync_state() on two machines
+//to show which objects got out of sync and how they differ now.
+COMMAND_LINE_UTILITY(diff_desync)
+{
+	ASSERT_LOG(args.size() == 2, "usage: diff_desync <file> <file>");
+	const variant a = json::parse_from_file(args[0]);
+	const variant b = json::parse_from_file(args[1]);
+
+	const variant hashes_a = a["hashes"], hashes_b = b["hashes"];
+	if(a["cycle"] != b["cycle"] || !hashes_a.is_list() || !hashes_b.is_list()) {
+		std::cout << "NO OBJECT HASHES TO COMPARE FOR THE CYCLE WHICH DID NOT MATCH\n";
+	} else {
+		std::cout << "AT CYCLE " << a["cycle"].as_int() << ":\n";
+		if(hashes_a.num_elements() != hashes_b.num_elements()) {
+			std::cout << "  NUMBER OF OBJECTS DIFFERS: " << hashes_a.num_elements() << " VS " << hashes_b.num_elements() << "\n";
+		}
+
+		for(int n = 0; n < hashes_a.num_elements() && n < hashes_b.num_elements(); ++n) {
+			if(hashes_a[n] != hashes_b[n]) {
+				std::cout << "  OBJECT " << n << " DIFFERS\n";
+			}
+		}
+	}
+
+	const variant objects_a = a["objects"], objects_b = b["objects"];
+	std::cout << "NOW, AT CYCLES " << a["current_cycle"].as_int() << " AND " << b["current_cycle"].as_int() << ":\n";
+	if(objects_a.num_elements() != objects_b.num_elements()) {
+		std::cout << "  NUMBER OF OBJECTS DIFFERS: " << objects_a.num_elements() << " VS " << objects_b.num_elements() << "\n";
+	}
+
+	for(int n = 0; n < objects_a.num_elements() && n < objects_b.num_elements(); ++n) {
+		if(objects_a[n]["hash"] != objects_b[n]["hash"]) {
+			std::cout << "  OBJECT " << n << " (" << objects_a[n]["type"].as_string() << " " << objects_a[n]["label"].as_string()
+			          << " / " << objects_b[n]["type"].as_string() << " " << objects_b[n]["label"].as_string() << "):\n";
+			print_state_differences("", objects_a[n], objects_b[n]);
+		}
+	}
+}
+
+namespace {
+entity_ptr map_entity(const std::map<entity_ptr, entity_ptr>& m, const entity_ptr& e)
 {
+	std::map<entity_ptr, entity_ptr>::const_iterator i = m.find(e);
+	if(i != m.end()) {
+		return i->second;
+	}
+
+	return e;
+}
+}
+
+void level::restore_from_backup(const backup_snapshot& snapshot, const std::deque<backup_snapshot_ptr>& history, size_t history_end)
+{
+	//the snapshot's copies may be shared with other snapshots, so the
+	//level is given copies of them rather than the copies themselves.
+	std::map<entity_ptr, entity_ptr> entity_map;
+	std::vector<entity_ptr> chars;
+	chars.reserve(snapshot.chars.size());
+	foreach(const entity_ptr& e, snapshot.chars) {
+		chars.push_back(e->backup());
+		entity_map[e] = chars.back();
+	}
+
+	//copies shared from earlier snapshots may refer to copies of other
+	//characters that have since been replaced, so follow each replaced
+	//copy forward to the one in this snapshot.
+	if(!snapshot.keyframe) {
+		const backup_snapshot* s = &snapshot;
+		size_t n = history_end;
+		while(s) {
+			typedef std::pair<entity_ptr, entity_ptr> entity_pair;
+			foreach(const entity_pair& p, s->replaced) {
+				std::map<entity_ptr, entity_ptr>::const_iterator i = entity_map.find(p.second);
+				if(i != entity_map.end()) {
+					entity_map[p.first] = i->second;
+				}
+			}
+
+			s = NULL;
+			if(n > 0 && !history[n-1]->keyframe) {
+				s = history[--n].get();
+			}
+		}
+	}
+
+	foreach(const entity_ptr& e, chars) {
+		e->map_entities(entity_map);
+	}
+
 	rng::set_seed(snapshot.rng_seed);
 	cycle_ = snapshot.cycle;
-	chars_ = snapshot.chars;
-	players_ = snapshot.players;
-	player_ = snapshot.player;
-	groups_ = snapshot.groups;
-	last_touched_player_ = snapshot.last_touched_player;
-	active_chars_.clear();
+	chars_.swap(chars);
+	char_grid_.invalidate();
+	solid_grid_.invalidate();
+
+	//flow fields aren't kept in snapshots, so start them again as a level
+	//loaded from a keyframe would.
+	flow_fields_.clear();
 
-	solid_chars_.clear();
+	players_.clear();
+	foreach(const entity_ptr& e, snapshot.players) {
+		players_.push_back(map_entity(entity_map, e));
+	}
+
+	player_ = map_entity(entity_map, snapshot.player);
+
+	groups_.clear();
+	foreach(const entity_group& g, snapshot.groups) {
+		groups_.push_back(entity_group());
+		foreach(const entity_ptr& e, g) {
+			groups_.back().push_back(map_entity(entity_map, e));
+		}
+	}
+
+	last_touched_player_ = map_entity(entity_map, snapshot.last_touched_player);
+	active_chars_.clear();
 
 	chars_by_label_.clear();
 	foreach(const entity_ptr& e, chars_) {
@@ -4371,7 +5030,7 @@ void level::restore_from_backup(backup_snapshot& snapshot)
 		}
 	}
 
-	for(const entity_ptr& ch : snapshot.chars) {
+	for(const entity_ptr& ch : chars_) {
 		ch->handle_event(OBJECT_EVENT_LOAD);
 	}
 }
@@ -4393,7 +5052,11 @@ std::vector<entity_ptr> level::trace_past(entity_ptr e, int ncycle)
 
 		foreach(const entity_ptr& ghost, snapshot.chars) {
 			if(ghost->label() == e->label()) {
-				result.push_back(ghost);
+				//snapshots share the copies of characters which didn't
+				//change, so only one of them is needed.
+				if(result.empty() || result.back() != ghost) {
+					result.push_back(ghost);
+				}
 				break;
 			}
 		}
@@ -4440,16 +5103,138 @@ std::vector<entity_ptr> level::predict_future(entity_ptr e, int ncycles)
 	std::cerr << "TOOK " << (SDL_GetTicks() - begin_time) << "ms to TRACE PAST OF " << result.size() << " FRAMES\n";
 
 	backups_.resize(starting_backups);
-	restore_from_backup(*snapshot);
+	restore_from_backup(*snapshot, backups_, backups_.size());
 
 	return result;
 }
 
+PREF_INT(predict_future_ms_per_frame, 4, "Milliseconds to spend each frame moving a copy of the level forward when predicting its future in the background");
+
+namespace {
+struct future_prediction {
+	boost::intrusive_ptr<level> lvl;
+	entity_ptr target;
+	std::vector<entity_ptr> past;
+	level::prediction_callback callback;
+
+	//the state of the copy of the level which is kept apart from the
+	//live level between steps.
+	unsigned int rng_seed;
+	boost::shared_ptr<controls::control_backup_scope> controls;
+	int controls_end;
+};
+
+bool step_future_prediction(boost::shared_ptr<future_prediction> p)
+{
+	disable_flashes_scope flashes_disabled_scope;
+	const controls::control_backup_scope live_controls;
+	p->controls->restore_state();
+
+	const unsigned int live_seed = rng::get_seed();
+	rng::set_seed(p->rng_seed);
+
+	bool done = false;
+	{
+		const current_level_scope level_scope(p->lvl.get());
+		const int begin_time = SDL_GetTicks();
+		while(!done && SDL_GetTicks() - begin_time < g_predict_future_ms_per_frame) {
+			if(p->lvl->cycle() >= p->controls_end) {
+				done = true;
+				break;
+			}
+
+			try {
+				const assert_recover_scope safe_scope;
+				p->lvl->process();
+				p->lvl->backup();
+			} catch(validation_failure_exception&) {
+				std::cerr << "ERROR WHILE PREDICTING FUTURE...\n";
+				done = true;
+			}
+		}
+	}
+
+	p->rng_seed = rng::get_seed();
+	rng::set_seed(live_seed);
+
+	//keep the controls as the copy of the level left them, and let the
+	//live controls be restored.
+	p->controls->cancel();
+	p->controls.reset(new controls::control_backup_scope);
+	if(done) {
+		p->controls->cancel();
+	}
+
+	return done;
+}
+
+void finish_future_prediction(boost::shared_ptr<future_prediction> p)
+{
+	//ghosts come newest first, so the future goes before the past.
+	std::vector<entity_ptr> result = p->lvl->trace_past(p->target, -1);
+	result.insert(result.end(), p->past.begin(), p->past.end());
+
+	std::cerr << "PREDICTED FUTURE OF " << result.size() << " FRAMES IN THE BACKGROUND\n";
+	p->callback(result);
+}
+}
+
+void level::predict_future_async(entity_ptr e, int ncycles, prediction_callback callback)
+{
+	boost::shared_ptr<future_prediction> p(new future_prediction);
+	p->target = e;
+	p->callback = callback;
+	p->past = trace_past(e, -1);
+
+	//the copy shares everything that isn't changed by processing the
+	//level, and gets copies of the characters from a snapshot.
+	p->lvl.reset(new level(*this));
+	p->lvl->backups_.clear();
+	p->lvl->before_pause_controls_backup_.reset();
+	if(water_) {
+		p->lvl->water_.reset(new water(*water_));
+	}
+
+	//solid maps aren't copied with the level, so give the copy the live
+	//level's, which include any changes made with set_solid_area.
+	level& lvl = *p->lvl;
+	lvl.solid_.copy_from(solid_);
+	lvl.standable_.copy_from(standable_);
+	lvl.solid_base_.copy_from(solid_base_);
+	lvl.standable_base_.copy_from(standable_base_);
+
+	//the restore below replaces the characters, but anything else the
+	//copy has which refers to the live level's characters must go.
+	lvl.new_chars_.clear();
+	lvl.chars_immune_from_time_freeze_.clear();
+	lvl.focus_override_.clear();
+	lvl.editor_highlight_.reset();
+	lvl.editor_selection_.clear();
+	for(std::map<std::string, sub_level_data>::iterator i = lvl.sub_levels_.begin(); i != lvl.sub_levels_.end(); ++i) {
+		i->second.objects.clear();
+	}
+
+	//the snapshot isn't recorded, so the characters' backup state and the
+	//rewind history are as they were.
+	const backup_snapshot_ptr snapshot = make_backup_snapshot(true, false);
+	{
+		const current_level_scope level_scope(p->lvl.get());
+		p->lvl->restore_from_backup(*snapshot, backups_, 0);
+	}
+
+	p->rng_seed = rng::get_seed();
+	p->controls.reset(new controls::control_backup_scope);
+	p->controls_end = controls::local_controls_end();
+
+	background_task_pool::submit_incremental(
+	  boost::bind(step_future_prediction, p),
+	  boost::bind(finish_future_prediction, p));
+}
+
 void level::transfer_state_to(level& lvl)
 {
-	backup();
-	lvl.restore_from_backup(*backups_.back());
-	backups_.pop_back();
+	const backup_snapshot_ptr snapshot = make_backup_snapshot(true, false);
+	lvl.restore_from_backup(*snapshot, backups_, 0);
 }
 
 void level::get_tile_layers(std::set<int>* all_layers, std::set<int>* hidden_layers)
@@ -4621,6 +5406,8 @@ void level::build_solid_data_from_sub_levels()
 		solid_.merge(i->second.lvl->solid_, xoffset, yoffset);
 		standable_.merge(i->second.lvl->standable_, xoffset, yoffset);
 	}
+
+	solid_area_changed(boundaries_);
 }
 
 void level::adjust_level_offset(int xoffset, int yoffset)
@@ -4935,6 +5722,109 @@ BENCHMARK(level_solid)
 	}
 }
 
+BENCHMARK_ARG(level_spatial_queries, int nobjects)
+{
+	//benchmark of the queries which find the characters near a point or
+	//in an area of a level full of objects.
+	static std::map<int, level*> levels;
+	level*& lvl = levels[nobjects];
+	const int LevelWidth = 20000, LevelHeight = 4000;
+	if(!lvl) {
+		lvl = new level("empty.cfg");
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+		for(int n = 0; n != nobjects; ++n) {
+			lvl->add_character(entity_ptr(new custom_object("ant_black", rng::generate()%LevelWidth, rng::generate()%LevelHeight, true)));
+		}
+	}
+
+	BENCHMARK_LOOP {
+		const int x = rng::generate()%LevelWidth;
+		const int y = rng::generate()%LevelHeight;
+		lvl->get_characters_in_rect(rect(x, y, 800, 600), 0, 0);
+		lvl->get_characters_at_point(x, y, 0, 0);
+		lvl->set_active_chars();
+	}
+}
+
+BENCHMARK_ARG_CALL(level_spatial_queries, objects_1000, 1000);
+BENCHMARK_ARG_CALL(level_spatial_queries, objects_5000, 5000);
+
+BENCHMARK_ARG(level_backup, bool delta_backups)
+{
+	//benchmark of a cycle of processing and backing up a level of 2000
+	//objects, most of which are inactive at any one time.
+	static std::map<bool, level*> levels;
+	level*& lvl = levels[delta_backups];
+	const int LevelWidth = 20000, LevelHeight = 4000;
+	if(!lvl) {
+		lvl = new level("empty.cfg");
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+		for(int n = 0; n != 2000; ++n) {
+			lvl->add_character(entity_ptr(new custom_object("ant_black", rng::generate()%LevelWidth, rng::generate()%LevelHeight, true)));
+		}
+	}
+
+	const bool old_delta_backups = g_delta_backups;
+	g_delta_backups = delta_backups;
+
+	BENCHMARK_LOOP {
+		lvl->process();
+		lvl->backup();
+	}
+
+	std::cerr << "BACKUPS HOLD " << lvl->num_backup_copies() << " OBJECT COPIES (" << (lvl->num_backup_copies()*sizeof(custom_object))/1024 << "KB)\n";
+
+	g_delta_backups = old_delta_backups;
+}
+
+BENCHMARK_ARG_CALL(level_backup, full_snapshots, false);
+BENCHMARK_ARG_CALL(level_backup, delta_snapshots, true);
+
+BENCHMARK(level_edit_tile)
+{
+	//benchmark of erasing a tile in the middle of a level and putting it
+	//back, as the editor does, including rebuilding the tiles around it.
+	static level* lvl = NULL;
+	static std::map<int, std::vector<std::string> > old_tiles;
+	static int x = 0, y = 0;
+	if(!lvl) {
+		lvl = new level("stairway-to-heaven.cfg");
+		lvl->finish_loading();
+		x = lvl->boundaries().x() + lvl->boundaries().w()/2;
+		y = lvl->boundaries().y() + lvl->boundaries().h()/2;
+		lvl->get_all_tiles_rect(x, y, x, y, old_tiles);
+	}
+
+	BENCHMARK_LOOP {
+		lvl->clear_tile_rect(x, y, x, y);
+		lvl->start_rebuild_tiles_in_background(std::vector<int>());
+		for(std::map<int, std::vector<std::string> >::const_iterator i = old_tiles.begin(); i != old_tiles.end(); ++i) {
+			lvl->add_tile_rect_vector(i->first, x, y, x, y, i->second);
+		}
+		lvl->start_rebuild_tiles_in_background(std::vector<int>());
+		while(tile_rebuild_map[lvl].tile_rebuild_in_progress) {
+			lvl->complete_rebuild_tiles_in_background();
+		}
+	}
+}
+
+BENCHMARK(level_build_tiles)
+{
+	//benchmark of building all the tiles of a large level, as is done
+	//when it's loaded.
+	static level* lvl = NULL;
+	if(!lvl) {
+		lvl = new level("stairway-to-heaven.cfg");
+		lvl->finish_loading();
+	}
+
+	BENCHMARK_LOOP {
+		lvl->rebuild_tiles();
+	}
+}
+
 BENCHMARK(load_nene)
 {
 	BENCHMARK_LOOP {
@@ -27,6 +27,7 @@
 #include <vector>
 
 #include <boost/array.hpp>
+#include <boost/function.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
 
@@ -38,12 +39,15 @@
 #include "color_utils.hpp"
 #include "decimal.hpp"
 #include "entity.hpp"
+#include "entity_grid.hpp"
+#include "flow_field.hpp"
 #include "formula.hpp"
 #include "formula_callable.hpp"
 #include "formula_callable_definition_fwd.hpp"
 #include "geometry.hpp"
 #include "gui_formula_functions.hpp"
 #include "hex_map.hpp"
+#include "hierarchical_pathfinding.hpp"
 #include "isoworld.hpp"
 #include "level_object.hpp"
 #include "level_solid_map.hpp"
@@ -122,10 +126,37 @@ public:
 	bool standable_tile(int x, int y, const surface_info** info=NULL) const;
 	bool solid(int x, int y, const surface_info** info=NULL) const;
 	bool solid(const entity& e, const std::vector<point>& points, const surface_info** info=NULL) const;
+
+	//the number of points in the mask, placed for the entity, which are
+	//solid. If first_only is true, stops at the first one found.
+	int solid_count(const entity& e, const solid_point_mask& mask, bool first_only) const;
 	bool solid(const rect& r, const surface_info** info=NULL) const;
 	bool solid(int xbegin, int ybegin, int w, int h, const surface_info** info=NULL) const;
 	bool may_be_solid_in_rect(const rect& r) const;
+	bool may_be_standable_in_rect(const rect& r) const;
+
+	//the number of pixels from (x,y) moving down (dir=1) or up (dir=-1) to
+	//the first pixel which is solid, or standable, or -1 if there is none
+	//within max_search pixels. If 'value' is false, finds the first pixel
+	//which isn't. These look at the level a tile column at a time, so are
+	//much faster than probing pixels one by one.
+	int solid_distance(int x, int y, int dir, int max_search, bool value=true) const;
+	int standable_distance(int x, int y, int dir, int max_search, bool value=true) const;
+
+	//the ground level and slope of the standable pixels around a point, as
+	//level_solid_map::ground_level() and ground_slope() give them.
+	int ground_level(int x, int y, int max_search) const;
+	bool ground_slope(int x, int y, int range, int* rise) const;
 	void set_solid_area(const rect& r, bool solid);
+
+	//the graph used to find long paths across the level quickly, which is
+	//invalidated wherever the level's solidity changes.
+	pathfinding::hierarchical_graph& hierarchical_path_graph() const { return hierarchical_path_graph_; }
+
+	//the flow fields agents on the level use to find their way to shared
+	//goals. They are searched a slice at a time as the level is processed.
+	pathfinding::flow_field_cache& flow_fields() const { return flow_fields_; }
+
 	entity_ptr board(int x, int y) const;
 	const rect& boundaries() const { return boundaries_; }
 	void set_boundaries(const rect& bounds) { boundaries_ = bounds; }
@@ -310,8 +341,11 @@ public:
 
 	const std::vector<entity_ptr>& get_active_chars() const { return active_chars_; }
 	const std::vector<entity_ptr>& get_chars() const { return chars_; }
-	const std::vector<entity_ptr>& get_solid_chars() const;
-	void swap_chars(std::vector<entity_ptr>& v) { chars_.swap(v); solid_chars_.clear(); }
+
+	//appends the solid and platform characters whose solid or platform
+	//area might intersect r, in the order they appear in get_chars().
+	void get_solid_chars_in_rect(const rect& r, std::vector<entity*>& result) const;
+	void swap_chars(std::vector<entity_ptr>& v) { chars_.swap(v); char_grid_.invalidate(); solid_grid_.invalidate(); }
 	int num_active_chars() const { return active_chars_.size(); }
 
 	void begin_movement_script(const std::string& name, entity& e);
@@ -328,6 +362,15 @@ public:
 	void reverse_one_cycle();
 	void reverse_to_cycle(int ncycle);
 
+	//the number of distinct character copies held by the backups.
+	int num_backup_copies() const;
+
+	//writes the hash of each object's state at a cycle, if it was recent
+	//enough to still be known, along with the state of each object now.
+	//When a multiplayer game gets out of sync the files written by each
+	//machine can be compared with the diff_desync utility.
+	void dump_desync_state(int cycle) const;
+
 	void transfer_state_to(level& lvl);
 
 	//gets historical 'shadows' of a given object back to the given cycle
@@ -335,6 +378,13 @@ public:
 
 	std::vector<entity_ptr> predict_future(entity_ptr e, int ncycles);
 
+	//like predict_future(), but runs the level forward on a copy of its
+	//state a few cycles at a time, each time background_task_pool::pump()
+	//is called, so the level may be used while the prediction runs.
+	//callback is given the result once it's complete.
+	typedef boost::function<void(const std::vector<entity_ptr>&)> prediction_callback;
+	void predict_future_async(entity_ptr e, int ncycles, prediction_callback callback);
+
 	bool is_multiplayer() const { return players_.size() > 1; }
 
 	void get_tile_layers(std::set<int>* all_layers, std::set<int>* hidden_layers=NULL);
@@ -437,10 +487,27 @@ private:
 	void draw_layer_solid(int layer, int x, int y, int w, int h) const;
 
 	void rebuild_tiles_rect(const rect& r);
+
+	//rebuilds the tiles built from each layer within an area, splicing
+	//them into tiles_, the solid maps and the blit cache rather than
+	//rebuilding everything.
+	void rebuild_tiles_in_areas(const std::vector<std::pair<int, rect> >& areas);
+	void splice_layer_tiles(int layer, const rect& area, std::set<int>* zorders, bool* solid_colors_changed);
+	void refresh_tile_solids(const rect& area);
+	bool splice_tiles_for_drawing(int zorder, const rect& area);
+
+	//rebuilds the areas of layers changed since they were built. Returns
+	//false if that can't be done and they need rebuilding in full.
+	bool rebuild_dirty_tiles(const std::vector<int>& layers);
+
 	void add_tile_solid(const level_tile& t);
 	void add_solid_rect(int x1, int y1, int x2, int y2, int friction, int traction, int damage, const std::string& info);
 	void add_solid(int x, int y, int friction, int traction, int damage, const std::string& info);
 	void add_standable(int x, int y, int friction, int traction, int damage, const std::string& info);
+
+	//called whenever the solidity of an area of the level changes, to
+	//invalidate what has been built from it.
+	void solid_area_changed(const rect& r);
 	typedef std::pair<int,int> tile_pos;
 
 	std::string id_;
@@ -468,7 +535,11 @@ private:
 	level_solid_map solid_base_;
 	level_solid_map standable_base_;
 
+	mutable pathfinding::hierarchical_graph hierarchical_path_graph_;
+	mutable pathfinding::flow_field_cache flow_fields_;
+
 	bool is_solid(const level_solid_map& map, int x, int y, const surface_info** surf_info) const;
+	bool may_be_solid_in_rect(const level_solid_map& map, const rect& r) const;
 	bool is_solid(const level_solid_map& map, const entity& e, const std::vector<point>& points, const surface_info** surf_info) const;
 
 	void set_solid(level_solid_map& map, int x, int y, int friction, int traction, int damage, const std::string& info, bool solid=true);
@@ -488,12 +559,15 @@ private:
 
 	//tiles sorted by position rather than zorder.
 	mutable std::vector<level_tile> tiles_by_position_;
+
+	//the area of each tile layer changed since its tiles were built.
+	std::map<int, rect> dirty_tile_areas_;
 	std::set<int> layers_;
 	std::set<int> hidden_layers_; //layers hidden in the editor.
 	int highlight_layer_;
 
 	struct layer_blit_info {
-		layer_blit_info() : texture_id(0), xbase(-1), ybase(-1)
+		layer_blit_info() : texture_id(0), xbase(-1), ybase(-1), unused_vertexes(0)
 		{}
 
 		GLuint texture_id;
@@ -521,6 +595,10 @@ private:
 
 		rect tile_positions;
 
+		//the number of blit_vertexes no longer used by any tile, after
+		//tiles have been spliced in.
+		int unused_vertexes;
+
 		//graphics::vbo_array vbo;
 	};
 
@@ -550,7 +628,16 @@ private:
 	std::vector<entity_ptr> chars_;
 	mutable std::vector<entity_ptr> active_chars_;
 	std::vector<entity_ptr> new_chars_;
-	mutable std::vector<entity_ptr> solid_chars_;
+
+	//spatial index of chars_, used to find the characters in an area
+	//without visiting every character. Any change to chars_ must either
+	//be made to the grid too or invalidate it.
+	mutable entity_grid char_grid_;
+	const entity_grid& char_grid() const;
+
+	//spatial index of the solid and platform characters in chars_, kept
+	//in step with chars_ in the same way as char_grid_.
+	mutable entity_grid solid_grid_;
 
 	std::vector<entity_ptr> chars_immune_from_time_freeze_;
 
@@ -637,21 +724,46 @@ private:
 
 	boost::shared_ptr<point> lock_screen_;
 
+	//a snapshot of the level's characters. A keyframe holds a fresh copy
+	//of every character. Other snapshots share the copies of characters
+	//which haven't changed since the previous snapshot, so a shared copy
+	//may still refer to older copies of other characters; 'replaced' lists
+	//the copies which were superseded by this snapshot so those references
+	//can be followed to the right copy.
 	struct backup_snapshot {
 		unsigned int rng_seed;
 		int cycle;
+		bool keyframe;
 		std::vector<entity_ptr> chars;
+		std::vector<std::pair<entity_ptr, entity_ptr> > replaced;
 		std::vector<entity_ptr> players;
 		std::vector<entity_group> groups;
 		entity_ptr player, last_touched_player;
 	};
 
-	void restore_from_backup(backup_snapshot& snapshot);
-
 	typedef boost::shared_ptr<backup_snapshot> backup_snapshot_ptr;
 
+	//copies the level's characters into a new snapshot. A snapshot which
+	//isn't a keyframe shares the copies of characters which haven't
+	//changed since the last one. If 'record' is false the characters'
+	//backup state is left alone, so the snapshot can be used without
+	//affecting later backups; it must then be a keyframe.
+	backup_snapshot_ptr make_backup_snapshot(bool keyframe, bool record);
+
+	//restores the level to a snapshot whose earlier snapshots are the
+	//first history_end snapshots in history.
+	void restore_from_backup(const backup_snapshot& snapshot, const std::deque<backup_snapshot_ptr>& history, size_t history_end);
+
 	std::deque<backup_snapshot_ptr> backups_;
 
+	//the hash of each object's state for recent cycles of multiplayer
+	//games, to find which objects got out of sync.
+	struct cycle_state_hashes {
+		int cycle;
+		std::vector<unsigned int> hashes;
+	};
+	std::deque<cycle_state_hashes> state_hash_history_;
+
 	int editor_tile_updates_frozen_;
 	bool editor_dragging_objects_;
 
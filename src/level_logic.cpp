@@ -85,30 +85,5 @@ int distance_to_cliff(const level& lvl, int xpos, int ypos, int facing)
 
 int find_ground_level(const level& lvl, int xpos, int ypos, int max_search)
 {
-	if(lvl.standable(xpos, ypos)) {
-		--ypos;
-		while(lvl.standable(xpos, ypos) && --max_search > 0) {
-			--ypos;
-		}
-
-		if(!max_search) {
-			return INT_MIN;
-		}
-
-		return ypos + 1;
-	} else {
-		//search both up and down, since in the case of a platform the
-		//ground may be above us.
-		for(int n = 1; n < max_search; ++n) {
-			if(lvl.standable(xpos, ypos + n)) {
-				return ypos + n - 1;
-			}
-
-			if(lvl.standable(xpos, ypos - n) && !lvl.standable(xpos, ypos - n - 1)) {
-				return ypos - n;
-			}
-		}
-
-		return INT_MIN;
-	}
+	return lvl.ground_level(xpos, ypos, max_search);
 }
@@ -62,6 +62,7 @@
 #include "player_info.hpp"
 #include "preferences.hpp"
 #include "raster.hpp"
+#include "replay.hpp"
 #include "settings_dialog.hpp"
 #include "sound.hpp"
 #include "stats.hpp"
@@ -78,6 +79,7 @@ namespace {
 PREF_BOOL(allow_debug_console_clicking, true, "Allow clicking on objects in the debug console to select them");
 PREF_BOOL(reload_modified_objects, false, "Reload object definitions when their file is modified on disk");
 PREF_INT(mouse_drag_threshold, 1000, "Threshold for how much motion can take place in a mouse drag");
+PREF_STRING(record_replay, "", "Record a replay of the level being played to this file. When moving to another level the file is replaced with a replay of the new level");
 
 level_runner* current_level_runner = NULL;
 
@@ -758,12 +760,15 @@ level_runner::level_runner(boost::intrusive_ptr<level>& lvl, std::string& level_
 	pause_time_ = -global_pause_time;
 	mouse_clicking_ = false;
 	mouse_drag_count_ = 0;
+	replay_recording_ = false;
 }
 
 void level_runner::start_editor()
 {
 #ifndef NO_EDITOR
 	if(!editor_) {
+		stop_replay_recording();
+
 		controls::control_backup_scope ctrl_backup;
 		editor_ = editor::get_editor(lvl_->id().c_str());
 		editor_resolution_manager_.reset(new editor_resolution_manager(editor_->xres(), editor_->yres()));
@@ -797,6 +802,7 @@ void level_runner::close_editor()
 	history_slider_.reset();
 	history_button_.reset();
 	history_trails_.clear();
+	history_trails_prediction_.reset();
 	editor_resolution_manager_.reset();
 	lvl_->mutate_value("zoom", variant(1));
 	lvl_->set_editor(false);
@@ -841,6 +847,7 @@ bool level_runner::play_level()
 			reversing = false;
 			bool res = play_cycle();
 			if(!res) {
+				stop_replay_recording();
 				return quit_;
 			}
 
@@ -850,9 +857,38 @@ bool level_runner::play_level()
 		}
 	}
 
+	stop_replay_recording();
 	return quit_;
 }
 
+void level_runner::update_replay_recording()
+{
+	if(g_record_replay.empty()) {
+		return;
+	}
+
+	if(replay_recorder_ && &replay_recorder_->get_level() != lvl_.get()) {
+		stop_replay_recording();
+		replay_recorder_.reset();
+	}
+
+	//replays only hold the local player's controls, and editing the
+	//level would make them meaningless.
+	if(!replay_recorder_ && editor_ == NULL && controls::num_players() == 1) {
+		replay_recorder_.reset(new replay::recorder(*lvl_));
+		replay_recording_ = true;
+	}
+}
+
+void level_runner::stop_replay_recording()
+{
+	if(replay_recording_) {
+		sys::write_file(g_record_replay, replay_recorder_->write().write_json());
+		std::cerr << "WROTE REPLAY OF " << replay_recorder_->num_cycles() << " CYCLES OF " << replay_recorder_->get_level().id() << " TO " << g_record_replay << "\n";
+		replay_recording_ = false;
+	}
+}
+
 namespace {
 
 std::set<std::string> g_levels_modified;
@@ -930,7 +966,12 @@ bool level_runner::play_cycle()
 			background::load_modified_backgrounds();
 		}
 
-		if(history_trails_.empty() == false && (tile_rebuild_state_id_ != level::tile_rebuild_state_id() || history_trails_state_id_ != editor_->level_state_id() || object_reloads_state_id_ != custom_object_type::num_object_reloads())) {
+		if(history_trails_prediction_ && history_trails_prediction_->finished) {
+			history_trails_.swap(history_trails_prediction_->trails);
+			history_trails_prediction_.reset();
+		}
+
+		if((history_trails_.empty() == false || history_trails_prediction_) && (tile_rebuild_state_id_ != level::tile_rebuild_state_id() || history_trails_state_id_ != editor_->level_state_id() || object_reloads_state_id_ != custom_object_type::num_object_reloads())) {
 			update_history_trails();
 		}
 
@@ -1558,6 +1599,8 @@ bool level_runner::play_cycle()
 		if (!paused && pause_stack == 0) {
 			const int start_process = SDL_GetTicks();
 
+			update_replay_recording();
+
 			try {
 				debug_console::process_graph();
 				lvl_->process();
@@ -1565,6 +1608,10 @@ bool level_runner::play_cycle()
 				handle_pause_game_result(e.result);
 			}
 
+			if(replay_recording_) {
+				replay_recorder_->record_cycle();
+			}
+
 			const int process_time = SDL_GetTicks() - start_process;
 			next_process_ += process_time;
 			current_perf.process = process_time;
@@ -1797,6 +1844,8 @@ void level_runner::toggle_pause()
 
 void level_runner::reverse_cycle()
 {
+	stop_replay_recording();
+
 	const int begin_time = SDL_GetTicks();
 	lvl_->reverse_one_cycle();
 	lvl_->set_active_chars();
@@ -1872,6 +1921,7 @@ void level_runner::init_history_slider()
 		history_slider_.reset();
 		history_button_.reset();
 		history_trails_.clear();
+		history_trails_prediction_.reset();
 	}
 }
 
@@ -1905,14 +1955,27 @@ void level_runner::on_history_change(double value)
 
 void level_runner::toggle_history_trails()
 {
-	if(history_trails_.empty() && lvl_->player()) {
+	if(history_trails_.empty() && !history_trails_prediction_ && lvl_->player()) {
 		update_history_trails();
 	} else {
 		history_trails_.clear();
+		history_trails_prediction_.reset();
 		history_trails_label_.clear();
 	}
 }
 
+namespace {
+void receive_history_trails(boost::weak_ptr<history_trails_prediction> target, const std::vector<entity_ptr>& trails)
+{
+	//the trails are dropped if they were cancelled or superseded.
+	boost::shared_ptr<history_trails_prediction> result = target.lock();
+	if(result) {
+		result->trails = trails;
+		result->finished = true;
+	}
+}
+}
+
 void level_runner::update_history_trails()
 {
 	entity_ptr e;
@@ -1929,7 +1992,8 @@ void level_runner::update_history_trails()
 		const int last_frame = controls::local_controls_end();
 
 		const int ncycles = (last_frame - first_frame) + 1;
-		history_trails_ = lvl_->predict_future(e, ncycles);
+		history_trails_prediction_.reset(new history_trails_prediction);
+		lvl_->predict_future_async(e, ncycles, boost::bind(receive_history_trails, boost::weak_ptr<history_trails_prediction>(history_trails_prediction_), _1));
 		history_trails_state_id_ = editor_->level_state_id();
 		object_reloads_state_id_ = custom_object_type::num_object_reloads();
 		tile_rebuild_state_id_ = level::tile_rebuild_state_id();
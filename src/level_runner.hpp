@@ -21,12 +21,14 @@
 
 #include <boost/intrusive_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "button.hpp"
 #include "debug_console.hpp"
 #include "geometry.hpp"
 #include "level.hpp"
 #include "pause_game_dialog.hpp"
+#include "replay.hpp"
 #include "slider.hpp"
 
 //an exception which is thrown if we go through a portal which takes us
@@ -38,6 +40,16 @@ struct multiplayer_exception {
 class editor;
 struct editor_resolution_manager;
 
+//the trails of an object predicted in the background by the editor.
+struct history_trails_prediction {
+	history_trails_prediction() : finished(false)
+	{}
+
+	//set once the prediction is done, even if it found no trails.
+	bool finished;
+	std::vector<entity_ptr> trails;
+};
+
 class level_runner {
 public:
 	static level_runner* get_current();
@@ -72,6 +84,12 @@ private:
 	void close_editor();
 	void reverse_cycle();
 	void handle_pause_game_result(PAUSE_GAME_RESULT result);
+
+	//starts recording the level being played if recording replays is
+	//enabled, or moves the recording on to a new level.
+	void update_replay_recording();
+	//writes out the replay being recorded and stops recording it.
+	void stop_replay_recording();
 	typedef boost::intrusive_ptr<level> level_ptr;
 	level_ptr& lvl_;
 	std::string& level_cfg_;
@@ -94,6 +112,9 @@ private:
 	int start_time_;
 	int pause_time_;
 
+	boost::scoped_ptr<replay::recorder> replay_recorder_;
+	bool replay_recording_;
+
 	point last_stats_point_;
 	std::string last_stats_point_level_;
 	bool handle_mouse_events(const SDL_Event &event);
@@ -118,6 +139,10 @@ private:
 	gui::slider_ptr history_slider_;
 	gui::button_ptr history_button_;
 	std::vector<entity_ptr> history_trails_;
+
+	//where the trails being predicted in the background are put when
+	//they're ready, replacing history_trails_.
+	boost::shared_ptr<history_trails_prediction> history_trails_prediction_;
 	std::string history_trails_label_;
 	int history_trails_state_id_;
 	int object_reloads_state_id_;
@@ -14,12 +14,18 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <iostream>
 #include <set>
 
+#include <limits.h>
+
+#include "asserts.hpp"
 #include "foreach.hpp"
 #include "level_solid_map.hpp"
 #include "preferences.hpp"
+#include "random.hpp"
+#include "unit_test.hpp"
 
 namespace {
 void merge_surface_info(surface_info& a, const surface_info& b)
@@ -39,6 +45,42 @@ const std::string* surface_info::get_info_str(const std::string& key)
 	return &*info_set.insert(key).first;
 }
 
+void tile_solid_info::set_pixel(int x, int y, bool value)
+{
+	const tile_column column_mask = tile_column(1) << y;
+	const tile_row row_mask = tile_row(1) << x;
+	if(value) {
+		bitmap.set(y*TileSize + x);
+		columns[x] |= column_mask;
+		rows[y] |= row_mask;
+	} else {
+		bitmap.reset(y*TileSize + x);
+		columns[x] &= ~column_mask;
+		rows[y] &= ~row_mask;
+	}
+}
+
+void tile_solid_info::set_all_pixels()
+{
+	bitmap.set();
+	std::fill(columns.begin(), columns.end(), full_mask());
+	std::fill(rows.begin(), rows.end(), full_mask());
+}
+
+void tile_solid_info::merge_pixels(const tile_solid_info& o)
+{
+	bitmap |= o.bitmap;
+	for(int n = 0; n != columns.size(); ++n) {
+		columns[n] |= o.columns[n];
+		rows[n] |= o.rows[n];
+	}
+}
+
+tile_column tile_solid_info::full_mask()
+{
+	return TileSize >= 64 ? ~tile_column(0) : (tile_column(1) << TileSize) - 1;
+}
+
 level_solid_map::level_solid_map()
 {
 }
@@ -61,6 +103,7 @@ tile_solid_info& level_solid_map::insert_or_find(const tile_pos& pos)
 {
 	tile_solid_info** result = insert_raw(pos);
 	if(!*result) {
+		ASSERT_LOG(TileSize <= 64, "Tiles may be at most 64 pixels high to be stored in columns: " << TileSize);
 		*result = new tile_solid_info;
 	}
 
@@ -135,6 +178,231 @@ const tile_solid_info* level_solid_map::find(const tile_pos& pos) const
 	}
 }
 
+tile_column level_solid_map::column_at(int x, int y, int* row) const
+{
+	tile_pos pos(x/TileSize, y/TileSize);
+	x = x%TileSize;
+	y = y%TileSize;
+	if(x < 0) {
+		pos.first--;
+		x += TileSize;
+	}
+
+	if(y < 0) {
+		pos.second--;
+		y += TileSize;
+	}
+
+	*row = y;
+
+	const tile_solid_info* info = find(pos);
+	return info ? info->column(x) : 0;
+}
+
+namespace {
+int lowest_set_bit(tile_column n)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(n);
+#else
+	int result = 0;
+	while((n&1) == 0) {
+		n >>= 1;
+		++result;
+	}
+	return result;
+#endif
+}
+
+int count_set_bits(uint64_t n)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(n);
+#else
+	int result = 0;
+	while(n) {
+		n &= n - 1;
+		++result;
+	}
+	return result;
+#endif
+}
+
+int highest_set_bit(tile_column n)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(n);
+#else
+	int result = 63;
+	while((n&(tile_column(1) << 63)) == 0) {
+		n <<= 1;
+		--result;
+	}
+	return result;
+#endif
+}
+}
+
+int level_solid_map::column_distance(const level_solid_map* other, int x, int y, int dir, int max_search, bool value) const
+{
+	int distance = 0;
+	while(distance <= max_search) {
+		int row = 0;
+		tile_column column = column_at(x, y + distance*dir, &row);
+		if(other) {
+			column |= other->column_at(x, y + distance*dir, &row);
+		}
+
+		if(!value) {
+			column = ~column & tile_solid_info::full_mask();
+		}
+
+		if(dir > 0) {
+			column &= ~tile_column(0) << row;
+			if(column) {
+				distance += lowest_set_bit(column) - row;
+				break;
+			}
+
+			distance += TileSize - row;
+		} else {
+			column &= row >= 63 ? ~tile_column(0) : (tile_column(1) << (row + 1)) - 1;
+			if(column) {
+				distance += row - highest_set_bit(column);
+				break;
+			}
+
+			distance += row + 1;
+		}
+	}
+
+	return distance <= max_search ? distance : -1;
+}
+
+int level_solid_map::ground_level(const level_solid_map* other, int x, int y, int max_search) const
+{
+	if(max_search < 1) {
+		return INT_MIN;
+	}
+
+	if(column_distance(other, x, y, 1, 0, true) == 0) {
+		//find the top of the ground we are in.
+		const int height = column_distance(other, x, y - 1, -1, max_search - 1, false);
+		if(height == -1) {
+			return INT_MIN;
+		}
+
+		return y - height;
+	}
+
+	//search both up and down, since in the case of a platform the ground
+	//may be above us. Searching down is preferred if the ground is the
+	//same distance away in both directions.
+	int down = column_distance(other, x, y + 1, 1, max_search - 2, true);
+	if(down != -1) {
+		down += 1;
+	}
+
+	int up = column_distance(other, x, y - 1, -1, max_search - 2, true);
+	if(up != -1) {
+		up += 1;
+
+		//the ground above us is at the top of the solid we find.
+		const int height = column_distance(other, x, y - up - 1, -1, max_search - 1 - up, false);
+		up = height == -1 ? -1 : up + height;
+	}
+
+	if(down != -1 && (up == -1 || down <= up)) {
+		return y + down - 1;
+	}
+
+	if(up != -1) {
+		return y - up;
+	}
+
+	return INT_MIN;
+}
+
+bool level_solid_map::ground_slope(const level_solid_map* other, int x, int y, int range, int* rise) const
+{
+	const int before = ground_level(other, x - range, y, range + 1);
+	const int after = ground_level(other, x + range, y, range + 1);
+	if(before == INT_MIN || after == INT_MIN) {
+		return false;
+	}
+
+	*rise = after - before;
+	return true;
+}
+
+uint64_t level_solid_map::row_bits(int x, int y) const
+{
+	tile_pos pos(x/TileSize, y/TileSize);
+	x = x%TileSize;
+	y = y%TileSize;
+	if(x < 0) {
+		pos.first--;
+		x += TileSize;
+	}
+
+	if(y < 0) {
+		pos.second--;
+		y += TileSize;
+	}
+
+	uint64_t result = 0;
+	for(int filled = 0; filled < 64; ++pos.first) {
+		const tile_solid_info* info = find(pos);
+		if(info) {
+			result |= (info->row(y) >> x) << filled;
+		}
+
+		filled += TileSize - x;
+		x = 0;
+	}
+
+	return result;
+}
+
+int level_solid_map::count_solid(const uint64_t* mask, int words_per_row, int height, int x, int y, bool first_only) const
+{
+	int result = 0;
+	for(int row = 0; row != height; ++row) {
+		for(int word = 0; word != words_per_row; ++word) {
+			const uint64_t bits = *mask++;
+			if(!bits) {
+				continue;
+			}
+
+			const uint64_t solid = bits & row_bits(x + word*64, y + row);
+			if(solid) {
+				if(first_only) {
+					return 1;
+				}
+
+				result += count_set_bits(solid);
+			}
+		}
+	}
+
+	return result;
+}
+
+bool level_solid_map::any_solid(int x, int y, int w, int h) const
+{
+	for(int ypos = y; ypos < y + h; ++ypos) {
+		for(int xpos = x; xpos < x + w; xpos += 64) {
+			const int width = std::min(64, x + w - xpos);
+			const uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+			if(row_bits(xpos, ypos)&mask) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
 void level_solid_map::erase(const tile_pos& pos)
 {
 	tile_solid_info** info = insert_raw(pos);
@@ -168,6 +436,33 @@ void level_solid_map::clear()
 	negative_rows_.clear();
 }
 
+void level_solid_map::copy_from(const level_solid_map& m)
+{
+	if(&m == this) {
+		return;
+	}
+
+	clear();
+	positive_rows_ = m.positive_rows_;
+	negative_rows_ = m.negative_rows_;
+
+	for(int n = 0; n != 2; ++n) {
+		foreach(row& r, n == 0 ? positive_rows_ : negative_rows_) {
+			foreach(tile_solid_info*& info, r.positive_cells) {
+				if(info) {
+					info = new tile_solid_info(*info);
+				}
+			}
+
+			foreach(tile_solid_info*& info, r.negative_cells) {
+				if(info) {
+					info = new tile_solid_info(*info);
+				}
+			}
+		}
+	}
+}
+
 void level_solid_map::merge(const level_solid_map& map, int xoffset, int yoffset)
 {
 	for(int n = 0; n != map.negative_rows_.size(); ++n) {
@@ -182,7 +477,7 @@ void level_solid_map::merge(const level_solid_map& map, int xoffset, int yoffset
 			dst.all_solid = dst.all_solid || src->all_solid;
 			merge_surface_info(dst.info, src->info);
 			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+				dst.merge_pixels(*src);
 			}
 		}
 
@@ -197,7 +492,7 @@ void level_solid_map::merge(const level_solid_map& map, int xoffset, int yoffset
 			dst.all_solid = dst.all_solid || src->all_solid;
 			merge_surface_info(dst.info, src->info);
 			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+				dst.merge_pixels(*src);
 			}
 		}
 	}
@@ -214,7 +509,7 @@ void level_solid_map::merge(const level_solid_map& map, int xoffset, int yoffset
 			dst.all_solid = dst.all_solid || src->all_solid;
 			merge_surface_info(dst.info, src->info);
 			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+				dst.merge_pixels(*src);
 			}
 		}
 
@@ -230,8 +525,175 @@ void level_solid_map::merge(const level_solid_map& map, int xoffset, int yoffset
 			dst.all_solid = dst.all_solid || src->all_solid;
 			merge_surface_info(dst.info, src->info);
 			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+				dst.merge_pixels(*src);
+			}
+		}
+	}
+}
+
+namespace {
+int floor_tile(int n)
+{
+	return n >= 0 ? n/TileSize : -((-n + TileSize - 1)/TileSize);
+}
+
+bool test_pixel_solid(const level_solid_map& map, int x, int y)
+{
+	int row = 0;
+	return ((map.column_at(x, y, &row) >> row)&1) != 0;
+}
+}
+
+UNIT_TEST(level_solid_map_column_distance)
+{
+	//checks searching up and down a column against probing pixel by pixel,
+	//across tile boundaries and into empty and fully solid tiles.
+	level_solid_map map;
+	for(int n = 0; n != 200; ++n) {
+		const int x = rng::generate()%(TileSize*4) - TileSize*2;
+		const int y = rng::generate()%(TileSize*8) - TileSize*4;
+		const tile_pos pos(floor_tile(x), floor_tile(y));
+		tile_solid_info& info = map.insert_or_find(pos);
+		info.set_pixel(x - pos.first*TileSize, y - pos.second*TileSize, true);
+	}
+
+	map.insert_or_find(tile_pos(0, 5)).all_solid = true;
+	map.insert_or_find(tile_pos(-1, -6)).all_solid = true;
+
+	for(int x = -TileSize*2; x < TileSize*2; ++x) {
+		for(int y = -TileSize*6; y < TileSize*6; y += 7) {
+			for(int dir = -1; dir <= 1; dir += 2) {
+				for(int value = 0; value != 2; ++value) {
+					const int max_search = TileSize*3;
+					int expected = -1;
+					for(int n = 0; n <= max_search; ++n) {
+						if(test_pixel_solid(map, x, y + n*dir) == (value != 0)) {
+							expected = n;
+							break;
+						}
+					}
+
+					CHECK_EQ(map.column_distance(NULL, x, y, dir, max_search, value != 0), expected);
+				}
 			}
 		}
 	}
 }
+
+UNIT_TEST(level_solid_map_count_solid)
+{
+	//checks counting the solid pixels under masks a word at a time against
+	//testing each pixel, with masks wider than a word placed across tile
+	//boundaries.
+	level_solid_map map;
+	for(int n = 0; n != 2000; ++n) {
+		const int x = rng::generate()%(TileSize*8) - TileSize*4;
+		const int y = rng::generate()%(TileSize*4) - TileSize*2;
+		const tile_pos pos(floor_tile(x), floor_tile(y));
+		map.insert_or_find(pos).set_pixel(x - pos.first*TileSize, y - pos.second*TileSize, true);
+	}
+
+	map.insert_or_find(tile_pos(1, 0)).all_solid = true;
+
+	for(int n = 0; n != 100; ++n) {
+		const int width = 1 + rng::generate()%100;
+		const int height = 1 + rng::generate()%40;
+		const int words_per_row = (width + 63)/64;
+		std::vector<uint64_t> mask(words_per_row*height);
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				if(rng::generate()%3 == 0) {
+					mask[y*words_per_row + x/64] |= uint64_t(1) << (x%64);
+				}
+			}
+		}
+
+		const int xpos = rng::generate()%(TileSize*8) - TileSize*5;
+		const int ypos = rng::generate()%(TileSize*4) - TileSize*3;
+
+		int expected = 0;
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				if((mask[y*words_per_row + x/64] >> (x%64))&1) {
+					expected += test_pixel_solid(map, xpos + x, ypos + y);
+				}
+			}
+		}
+
+		CHECK_EQ(map.count_solid(&mask[0], words_per_row, height, xpos, ypos, false), expected);
+		CHECK_EQ(map.count_solid(&mask[0], words_per_row, height, xpos, ypos, true), expected ? 1 : 0);
+	}
+}
+
+UNIT_TEST(level_solid_map_any_solid)
+{
+	level_solid_map map;
+	for(int n = 0; n != 200; ++n) {
+		const int x = rng::generate()%(TileSize*8) - TileSize*4;
+		const int y = rng::generate()%(TileSize*4) - TileSize*2;
+		const tile_pos pos(floor_tile(x), floor_tile(y));
+		map.insert_or_find(pos).set_pixel(x - pos.first*TileSize, y - pos.second*TileSize, true);
+	}
+
+	for(int n = 0; n != 200; ++n) {
+		const int width = 1 + rng::generate()%100;
+		const int height = 1 + rng::generate()%20;
+		const int xpos = rng::generate()%(TileSize*8) - TileSize*5;
+		const int ypos = rng::generate()%(TileSize*4) - TileSize*3;
+
+		bool expected = false;
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				expected = expected || test_pixel_solid(map, xpos + x, ypos + y);
+			}
+		}
+
+		CHECK_EQ(map.any_solid(xpos, ypos, width, height), expected);
+	}
+}
+
+UNIT_TEST(level_solid_map_ground_slope)
+{
+	//ground going down one pixel for every two across, with a platform
+	//above it.
+	level_solid_map map, platforms;
+	for(int x = 0; x != TileSize*4; ++x) {
+		for(int y = 20 + x/2; y < TileSize*4; ++y) {
+			map.insert_or_find(tile_pos(floor_tile(x), floor_tile(y))).set_pixel(x%TileSize, y%TileSize, true);
+		}
+
+		platforms.insert_or_find(tile_pos(floor_tile(x), 0)).set_pixel(x%TileSize, 4, true);
+	}
+
+	//from above the ground, the ground level is the pixel above it, and
+	//from inside it, its top pixel.
+	CHECK_EQ(map.ground_level(NULL, 30, 20, 40), 34);
+	CHECK_EQ(map.ground_level(NULL, 30, 50, 40), 35);
+	CHECK_EQ(map.ground_level(NULL, 30, 0, 10), INT_MIN);
+	CHECK_EQ(map.ground_level(&platforms, 30, 8, 20), 4);
+
+	int rise = 0;
+	CHECK_EQ(map.ground_slope(NULL, 30, 37, 4, &rise), true);
+	CHECK_EQ(rise, 4);
+	CHECK_EQ(map.ground_slope(NULL, 30, 0, 6, &rise), false);
+}
+
+UNIT_TEST(level_solid_map_copy_from)
+{
+	level_solid_map map;
+	map.insert_or_find(tile_pos(1, -2)).set_pixel(3, 4, true);
+	map.insert_or_find(tile_pos(-1, 2)).set_all_pixels();
+	map.insert_or_find(tile_pos(-1, 2)).all_solid = true;
+
+	level_solid_map copy;
+	copy.insert_or_find(tile_pos(5, 5)).set_pixel(0, 0, true);
+	copy.copy_from(map);
+	CHECK(copy.find(tile_pos(5, 5)) == NULL, "copy kept its old tiles");
+	CHECK(copy.find(tile_pos(1, -2)) != map.find(tile_pos(1, -2)), "copy shares tiles with the original");
+	CHECK_EQ(copy.find(tile_pos(1, -2))->bitmap, map.find(tile_pos(1, -2))->bitmap);
+	CHECK_EQ(copy.find(tile_pos(-1, 2))->all_solid, true);
+
+	//the copy doesn't change with the original.
+	map.insert_or_find(tile_pos(1, -2)).set_pixel(5, 5, true);
+	CHECK_EQ(copy.find(tile_pos(1, -2))->bitmap.test(5*TileSize + 5), false);
+}
@@ -21,6 +21,8 @@
 #include <map>
 #include <vector>
 
+#include <stdint.h>
+
 #ifndef MAX_TILE_SIZE
 #define MAX_TILE_SIZE 64
 #endif
@@ -41,10 +43,30 @@ struct surface_info {
 	static const std::string* get_info_str(const std::string& key);
 };
 
+//a column of a tile, with bit n set if the pixel in row n is solid. Tiles
+//are never more than 64 pixels high so a column always fits in a word.
+typedef uint64_t tile_column;
+
+//a row of a tile, with bit n set if the pixel in column n is solid.
+typedef uint64_t tile_row;
+
 struct tile_solid_info {
-	tile_solid_info() : bitmap(TileSize*TileSize), all_solid(false)
+	tile_solid_info() : bitmap(TileSize*TileSize), columns(TileSize), rows(TileSize), all_solid(false)
 	{}
+
+	//the pixels of the tile should only be changed through these functions
+	//so the rows and columns stay in sync with the bitmap.
+	void set_pixel(int x, int y, bool value);
+	void set_all_pixels();
+	void merge_pixels(const tile_solid_info& o);
+
+	tile_column column(int x) const { return all_solid ? full_mask() : columns[x]; }
+	tile_row row(int y) const { return all_solid ? full_mask() : rows[y]; }
+	static tile_column full_mask();
+
 	tile_bitmap bitmap;
+	std::vector<tile_column> columns;
+	std::vector<tile_row> rows;
 	surface_info info;
 	bool all_solid;
 };
@@ -61,10 +83,48 @@ public:
 	void clear();
 
 	void merge(const level_solid_map& m, int xoffset, int yoffset);
+
+	//makes this map a copy of m. Copying a map with the copy constructor
+	//or assignment gives an empty map, as copies of levels rebuild theirs.
+	void copy_from(const level_solid_map& m);
+
+	//the column of the tile containing the pixel (x,y), or 0 if there is
+	//no tile there. 'row' is set to the row (x,y) is in within the column.
+	tile_column column_at(int x, int y, int* row) const;
+
+	//the number of pixels from (x,y), moving in direction dir (1 for down,
+	//-1 for up), to the first pixel whose solidity is 'value', treating
+	//pixels solid in 'other' as solid too if it's given. Returns -1 if
+	//there is no such pixel within max_search pixels.
+	int column_distance(const level_solid_map* other, int x, int y, int dir, int max_search, bool value) const;
+
+	//the y of the top of the ground nearest (x,y) in column x, as
+	//find_ground_level() finds it, looking up to max_search pixels away.
+	//Returns INT_MIN if there's no ground that close.
+	int ground_level(const level_solid_map* other, int x, int y, int max_search) const;
+
+	//the slope of the ground around x, as how much lower the ground is
+	//'range' pixels after x than 'range' pixels before it. Returns false
+	//if the ground can't be found at either end.
+	bool ground_slope(const level_solid_map* other, int x, int y, int range, int* rise) const;
+
+	//the number of solid pixels among the set bits of a mask placed with
+	//its top left corner at (x,y). The mask is 'height' rows of
+	//'words_per_row' words each, with bit n of a row being n pixels from
+	//its left. Rows of the level are read a word at a time. If first_only is
+	//true, returns 1 as soon as any solid pixel is found.
+	int count_solid(const uint64_t* mask, int words_per_row, int height, int x, int y, bool first_only) const;
+
+	//true if any pixel in the w by h area with its top left corner at
+	//(x,y) is solid.
+	bool any_solid(int x, int y, int w, int h) const;
 private:
 
 	tile_solid_info** insert_raw(const tile_pos& pos);
 
+	//the 64 pixels of row y of the level starting at x.
+	uint64_t row_bits(int x, int y) const;
+
 	struct row {
 		std::vector<tile_solid_info*> positive_cells, negative_cells;
 	};
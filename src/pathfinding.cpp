@@ -14,9 +14,15 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <limits>
 #include <queue>
 
+#include <boost/dynamic_bitset.hpp>
+
 #include "math.h"
+#include "asserts.hpp"
+#include "foreach.hpp"
 #include "level.hpp"
 #include "pathfinding.hpp"
 #include "tile_map.hpp"
@@ -213,10 +219,7 @@ point get_midpoint(const point& src_pt, const int tile_size_x, const int tile_si
 }
 
 variant point_as_variant_list(const point& pt) {
-	std::vector<variant> v;
-	v.push_back(variant(pt.x));
-	v.push_back(variant(pt.y));
-	return variant(&v);
+	return variant::create_list(variant(pt.x), variant(pt.y));
 }
 
 // Calculate the neighbour set of rectangles from a point.
@@ -278,6 +281,13 @@ void clip_pt_to_rect(point& pt, const rect& r) {
 	if(pt.y > r.y2()) {pt.y = r.y2();}
 }
 
+//moves a point to the nearest pixel inside a rect, whose right and
+//bottom edges are outside it.
+void clip_pt_inside_rect(point& pt, const rect& r) {
+	pt.x = std::min(std::max(pt.x, r.x()), r.x2() - 1);
+	pt.y = std::min(std::max(pt.y, r.y()), r.y2() - 1);
+}
+
 template<typename N, typename T>
 bool graph_node_cmp(const typename graph_node<N,T>::graph_node_ptr& lhs, 
 	const typename graph_node<N,T>::graph_node_ptr& rhs) {
@@ -461,6 +471,507 @@ variant path_cost_search(weighted_directed_graph_ptr wg,
 	return variant(&reachable);
 }
 
+namespace {
+//the cell a coordinate is in, rounding towards negative infinity.
+int grid_coord(int n, int cell_size)
+{
+	if(n >= 0) {
+		return n/cell_size;
+	} else {
+		return -((-n + cell_size - 1)/cell_size);
+	}
+}
+}
+
+occupancy_grid::occupancy_grid(const level& lvl, const rect& area, int cell_width, int cell_height)
+  : cell_width_(cell_width), cell_height_(cell_height)
+{
+	ASSERT_LOG(cell_width > 0 && cell_height > 0, "Illegal occupancy grid cell size: " << cell_width << "x" << cell_height);
+	xbase_ = grid_coord(area.x(), cell_width);
+	ybase_ = grid_coord(area.y(), cell_height);
+	width_ = area.w() > 0 ? grid_coord(area.x2() - 1, cell_width) - xbase_ + 1 : 0;
+	height_ = area.h() > 0 ? grid_coord(area.y2() - 1, cell_height) - ybase_ + 1 : 0;
+
+	blocked_.resize(width_*height_);
+	for(int y = 0; y != height_; ++y) {
+		for(int x = 0; x != width_; ++x) {
+			const rect r((xbase_ + x)*cell_width, (ybase_ + y)*cell_height, cell_width, cell_height);
+			blocked_[y*width_ + x] = lvl.may_be_solid_in_rect(r) && lvl.solid(r);
+		}
+	}
+}
+
+occupancy_grid::occupancy_grid(int width, int height, const std::vector<bool>& blocked, int cell_width, int cell_height)
+  : xbase_(0), ybase_(0), width_(width), height_(height),
+    cell_width_(cell_width), cell_height_(cell_height),
+    blocked_(blocked.begin(), blocked.end())
+{
+	ASSERT_LOG(blocked.size() == width*height, "Occupancy grid of " << width << "x" << height << " given " << blocked.size() << " cells");
+}
+
+point occupancy_grid::cell_at(const point& p) const
+{
+	return point(grid_coord(p.x, cell_width_) - xbase_, grid_coord(p.y, cell_height_) - ybase_);
+}
+
+point occupancy_grid::cell_midpoint(const point& cell) const
+{
+	return point((xbase_ + cell.x)*cell_width_ + cell_width_/2,
+	             (ybase_ + cell.y)*cell_height_ + cell_height_/2);
+}
+
+namespace {
+//A binary heap of cell indexes ordered by their f cost. Each cell's
+//position in the heap is kept, so a cell whose cost is lowered can be
+//moved up without searching for it.
+class cell_heap {
+public:
+	cell_heap(const std::vector<double>& f) : f_(f), pos_(f.size(), -1)
+	{}
+
+	bool empty() const { return heap_.empty(); }
+	bool contains(int cell) const { return pos_[cell] >= 0; }
+
+	void push(int cell) {
+		pos_[cell] = heap_.size();
+		heap_.push_back(cell);
+		sift_up(pos_[cell]);
+	}
+
+	//called after the cost of a cell in the heap has been lowered.
+	void decreased(int cell) {
+		sift_up(pos_[cell]);
+	}
+
+	int pop() {
+		const int res = heap_.front();
+		pos_[res] = -1;
+		const int last = heap_.back();
+		heap_.pop_back();
+		if(!heap_.empty()) {
+			heap_.front() = last;
+			pos_[last] = 0;
+			sift_down(0);
+		}
+		return res;
+	}
+private:
+	bool less(int a, int b) const { return f_[heap_[a]] < f_[heap_[b]]; }
+
+	void swap(int a, int b) {
+		std::swap(heap_[a], heap_[b]);
+		pos_[heap_[a]] = a;
+		pos_[heap_[b]] = b;
+	}
+
+	void sift_up(int n) {
+		while(n > 0) {
+			const int parent = (n - 1)/2;
+			if(!less(n, parent)) {
+				break;
+			}
+			swap(n, parent);
+			n = parent;
+		}
+	}
+
+	void sift_down(int n) {
+		const int size = heap_.size();
+		for(;;) {
+			int smallest = n;
+			const int left = n*2 + 1, right = n*2 + 2;
+			if(left < size && less(left, smallest)) {
+				smallest = left;
+			}
+			if(right < size && less(right, smallest)) {
+				smallest = right;
+			}
+			if(smallest == n) {
+				break;
+			}
+			swap(n, smallest);
+			n = smallest;
+		}
+	}
+
+	const std::vector<double>& f_;
+	std::vector<int> heap_;
+	std::vector<int> pos_;
+};
+
+int sign(int n)
+{
+	return n > 0 ? 1 : (n < 0 ? -1 : 0);
+}
+
+//the cost of a single move in the direction (dx, dy).
+double step_cost(const occupancy_grid& grid, int dx, int dy)
+{
+	if(dx && dy) {
+		return sqrt(double(grid.cell_width()*grid.cell_width() + grid.cell_height()*grid.cell_height()));
+	}
+
+	return dx ? grid.cell_width() : grid.cell_height();
+}
+
+//the cost of the cheapest path between two cells if nothing is in the way.
+double octile_distance(const occupancy_grid& grid, int x1, int y1, int x2, int y2)
+{
+	const int dx = abs(x1 - x2);
+	const int dy = abs(y1 - y2);
+	const int diagonal = std::min(dx, dy);
+	return diagonal*step_cost(grid, 1, 1) + (dx - diagonal)*grid.cell_width() + (dy - diagonal)*grid.cell_height();
+}
+
+bool can_move(const occupancy_grid& grid, int x, int y, int dx, int dy)
+{
+	if(grid.blocked(x + dx, y + dy)) {
+		return false;
+	}
+
+	return !dx || !dy || (!grid.blocked(x + dx, y) && !grid.blocked(x, y + dy));
+}
+
+//moves from (x, y) in the direction (dx, dy) until reaching a cell which
+//has to be expanded: the goal, or a cell which is the only optimal way to
+//reach one of its neighbours. Returns false if an obstacle is hit first.
+bool jump(const occupancy_grid& grid, int x, int y, int dx, int dy, const point& goal, point* result)
+{
+	for(;;) {
+		if(grid.blocked(x, y)) {
+			return false;
+		}
+
+		if(x == goal.x && y == goal.y) {
+			*result = point(x, y);
+			return true;
+		}
+
+		if(dx && dy) {
+			point p;
+			if(jump(grid, x + dx, y, dx, 0, goal, &p) || jump(grid, x, y + dy, 0, dy, goal, &p)) {
+				*result = point(x, y);
+				return true;
+			}
+
+			if(grid.blocked(x + dx, y) || grid.blocked(x, y + dy)) {
+				return false;
+			}
+		} else if(dx) {
+			if((!grid.blocked(x, y - 1) && grid.blocked(x - dx, y - 1)) ||
+			   (!grid.blocked(x, y + 1) && grid.blocked(x - dx, y + 1))) {
+				*result = point(x, y);
+				return true;
+			}
+		} else {
+			if((!grid.blocked(x - 1, y) && grid.blocked(x - 1, y - dy)) ||
+			   (!grid.blocked(x + 1, y) && grid.blocked(x + 1, y - dy))) {
+				*result = point(x, y);
+				return true;
+			}
+		}
+
+		x += dx;
+		y += dy;
+	}
+}
+
+//the directions worth searching from a cell reached by moving in the
+//direction (dx, dy). Other neighbours can be reached at least as cheaply
+//without passing through the cell.
+void pruned_directions(const occupancy_grid& grid, int x, int y, int dx, int dy, std::vector<point>& dirs)
+{
+	if(dx && dy) {
+		const bool vertical = !grid.blocked(x, y + dy);
+		const bool horizontal = !grid.blocked(x + dx, y);
+		if(vertical) {
+			dirs.push_back(point(0, dy));
+		}
+		if(horizontal) {
+			dirs.push_back(point(dx, 0));
+		}
+		if(vertical && horizontal) {
+			dirs.push_back(point(dx, dy));
+		}
+	} else if(dx) {
+		const bool up = !grid.blocked(x, y - 1);
+		const bool down = !grid.blocked(x, y + 1);
+		if(!grid.blocked(x + dx, y)) {
+			dirs.push_back(point(dx, 0));
+			if(up) {
+				dirs.push_back(point(dx, -1));
+			}
+			if(down) {
+				dirs.push_back(point(dx, 1));
+			}
+		}
+		if(up) {
+			dirs.push_back(point(0, -1));
+		}
+		if(down) {
+			dirs.push_back(point(0, 1));
+		}
+	} else {
+		const bool left = !grid.blocked(x - 1, y);
+		const bool right = !grid.blocked(x + 1, y);
+		if(!grid.blocked(x, y + dy)) {
+			dirs.push_back(point(0, dy));
+			if(left) {
+				dirs.push_back(point(-1, dy));
+			}
+			if(right) {
+				dirs.push_back(point(1, dy));
+			}
+		}
+		if(left) {
+			dirs.push_back(point(-1, 0));
+		}
+		if(right) {
+			dirs.push_back(point(1, 0));
+		}
+	}
+}
+}
+
+bool grid_find_path(const occupancy_grid& grid, const point& src, const point& dst,
+	std::vector<point>* path, const grid_weight_fn& weight, bool use_jps, double* cost)
+{
+	if(grid.blocked(src.x, src.y) || grid.blocked(dst.x, dst.y)) {
+		return false;
+	}
+
+	const int width = grid.width();
+	const int ncells = width*grid.height();
+	const bool jps = use_jps && !weight;
+
+	std::vector<double> g(ncells, std::numeric_limits<double>::max());
+	std::vector<double> f(ncells);
+	std::vector<int> parent(ncells, -1);
+	boost::dynamic_bitset<> closed(ncells);
+	cell_heap open(f);
+
+	const int start = src.y*width + src.x;
+	const int goal = dst.y*width + dst.x;
+	g[start] = 0.0;
+	f[start] = octile_distance(grid, src.x, src.y, dst.x, dst.y);
+	open.push(start);
+
+	std::vector<point> dirs;
+	while(!open.empty()) {
+		const int current = open.pop();
+		if(current == goal) {
+			break;
+		}
+
+		closed[current] = true;
+		const int x = current%width;
+		const int y = current/width;
+
+		dirs.clear();
+		if(jps && parent[current] != -1) {
+			pruned_directions(grid, x, y, sign(x - parent[current]%width), sign(y - parent[current]/width), dirs);
+		} else {
+			for(int dy = -1; dy <= 1; ++dy) {
+				for(int dx = -1; dx <= 1; ++dx) {
+					if((dx || dy) && can_move(grid, x, y, dx, dy)) {
+						dirs.push_back(point(dx, dy));
+					}
+				}
+			}
+		}
+
+		foreach(const point& dir, dirs) {
+			point next(x + dir.x, y + dir.y);
+			double move_cost;
+			if(jps) {
+				if(!jump(grid, next.x, next.y, dir.x, dir.y, dst, &next)) {
+					continue;
+				}
+				move_cost = std::max(abs(next.x - x), abs(next.y - y))*step_cost(grid, dir.x, dir.y);
+			} else if(weight) {
+				move_cost = weight(point(x, y), next);
+			} else {
+				move_cost = step_cost(grid, dir.x, dir.y);
+			}
+
+			const int n = next.y*width + next.x;
+			if(closed[n]) {
+				continue;
+			}
+
+			const double g_cost = g[current] + move_cost;
+			if(g_cost < g[n]) {
+				g[n] = g_cost;
+				f[n] = g_cost + octile_distance(grid, next.x, next.y, dst.x, dst.y);
+				parent[n] = current;
+				if(open.contains(n)) {
+					open.decreased(n);
+				} else {
+					open.push(n);
+				}
+			}
+		}
+	}
+
+	if(g[goal] == std::numeric_limits<double>::max()) {
+		return false;
+	}
+
+	if(cost) {
+		*cost = g[goal];
+	}
+
+	if(path) {
+		//walk back from the goal, filling in the cells jumped over.
+		path->clear();
+		point p(dst);
+		path->push_back(p);
+		for(int n = goal; parent[n] != -1; n = parent[n]) {
+			const point to(parent[n]%width, parent[n]/width);
+			const int dx = sign(to.x - p.x), dy = sign(to.y - p.y);
+			while(p != to) {
+				p.x += dx;
+				p.y += dy;
+				path->push_back(p);
+			}
+		}
+		std::reverse(path->begin(), path->end());
+	}
+
+	return true;
+}
+
+void grid_distance_map(const occupancy_grid& grid, const point& src, std::vector<double>* distances)
+{
+	const int width = grid.width();
+	distances->assign(width*grid.height(), std::numeric_limits<double>::max());
+	if(grid.blocked(src.x, src.y)) {
+		return;
+	}
+
+	std::vector<double>& g = *distances;
+	boost::dynamic_bitset<> closed(g.size());
+	cell_heap open(g);
+
+	const int start = src.y*width + src.x;
+	g[start] = 0.0;
+	open.push(start);
+
+	while(!open.empty()) {
+		const int current = open.pop();
+		closed[current] = true;
+		const int x = current%width;
+		const int y = current/width;
+		for(int dy = -1; dy <= 1; ++dy) {
+			for(int dx = -1; dx <= 1; ++dx) {
+				if((!dx && !dy) || !can_move(grid, x, y, dx, dy)) {
+					continue;
+				}
+
+				const int n = (y + dy)*width + x + dx;
+				if(closed[n]) {
+					continue;
+				}
+
+				const double g_cost = g[current] + step_cost(grid, dx, dy);
+				if(g_cost < g[n]) {
+					g[n] = g_cost;
+					if(open.contains(n)) {
+						open.decreased(n);
+					} else {
+						open.push(n);
+					}
+				}
+			}
+		}
+	}
+}
+
+namespace {
+//the cost of a move given by an FFL expression of the midpoints of the
+//cells, a and b.
+struct formula_grid_weight {
+	formula_grid_weight(const occupancy_grid& g, game_logic::expression_ptr e, game_logic::map_formula_callable_ptr c)
+	  : grid(&g), expr(e), callable(c),
+	    a(&c->add_direct_access("a")), b(&c->add_direct_access("b"))
+	{}
+
+	double operator()(const point& p1, const point& p2) const {
+		*a = point_as_variant_list(grid->cell_midpoint(p1));
+		*b = point_as_variant_list(grid->cell_midpoint(p2));
+		return expr->evaluate(*callable).as_decimal().as_float();
+	}
+
+	const occupancy_grid* grid;
+	game_logic::expression_ptr expr;
+	game_logic::map_formula_callable_ptr callable;
+	variant* a;
+	variant* b;
+};
+
+bool search_grid_area(const level& lvl, const rect& area, const point& src_pt, const point& dst_pt,
+	game_logic::expression_ptr weight_expr, game_logic::map_formula_callable_ptr callable,
+	const int tile_size_x, const int tile_size_y, std::vector<variant>& path)
+{
+	const occupancy_grid grid(lvl, area, tile_size_x, tile_size_y);
+	grid_weight_fn weight;
+	if(weight_expr) {
+		weight = formula_grid_weight(grid, weight_expr, callable);
+	}
+
+	std::vector<point> cells;
+	if(!grid_find_path(grid, grid.cell_at(src_pt), grid.cell_at(dst_pt), &cells, weight)) {
+		return false;
+	}
+
+	path.clear();
+	foreach(const point& cell, cells) {
+		path.push_back(point_as_variant_list(grid.cell_midpoint(cell)));
+	}
+	path.front() = point_as_variant_list(src_pt);
+	path.back() = point_as_variant_list(dst_pt);
+	return true;
+}
+}
+
+variant grid_a_star_find_path(level_ptr lvl,
+	const point& src_pt1, 
+	const point& dst_pt1, 
+	game_logic::expression_ptr weight_expr, 
+	game_logic::map_formula_callable_ptr callable, 
+	const int tile_size_x, 
+	const int tile_size_y) 
+{
+	std::vector<variant> path;
+	point src_pt(src_pt1), dst_pt(dst_pt1);
+	const rect& b_rect = lvl->boundaries();
+	clip_pt_inside_rect(src_pt, b_rect);
+	clip_pt_inside_rect(dst_pt, b_rect);
+
+	if(get_midpoint(src_pt, tile_size_x, tile_size_y) == get_midpoint(dst_pt, tile_size_x, tile_size_y)) {
+		return variant(&path);
+	}
+
+	//most paths stay fairly close to the line between their ends, so
+	//first search the area around it, which is much cheaper to build a grid
+	//of than the whole level.
+	const int x1 = std::min(src_pt.x, dst_pt.x), x2 = std::max(src_pt.x, dst_pt.x);
+	const int y1 = std::min(src_pt.y, dst_pt.y), y2 = std::max(src_pt.y, dst_pt.y);
+	const int border_x = (x2 - x1)/2 + tile_size_x*8;
+	const int border_y = (y2 - y1)/2 + tile_size_y*8;
+	const rect area = intersection_rect(b_rect, rect::from_coordinates(x1 - border_x, y1 - border_y, x2 + border_x, y2 + border_y));
+
+	if(search_grid_area(*lvl, area, src_pt, dst_pt, weight_expr, callable, tile_size_x, tile_size_y, path)) {
+		return variant(&path);
+	}
+
+	if(area != b_rect) {
+		search_grid_area(*lvl, b_rect, src_pt, dst_pt, weight_expr, callable, tile_size_x, tile_size_y, path);
+	}
+
+	return variant(&path);
+}
+
 }
 
 UNIT_TEST(directed_graph_function) {
@@ -477,3 +988,159 @@ UNIT_TEST(cost_path_search_function) {
 	CHECK_EQ(game_logic::formula(variant("sort(path_cost_search(weighted_graph(directed_graph(map(range(9), [value/3,value%3]), filter(links(v), inside_bounds(value))), distance(a,b)), [1,1], 1)) where links = def(v) [[v[0]-1,v[1]], [v[0]+1,v[1]], [v[0],v[1]-1], [v[0],v[1]+1],[v[0]-1,v[1]-1],[v[0]-1,v[1]+1],[v[0]+1,v[1]-1],[v[0]+1,v[1]+1]], inside_bounds = def(v) v[0]>=0 and v[1]>=0 and v[0]<3 and v[1]<3, distance=def(a,b)sqrt((a[0]-b[0])^2+(a[1]-b[1])^2)")).execute(), 
 		game_logic::formula(variant("sort([[1,1], [1,0], [2,1], [1,2], [0,1]])")).execute());
 }
+
+namespace {
+//checks a path found on a grid only moves between adjacent open cells,
+//and returns what it costs.
+double check_grid_path(const pathfinding::occupancy_grid& grid, const std::vector<point>& path)
+{
+	double cost = 0.0;
+	for(int n = 1; n < path.size(); ++n) {
+		const int dx = path[n].x - path[n-1].x;
+		const int dy = path[n].y - path[n-1].y;
+		CHECK(abs(dx) <= 1 && abs(dy) <= 1 && (dx || dy), "path jumps from " << path[n-1].x << "," << path[n-1].y << " to " << path[n].x << "," << path[n].y);
+		CHECK(!grid.blocked(path[n].x, path[n].y), "path goes through blocked cell " << path[n].x << "," << path[n].y);
+		CHECK(!dx || !dy || (!grid.blocked(path[n-1].x + dx, path[n-1].y) && !grid.blocked(path[n-1].x, path[n-1].y + dy)), "path cuts a corner at " << path[n].x << "," << path[n].y);
+		cost += dx && dy ? sqrt(double(grid.cell_width()*grid.cell_width() + grid.cell_height()*grid.cell_height())) : (dx ? grid.cell_width() : grid.cell_height());
+	}
+	return cost;
+}
+}
+
+UNIT_TEST(grid_find_path_jps_matches_a_star) {
+	for(int test = 0; test != 200; ++test) {
+		const int width = 5 + rand()%40, height = 5 + rand()%40;
+		std::vector<bool> blocked(width*height);
+		for(int n = 0; n != blocked.size(); ++n) {
+			blocked[n] = rand()%100 < 30;
+		}
+
+		const pathfinding::occupancy_grid grid(width, height, blocked, 16 + rand()%3*8, 16 + rand()%3*8);
+		const point src(rand()%width, rand()%height);
+		const point dst(rand()%width, rand()%height);
+
+		std::vector<point> jps_path, a_star_path;
+		double jps_cost = 0.0, a_star_cost = 0.0;
+		const bool jps_found = pathfinding::grid_find_path(grid, src, dst, &jps_path, pathfinding::grid_weight_fn(), true, &jps_cost);
+		const bool a_star_found = pathfinding::grid_find_path(grid, src, dst, &a_star_path, pathfinding::grid_weight_fn(), false, &a_star_cost);
+		CHECK_EQ(jps_found, a_star_found);
+		if(!jps_found) {
+			continue;
+		}
+
+		CHECK(jps_path.front() == src && jps_path.back() == dst, "path doesn't join its ends");
+		CHECK(a_star_path.front() == src && a_star_path.back() == dst, "path doesn't join its ends");
+		CHECK(fabs(check_grid_path(grid, jps_path) - jps_cost) < 0.001, "jump point path cost is wrong");
+		CHECK(fabs(check_grid_path(grid, a_star_path) - a_star_cost) < 0.001, "a* path cost is wrong");
+		CHECK(fabs(jps_cost - a_star_cost) < 0.001, "jump point search found a path costing " << jps_cost << " where a* found one costing " << a_star_cost);
+	}
+}
+
+UNIT_TEST(grid_find_path_walls) {
+	//a wall with a gap at the bottom.
+	const char* cells =
+		"..#.."
+		"..#.."
+		".....";
+	std::vector<bool> blocked;
+	for(const char* c = cells; *c; ++c) {
+		blocked.push_back(*c == '#');
+	}
+
+	const pathfinding::occupancy_grid grid(5, 3, blocked, 32, 32);
+	std::vector<point> path;
+	CHECK(pathfinding::grid_find_path(grid, point(0, 0), point(4, 0), &path), "no path found");
+	CHECK_EQ(path.size(), 7);
+	CHECK(std::find(path.begin(), path.end(), point(2, 2)) != path.end(), "path doesn't go through the gap");
+
+	blocked[2*5 + 2] = true;
+	const pathfinding::occupancy_grid closed_grid(5, 3, blocked, 32, 32);
+	CHECK(!pathfinding::grid_find_path(closed_grid, point(0, 0), point(4, 0), &path), "path found through a wall");
+}
+
+UNIT_TEST(grid_find_path_to_boundary) {
+	//a goal on or past the right and bottom edges of the level is moved
+	//into the last cell, rather than off the grid.
+	const pathfinding::occupancy_grid grid(5, 3, std::vector<bool>(5*3, false), 32, 32);
+	const rect boundaries(0, 0, 5*32, 3*32);
+	const point goals[] = { point(5*32, 3*32), point(5*32 + 100, 40), point(-10, 3*32) };
+	foreach(point goal, goals) {
+		pathfinding::clip_pt_inside_rect(goal, boundaries);
+		const point cell = grid.cell_at(goal);
+		CHECK(!grid.blocked(cell.x, cell.y), "goal clipped to cell outside grid: " << cell.x << "," << cell.y);
+
+		std::vector<point> path;
+		CHECK(pathfinding::grid_find_path(grid, point(1, 1), cell, &path), "no path found to boundary");
+		CHECK(path.back() == cell, "path doesn't reach boundary");
+	}
+}
+
+namespace {
+//finds paths between random open cells of a level.
+void benchmark_grid_path_search(int benchmark_iterations, const std::string& file, bool use_jps)
+{
+	static std::map<std::string, boost::intrusive_ptr<level> > levels;
+	boost::intrusive_ptr<level>& lvl = levels[file];
+	if(!lvl) {
+		lvl.reset(new level(file));
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+	}
+
+	const pathfinding::occupancy_grid grid(*lvl, lvl->boundaries(), TileSize, TileSize);
+	std::vector<point> open_cells;
+	for(int y = 0; y != grid.height(); ++y) {
+		for(int x = 0; x != grid.width(); ++x) {
+			if(!grid.blocked(x, y)) {
+				open_cells.push_back(point(x, y));
+			}
+		}
+	}
+
+	if(open_cells.empty()) {
+		return;
+	}
+
+	srand(0);
+	std::vector<point> path;
+	BENCHMARK_LOOP {
+		const point& src = open_cells[rand()%open_cells.size()];
+		const point& dst = open_cells[rand()%open_cells.size()];
+		pathfinding::grid_find_path(grid, src, dst, &path, pathfinding::grid_weight_fn(), use_jps);
+	}
+}
+}
+
+BENCHMARK_ARG(grid_path_search_jps, const std::string& file)
+{
+	benchmark_grid_path_search(benchmark_iterations, file, true);
+}
+
+BENCHMARK_ARG_CALL(grid_path_search_jps, stairway_jps, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(grid_path_search_jps);
+
+BENCHMARK_ARG(grid_path_search_a_star, const std::string& file)
+{
+	benchmark_grid_path_search(benchmark_iterations, file, false);
+}
+
+BENCHMARK_ARG_CALL(grid_path_search_a_star, stairway_a_star, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(grid_path_search_a_star);
+
+BENCHMARK_ARG(grid_path_rasterize, const std::string& file)
+{
+	static std::map<std::string, boost::intrusive_ptr<level> > levels;
+	boost::intrusive_ptr<level>& lvl = levels[file];
+	if(!lvl) {
+		lvl.reset(new level(file));
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+	}
+
+	BENCHMARK_LOOP {
+		const pathfinding::occupancy_grid grid(*lvl, lvl->boundaries(), TileSize, TileSize);
+	}
+}
+
+BENCHMARK_ARG_CALL(grid_path_rasterize, stairway_rasterize, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(grid_path_rasterize);
@@ -23,6 +23,7 @@
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include "decimal.hpp"
@@ -205,6 +206,65 @@ variant a_star_find_path(level_ptr lvl, const point& src,
 variant path_cost_search(weighted_directed_graph_ptr wg, 
 	const variant src_node, 
 	decimal max_cost );
+
+// A grid of cells covering an area of a level, each of which is blocked if
+// any pixel in it is solid. Cells are aligned to multiples of the cell size.
+class occupancy_grid {
+public:
+	occupancy_grid(const level& lvl, const rect& area, int cell_width, int cell_height);
+
+	// A grid of width*height cells, with blocked giving the cells row by row.
+	occupancy_grid(int width, int height, const std::vector<bool>& blocked, int cell_width, int cell_height);
+
+	int width() const { return width_; }
+	int height() const { return height_; }
+	int cell_width() const { return cell_width_; }
+	int cell_height() const { return cell_height_; }
+
+	// Cells outside the grid are blocked.
+	bool blocked(int x, int y) const {
+		return x < 0 || y < 0 || x >= width_ || y >= height_ || blocked_[y*width_ + x];
+	}
+
+	// The cell containing a pixel, which may be outside the grid.
+	point cell_at(const point& p) const;
+	point cell_midpoint(const point& cell) const;
+private:
+	int xbase_, ybase_;
+	int width_, height_;
+	int cell_width_, cell_height_;
+	std::vector<unsigned char> blocked_;
+};
+
+// The cost of moving between two adjacent cells.
+typedef boost::function<double(const point&, const point&)> grid_weight_fn;
+
+// Finds the cheapest path between two cells of a grid using A*. Moves are
+// between adjacent cells, diagonally only if neither cell beside the
+// diagonal is blocked. Unless a weight function is given moves cost the
+// distance between the cells' midpoints, and if use_jps is true jump point
+// search is used to skip over open areas. A weight function should never
+// make a move cheaper than that distance, since the search's heuristic
+// assumes it doesn't. The path includes both ends. Returns false if there
+// is no path.
+bool grid_find_path(const occupancy_grid& grid, const point& src, const point& dst,
+	std::vector<point>* path, const grid_weight_fn& weight=grid_weight_fn(),
+	bool use_jps=true, double* cost=NULL);
+
+// Finds the cost of the cheapest path from a cell to every cell of a grid,
+// moving as grid_find_path does, with unreachable cells costing
+// std::numeric_limits<double>::max(). distances is indexed row by row.
+void grid_distance_map(const occupancy_grid& grid, const point& src, std::vector<double>* distances);
+
+// Like a_star_find_path, but searches an occupancy grid of the level. The
+// grid is built over the area around the two points, and over the whole
+// level if there is no path within that area. weight_expr may be NULL.
+variant grid_a_star_find_path(level_ptr lvl, const point& src, 
+	const point& dst, 
+	game_logic::expression_ptr weight_expr, 
+	game_logic::map_formula_callable_ptr callable, 
+	const int tile_size_x, 
+	const int tile_size_y);
 }
 
 
@@ -47,6 +47,7 @@ public:
 	virtual int vertical_look() const { return vertical_look_; }
 
 	virtual bool is_active(const rect& screen_area) const;
+	virtual bool spatial_index_area(rect* area) const { return false; }
 
 	bool can_interact() const { return can_interact_ != 0; }
 
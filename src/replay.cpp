@@ -0,0 +1,315 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <ctype.h>
+#include <iostream>
+#include <map>
+
+#include <boost/lexical_cast.hpp>
+
+#include "asserts.hpp"
+#include "controls.hpp"
+#include "foreach.hpp"
+#include "level.hpp"
+#include "preferences.hpp"
+#include "random.hpp"
+#include "replay.hpp"
+#include "unit_test.hpp"
+#include "variant_utils.hpp"
+
+PREF_INT(replay_keyframe_interval, 500, "Number of cycles between the keyframes saved in replays");
+
+namespace replay
+{
+
+namespace {
+//when a recording has more keyframes than this, every other one is dropped.
+const size_t MaxKeyframes = 64;
+
+//a level's state as JSON, with the addresses objects are written with,
+//which differ every time a level is created, replaced by the order they
+//first appear in. References to objects are written with the same
+//addresses, so they still have to point at the same objects to match.
+std::string write_state_without_addresses(const variant& state)
+{
+	const std::string doc = state.write_json();
+
+	std::map<std::string, int> ids;
+	std::string result;
+	result.reserve(doc.size());
+
+	std::string::const_iterator i = doc.begin();
+	while(i != doc.end()) {
+		if(*i == '0' && i+1 != doc.end() && (*(i+1) == 'x' || *(i+1) == 'X') && (i == doc.begin() || !isalnum(*(i-1)))) {
+			std::string::const_iterator end = i+2;
+			while(end != doc.end() && isxdigit(*end)) {
+				++end;
+			}
+
+			if(end != i+2) {
+				const std::string addr(i, end);
+				std::map<std::string, int>::const_iterator itor = ids.find(addr);
+				if(itor == ids.end()) {
+					itor = ids.insert(std::pair<std::string, int>(addr, ids.size())).first;
+				}
+
+				result += "@" + boost::lexical_cast<std::string>(itor->second);
+				i = end;
+				continue;
+			}
+		}
+
+		result += *i;
+		++i;
+	}
+
+	return result;
+}
+}
+
+bool same_level_state(const variant& a, const variant& b)
+{
+	return a == b || write_state_without_addresses(a) == write_state_without_addresses(b);
+}
+
+control_stream::control_stream() : size_(0)
+{}
+
+control_stream::control_stream(variant node) : size_(0)
+{
+	foreach(const variant& item, node.as_list()) {
+		ASSERT_LOG(item.num_elements() >= 2, "Bad controls in replay: " << item.write_json());
+		run r;
+		r.begin = size_;
+		r.keys = item[1].as_int();
+		if(item.num_elements() > 2) {
+			r.user = item[2].as_string();
+		}
+
+		runs_.push_back(r);
+		size_ += item[0].as_int();
+	}
+}
+
+void control_stream::push_back(unsigned char keys, const std::string& user)
+{
+	if(runs_.empty() || runs_.back().keys != keys || runs_.back().user != user) {
+		run r;
+		r.begin = size_;
+		r.keys = keys;
+		r.user = user;
+		runs_.push_back(r);
+	}
+
+	++size_;
+}
+
+const control_stream::run& control_stream::get_run(int cycle) const
+{
+	ASSERT_LOG(cycle >= 0 && cycle < size_, "Cycle out of range of replay controls: " << cycle << "/" << size_);
+
+	//the last run starting at or before the cycle.
+	int lo = 0, hi = runs_.size();
+	while(hi - lo > 1) {
+		const int mid = (lo + hi)/2;
+		if(runs_[mid].begin <= cycle) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return runs_[lo];
+}
+
+unsigned char control_stream::keys(int cycle) const
+{
+	return get_run(cycle).keys;
+}
+
+const std::string& control_stream::user(int cycle) const
+{
+	return get_run(cycle).user;
+}
+
+variant control_stream::write() const
+{
+	std::vector<variant> result;
+	for(size_t n = 0; n != runs_.size(); ++n) {
+		const int end = n+1 == runs_.size() ? size_ : runs_[n+1].begin;
+
+		std::vector<variant> item;
+		item.push_back(variant(end - runs_[n].begin));
+		item.push_back(variant(static_cast<int>(runs_[n].keys)));
+		if(runs_[n].user.empty() == false) {
+			item.push_back(variant(runs_[n].user));
+		}
+
+		result.push_back(variant(&item));
+	}
+
+	return variant(&result);
+}
+
+recorder::recorder(level& lvl) : lvl_(&lvl), keyframe_interval_(std::max(1, g_replay_keyframe_interval))
+{
+	add_keyframe();
+}
+
+void recorder::record_cycle()
+{
+	unsigned char keys = 0;
+	std::string user;
+	controls::last_local_controls(&keys, &user);
+	controls_.push_back(keys, user);
+
+	if(controls_.size()%keyframe_interval_ == 0) {
+		add_keyframe();
+	}
+}
+
+void recorder::add_keyframe()
+{
+	variant_builder node;
+	node.add("cycle", controls_.size());
+	node.add("seed", rng::get_seed());
+	//objects share the maps in their state with what's written, and maps
+	//can be changed in place, so keep a copy which later cycles can't change.
+	node.add("state", deep_copy_variant(lvl_->write()));
+	keyframes_.push_back(node.build());
+
+	if(keyframes_.size() > MaxKeyframes) {
+		keyframe_interval_ *= 2;
+
+		std::vector<variant> keep;
+		foreach(const variant& k, keyframes_) {
+			if(k["cycle"].as_int()%keyframe_interval_ == 0) {
+				keep.push_back(k);
+			}
+		}
+
+		keyframes_.swap(keep);
+	}
+}
+
+variant recorder::write() const
+{
+	std::vector<variant> keyframes = keyframes_;
+
+	variant_builder res;
+	res.add("level", lvl_->id());
+	res.add("cycles", controls_.size());
+	res.add("controls", controls_.write());
+	res.add("keyframes", variant(&keyframes));
+	return res.build();
+}
+
+player::player(variant node)
+  : level_id_(node["level"].as_string()), controls_(node["controls"]),
+    cycle_(0), verify_(false), first_divergence_(-1)
+{
+	foreach(const variant& k, node["keyframes"].as_list()) {
+		keyframe frame;
+		frame.cycle = k["cycle"].as_int();
+		frame.rng_seed = static_cast<unsigned int>(k["seed"].as_int());
+		frame.state = k["state"];
+		keyframes_.push_back(frame);
+	}
+
+	ASSERT_LOG(keyframes_.empty() == false && keyframes_.front().cycle == 0, "Replay of " << level_id_ << " has no starting state");
+
+	restore_keyframe(0);
+}
+
+bool player::step()
+{
+	if(cycle_ >= controls_.size()) {
+		return false;
+	}
+
+	{
+		const controls::local_controls_lock lock(controls_.keys(cycle_), controls_.user(cycle_));
+		lvl_->process();
+	}
+
+	++cycle_;
+
+	if(verify_ && first_divergence_ == -1) {
+		foreach(const keyframe& k, keyframes_) {
+			if(k.cycle == cycle_) {
+				if(rng::get_seed() != k.rng_seed || !same_level_state(lvl_->write(), k.state)) {
+					std::cerr << "REPLAY OF " << level_id_ << " DIVERGES FROM KEYFRAME AT CYCLE " << cycle_ << "\n";
+					first_divergence_ = cycle_;
+				}
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+void player::seek(int cycle)
+{
+	ASSERT_LOG(cycle >= 0 && cycle <= num_cycles(), "Seek out of range of replay: " << cycle << "/" << num_cycles());
+
+	int index = 0;
+	while(index+1 < keyframes_.size() && keyframes_[index+1].cycle <= cycle) {
+		++index;
+	}
+
+	//only restore a keyframe if it gets us closer than we already are.
+	if(cycle < cycle_ || keyframes_[index].cycle > cycle_) {
+		restore_keyframe(index);
+	}
+
+	while(cycle_ < cycle) {
+		step();
+	}
+}
+
+void player::restore_keyframe(int index)
+{
+	const keyframe& k = keyframes_[index];
+	lvl_.reset(new level(level_id_, deep_copy_variant(k.state)));
+	lvl_->finish_loading();
+	lvl_->set_as_current_level();
+	rng::set_seed(k.rng_seed);
+	cycle_ = k.cycle;
+}
+
+}
+
+UNIT_TEST(replay_control_stream)
+{
+	replay::control_stream stream;
+	for(int n = 0; n != 100; ++n) {
+		stream.push_back(n < 50 ? 0 : (n < 70 ? 5 : 1), n == 80 ? "{\"fire\": true}" : "");
+	}
+
+	const replay::control_stream copy(stream.write());
+	CHECK_EQ(copy.size(), 100);
+	CHECK_EQ(stream.write().num_elements(), 5);
+	for(int n = 0; n != 100; ++n) {
+		CHECK_EQ(static_cast<int>(copy.keys(n)), static_cast<int>(stream.keys(n)));
+		CHECK_EQ(copy.user(n), stream.user(n));
+	}
+
+	CHECK_EQ(static_cast<int>(copy.keys(60)), 5);
+	CHECK_EQ(copy.user(80), "{\"fire\": true}");
+	CHECK_EQ(copy.user(81), "");
+}
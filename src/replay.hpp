@@ -0,0 +1,144 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef REPLAY_HPP_INCLUDED
+#define REPLAY_HPP_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+
+#include "variant.hpp"
+
+class level;
+
+namespace replay
+{
+
+//whether two writes of a level are of the same state. The addresses
+//objects are written with differ each time a level is created, so they
+//only have to match up with each other.
+bool same_level_state(const variant& a, const variant& b);
+
+//the controls held on each cycle of a replay, stored as runs of cycles
+//with the same controls.
+class control_stream
+{
+public:
+	control_stream();
+	explicit control_stream(variant node);
+
+	void push_back(unsigned char keys, const std::string& user);
+
+	int size() const { return size_; }
+	unsigned char keys(int cycle) const;
+	const std::string& user(int cycle) const;
+
+	variant write() const;
+private:
+	struct run {
+		int begin;
+		unsigned char keys;
+		std::string user;
+	};
+
+	const run& get_run(int cycle) const;
+
+	std::vector<run> runs_;
+	int size_;
+};
+
+//records a single player playing a level: the state of the level and the
+//random number generator when recording starts, the controls read each
+//cycle, and keyframes of the level's state every so often so that
+//playback can start from anywhere without simulating the whole replay.
+class recorder
+{
+public:
+	explicit recorder(level& lvl);
+
+	const level& get_level() const { return *lvl_; }
+
+	//call after the level has processed a cycle.
+	void record_cycle();
+
+	int num_cycles() const { return controls_.size(); }
+
+	variant write() const;
+private:
+	void add_keyframe();
+
+	boost::intrusive_ptr<level> lvl_;
+	control_stream controls_;
+	std::vector<variant> keyframes_;
+
+	//cycles between keyframes. Doubles whenever there are too many
+	//keyframes, so long recordings don't use unbounded memory.
+	int keyframe_interval_;
+};
+
+//plays back a recording. The level is simulated without being drawn, so
+//this works headless.
+class player
+{
+public:
+	explicit player(variant node);
+
+	int num_cycles() const { return controls_.size(); }
+
+	//the number of cycles of the replay which have been played.
+	int cycle() const { return cycle_; }
+
+	boost::intrusive_ptr<level> get_level() const { return lvl_; }
+
+	//plays the next cycle, returning false if the replay is over.
+	bool step();
+
+	//puts the level in the state it was in after the given number of cycles
+	//by restoring the closest keyframe before it and simulating forward.
+	void seek(int cycle);
+
+	//if set, whenever playing passes a keyframe the level is compared to
+	//it, and the first cycle where they differ is reported by
+	//first_divergence(). Restoring a level from a keyframe only gives the
+	//same simulation if everything which affects it is serialized, so this
+	//finds where that isn't true.
+	void set_verify(bool value) { verify_ = value; }
+	int first_divergence() const { return first_divergence_; }
+private:
+	void restore_keyframe(int index);
+
+	std::string level_id_;
+	control_stream controls_;
+
+	struct keyframe {
+		int cycle;
+		unsigned int rng_seed;
+		variant state;
+	};
+	std::vector<keyframe> keyframes_;
+
+	boost::intrusive_ptr<level> lvl_;
+	int cycle_;
+
+	bool verify_;
+	int first_divergence_;
+};
+
+}
+
+#endif
@@ -75,6 +75,7 @@ void solid_map::create_object_solid_maps(variant node, std::vector<const_solid_m
 		if(legs_height == 0) {
 			body_map->calculate_side(0, 1, body_map->bottom_);
 		}
+		body_map->build_masks();
 		v.push_back(body_map);
 	} else {
 		legs_height = area.h();
@@ -102,6 +103,7 @@ void solid_map::create_object_solid_maps(variant node, std::vector<const_solid_m
 		legs_map->calculate_side(-1, 0, legs_map->left_);
 		legs_map->calculate_side(1, 0, legs_map->right_);
 		legs_map->calculate_side(-10000, 0, legs_map->all_);
+		legs_map->build_masks();
 		v.push_back(legs_map);
 	}
 }
@@ -123,6 +125,7 @@ void solid_map::create_object_platform_maps(const rect& area_ref, std::vector<co
 	platform->calculate_side(-1, 0, platform->left_);
 	platform->calculate_side(1, 0, platform->right_);
 	platform->calculate_side(-100000, 0, platform->all_);
+	platform->build_masks();
 	v.push_back(platform);
 }
 solid_map_ptr solid_map::create_from_texture(const graphics::texture& t, const rect& area_rect)
@@ -208,6 +211,8 @@ solid_map_ptr solid_map::create_from_texture(const graphics::texture& t, const r
 			}
 		}
 	}
+
+	solid->build_masks();
 	return solid;
 }
 
@@ -234,6 +239,36 @@ const std::vector<point>& solid_map::dir(MOVE_DIRECTION d) const
 	}
 }
 
+const solid_point_mask& solid_map::dir_mask(MOVE_DIRECTION d, bool face_right) const
+{
+	ASSERT_LOG(masks_.size() == (MOVE_NONE + 1)*2, "Solid map masks have not been built");
+	return masks_[d*2 + (face_right ? 0 : 1)];
+}
+
+void solid_map::build_masks()
+{
+	const int words_per_row = (area_.w() + 63)/64;
+
+	masks_.clear();
+	for(int d = 0; d <= MOVE_NONE; ++d) {
+		for(int mirrored = 0; mirrored != 2; ++mirrored) {
+			solid_point_mask mask;
+			mask.area = area_;
+			mask.mirrored = mirrored != 0;
+			mask.words_per_row = words_per_row;
+			mask.bits.resize(words_per_row*area_.h());
+
+			foreach(const point& p, dir(static_cast<MOVE_DIRECTION>(d))) {
+				const int x = mirrored ? area_.x2() - 1 - p.x : p.x - area_.x();
+				const int y = p.y - area_.y();
+				mask.bits[y*words_per_row + x/64] |= uint64_t(1) << (x%64);
+			}
+
+			masks_.push_back(mask);
+		}
+	}
+}
+
 void solid_map::set_solid(int x, int y, bool value)
 {
 	ASSERT_EQ(solid_.size(), area_.w()*area_.h());
@@ -21,6 +21,8 @@
 
 #include <vector>
 
+#include <stdint.h>
+
 #include "geometry.hpp"
 #include "solid_map_fwd.hpp"
 #include "variant.hpp"
@@ -31,6 +33,20 @@ namespace graphics {
 class texture;
 }
 
+//a set of points of a solid map packed into rows of bits, so they can be
+//tested against the level a word at a time. Bit n of row m is the point
+//n pixels from the left and m pixels from the top of the solid area. If
+//mirrored is set, bit n is instead n pixels from the right of the area, as
+//the points are placed when the object faces left.
+struct solid_point_mask {
+	rect area;
+	bool mirrored;
+	int words_per_row;
+	std::vector<uint64_t> bits;
+
+	const uint64_t* row(int y) const { return &bits[y*words_per_row]; }
+};
+
 class solid_map
 {
 public:
@@ -49,6 +65,10 @@ public:
 	const std::vector<point>& top() const { return top_; }
 	const std::vector<point>& bottom() const { return bottom_; }
 	const std::vector<point>& all() const { return all_; }
+
+	//the points given by dir(d), packed into a mask for an object facing
+	//in the given direction.
+	const solid_point_mask& dir_mask(MOVE_DIRECTION d, bool face_right) const;
 private:
 	static const_solid_map_ptr create_object_solid_map_from_solid_node(variant node);
 
@@ -60,6 +80,9 @@ private:
 
 	void apply_offsets(const std::vector<int>& offsets);
 
+	//builds the point masks, once the sides have been calculated.
+	void build_masks();
+
 	std::string id_;
 	rect area_;
 
@@ -67,6 +90,9 @@ private:
 
 	//all the solid points that are on the different sides of the solid area.
 	std::vector<point> left_, right_, top_, bottom_, all_;
+
+	//the masks for each direction, facing right then facing left.
+	std::vector<solid_point_mask> masks_;
 };
 
 class solid_info
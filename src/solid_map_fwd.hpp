@@ -26,6 +26,8 @@ typedef boost::shared_ptr<const solid_map> const_solid_map_ptr;
 
 class solid_info;
 
+struct solid_point_mask;
+
 typedef boost::shared_ptr<const solid_info> const_solid_info_ptr;
 
 #endif
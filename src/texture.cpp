@@ -39,6 +39,8 @@
 
 #include <SDL_thread.h>
 
+PREF_BOOL(headless, false, "Run without a window or GL context, as utilities which simulate levels do. Objects and levels are created without their shaders.");
+
 namespace graphics
 {
 
@@ -122,6 +124,11 @@ namespace {
 		if (once) return npot;
 		once = true;
 
+		//there's no GL to ask, and nothing will be drawn anyway.
+		if(g_headless) {
+			return npot;
+		}
+
 		if(preferences::force_no_npot_textures()) {
 			npot = false;
 			return false;
@@ -478,7 +485,9 @@ threading::mutex id_to_build_mutex;
 
 unsigned int texture::get_id() const
 {
-	if(!valid()) {
+	//when headless there's no GL context, and nothing will be drawn, so
+	//textures never get a GL id.
+	if(!valid() || g_headless) {
 		return 0;
 	}
 
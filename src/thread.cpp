@@ -38,15 +38,32 @@ manager::~manager()
 
 namespace {
 
+std::vector<void (*)()>& thread_exit_handlers()
+{
+	static std::vector<void (*)()> handlers;
+	return handlers;
+}
+
 int call_boost_function(void* arg)
 {
-	boost::scoped_ptr<boost::function<void()> > fn((boost::function<void()>*)arg);
-	(*fn)();
+	{
+		boost::scoped_ptr<boost::function<void()> > fn((boost::function<void()>*)arg);
+		(*fn)();
+	}
+
+	for(std::vector<void (*)()>::const_iterator i = thread_exit_handlers().begin(); i != thread_exit_handlers().end(); ++i) {
+		(*i)();
+	}
 	return 0;
 }
 
 }
 
+void add_thread_exit_handler(void (*fn)())
+{
+	thread_exit_handlers().push_back(fn);
+}
+
 thread::thread(const std::string& name, boost::function<void()> fn) 
 	: fn_(fn), thread_(SDL_CreateThread(call_boost_function, name.c_str(), new boost::function<void()>(fn_)))
 {}
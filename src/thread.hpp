@@ -78,6 +78,12 @@ private:
 };
 
 inline Uint32 get_current_thread_id() { return SDL_ThreadID(); }
+
+//registers a function which every thread started through threading::thread
+//calls just before it exits, so per-thread caches can be released.
+//Handlers should be added during static initialization, before any
+//threads are started.
+void add_thread_exit_handler(void (*fn)());
 // Binary mutexes.
 //
 // Implements an interface to mutexes. This class only defines the
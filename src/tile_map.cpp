@@ -14,6 +14,8 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <boost/bind.hpp>
+#include <boost/dynamic_bitset.hpp>
 #include <boost/regex.hpp>
 #include <iostream>
 #include <math.h>
@@ -28,6 +30,7 @@
 #include "formula_function.hpp"
 #include "json_parser.hpp"
 #include "level_solid_map.hpp"
+#include "load_level.hpp"
 #include "multi_tile_pattern.hpp"
 #include "point_map.hpp"
 #include "preferences.hpp"
@@ -35,7 +38,9 @@
 #include "string_utils.hpp"
 #include "thread.hpp"
 #include "tile_map.hpp"
+#include "unit_test.hpp"
 #include "variant_utils.hpp"
+#include "worker_pool.hpp"
 
 namespace {
 
@@ -401,7 +406,6 @@ tile_map::tile_map() : xpos_(0), ypos_(0), x_speed_(100), y_speed_(100), zorder_
 
 	//make an entry for the empty string.
 	pattern_index_.push_back(pattern_index_entry());
-	pattern_index_.back().matching_patterns.push_back(&get_regex_from_pool(""));
 }
 
 tile_map::tile_map(variant node)
@@ -430,7 +434,6 @@ tile_map::tile_map(variant node)
 
 	//make an entry for the empty string.
 	pattern_index_.push_back(pattern_index_entry());
-	pattern_index_.back().matching_patterns.push_back(&get_regex_from_pool(""));
 
 	{
 	const std::string& tiles_str = node["tiles"].as_string();
@@ -513,6 +516,49 @@ tile_map::~tile_map()
 #endif
 }
 
+//For each string in the map, which of the patterns it can be the middle
+//tile of, and for each position around the middle tile that some pattern
+//looks at, which of the patterns accept it there. Finding the patterns
+//matching a tile is then just and'ing together the sets for its
+//neighbours, without any regexes.
+struct tile_map::pattern_tables {
+	typedef boost::dynamic_bitset<> pattern_set;
+
+	//indexed by pattern_index_ entry.
+	std::vector<pattern_set> candidates;
+
+	//the positions looked at by the patterns, nearest first.
+	std::vector<point> offsets;
+
+	//the patterns accepting each entry at each offset, indexed by
+	//offset*pattern_index_.size() + entry. A pattern which doesn't look at
+	//an offset accepts anything there.
+	std::vector<pattern_set> accepts;
+
+	//the patterns which may also match mirrored.
+	pattern_set reversible;
+
+	//for each multi pattern, the regexes in its try_order as indexes
+	//into the sets of regex_matches, which is indexed by entry.
+	std::vector<std::vector<int> > multi_pattern_regexes;
+	std::vector<boost::dynamic_bitset<> > regex_matches;
+
+	//the largest width or height of the multi patterns.
+	int multi_pattern_size;
+};
+
+namespace {
+bool nearer_offset(const point& a, const point& b) {
+	const int da = abs(a.x) + abs(a.y);
+	const int db = abs(b.x) + abs(b.y);
+	if(da != db) {
+		return da < db;
+	}
+
+	return a < b;
+}
+}
+
 void tile_map::build_patterns()
 {
 	std::vector<const boost::regex*> all_regexes;
@@ -520,6 +566,7 @@ void tile_map::build_patterns()
 	patterns_version_ = current_patterns_version;
 	const int begin_time = SDL_GetTicks();
 	patterns_.clear();
+	multi_patterns_.clear();
 	foreach(const tile_pattern& p, patterns) {
 		std::vector<const boost::regex*> re;
 		std::vector<const boost::regex*> accepted_re;
@@ -590,19 +637,70 @@ void tile_map::build_patterns()
 		}
 	}
 
+	boost::shared_ptr<pattern_tables> tables(new pattern_tables);
+
+	const int nentries = pattern_index_.size();
+	const int npatterns = patterns_.size();
+
+	foreach(const tile_pattern* p, patterns_) {
+		foreach(const tile_pattern::surrounding_tile& t, p->surrounding_tiles) {
+			tables->offsets.push_back(point(t.xoffset, t.yoffset));
+		}
+	}
+
+	std::sort(tables->offsets.begin(), tables->offsets.end(), nearer_offset);
+	tables->offsets.erase(std::unique(tables->offsets.begin(), tables->offsets.end()), tables->offsets.end());
+
+	tables->candidates.assign(nentries, pattern_tables::pattern_set(npatterns));
+	tables->accepts.assign(tables->offsets.size()*nentries, pattern_tables::pattern_set(npatterns));
+	foreach(pattern_tables::pattern_set& accepts, tables->accepts) {
+		accepts.set();
+	}
+
+	tables->reversible.resize(npatterns);
+
+	for(int n = 0; n != npatterns; ++n) {
+		const tile_pattern& p = *patterns_[n];
+		tables->reversible[n] = p.reverse;
+
+		for(int e = 0; e != nentries; ++e) {
+			tables->candidates[e][n] = match_regex(pattern_index_[e].str, p.current_tile_pattern);
+		}
+
+		foreach(const tile_pattern::surrounding_tile& t, p.surrounding_tiles) {
+			const int offset = std::lower_bound(tables->offsets.begin(), tables->offsets.end(), point(t.xoffset, t.yoffset), nearer_offset) - tables->offsets.begin();
+			for(int e = 0; e != nentries; ++e) {
+				if(!match_regex(pattern_index_[e].str, t.pattern)) {
+					tables->accepts[offset*nentries + e][n] = false;
+				}
+			}
+		}
+	}
+
 	std::sort(all_regexes.begin(), all_regexes.end());
 	all_regexes.erase(std::unique(all_regexes.begin(), all_regexes.end()), all_regexes.end());
 
-	foreach(pattern_index_entry& e, pattern_index_) {
-		e.matching_patterns.clear();
+	tables->multi_pattern_size = 0;
+	foreach(const multi_tile_pattern* p, multi_patterns_) {
+		tables->multi_pattern_size = std::max(tables->multi_pattern_size, std::max(p->width(), p->height()));
+		tables->multi_pattern_regexes.push_back(std::vector<int>());
+		for(int n = 0; n != p->try_order().size(); ++n) {
+			const boost::regex* re = p->tile_at(p->try_order()[n].loc.x, p->try_order()[n].loc.y).re;
+			const int index = std::lower_bound(all_regexes.begin(), all_regexes.end(), re) - all_regexes.begin();
+			ASSERT_LOG(index != all_regexes.size() && all_regexes[index] == re, "Multi tile pattern regex not found");
+			tables->multi_pattern_regexes.back().push_back(index);
+		}
+	}
 
-		foreach(const boost::regex* re, all_regexes) {
-			if(match_regex(e.str, re)) {
-				e.matching_patterns.push_back(re);
-			}
+	tables->regex_matches.assign(nentries, boost::dynamic_bitset<>(all_regexes.size()));
+	for(int e = 0; e != nentries; ++e) {
+		for(int n = 0; n != all_regexes.size(); ++n) {
+			tables->regex_matches[e][n] = match_regex(pattern_index_[e].str, all_regexes[n]);
 		}
 	}
 
+	pattern_tables_ = tables;
+
 	const int end_time = SDL_GetTicks();
 	static int total_time = 0;
 	total_time += (end_time - begin_time);
@@ -617,6 +715,24 @@ const std::vector<const tile_pattern*>& tile_map::get_patterns() const
 	return patterns_;
 }
 
+int tile_map::pattern_radius() const
+{
+	get_patterns();
+
+	int radius = 0;
+	foreach(const point& offset, pattern_tables_->offsets) {
+		radius = std::max(radius, std::max(abs(offset.x), abs(offset.y)));
+	}
+
+	//a multi pattern can be placed anywhere covering the tile, and placing
+	//it can stop another overlapping one from being placed.
+	if(pattern_tables_->multi_pattern_size) {
+		radius = std::max(radius, (pattern_tables_->multi_pattern_size - 1)*2);
+	}
+
+	return radius;
+}
+
 variant tile_map::write() const
 {
 	variant_builder res;
@@ -705,25 +821,20 @@ const char* tile_map::get_tile(int y, int x) const
 	return pattern_index_[map_[y][x]].str.data();
 }
 
-const tile_map::pattern_index_entry& tile_map::get_tile_entry(int y, int x) const
+int tile_map::get_tile_index(int y, int x) const
 {
 	if(x < 0 || y < 0 || y >= map_.size() || x >= map_[y].size()) {
-		return pattern_index_.front();
+		return 0;
 	}
 
-	return pattern_index_[map_[y][x]];
+	return map_[y][x];
 }
 
 namespace {
-struct cstr_less {
-	bool operator()(const char* a, const char* b) const {
-		return strcmp(a, b) < 0;
-	}
-};
-
-typedef std::map<const char*, std::vector<const tile_pattern*>, cstr_less> tile_pattern_cache_map;
+//space for working out the patterns matching a tile, kept between tiles
+//to save allocating it each time.
 struct tile_pattern_cache {
-	tile_pattern_cache_map cache;
+	boost::dynamic_bitset<> normal, reversed;
 };
 
 }
@@ -818,10 +929,12 @@ int random_hash(int x, int y, int z, int n)
 }
 
 void tile_map::apply_matching_multi_pattern(int& x, int y,
-  const multi_tile_pattern& pattern,
+  int multi_pattern_index,
   point_map<level_object*>& mapping,
   std::map<point_zorder, level_object*>& different_zorder_mapping) const
 {
+	const multi_tile_pattern& pattern = *multi_patterns_[multi_pattern_index];
+	const std::vector<int>& regexes = pattern_tables_->multi_pattern_regexes[multi_pattern_index];
 
 	if(pattern.chance() < 100 && random_hash(x, y, zorder_, 0)%100 > pattern.chance()) {
 		return;
@@ -832,8 +945,7 @@ void tile_map::apply_matching_multi_pattern(int& x, int y,
 		const int xpos = pattern.try_order()[n].loc.x;
 		const int ypos = pattern.try_order()[n].loc.y;
 
-		const pattern_index_entry& entry = get_tile_entry(y + ypos, x + xpos);
-		if(std::find(entry.matching_patterns.begin(), entry.matching_patterns.end(), pattern.tile_at(xpos, ypos).re) == entry.matching_patterns.end()) {
+		if(!pattern_tables_->regex_matches[get_tile_index(y + ypos, x + xpos)][regexes[n]]) {
 			//the regex doesn't match
 			match = false;
 
@@ -873,8 +985,122 @@ void tile_map::apply_matching_multi_pattern(int& x, int y,
 
 void tile_map::build_tiles(std::vector<level_tile>* tiles, const rect* r) const
 {
-	const int begin_time = SDL_GetTicks();
-	//std::cerr << "build tiles... " << patterns_.size() << "/" << patterns.size() << "\n";
+	get_patterns();
+
+	int x1, y1, x2, y2;
+	get_cells_to_build(r, &x1, &y1, &x2, &y2);
+
+	point_map<level_object*> multi_pattern_matches;
+	find_multi_pattern_matches(x1, y1, x2, y2, r, &multi_pattern_matches, tiles);
+	build_cell_tiles(x1, y1, x2, y2, r, multi_pattern_matches, tiles);
+}
+
+namespace {
+//the number of rows of cells built by each job when building in parallel.
+const int TileBuildBandRows = 16;
+
+struct layer_build {
+	const tile_map* map;
+	int x1, y1, x2, y2;
+	point_map<level_object*> multi_pattern_matches;
+	std::vector<level_tile> multi_pattern_tiles;
+};
+
+struct band_build {
+	int layer;
+	int y1, y2;
+	std::vector<level_tile> tiles;
+};
+}
+
+bool tile_map::has_filter_formulas() const
+{
+	foreach(const tile_pattern* p, get_patterns()) {
+		if(p->filter_formula) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void tile_map::build_tiles_in_parallel(const std::vector<const tile_map*>& maps, std::vector<level_tile>* tiles)
+{
+	//the patterns of a map are found when it's first built, which can't
+	//be done by several threads at once.
+	foreach(const tile_map* m, maps) {
+		m->get_patterns();
+	}
+
+	//multi patterns depend on which others have been placed before them
+	//across the whole map, so they're placed a layer at a time first.
+	std::vector<layer_build> layers(maps.size());
+	std::vector<boost::function<void()> > jobs;
+	for(int n = 0; n != maps.size(); ++n) {
+		layer_build& layer = layers[n];
+		layer.map = maps[n];
+		layer.map->get_cells_to_build(NULL, &layer.x1, &layer.y1, &layer.x2, &layer.y2);
+		if(!layer.map->multi_patterns_.empty()) {
+			jobs.push_back(boost::bind(&tile_map::find_multi_pattern_matches, layer.map, layer.x1, layer.y1, layer.x2, layer.y2, static_cast<const rect*>(NULL), &layer.multi_pattern_matches, &layer.multi_pattern_tiles));
+		}
+	}
+
+	worker_pool::run(jobs);
+
+	//every other cell only depends on the map around it, so each layer is
+	//divided into bands of rows.
+	std::vector<band_build> bands;
+	for(int n = 0; n != layers.size(); ++n) {
+		for(int y = layers[n].y1; y < layers[n].y2; y += TileBuildBandRows) {
+			band_build band;
+			band.layer = n;
+			band.y1 = y;
+			band.y2 = std::min(y + TileBuildBandRows, layers[n].y2);
+			bands.push_back(band);
+		}
+	}
+
+	//formulas can't be run by several threads at once, so maps with
+	//patterns that have filter formulas are built on this thread.
+	jobs.clear();
+	std::vector<boost::function<void()> > filtered_jobs;
+	foreach(band_build& band, bands) {
+		const layer_build& layer = layers[band.layer];
+		(layer.map->has_filter_formulas() ? filtered_jobs : jobs).push_back(boost::bind(&tile_map::build_cell_tiles, layer.map, layer.x1, band.y1, layer.x2, band.y2, static_cast<const rect*>(NULL), boost::cref(layer.multi_pattern_matches), &band.tiles));
+	}
+
+	worker_pool::run(jobs);
+
+	foreach(const boost::function<void()>& job, filtered_jobs) {
+		job();
+	}
+
+	//put the tiles together in the order building each map in turn gives.
+	std::vector<band_build>::const_iterator band = bands.begin();
+	for(int n = 0; n != layers.size(); ++n) {
+		tiles->insert(tiles->end(), layers[n].multi_pattern_tiles.begin(), layers[n].multi_pattern_tiles.end());
+		for(; band != bands.end() && band->layer == n; ++band) {
+			tiles->insert(tiles->end(), band->tiles.begin(), band->tiles.end());
+		}
+	}
+}
+
+void tile_map::get_cells_to_build(const rect* r, int* x1, int* y1, int* x2, int* y2) const
+{
+	*x1 = -g_tile_pattern_search_border;
+	*y1 = -g_tile_pattern_search_border;
+	*x2 = width() + g_tile_pattern_search_border;
+	*y2 = static_cast<int>(map_.size()) + g_tile_pattern_search_border;
+	if(r) {
+		*x1 = std::max(*x1, floor_div(r->x() - xpos_, TileSize));
+		*y1 = std::max(*y1, floor_div(r->y() - ypos_, TileSize));
+		*x2 = std::min(*x2, floor_div(r->x2() - 1 - xpos_, TileSize) + 1);
+		*y2 = std::min(*y2, floor_div(r->y2() - 1 - ypos_, TileSize) + 1);
+	}
+}
+
+int tile_map::width() const
+{
 	int width = 0;
 	foreach(const std::vector<int>& row, map_) {
 		if(row.size() > width) {
@@ -882,20 +1108,32 @@ void tile_map::build_tiles(std::vector<level_tile>* tiles, const rect* r) const
 		}
 	}
 
-	point_map<level_object*> multi_pattern_matches;
+	return width;
+}
+
+void tile_map::find_multi_pattern_matches(int x1, int y1, int x2, int y2, const rect* r, point_map<level_object*>* multi_pattern_matches, std::vector<level_tile>* tiles) const
+{
+	const int width = this->width();
 	std::map<point_zorder, level_object*> different_zorder_multi_pattern_matches;
 
 	//std::cerr << "MULTIPATTERNS: " << multi_patterns_.size() << "/" << multi_tile_pattern::get_all().size() << "\n";
-	foreach(const multi_tile_pattern* p, multi_patterns_) {
-		for(int y = -p->height(); y < static_cast<int>(map_.size()) + p->height(); ++y) {
-			const int ypos = ypos_ + y*TileSize;
-	
-			if(r && ypos < r->y() || r && ypos > r->y2()) {
-				continue;
-			}
+	for(int n = 0; n != multi_patterns_.size(); ++n) {
+		const multi_tile_pattern* p = multi_patterns_[n];
+		int begin_x = -p->width(), begin_y = -p->height();
+		int end_x = width + p->width(), end_y = static_cast<int>(map_.size()) + p->height();
+		if(r) {
+			//look for the pattern wherever it could cover the area, and far
+			//enough beyond to settle which overlapping patterns are placed.
+			const int margin = pattern_tables_->multi_pattern_size;
+			begin_x = std::max(begin_x, x1 - p->width() - margin);
+			begin_y = std::max(begin_y, y1 - p->height() - margin);
+			end_x = std::min(end_x, x2 + margin);
+			end_y = std::min(end_y, y2 + margin);
+		}
 
-			for(int x = -p->width(); x < width + p->width(); ++x) {
-				apply_matching_multi_pattern(x, y, *p, multi_pattern_matches, different_zorder_multi_pattern_matches);
+		for(int y = begin_y; y < end_y; ++y) {
+			for(int x = begin_x; x < end_x; ++x) {
+				apply_matching_multi_pattern(x, y, n, *multi_pattern_matches, different_zorder_multi_pattern_matches);
 			}
 		}
 	}
@@ -909,6 +1147,10 @@ void tile_map::build_tiles(std::vector<level_tile>* tiles, const rect* r) const
 		const int xpos = xpos_ + x*TileSize;
 		const int ypos = ypos_ + y*TileSize;
 
+		if(r && !point_in_rect(point(xpos, ypos), *r)) {
+			continue;
+		}
+
 		level_tile t;
 		t.x = xpos;
 		t.y = ypos;
@@ -918,20 +1160,20 @@ void tile_map::build_tiles(std::vector<level_tile>* tiles, const rect* r) const
 		t.face_right = false;
 		tiles->push_back(t);
 	}
+}
 
-
+void tile_map::build_cell_tiles(int x1, int y1, int x2, int y2, const rect* r, const point_map<level_object*>& multi_pattern_matches, std::vector<level_tile>* tiles) const
+{
 	tile_pattern_cache cache;
 
-	int ntiles = 0;
-	for(int y = -g_tile_pattern_search_border; y < static_cast<int>(map_.size()) + g_tile_pattern_search_border; ++y) {
+	for(int y = y1; y < y2; ++y) {
 		const int ypos = ypos_ + y*TileSize;
 
-		if(r && ypos < r->y() || r && ypos > r->y2()) {
-			continue;
-		}
-
-		for(int x = -g_tile_pattern_search_border; x < width + g_tile_pattern_search_border; ++x) {
+		for(int x = x1; x < x2; ++x) {
 			const int xpos = xpos_ + x*TileSize;
+			if(r && !point_in_rect(point(xpos, ypos), *r)) {
+				continue;
+			}
 
 			const level_object* obj = multi_pattern_matches.get(point(x, y));
 			if(obj) {
@@ -952,13 +1194,6 @@ void tile_map::build_tiles(std::vector<level_tile>* tiles, const rect* r) const
 				continue;
 			}
 
-
-			if(r && xpos < r->x() || r && xpos > r->x2()) {
-				continue;
-			}
-
-			++ntiles;
-
 			level_tile t;
 			t.x = xpos;
 			t.y = ypos;
@@ -997,86 +1232,57 @@ void tile_map::build_tiles(std::vector<level_tile>* tiles, const rect* r) const
 			}
 		}
 	}
-	//std::cerr << "done build tiles: " << ntiles << " " << (SDL_GetTicks() - begin_time) << "\n";
 }
 
 const tile_pattern* tile_map::get_matching_pattern(int x, int y, tile_pattern_cache& cache, bool* face_right) const
 {
-
-	if (!*get_tile(y, x) &&
-	    !*get_tile(y-1, x) &&
-		!*get_tile(y+1, x) &&
-		!*get_tile(y, x-1) &&
-		!*get_tile(y, x+1)) {
+	const int index = get_tile_index(y, x);
+	if (!index &&
+	    !get_tile_index(y-1, x) &&
+		!get_tile_index(y+1, x) &&
+		!get_tile_index(y, x-1) &&
+		!get_tile_index(y, x+1)) {
 		return NULL;
 	}
 
-	const int xpos = xpos_ + x*TileSize;
-
-	filter_callable callable(*this, x, y);
+	const std::vector<const tile_pattern*>& patterns = get_patterns();
+	const pattern_tables& tables = *pattern_tables_;
+	const int nentries = pattern_index_.size();
 
-	const char* current_tile = get_tile(y,x);
+	//find the patterns matching the tile as they are, and mirrored.
+	cache.normal = tables.candidates[index];
+	for(int n = 0; n != tables.offsets.size() && cache.normal.any(); ++n) {
+		const point& offset = tables.offsets[n];
+		cache.normal &= tables.accepts[n*nentries + get_tile_index(y + offset.y, x + offset.x)];
+	}
 
-	//we build a cache of all of the patterns which have some chance of
-	//matching the current tile.
-	tile_pattern_cache_map::iterator itor = cache.cache.find(current_tile);
-	if(itor == cache.cache.end()) {
-		itor = cache.cache.insert(std::pair<const char*,std::vector<const tile_pattern*> >(current_tile, std::vector<const tile_pattern*>())).first;
-		foreach(const tile_pattern* p, get_patterns()) {
-			if(!p->current_tile_pattern->empty() && !boost::regex_match(current_tile, current_tile + strlen(current_tile), *p->current_tile_pattern)) {
-				continue;
-			}
+	cache.reversed = tables.candidates[index];
+	cache.reversed &= tables.reversible;
+	for(int n = 0; n != tables.offsets.size() && cache.reversed.any(); ++n) {
+		const point& offset = tables.offsets[n];
+		cache.reversed &= tables.accepts[n*nentries + get_tile_index(y + offset.y, x - offset.x)];
+	}
 
-			itor->second.push_back(&*p);
-		}
+	cache.reversed |= cache.normal;
+	if(cache.reversed.none()) {
+		return NULL;
 	}
 
-	const std::vector<const tile_pattern*>& matching_patterns = itor->second;
+	filter_callable callable(*this, x, y);
 
-	foreach(const tile_pattern* ptr, matching_patterns) {
-		const tile_pattern& p = *ptr;
+	//the first matching pattern wins, preferring it unmirrored.
+	for(size_t n = cache.reversed.find_first(); n != cache.reversed.npos; n = cache.reversed.find_next(n)) {
+		const tile_pattern& p = *patterns[n];
 		if(p.filter_formula && p.filter_formula->execute(callable).as_bool() == false) {
 			continue;
 		}
 
-		bool match = true;
-		foreach(const tile_pattern::surrounding_tile& t, p.surrounding_tiles) {
-			const pattern_index_entry& entry = get_tile_entry(y + t.yoffset, x + t.xoffset);
-			if(std::find(entry.matching_patterns.begin(), entry.matching_patterns.end(), t.pattern) == entry.matching_patterns.end()) {
-				match = false;
-				break;
-			}
+		if(p.empty) {
+			return NULL;
 		}
 
-		if(match) {
-			if(p.empty) {
-				return NULL;
-			}
-
-			*face_right = false;
-			return &p;
-		}
-
-		if(p.reverse) {
-			match = true;
-
-			foreach(const tile_pattern::surrounding_tile& t, p.surrounding_tiles) {
-				const pattern_index_entry& entry = get_tile_entry(y + t.yoffset, x - t.xoffset);
-				if(std::find(entry.matching_patterns.begin(), entry.matching_patterns.end(), t.pattern) == entry.matching_patterns.end()) {
-					match = false;
-					break;
-				}
-			}
-		}
-
-		if(match) {
-			if(p.empty) {
-				return NULL;
-			}
-
-			*face_right = true;
-			return &p;
-		}
+		*face_right = !cache.normal[n];
+		return &p;
 	}
 
 	return NULL;
@@ -1157,3 +1363,54 @@ int tile_map::get_pattern_index_entry(const tile_string& str) {
 	build_patterns();
 	return index;
 }
+
+namespace {
+//the tile maps of a level, built the same way the level builds them.
+const std::vector<variant>& benchmark_tile_map_nodes(const std::string& file)
+{
+	static std::map<std::string, std::vector<variant> > cache;
+	std::vector<variant>& nodes = cache[file];
+	if(nodes.empty()) {
+		foreach(variant node, load_level_wml(file)["tile_map"].as_list()) {
+			if(node["tiles"].is_string()) {
+				nodes.push_back(node);
+			}
+		}
+	}
+
+	return nodes;
+}
+}
+
+BENCHMARK_ARG(tile_map_load, const std::string& file)
+{
+	const std::vector<variant>& nodes = benchmark_tile_map_nodes(file);
+	BENCHMARK_LOOP {
+		foreach(const variant& node, nodes) {
+			tile_map m(node);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(tile_map_load, stairway_tile_map_load, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(tile_map_load);
+
+BENCHMARK_ARG(tile_map_build_tiles, const std::string& file)
+{
+	const std::vector<variant>& nodes = benchmark_tile_map_nodes(file);
+	std::vector<tile_map> maps;
+	foreach(const variant& node, nodes) {
+		maps.push_back(tile_map(node));
+	}
+
+	std::vector<level_tile> tiles;
+	BENCHMARK_LOOP {
+		tiles.clear();
+		foreach(const tile_map& m, maps) {
+			m.build_tiles(&tiles);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(tile_map_build_tiles, stairway_tile_map_build, "stairway-to-heaven.cfg");
+BENCHMARK_ARG_CALL_COMMAND_LINE(tile_map_build_tiles);
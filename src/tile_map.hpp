@@ -19,6 +19,7 @@
 
 #include <boost/array.hpp>
 #include <boost/regex.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <map>
 #include <string>
@@ -54,7 +55,20 @@ public:
 	~tile_map();
 
 	variant write() const;
+
+	//builds the tiles of the map, or only those with their top left corner
+	//in the area r, in pixels.
 	void build_tiles(std::vector<level_tile>* tiles, const rect* r=NULL) const;
+
+	//builds the tiles of a number of maps, divided into jobs run on the
+	//worker pool. The tiles are in the same order as building each map in
+	//turn with build_tiles() gives.
+	static void build_tiles_in_parallel(const std::vector<const tile_map*>& maps, std::vector<level_tile>* tiles);
+
+	//how many tiles away changing a tile can change the tiles built, through
+	//patterns which look at its neighbours.
+	int pattern_radius() const;
+
 	bool set_tile(int xpos, int ypos, const std::string& str);
 	int zorder() const { return zorder_; }
 	int x_speed() const { return x_speed_; }
@@ -82,8 +96,19 @@ private:
 	void build_patterns();
 	const std::vector<const tile_pattern*>& get_patterns() const;
 
+	//true if any of the patterns for this map have a filter formula.
+	bool has_filter_formulas() const;
+
 	int variation(int x, int y) const;
 	const tile_pattern* get_matching_pattern(int x, int y, tile_pattern_cache& cache, bool* face_right) const;
+
+	//the stages of build_tiles(). The cells to build tiles for are found,
+	//then where multi patterns are placed over them, adding any tiles they
+	//put in other zorders, then the tiles of each cell in rows y1 to y2.
+	void get_cells_to_build(const rect* r, int* x1, int* y1, int* x2, int* y2) const;
+	void find_multi_pattern_matches(int x1, int y1, int x2, int y2, const rect* r, point_map<level_object*>* multi_pattern_matches, std::vector<level_tile>* tiles) const;
+	void build_cell_tiles(int x1, int y1, int x2, int y2, const rect* r, const point_map<level_object*>& multi_pattern_matches, std::vector<level_tile>* tiles) const;
+	int width() const;
 	variant get_value(const std::string& key) const { return variant(); }
 	int xpos_, ypos_;
 	int x_speed_, y_speed_;
@@ -94,15 +119,15 @@ private:
 	//a map of all of our strings, which maps into pattern_index.
 	std::vector<std::vector<int> > map_;
 
-	//an entry which holds one of the strings found in this map, as well
-	//as the patterns it matches.
+	//an entry which holds one of the strings found in this map.
 	struct pattern_index_entry {
 		pattern_index_entry() { for(int n = 0; n != str.size(); ++n) { str[n] = 0; } }
 		tile_string str;
-		mutable std::vector<const boost::regex*> matching_patterns;
 	};
 
-	const pattern_index_entry& get_tile_entry(int y, int x) const;
+	//the index into pattern_index_ of a tile. Tiles outside the map are
+	//the empty string, which is always entry 0.
+	int get_tile_index(int y, int x) const;
 
 	std::vector<pattern_index_entry> pattern_index_;
 
@@ -117,7 +142,7 @@ private:
 	//different_zorder_mapping represents the mappings in different zorders
 	//to this tile_map.
 	void apply_matching_multi_pattern(int& x, int y,
-	  const multi_tile_pattern& pattern,
+	  int multi_pattern_index,
 	  point_map<level_object*>& mapping,
 	  std::map<point_zorder, level_object*>& different_zorder_mapping) const;
 
@@ -129,6 +154,11 @@ private:
 	//update our view into it.
 	int patterns_version_;
 
+	//lookup tables of which patterns each of our strings matches, compiled
+	//by build_patterns(). They are shared between copies of the map.
+	struct pattern_tables;
+	boost::shared_ptr<const pattern_tables> pattern_tables_;
+
 	std::vector<std::vector<int> > variations_;
 
 #ifndef NO_EDITOR
@@ -78,11 +78,12 @@ struct NameValuePairLocs {
 };
 
 NameValuePairLocs
-find_pair_range(const std::string& contents, int line, int col, variant key) {
-	ASSERT_LOG(key.get_debug_info(), "NO DEBUG INFO");
+find_pair_range(const std::string& contents, int line, int col, variant map, variant key) {
+	const variant::debug_info* key_info = map.get_key_debug_info(key);
+	ASSERT_LOG(key_info, "NO DEBUG INFO");
 
 	std::string::const_iterator i1 = contents.begin();
-	while(i1 != contents.end() && (line < key.get_debug_info()->line || col < key.get_debug_info()->column)) {
+	while(i1 != contents.end() && (line < key_info->line || col < key_info->column)) {
 		if(*i1 == '\n') {
 			col = 1;
 			++line;
@@ -95,7 +96,7 @@ find_pair_range(const std::string& contents, int line, int col, variant key) {
 
 	NameValuePairLocs result = { i1, i1, i1, i1, i1, false };
 
-	ASSERT_LOG(i1 != contents.end(), "COULD NOT FIND LOCATION FOR " << key << ": " << line << ", " << col << ": " << key.get_debug_info()->line << ", " << key.get_debug_info()->column << ": " << contents);
+	ASSERT_LOG(i1 != contents.end(), "COULD NOT FIND LOCATION FOR " << key << ": " << line << ", " << col << ": " << key_info->line << ", " << key_info->column << ": " << contents);
 
 	const char* ptr = &*i1;
 	const char* end_ptr = contents.c_str() + contents.size();
@@ -196,7 +197,7 @@ std::string modify_variant_text(const std::string& contents, variant original, v
 				}
 
 				//modify value.
-				NameValuePairLocs range = find_pair_range(contents, line, col, item.first);
+				NameValuePairLocs range = find_pair_range(contents, line, col, original, item.first);
 				std::string new_contents(range.begin_value, range.end_value);
 				int l = line, c = col;
 				advance_line_col(contents.begin(), range.begin_value, l, c);
@@ -206,7 +207,7 @@ std::string modify_variant_text(const std::string& contents, variant original, v
 				mods.push_back(Modification(range.begin_value - contents.begin(), range.end_value - contents.begin(), new_contents));
 			} else {
 				//delete value
-				NameValuePairLocs range = find_pair_range(contents, line, col, item.first);
+				NameValuePairLocs range = find_pair_range(contents, line, col, original, item.first);
 				mods.push_back(Modification(range.begin_name - contents.begin(), range.end_comma - contents.begin(), ""));
 			}
 		}
@@ -0,0 +1,380 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+	
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <boost/intrusive_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "asserts.hpp"
+#include "controls.hpp"
+#include "custom_object.hpp"
+#include "filesystem.hpp"
+#include "foreach.hpp"
+#include "formula.hpp"
+#include "formula_callable.hpp"
+#include "formula_object.hpp"
+#include "formula_profiler.hpp"
+#include "framed_gui_element.hpp"
+#include "gui_section.hpp"
+#include "json_parser.hpp"
+#include "level.hpp"
+#include "load_level.hpp"
+#include "preferences.hpp"
+#include "random.hpp"
+#include "replay.hpp"
+#include "string_utils.hpp"
+#include "texture.hpp"
+#include "tile_map.hpp"
+#include "unit_test.hpp"
+
+#if defined(USE_BOX2D)
+#include "b2d_ffl.hpp"
+#endif
+
+extern bool g_headless;
+extern int g_replay_keyframe_interval;
+
+namespace {
+
+//a run of cycles with the same controls held.
+struct control_run {
+	int cycles;
+	unsigned char keys;
+};
+
+unsigned char parse_controls(const std::vector<std::string>& names)
+{
+	unsigned char keys = 0;
+	foreach(const std::string& name, names) {
+		int n = 0;
+		while(controls::control_names()[n] && name != controls::control_names()[n]) {
+			++n;
+		}
+
+		ASSERT_LOG(controls::control_names()[n], "Unknown control: " << name);
+		keys |= 1 << n;
+	}
+
+	return keys;
+}
+
+//reads a file of controls, with a line for each run of cycles: the number
+//of cycles followed by the controls held, e.g. "30 right jump".
+std::vector<control_run> read_controls_file(const std::string& fname)
+{
+	std::vector<control_run> result;
+	foreach(const std::string& line, util::split(sys::read_file(fname), '\n')) {
+		std::vector<std::string> items = util::split(line, ' ');
+		if(items.empty() || items.front()[0] == '#') {
+			continue;
+		}
+
+		control_run run;
+		run.cycles = atoi(items.front().c_str());
+		ASSERT_LOG(run.cycles > 0, "Bad line in controls file " << fname << ": " << line);
+		run.keys = parse_controls(std::vector<std::string>(items.begin() + 1, items.end()));
+		result.push_back(run);
+	}
+
+	return result;
+}
+
+//loads what levels need which isn't loaded before utilities run.
+void load_game_data()
+{
+	const variant gui_node = json::parse_from_file(preferences::load_compiled() ? "data/compiled/gui.cfg" : "data/gui.cfg");
+	gui_section::init(gui_node);
+	framed_gui_element::init(gui_node);
+
+	custom_object::init();
+	tile_map::init(json::parse_from_file("data/tiles.cfg"));
+	game_logic::formula_object::load_all_classes();
+}
+
+//the most memory the process has used, in kilobytes, or -1 if it isn't
+//known.
+long peak_memory_kb()
+{
+#if defined(__linux__)
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0) {
+		return usage.ru_maxrss;
+	}
+#elif defined(__APPLE__)
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0) {
+		return usage.ru_maxrss/1024;
+	}
+#endif
+	return -1;
+}
+
+}
+
+//runs a level as fast as possible without a window or GL context, for
+//soak tests and bots. Usage:
+//  simulate_level <level> [--cycles=N] [--seed=N] [--controls=FILE | --script=FFL]
+//  simulate_level --replay=FILE [--seek=N] [--cycles=N] [--verify]
+//A script is a formula given the cycle and level which gives the list of
+//controls to hold that cycle. Without either no controls are held.
+//
+//A replay is played from the cycle it's seeked to until its end, or for
+//the given number of cycles. With --verify the level is compared to the
+//replay's keyframes as they're passed, to find where it stops matching.
+COMMAND_LINE_UTILITY(simulate_level)
+{
+	std::string level_cfg, controls_file, script, replay_file;
+	int ncycles = -1;
+	int seed = -1;
+	int seek = 0;
+	bool verify = false;
+	foreach(const std::string& arg, args) {
+		if(arg.compare(0, 9, "--cycles=") == 0) {
+			ncycles = atoi(arg.c_str() + 9);
+		} else if(arg.compare(0, 7, "--seed=") == 0) {
+			seed = atoi(arg.c_str() + 7);
+		} else if(arg.compare(0, 11, "--controls=") == 0) {
+			controls_file = arg.substr(11);
+		} else if(arg.compare(0, 9, "--script=") == 0) {
+			script = arg.substr(9);
+		} else if(arg.compare(0, 9, "--replay=") == 0) {
+			replay_file = arg.substr(9);
+		} else if(arg.compare(0, 7, "--seek=") == 0) {
+			seek = atoi(arg.c_str() + 7);
+		} else if(arg == "--verify") {
+			verify = true;
+		} else {
+			ASSERT_LOG(level_cfg.empty(), "Unrecognized argument: " << arg);
+			level_cfg = arg;
+		}
+	}
+
+	ASSERT_LOG(level_cfg.empty() != replay_file.empty(), "usage: simulate_level <level> [--cycles=N] [--seed=N] [--controls=FILE | --script=FFL]\n"
+	           "       simulate_level --replay=FILE [--seek=N] [--cycles=N] [--verify]");
+
+	g_headless = true;
+	graphics::texture::manager texture_manager;
+
+#if defined(USE_BOX2D)
+	box2d::manager b2d_manager;
+#endif
+
+	load_game_data();
+
+	std::vector<control_run> control_runs;
+	if(controls_file.empty() == false) {
+		control_runs = read_controls_file(controls_file);
+	}
+
+	game_logic::formula_ptr script_formula;
+	if(script.empty() == false) {
+		script_formula.reset(new game_logic::formula(variant(script)));
+	}
+
+	if(seed >= 0) {
+		rng::set_seed(seed);
+	}
+
+	boost::scoped_ptr<replay::player> replay_player;
+	boost::intrusive_ptr<level> lvl;
+
+	const int load_start = SDL_GetTicks();
+	if(replay_file.empty() == false) {
+		replay_player.reset(new replay::player(json::parse_from_file(replay_file)));
+		replay_player->set_verify(verify);
+		std::cout << "LOADED REPLAY OF " << replay_player->num_cycles() << " CYCLES OF " << replay_player->get_level()->id() << " IN " << (SDL_GetTicks() - load_start) << "ms\n";
+
+		const int seek_start = SDL_GetTicks();
+		replay_player->seek(seek);
+		std::cout << "SEEKED TO CYCLE " << seek << " IN " << (SDL_GetTicks() - seek_start) << "ms\n";
+
+		if(ncycles < 0) {
+			ncycles = replay_player->num_cycles() - seek;
+		}
+	} else {
+		lvl = load_level(level_cfg);
+		lvl->finish_loading();
+		lvl->set_as_current_level();
+		std::cout << "LOADED " << level_cfg << " IN " << (SDL_GetTicks() - load_start) << "ms\n";
+	}
+
+	if(ncycles < 0) {
+		ncycles = 1000;
+	}
+
+	formula_profiler::enable_instrumentation_totals();
+
+	std::vector<control_run>::const_iterator run = control_runs.begin();
+	int run_cycle = 0;
+
+	const int start = SDL_GetTicks();
+	for(int cycle = 0; cycle != ncycles; ++cycle) {
+		if(replay_player) {
+			if(!replay_player->step()) {
+				ncycles = cycle;
+				break;
+			}
+
+			continue;
+		}
+
+		unsigned char keys = 0;
+		if(script_formula) {
+			boost::intrusive_ptr<game_logic::map_formula_callable> callable(new game_logic::map_formula_callable);
+			callable->add("cycle", variant(cycle));
+			callable->add("level", variant(lvl.get()));
+			keys = parse_controls(script_formula->execute(*callable).as_list_string());
+		} else if(run != control_runs.end()) {
+			keys = run->keys;
+			if(++run_cycle == run->cycles) {
+				++run;
+				run_cycle = 0;
+			}
+		}
+
+		controls::local_controls_lock lock(keys);
+		lvl->process();
+	}
+
+	const int elapsed = std::max<int>(1, SDL_GetTicks() - start);
+
+	std::cout << "SIMULATED " << ncycles << " CYCLES IN " << elapsed << "ms: " << (ncycles*1000LL)/elapsed << " CYCLES/SEC\n";
+
+	//instruments can be nested, so the times don't add up to the total.
+	foreach(const formula_profiler::instrumentation_total& t, formula_profiler::get_instrumentation_totals()) {
+		std::cout << "  " << std::left << std::setw(20) << t.id << std::right << std::setw(10) << t.time_us/1000 << "ms "
+		          << std::setw(4) << (t.time_us/10)/elapsed << "% " << std::setw(10) << t.calls << " calls\n";
+	}
+
+	std::cout << "PEAK MEMORY: " << peak_memory_kb() << "KB\n";
+
+	if(replay_player && verify) {
+		if(replay_player->first_divergence() >= 0) {
+			std::cout << "REPLAY DIVERGED FROM ITS KEYFRAMES AT CYCLE " << replay_player->first_divergence() << "\n";
+		} else {
+			std::cout << "REPLAY MATCHED ITS KEYFRAMES\n";
+		}
+	}
+}
+
+//records a level being played and checks the recording plays back the
+//same: from the start, after seeking forward to cycles between keyframes,
+//after seeking back, and after going through the replay's JSON. Fails if
+//playing back diverges from a keyframe or doesn't end in the state the
+//recorded level ended in. Unit tests can't load levels, so this is how
+//replays are tested, e.g.
+//  --module=phydemo --utility=test_replay replay_test.cfg
+COMMAND_LINE_UTILITY(test_replay)
+{
+	std::string level_cfg;
+	int ncycles = 300;
+	int keyframe_interval = 50;
+	foreach(const std::string& arg, args) {
+		if(arg.compare(0, 9, "--cycles=") == 0) {
+			ncycles = atoi(arg.c_str() + 9);
+		} else if(arg.compare(0, 20, "--keyframe-interval=") == 0) {
+			keyframe_interval = atoi(arg.c_str() + 20);
+		} else {
+			ASSERT_LOG(level_cfg.empty(), "Unrecognized argument: " << arg);
+			level_cfg = arg;
+		}
+	}
+
+	ASSERT_LOG(level_cfg.empty() == false && ncycles > keyframe_interval && keyframe_interval > 0,
+	           "usage: test_replay <level> [--cycles=N] [--keyframe-interval=N], with more cycles than the keyframe interval");
+
+	g_headless = true;
+	graphics::texture::manager texture_manager;
+
+#if defined(USE_BOX2D)
+	box2d::manager b2d_manager;
+#endif
+
+	load_game_data();
+
+	g_replay_keyframe_interval = keyframe_interval;
+	rng::set_seed(1);
+
+	boost::intrusive_ptr<level> lvl(load_level(level_cfg));
+	lvl->finish_loading();
+	lvl->set_as_current_level();
+
+	variant replay_node;
+	{
+		replay::recorder recorder(*lvl);
+		for(int cycle = 0; cycle != ncycles; ++cycle) {
+			//changes the controls held every few cycles, through every
+			//combination of them.
+			const unsigned char keys = static_cast<unsigned char>((cycle/7)*37);
+			controls::local_controls_lock lock(keys);
+			lvl->process();
+			recorder.record_cycle();
+		}
+
+		replay_node = recorder.write();
+	}
+
+	const variant end_state = lvl->write();
+	const unsigned int end_seed = rng::get_seed();
+	const int nkeyframes = replay_node["keyframes"].num_elements();
+	ASSERT_LOG(nkeyframes > 2, "Recording " << ncycles << " cycles of " << level_cfg << " made only " << nkeyframes << " keyframes");
+
+	//cycles to seek to, in order, going back and forth across keyframes.
+	std::vector<int> seeks;
+	seeks.push_back(0);
+	seeks.push_back(keyframe_interval + keyframe_interval/2);
+	seeks.push_back(keyframe_interval/3);
+	seeks.push_back(ncycles - keyframe_interval/2);
+	seeks.push_back(2*keyframe_interval);
+	seeks.push_back(2*keyframe_interval - 1);
+
+	const variant replays[] = { replay_node, json::parse(replay_node.write_json()) };
+	foreach(const variant& node, replays) {
+		foreach(int seek, seeks) {
+			replay::player player(node);
+			player.seek(seek);
+			ASSERT_EQ(player.cycle(), seek);
+
+			player.set_verify(true);
+			while(player.step()) {
+			}
+
+			ASSERT_LOG(player.first_divergence() < 0, "Replay of " << level_cfg << " seeked to cycle " << seek << " diverged from its keyframe at cycle " << player.first_divergence());
+			ASSERT_LOG(replay::same_level_state(player.get_level()->write(), end_state) && rng::get_seed() == end_seed, "Replay of " << level_cfg << " seeked to cycle " << seek << " didn't end where the recording did");
+		}
+
+		//seeking back within one player, rather than from a fresh one.
+		replay::player player(node);
+		player.seek(ncycles);
+		player.seek(keyframe_interval/2);
+		player.set_verify(true);
+		while(player.step()) {
+		}
+
+		ASSERT_LOG(player.first_divergence() < 0, "Replay of " << level_cfg << " seeked back diverged from its keyframe at cycle " << player.first_divergence());
+		ASSERT_LOG(replay::same_level_state(player.get_level()->write(), end_state), "Replay of " << level_cfg << " seeked back didn't end where the recording did");
+	}
+
+	std::cout << "REPLAY OF " << ncycles << " CYCLES OF " << level_cfg << " WITH " << nkeyframes << " KEYFRAMES PLAYED BACK THE SAME FROM " << seeks.size() << " SEEKS\n";
+}
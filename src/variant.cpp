@@ -24,6 +24,8 @@
 
 #include "boost/algorithm/string/replace.hpp"
 #include "boost/lexical_cast.hpp"
+#include "boost/functional/hash.hpp"
+#include "boost/unordered_map.hpp"
 
 #include "asserts.hpp"
 #include "ffl_weak_ptr.hpp"
@@ -36,6 +38,8 @@
 #include "formula_object.hpp"
 
 #include "i18n.hpp"
+#include "preferences.hpp"
+#include "thread.hpp"
 #include "unit_test.hpp"
 #include "variant.hpp"
 #include "variant_type.hpp"
@@ -65,6 +69,11 @@ std::set<variant*> callable_variants_loading, delayed_variants_loading;
 
 std::vector<CallStackEntry> call_stack;
 
+//frames an exception has propagated out of, innermost first. Only used
+//when the call stack is tracked lazily.
+typedef std::vector<boost::intrusive_ptr<const game_logic::formula_expression> > unwound_frames;
+VARIANT_THREAD_LOCAL unwound_frames* unwound_call_stack = NULL;
+
 variant last_failed_query_map, last_failed_query_key;
 variant last_query_map;
 variant UnfoundInMapNullVariant;
@@ -93,14 +102,44 @@ void pop_call_stack()
 	call_stack.pop_back();
 }
 
+PREF_BOOL(ffl_lazy_call_stack, false, "Don't track the FFL call stack during evaluation; reconstruct it only when an error occurs. Faster, but the call stack isn't available to the debugger.");
+
+void record_unwound_call_stack_frame(const game_logic::formula_expression* frame)
+{
+	if(unwound_call_stack == NULL) {
+		unwound_call_stack = new unwound_frames;
+	}
+
+	if(unwound_call_stack->size() < 4096) {
+		unwound_call_stack->push_back(frame);
+	}
+}
+
+void clear_unwound_call_stack()
+{
+	if(unwound_call_stack != NULL && !unwound_call_stack->empty()) {
+		unwound_call_stack->clear();
+	}
+}
+
 std::string get_call_stack()
 {
+	//innermost frame first.
+	std::vector<const game_logic::formula_expression*> frames;
+	for(std::vector<CallStackEntry>::const_reverse_iterator i = call_stack.rbegin(); i != call_stack.rend(); ++i) {
+		frames.push_back(i->expression);
+	}
+
+	if(frames.empty() && unwound_call_stack != NULL) {
+		for(int n = 0; n != unwound_call_stack->size(); ++n) {
+			frames.push_back((*unwound_call_stack)[n].get());
+		}
+	}
+
 	variant current_frame;
 	std::string res;
-	std::vector<CallStackEntry> reversed_call_stack = call_stack;
-	std::reverse(reversed_call_stack.begin(), reversed_call_stack.end());
-	for(std::vector<CallStackEntry>::const_iterator i = reversed_call_stack.begin(); i != reversed_call_stack.end(); ++i) {
-		const game_logic::formula_expression* p = i->expression;
+	for(std::vector<const game_logic::formula_expression*>::const_iterator i = frames.begin(); i != frames.end(); ++i) {
+		const game_logic::formula_expression* p = *i;
 		if(p && p->parent_formula() != current_frame) {
 			current_frame = p->parent_formula();
 			const variant::debug_info* info = current_frame.get_debug_info();
@@ -165,19 +204,17 @@ VariantFunctionTypeInfo::VariantFunctionTypeInfo() : num_unneeded_args(0)
 
 struct variant_list {
 
-	variant_list() : begin(elements.begin()), end(elements.end()),
+	variant_list() : begin(inline_elements), end(inline_elements),
 	                 refcount(0), storage(NULL)
 	{}
 
-	variant_list(const variant_list& o) :
-	   elements(o.begin, o.end), begin(elements.begin()), end(elements.end()),
-	   refcount(1), storage(NULL)
-	{}
+	variant_list(const variant_list& o) : refcount(1), storage(NULL)
+	{
+		assign(o.begin, o.end);
+	}
 
 	const variant_list& operator=(const variant_list& o) {
-		elements.assign(o.begin, o.end),
-		begin = elements.begin();
-		end = elements.end();
+		assign(o.begin, o.end);
 		storage = NULL;
 		return *this;
 	}
@@ -188,45 +225,340 @@ struct variant_list {
 		}
 	}
 
+	//lists this short are held in inline_elements rather than elements.
+	enum { InlineSize = 4 };
+
+	void assign(const variant* b, const variant* e) {
+		if(e - b <= InlineSize) {
+			elements.clear();
+			std::copy(b, e, inline_elements);
+			begin = inline_elements;
+			end = inline_elements + (e - b);
+		} else {
+			elements.assign(b, e);
+			use_elements();
+		}
+	}
+
+	//make begin and end refer to the contents of elements.
+	void use_elements() {
+		begin = elements.empty() ? inline_elements : &elements[0];
+		end = begin + elements.size();
+	}
+
 	size_t size() const { return end - begin; }
 
+	//list headers are recycled through a per-thread free list, so that
+	//the temporary lists created every frame don't go through malloc.
+	//The list is released when a threading::thread exits.
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+
 	variant::debug_info info;
 	boost::intrusive_ptr<const game_logic::formula_expression> expression;
 	std::vector<variant> elements;
-	std::vector<variant>::iterator begin, end;
+	variant inline_elements[InlineSize];
+	variant* begin;
+	variant* end;
 	int refcount;
 	variant_list* storage;
 };
 
+namespace {
+struct free_list_header {
+	free_list_header* next;
+};
+
+VARIANT_THREAD_LOCAL free_list_header* variant_list_free_list = NULL;
+VARIANT_THREAD_LOCAL int variant_list_free_list_size = 0;
+
+//the most list headers a thread will keep around for reuse.
+const int MaxFreeVariantLists = 4096;
+
+void release_variant_list_free_list()
+{
+	while(variant_list_free_list != NULL) {
+		free_list_header* header = variant_list_free_list;
+		variant_list_free_list = header->next;
+		::operator delete(header);
+	}
+
+	variant_list_free_list_size = 0;
+}
+
+void release_unwound_call_stack()
+{
+	delete unwound_call_stack;
+	unwound_call_stack = NULL;
+}
+
+struct thread_cache_releaser {
+	thread_cache_releaser() {
+		threading::add_thread_exit_handler(release_variant_list_free_list);
+		threading::add_thread_exit_handler(release_unwound_call_stack);
+	}
+};
+
+thread_cache_releaser cache_releaser;
+}
+
+void* variant_list::operator new(size_t size)
+{
+	if(variant_list_free_list != NULL && size == sizeof(variant_list)) {
+		free_list_header* header = variant_list_free_list;
+		variant_list_free_list = header->next;
+		--variant_list_free_list_size;
+		return header;
+	}
+
+	return ::operator new(size);
+}
+
+void variant_list::operator delete(void* p)
+{
+	if(p == NULL) {
+		return;
+	}
+
+	if(variant_list_free_list_size >= MaxFreeVariantLists) {
+		::operator delete(p);
+		return;
+	}
+
+	free_list_header* header = static_cast<free_list_header*>(p);
+	header->next = variant_list_free_list;
+	variant_list_free_list = header;
+	++variant_list_free_list_size;
+}
+
 struct variant_string {
 	variant::debug_info info;
 	boost::intrusive_ptr<const game_logic::formula_expression> expression;
 
-	variant_string() : refcount(0)
+	variant_string() : refcount(0), atom(NULL)
 	{}
-	variant_string(const variant_string& o) : str(o.str), translated_from(o.translated_from), refcount(1)
+	variant_string(const variant_string& o) : str(o.str), translated_from(o.translated_from), refcount(1), atom(o.atom)
 	{}
 	std::string str, translated_from;
 	int refcount;
 
 	std::vector<const game_logic::formula*> formulae_using_this;
 
+	//if the text of this string is interned, the atom for that text. An
+	//atom points to itself, is never modified and is never freed, so it
+	//isn't reference counted and may be shared between threads.
+	const variant_string* atom;
+
+	//the hash of str. Only calculated for atoms.
+	size_t hash;
+
 	private:
 	void operator=(const variant_string&);
 };
 
+namespace {
+size_t hash_string(const std::string& str)
+{
+	return boost::hash_range(str.begin(), str.end());
+}
+
+//whether two map keys are the same key as far as std::map is concerned.
+bool map_keys_equivalent(const variant& a, const variant& b)
+{
+	if(a.is_string() && b.is_string()) {
+		return a == b;
+	}
+
+	return !(a < b) && !(b < a);
+}
+}
+
+//An open addressing hash table indexing the nodes of a map, so that keys
+//can be looked up without walking the tree. The map remains the storage
+//for the elements, which keeps iteration sorted and keeps pointers to
+//values stable. Small maps aren't indexed since searching the tree is as
+//fast as hashing the key.
+class variant_map_index
+{
+public:
+	typedef std::map<variant,variant>::value_type node;
+
+	variant_map_index() : size_(0)
+	{}
+
+	bool empty() const { return size_ == 0; }
+
+	void clear() {
+		slots_.clear();
+		size_ = 0;
+	}
+
+	void build(std::map<variant,variant>& m) {
+		clear();
+		if(m.size() < MinIndexedSize) {
+			return;
+		}
+
+		size_t nslots = 16;
+		while(nslots < m.size()*2) {
+			nslots *= 2;
+		}
+
+		slots_.resize(nslots);
+		for(std::map<variant,variant>::iterator i = m.begin(); i != m.end(); ++i) {
+			insert_node(&*i, i->first.hash());
+		}
+	}
+
+	node* find(const variant& key) const {
+		const size_t hash = key.hash();
+		const size_t mask = slots_.size() - 1;
+		for(size_t n = hash&mask; slots_[n].item; n = (n+1)&mask) {
+			if(slots_[n].hash == hash && map_keys_equivalent(slots_[n].item->first, key)) {
+				return slots_[n].item;
+			}
+		}
+
+		return NULL;
+	}
+
+	//called after an element is added to m.
+	void insert(std::map<variant,variant>& m, node* item) {
+		if(empty() || (size_+1)*2 > slots_.size()) {
+			build(m);
+			return;
+		}
+
+		insert_node(item, item->first.hash());
+	}
+
+	//called before the element with the given key is erased from its map.
+	void erase(const variant& key) {
+		const size_t hash = key.hash();
+		const size_t mask = slots_.size() - 1;
+		size_t n = hash&mask;
+		while(slots_[n].item && !(slots_[n].hash == hash && map_keys_equivalent(slots_[n].item->first, key))) {
+			n = (n+1)&mask;
+		}
+
+		if(slots_[n].item == NULL) {
+			return;
+		}
+
+		//backward shift deletion: move any later entries in this run
+		//which would be unreachable into the gap.
+		size_t gap = n;
+		for(size_t i = (n+1)&mask; slots_[i].item; i = (i+1)&mask) {
+			const size_t ideal = slots_[i].hash&mask;
+			if(((i - ideal)&mask) >= ((i - gap)&mask)) {
+				slots_[gap] = slots_[i];
+				gap = i;
+			}
+		}
+
+		slots_[gap] = slot();
+		--size_;
+	}
+
+	enum { MinIndexedSize = 8 };
+private:
+	struct slot {
+		slot() : hash(0), item(NULL) {}
+		size_t hash;
+		node* item;
+	};
+
+	void insert_node(node* item, size_t hash) {
+		const size_t mask = slots_.size() - 1;
+		size_t n = hash&mask;
+		while(slots_[n].item) {
+			n = (n+1)&mask;
+		}
+
+		slots_[n].hash = hash;
+		slots_[n].item = item;
+		++size_;
+	}
+
+	std::vector<slot> slots_;
+	size_t size_;
+};
+
 struct variant_map {
 	variant::debug_info info;
 	boost::intrusive_ptr<const game_logic::formula_expression> expression;
 
 	variant_map() : refcount(0), modcount(0)
 	{}
-	variant_map(const variant_map& o) : expression(o.expression), elements(o.elements), refcount(1), modcount(0)
-	{}
+	variant_map(const variant_map& o) : expression(o.expression), elements(o.elements), key_info(o.key_info), refcount(1), modcount(0)
+	{
+	}
 
+	//the elements of the map. Modify through set() and erase() so the
+	//index is kept up to date, or call reindex() afterwards.
 	std::map<variant,variant> elements;
+
+	//built by the first lookup into a large enough map, since many maps
+	//are made and copied without ever having a key looked up.
+	mutable variant_map_index index;
+
+	//the locations of keys of a map parsed from a document. Copies of the
+	//map share them, and maps not parsed from a document have none.
+	typedef std::vector<std::pair<variant, variant::debug_info> > key_info_list;
+	boost::shared_ptr<key_info_list> key_info;
+
 	int refcount;
 	int modcount;
+
+	void reindex() {
+		index.clear();
+	}
+
+	const variant* find(const variant& key) const {
+		if(index.empty()) {
+			if(elements.size() < variant_map_index::MinIndexedSize) {
+				std::map<variant,variant>::const_iterator i = elements.find(key);
+				return i == elements.end() ? NULL : &i->second;
+			}
+
+			index.build(const_cast<std::map<variant,variant>&>(elements));
+		}
+
+		const variant_map_index::node* item = index.find(key);
+		return item ? &item->second : NULL;
+	}
+
+	variant* find_mutable(const variant& key) {
+		return const_cast<variant*>(find(key));
+	}
+
+	void set(const variant& key, const variant& value) {
+		if(index.empty()) {
+			//setting a key doesn't build the index; the next lookup will.
+			std::pair<std::map<variant,variant>::iterator, bool> result = elements.insert(std::pair<variant,variant>(key, value));
+			if(!result.second) {
+				result.first->second = value;
+			}
+			return;
+		}
+
+		variant_map_index::node* existing = index.find(key);
+		if(existing) {
+			existing->second = value;
+			return;
+		}
+
+		std::map<variant,variant>::iterator i = elements.insert(std::pair<variant,variant>(key, value)).first;
+		index.insert(elements, &*i);
+	}
+
+	void erase(const variant& key) {
+		if(index.empty() == false) {
+			index.erase(key);
+		}
+
+		elements.erase(key);
+	}
 private:
 	void operator=(const variant_map&);
 };
@@ -322,7 +654,9 @@ case VARIANT_TYPE_LIST:
 ++list_->refcount;
 break;
 case VARIANT_TYPE_STRING:
-++string_->refcount;
+if(string_->atom != string_) {
+	++string_->refcount;
+}
 break;
 case VARIANT_TYPE_MAP:
 ++map_->refcount;
@@ -369,7 +703,7 @@ if(--list_->refcount == 0) {
 }
 break;
 case VARIANT_TYPE_STRING:
-if(--string_->refcount == 0) {
+if(string_->atom != string_ && --string_->refcount == 0) {
 	delete string_;
 }
 break;
@@ -437,6 +771,8 @@ const game_logic::formula_expression* variant::get_source_expression() const
 
 void variant::set_source_expression(const game_logic::formula_expression* expr)
 {
+	unshare_atom();
+
 	switch(type_) {
 	case VARIANT_TYPE_LIST:
 	case VARIANT_TYPE_STRING:
@@ -450,6 +786,8 @@ void variant::set_source_expression(const game_logic::formula_expression* expr)
 
 void variant::set_debug_info(const debug_info& info)
 {
+	unshare_atom();
+
 	switch(type_) {
 	case VARIANT_TYPE_LIST:
 	case VARIANT_TYPE_STRING:
@@ -461,6 +799,32 @@ void variant::set_debug_info(const debug_info& info)
 	}
 }
 
+void variant::set_key_debug_info(const variant& key, const debug_info& info)
+{
+	if(type_ == VARIANT_TYPE_MAP) {
+		if(!map_->key_info) {
+			map_->key_info.reset(new variant_map::key_info_list);
+		} else if(!map_->key_info.unique()) {
+			map_->key_info.reset(new variant_map::key_info_list(*map_->key_info));
+		}
+
+		map_->key_info->push_back(std::pair<variant, debug_info>(key, info));
+	}
+}
+
+const variant::debug_info* variant::get_key_debug_info(const variant& key) const
+{
+	if(type_ == VARIANT_TYPE_MAP && map_->key_info) {
+		for(variant_map::key_info_list::const_iterator i = map_->key_info->begin(); i != map_->key_info->end(); ++i) {
+			if(i->first == key) {
+				return &i->second;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 const variant::debug_info* variant::get_debug_info() const
 {
 	switch(type_) {
@@ -539,11 +903,26 @@ variant::variant(std::vector<variant>* array)
 	assert(array);
 	list_ = new variant_list;
 	list_->elements.swap(*array);
-	list_->begin = list_->elements.begin();
-	list_->end = list_->elements.end();
+	list_->use_elements();
 	increment_refcount();
 }
 
+variant variant::create_list(const variant* begin, const variant* end)
+{
+	variant v;
+	v.type_ = VARIANT_TYPE_LIST;
+	v.list_ = new variant_list;
+	v.list_->assign(begin, end);
+	v.increment_refcount();
+	return v;
+}
+
+variant variant::create_list(const variant& a, const variant& b)
+{
+	const variant items[] = { a, b };
+	return create_list(items, items + 2);
+}
+
 variant::variant(const char* s)
    : type_(VARIANT_TYPE_STRING)
 {
@@ -576,6 +955,58 @@ variant variant::create_translated_string(const std::string& str, const std::str
 	return v;
 }
 
+namespace {
+typedef boost::unordered_map<std::string, variant_string*> atom_table;
+
+atom_table& get_atom_table()
+{
+	static atom_table* table = new atom_table;
+	return *table;
+}
+
+threading::mutex& get_atom_table_mutex()
+{
+	static threading::mutex instance;
+	return instance;
+}
+}
+
+variant variant::create_atom(const std::string& str)
+{
+	variant_string* atom = NULL;
+
+	{
+		threading::lock lck(get_atom_table_mutex());
+		variant_string*& entry = get_atom_table()[str];
+		if(entry == NULL) {
+			entry = new variant_string;
+			entry->str = str;
+			entry->refcount = 1;
+			entry->atom = entry;
+			entry->hash = hash_string(str);
+		}
+
+		atom = entry;
+	}
+
+	variant v;
+	v.type_ = VARIANT_TYPE_STRING;
+	v.string_ = atom;
+	return v;
+}
+
+bool variant::is_atom() const
+{
+	return type_ == VARIANT_TYPE_STRING && string_->atom != NULL;
+}
+
+void variant::unshare_atom()
+{
+	if(type_ == VARIANT_TYPE_STRING && string_->atom == string_) {
+		string_ = new variant_string(*string_);
+	}
+}
+
 variant::variant(std::map<variant,variant>* map)
     : type_(VARIANT_TYPE_MAP)
 {
@@ -589,6 +1020,7 @@ variant::variant(std::map<variant,variant>* map)
 	assert(map);
 	map_ = new variant_map;
 	map_->elements.swap(*map);
+	map_->reindex();
 	increment_refcount();
 }
 
@@ -705,8 +1137,8 @@ const variant& variant::operator[](const variant v) const
 
 	if(type_ == VARIANT_TYPE_MAP) {
 		assert(map_);
-		std::map<variant,variant>::const_iterator i = map_->elements.find(v);
-		if (i == map_->elements.end())
+		const variant* result = map_->find(v);
+		if(result == NULL)
 		{
 			last_failed_query_map = *this;
 			last_failed_query_key = v;
@@ -715,7 +1147,7 @@ const variant& variant::operator[](const variant v) const
 		}
 
 		last_query_map = *this;
-		return i->second;
+		return *result;
 	} else if(type_ == VARIANT_TYPE_LIST) {
 		return operator[](v.as_int());
 	} else {
@@ -740,12 +1172,8 @@ bool variant::has_key(const variant& key) const
 		return false;
 	}
 
-	std::map<variant,variant>::const_iterator i = map_->elements.find(key);
-	if(i != map_->elements.end() && i->second.is_null() == false) {
-		return true;
-	} else {
-		return false;
-	}
+	const variant* result = map_->find(key);
+	return result != NULL && result->is_null() == false;
 }
 
 bool variant::has_key(const std::string& key) const
@@ -1236,7 +1664,7 @@ variant variant::add_attr(variant key, variant value)
 		}
 
 		make_unique();
-		map_->elements[key] = value;
+		map_->set(key, value);
 		return *this;
 	} else {
 		return variant();
@@ -1255,36 +1683,48 @@ variant variant::remove_attr(variant key)
 		}
 
 		make_unique();
-		map_->elements.erase(key);
+		map_->erase(key);
 		return *this;
 	} else {
 		return variant();
 	}
 }
 
+namespace {
+unsigned int variant_mutation_count = 0;
+}
+
+unsigned int variant::mutation_count()
+{
+	return variant_mutation_count;
+}
+
 void variant::add_attr_mutation(variant key, variant value)
 {
 	if(is_map()) {
-		map_->elements[key] = value;
+		map_->set(key, value);
 		map_->modcount++;
+		++variant_mutation_count;
 	}
 }
 
 void variant::remove_attr_mutation(variant key)
 {
 	if(is_map()) {
-		map_->elements.erase(key);
+		map_->erase(key);
 		map_->modcount++;
+		++variant_mutation_count;
 	}
 }
 
 variant* variant::get_attr_mutable(variant key)
 {
 	if(is_map()) {
-		std::map<variant,variant>::iterator i = map_->elements.find(key);
-		if(i != map_->elements.end()) {
+		variant* result = map_->find_mutable(key);
+		if(result) {
 			map_->modcount++;
-			return &i->second;
+			++variant_mutation_count;
+			return result;
 		}
 	}
 
@@ -1295,6 +1735,7 @@ variant* variant::get_index_mutable(int index)
 {
 	if(is_list()) {
 		if(index >= 0 && index < list_->size()) {
+			++variant_mutation_count;
 			return &list_->begin[index];
 		}
 	}
@@ -1700,6 +2141,10 @@ bool variant::operator==(const variant& v) const
 	}
 
 	case VARIANT_TYPE_STRING: {
+		if(string_->atom && v.string_->atom) {
+			return string_->atom == v.string_->atom;
+		}
+
 		return string_->str == v.string_->str;
 	}
 
@@ -1781,6 +2226,10 @@ bool variant::operator<=(const variant& v) const
 	}
 
 	case VARIANT_TYPE_STRING: {
+		if(string_->atom && string_->atom == v.string_->atom) {
+			return true;
+		}
+
 		return string_->str <= v.string_->str;
 	}
 
@@ -1845,6 +2294,16 @@ bool variant::operator>=(const variant& v) const
 
 bool variant::operator<(const variant& v) const
 {
+	//fast path for strings, which most maps are keyed by. Atoms are still
+	//ordered by their text, so map iteration order doesn't change.
+	if(type_ == VARIANT_TYPE_STRING && v.type_ == VARIANT_TYPE_STRING) {
+		if(string_->atom && string_->atom == v.string_->atom) {
+			return false;
+		}
+
+		return string_->str < v.string_->str;
+	}
+
 	return !(*this >= v);
 }
 
@@ -1867,7 +2326,7 @@ void variant::throw_type_error(variant::TYPE t) const
 	if(last_query_map.is_map() && last_query_map.get_debug_info()) {
 		for(std::map<variant,variant>::const_iterator i = last_query_map.map_->elements.begin(); i != last_query_map.map_->elements.end(); ++i) {
 			if(this == &i->second) {
-				const debug_info* info = i->first.get_debug_info();
+				const debug_info* info = last_query_map.get_key_debug_info(i->first);
 				if(info == NULL) {
 					info = last_query_map.get_debug_info();
 				}
@@ -2051,6 +2510,33 @@ int variant::refcount() const
 	}
 }
 
+size_t variant::hash() const
+{
+	switch(type_) {
+	case VARIANT_TYPE_STRING:
+		return string_->atom ? string_->atom->hash : hash_string(string_->str);
+	case VARIANT_TYPE_INT:
+	case VARIANT_TYPE_DECIMAL: {
+		//ints and decimals with the same value are the same key.
+		const int64_t value = as_decimal().value();
+		return boost::hash_value(value);
+	}
+	case VARIANT_TYPE_BOOL:
+		return bool_value_ ? 1 : 0;
+	case VARIANT_TYPE_LIST: {
+		size_t seed = type_;
+		for(size_t n = 0; n != num_elements(); ++n) {
+			boost::hash_combine(seed, list_->begin[n].hash());
+		}
+		return seed;
+	}
+	default:
+		//other types are rarely used as keys, and their ordering is not
+		//by identity, so give every value of the type the same hash.
+		return type_;
+	}
+}
+
 void variant::make_unique()
 {
 	if(refcount() == 1) {
@@ -2061,12 +2547,17 @@ void variant::make_unique()
 	case VARIANT_TYPE_LIST: {
 		list_->refcount--;
 		list_ = new variant_list(*list_);
-		foreach(variant& v, list_->elements) {
-			v.make_unique();
+		for(variant* v = list_->begin; v != list_->end; ++v) {
+			v->make_unique();
 		}
 		break;
 	}
 	case VARIANT_TYPE_STRING:
+		if(string_->atom == string_) {
+			//atoms are immutable so may always be shared.
+			break;
+		}
+
 		string_->refcount--;
 		string_ = new variant_string(*string_);
 		string_->refcount = 1;
@@ -2087,6 +2578,7 @@ void variant::make_unique()
 		vm->info = map_->info;
 		vm->refcount = 1;
 		vm->elements.swap(m);
+		vm->reindex();
 		map_ = vm;
 		break;
 	}
@@ -2361,7 +2853,7 @@ void variant::write_json(std::ostream& s, write_flags flags) const
 	case VARIANT_TYPE_LIST: {
 		s << "[";
 
-		for(std::vector<variant>::const_iterator i = list_->begin;
+		for(const variant* i = list_->begin;
 		    i != list_->end; ++i) {
 			if(i != list_->begin) {
 				s << ',';
@@ -2502,7 +2994,7 @@ void variant::write_json_pretty(std::ostream& s, std::string indent, write_flags
 	}
 	case VARIANT_TYPE_LIST: {
 		bool found_non_scalar = false;
-		for(std::vector<variant>::const_iterator i = list_->begin;
+		for(const variant* i = list_->begin;
 		    i != list_->end; ++i) {
 			if(i->is_list() || i->is_map()) {
 				found_non_scalar = true;
@@ -2519,7 +3011,7 @@ void variant::write_json_pretty(std::ostream& s, std::string indent, write_flags
 		s << "[";
 
 		indent += "\t";
-		for(std::vector<variant>::const_iterator i = list_->begin;
+		for(const variant* i = list_->begin;
 		    i != list_->end; ++i) {
 			if(i != list_->begin) {
 				s << ',';
@@ -2550,13 +3042,14 @@ void variant::write_json_pretty(std::ostream& s, std::string indent, write_flags
 void variant::add_formula_using_this(const game_logic::formula* f)
 {
 	if(is_string()) {
+		unshare_atom();
 		string_->formulae_using_this.push_back(f);
 	}
 }
 
 void variant::remove_formula_using_this(const game_logic::formula* f)
 {
-	if(is_string()) {
+	if(is_string() && string_->atom != string_) {
 		string_->formulae_using_this.erase(std::remove(string_->formulae_using_this.begin(), string_->formulae_using_this.end(), f), string_->formulae_using_this.end());
 	}
 }
@@ -2586,7 +3079,7 @@ std::ostream& operator<<(std::ostream& os, const variant& v)
 std::pair<variant*,variant*> variant::range() const
 {
 	if(type_ == VARIANT_TYPE_LIST) {
-		return std::pair<variant*,variant*>(&(*list_->begin), &(*list_->end));
+		return std::pair<variant*,variant*>(list_->begin, list_->end);
 	}
 	variant v;
 	return std::pair<variant*,variant*>(&v,&v);
@@ -2602,6 +3095,203 @@ UNIT_TEST(variant_decimal)
 	CHECK_EQ((d + d2).as_decimal().value(), 9880000);
 }
 
+UNIT_TEST(variant_atom)
+{
+	variant a = variant::create_atom("abc");
+	variant b = variant::create_atom("abc");
+	variant c = variant::create_atom("abd");
+	variant s("abc");
+	CHECK_EQ(a.is_atom(), true);
+	CHECK_EQ(s.is_atom(), false);
+	CHECK_EQ(a, b);
+	CHECK_EQ(a, s);
+	CHECK_EQ(a == c, false);
+	CHECK_EQ(a < c, true);
+	CHECK_EQ(c < a, false);
+	CHECK_EQ(a < b, false);
+	CHECK_EQ(a <= b, true);
+
+	variant::debug_info info;
+	static const std::string filename = "test.cfg";
+	info.filename = &filename;
+	info.line = 5;
+	b.set_debug_info(info);
+	CHECK_EQ(b.is_atom(), true);
+	CHECK_EQ(a, b);
+	CHECK_EQ(b.get_debug_info()->line, 5);
+	CHECK_EQ(a.get_debug_info() == NULL, true);
+	CHECK_EQ(variant::create_atom("abc").get_debug_info() == NULL, true);
+
+	std::map<variant,variant> m;
+	m[variant("abd")] = variant(1);
+	m[a] = variant(2);
+	variant mv(&m);
+	CHECK_EQ(mv[variant::create_atom("abc")], variant(2));
+	CHECK_EQ(mv[variant::create_atom("abd")], variant(1));
+	CHECK_EQ(mv.get_keys()[0], a);
+	CHECK_EQ(mv.get_keys()[1], c);
+}
+
+UNIT_TEST(variant_map_index)
+{
+	std::map<variant,variant> expected;
+	std::map<variant,variant> empty;
+	variant m(&empty);
+	for(int n = 0; n != 2000; ++n) {
+		const int key = rand()%200;
+		variant k = (n%3 == 0) ? variant(formatter() << "key" << key) : variant(key);
+		if(n%4 == 0) {
+			expected.erase(k);
+			m = m.remove_attr(k);
+		} else {
+			expected[k] = variant(n);
+			m = m.add_attr(k, variant(n));
+		}
+
+		CHECK_EQ(m.num_elements(), expected.size());
+	}
+
+	for(int key = 0; key != 200; ++key) {
+		const variant int_key(key);
+		const variant str_key(formatter() << "key" << key);
+		std::map<variant,variant>::const_iterator i = expected.find(int_key);
+		std::map<variant,variant>::const_iterator j = expected.find(str_key);
+		CHECK_EQ(m.has_key(int_key), i != expected.end());
+		CHECK_EQ(m[int_key], i == expected.end() ? variant() : i->second);
+		CHECK_EQ(m[variant(decimal::from_int(key))], i == expected.end() ? variant() : i->second);
+		CHECK_EQ(m[str_key], j == expected.end() ? variant() : j->second);
+	}
+
+	CHECK_EQ(m, variant(&expected));
+}
+
+BENCHMARK(variant_atom_map_lookup)
+{
+	std::map<variant,variant> m;
+	std::vector<variant> keys;
+	for(int n = 0; n != 50; ++n) {
+		variant key = variant::create_atom(formatter() << "property_" << n);
+		m[key] = variant(n);
+		keys.push_back(key);
+	}
+
+	BENCHMARK_LOOP {
+		for(int n = 0; n != keys.size(); ++n) {
+			m.find(keys[n]);
+		}
+	}
+}
+
+BENCHMARK(variant_string_map_lookup)
+{
+	std::map<variant,variant> m;
+	std::vector<variant> keys;
+	for(int n = 0; n != 50; ++n) {
+		m[variant(formatter() << "property_" << n)] = variant(n);
+		keys.push_back(variant(formatter() << "property_" << n));
+	}
+
+	BENCHMARK_LOOP {
+		for(int n = 0; n != keys.size(); ++n) {
+			m.find(keys[n]);
+		}
+	}
+}
+
+BENCHMARK(variant_map_construct)
+{
+	std::map<variant,variant> m;
+	for(int n = 0; n != 10; ++n) {
+		m[variant::create_atom(formatter() << "property_" << n)] = variant(n);
+	}
+
+	BENCHMARK_LOOP {
+		std::map<variant,variant> items = m;
+		variant result(&items);
+	}
+}
+
+BENCHMARK(variant_map_add_attr)
+{
+	std::map<variant,variant> m;
+	for(int n = 0; n != 10; ++n) {
+		m[variant::create_atom(formatter() << "property_" << n)] = variant(n);
+	}
+
+	const variant base(&m);
+	const variant key = variant::create_atom("property_3");
+	BENCHMARK_LOOP {
+		//the map is shared with base, so this copies it.
+		variant copy = base;
+		copy.add_attr(key, variant(4));
+	}
+}
+
+BENCHMARK(variant_map_lookup)
+{
+	std::map<variant,variant> m;
+	std::vector<variant> keys;
+	for(int n = 0; n != 10; ++n) {
+		keys.push_back(variant::create_atom(formatter() << "property_" << n));
+		m[keys.back()] = variant(n);
+	}
+
+	const variant map(&m);
+	BENCHMARK_LOOP {
+		for(int n = 0; n != keys.size(); ++n) {
+			map[keys[n]];
+		}
+	}
+}
+
+UNIT_TEST(variant_inline_list)
+{
+	variant a = variant::create_list(variant(1), variant(2));
+	CHECK_EQ(a.num_elements(), 2);
+	CHECK_EQ(a[0], variant(1));
+	CHECK_EQ(a[1], variant(2));
+
+	std::vector<variant> items;
+	items.push_back(variant(1));
+	items.push_back(variant(2));
+	CHECK_EQ(a, variant(&items));
+
+	variant b = a + a;
+	CHECK_EQ(b.num_elements(), 4);
+	CHECK_EQ(b[3], variant(2));
+	CHECK_EQ(b.get_list_slice(1, 3), variant::create_list(variant(2), variant(1)));
+
+	variant c = a;
+	c.make_unique();
+	CHECK_EQ(c, a);
+	CHECK_EQ(c.as_list().size(), 2);
+
+	variant empty = variant::create_list(NULL, NULL);
+	CHECK_EQ(empty.num_elements(), 0);
+	CHECK_EQ(empty.as_list().empty(), true);
+}
+
+BENCHMARK(variant_small_list)
+{
+	BENCHMARK_LOOP {
+		for(int n = 0; n != 1000000; ++n) {
+			variant::create_list(variant(n), variant(n+1));
+		}
+	}
+}
+
+BENCHMARK(variant_small_list_from_vector)
+{
+	BENCHMARK_LOOP {
+		for(int n = 0; n != 1000000; ++n) {
+			std::vector<variant> v;
+			v.push_back(variant(n));
+			v.push_back(variant(n+1));
+			variant result(&v);
+		}
+	}
+}
+
 BENCHMARK(variant_assign)
 {
 	variant v(4);
@@ -35,6 +35,12 @@
 #include "formula_fwd.hpp"
 #include "reference_counted_object.hpp"
 
+#if defined(_MSC_VER)
+#define VARIANT_THREAD_LOCAL __declspec(thread)
+#else
+#define VARIANT_THREAD_LOCAL __thread
+#endif
+
 namespace game_logic {
 class formula_callable;
 class formula_expression;
@@ -57,14 +63,32 @@ std::string get_full_call_stack();
 
 const std::vector<CallStackEntry>& get_expression_call_stack();
 
+//If true the FFL call stack isn't tracked while expressions are evaluated.
+//Instead each expression records itself as an exception propagates out of
+//it, and the stack is reconstructed from those records when the error is
+//reported. Set with --ffl_lazy_call_stack.
+extern bool g_ffl_lazy_call_stack;
+
+//Expressions call clear_unwound_call_stack() when they start evaluating,
+//since any frames recorded by then belong to an exception which has
+//already been caught. The frames are kept per thread.
+void record_unwound_call_stack_frame(const game_logic::formula_expression* frame);
+void clear_unwound_call_stack();
+
 struct call_stack_manager {
-	explicit call_stack_manager(const game_logic::formula_expression* str, const game_logic::formula_callable* callable) {
-		push_call_stack(str, callable);
+	explicit call_stack_manager(const game_logic::formula_expression* str, const game_logic::formula_callable* callable) : pushed_(!g_ffl_lazy_call_stack) {
+		if(pushed_) {
+			push_call_stack(str, callable);
+		}
 	}
 
 	~call_stack_manager() {
-		pop_call_stack();
+		if(pushed_) {
+			pop_call_stack();
+		}
 	}
+private:
+	bool pushed_;
 };
 
 class variant;
@@ -120,10 +144,22 @@ public:
 	variant(int64_t n, DECIMAL_VARIANT_TYPE) : type_(VARIANT_TYPE_DECIMAL), decimal_value_(n) {}
 	explicit variant(const game_logic::formula_callable* callable);
 	explicit variant(std::vector<variant>* array);
+
+	//creates a list holding copies of the given elements. Lists of up to
+	//four elements are stored inside the list header, so creating them
+	//doesn't allocate memory.
+	static variant create_list(const variant* begin, const variant* end);
+	static variant create_list(const variant& a, const variant& b);
 	explicit variant(const char* str);
 	explicit variant(const std::string& str);
 	static variant create_translated_string(const std::string& str);
 	static variant create_translated_string(const std::string& str, const std::string& translation);
+
+	//creates an interned string. All atoms with the same text share one
+	//immutable string, so creating an atom doesn't allocate and comparing
+	//two atoms for equality is a pointer compare. Use for map keys,
+	//property and event names.
+	static variant create_atom(const std::string& str);
 	explicit variant(std::map<variant,variant>* map);
 	variant(const variant& formula_var, const game_logic::formula_callable& callable, int base_slot, const VariantFunctionTypeInfoPtr& type_info, const std::vector<std::string>& types, std::function<game_logic::const_formula_ptr(const std::vector<variant_type_ptr>&)> factory);
 	variant(const game_logic::const_formula_ptr& formula, const game_logic::formula_callable& callable, int base_slot, const VariantFunctionTypeInfoPtr& type_info);
@@ -170,6 +206,7 @@ public:
 	int& int_addr() { must_be(VARIANT_TYPE_INT); return int_value_; }
 
 	bool is_string() const { return type_ == VARIANT_TYPE_STRING; }
+	bool is_atom() const;
 	bool is_null() const { return type_ == VARIANT_TYPE_NULL; }
 	bool is_bool() const { return type_ == VARIANT_TYPE_BOOL; }
 	bool is_numeric() const { return is_int() || is_decimal(); }
@@ -223,6 +260,12 @@ public:
 	variant *get_attr_mutable(variant key);
 	variant *get_index_mutable(int index);
 
+	//how many times any map or list has been changed in place through the
+	//functions above, as a map's modcount is for that map. Lets a hash of
+	//a value be kept until something might have changed inside it, even
+	//in a nested map or list.
+	static unsigned int mutation_count();
+
 	const void* get_addr() const { return list_; }
 
 	//weaken returns a weak reference to the variant if it's some kind
@@ -302,6 +345,10 @@ public:
 	int refcount() const;
 	void make_unique();
 
+	//a hash which is consistent with operator<, so that any two keys a
+	//std::map would consider the same key have the same hash.
+	size_t hash() const;
+
 	std::string string_cast() const;
 
 	std::string to_debug_string(std::vector<const game_logic::formula_callable*>* seen=NULL) const;
@@ -339,6 +386,11 @@ public:
 	const debug_info* get_debug_info() const;
 	std::string debug_location() const;
 
+	//the location of a key of a map parsed from a document. Parsed keys
+	//are shared atoms, so their locations are kept with the map instead.
+	void set_key_debug_info(const variant& key, const debug_info& info);
+	const debug_info* get_key_debug_info(const variant& key) const;
+
 	//API for accessing formulas that are defined by this variant. The variant
 	//must be a string.
 	void add_formula_using_this(const game_logic::formula* f);
@@ -358,6 +410,10 @@ public:
 private:
 	void throw_type_error(TYPE expected) const;
 
+	//if this variant holds a shared atom, replaces it with a private copy
+	//of the atom so that it may be modified.
+	void unshare_atom();
+
 	TYPE type_;
 	union {
 		bool bool_value_;
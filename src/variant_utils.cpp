@@ -268,13 +268,13 @@ variant interpolate_variants(variant a, variant b, float ratiof)
 
 variant_builder& variant_builder::add_value(const std::string& name, const variant& val)
 {
-	attr_[variant(name)].push_back(val);
+	attr_[variant::create_atom(name)].push_back(val);
 	return *this;
 }
 
 variant_builder& variant_builder::set_value(const std::string& name, const variant& val)
 {
-	variant key(name);
+	variant key = variant::create_atom(name);
 	attr_.erase(key);
 	attr_[key].push_back(val);
 	return *this;
@@ -0,0 +1,186 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+	
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+#include "asserts.hpp"
+#include "foreach.hpp"
+#include "preferences.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+#include "worker_pool.hpp"
+
+PREF_INT(worker_threads, 0, "Number of threads to divide work such as building tiles between. 0 means one for each core");
+
+namespace worker_pool
+{
+
+namespace {
+
+//a set of jobs submitted by a call to run().
+struct batch {
+	const std::vector<boost::function<void()> >* jobs;
+
+	//the next job to be taken, and the number not yet finished.
+	int next, remaining;
+};
+
+//the pool is never shut down, since workers may be waiting on it as the
+//program exits, so these are never destroyed.
+threading::mutex* pool_mutex = NULL;
+threading::condition* jobs_available = NULL;
+threading::condition* batch_finished = NULL;
+
+//batches which still have jobs waiting to be taken.
+std::deque<batch*> batches;
+
+int nthreads = 0;
+
+//takes the next job of a batch. Must be called with pool_mutex locked.
+const boost::function<void()>& take_job(batch* b)
+{
+	const boost::function<void()>& job = (*b->jobs)[b->next++];
+	if(b->next == b->jobs->size()) {
+		batches.erase(std::find(batches.begin(), batches.end(), b));
+	}
+
+	return job;
+}
+
+void finish_job(batch* b)
+{
+	threading::lock lck(*pool_mutex);
+	if(--b->remaining == 0) {
+		batch_finished->notify_all();
+	}
+}
+
+void worker_thread_fn()
+{
+	for(;;) {
+		batch* b = NULL;
+		const boost::function<void()>* job = NULL;
+		{
+			threading::lock lck(*pool_mutex);
+			while(batches.empty()) {
+				jobs_available->wait(*pool_mutex);
+			}
+
+			b = batches.front();
+			job = &take_job(b);
+		}
+
+		(*job)();
+		finish_job(b);
+	}
+}
+
+void start_workers()
+{
+	nthreads = g_worker_threads > 0 ? g_worker_threads : SDL_GetCPUCount();
+	if(nthreads < 1) {
+		nthreads = 1;
+	}
+
+	pool_mutex = new threading::mutex;
+	jobs_available = new threading::condition;
+	batch_finished = new threading::condition;
+
+	for(int n = 1; n < nthreads; ++n) {
+		new threading::thread("worker_pool", worker_thread_fn);
+	}
+}
+
+}
+
+int num_threads()
+{
+	static threading::mutex* start_mutex = new threading::mutex;
+	threading::lock lck(*start_mutex);
+	if(nthreads == 0) {
+		start_workers();
+	}
+
+	return nthreads;
+}
+
+void run(const std::vector<boost::function<void()> >& jobs)
+{
+	if(jobs.size() <= 1 || num_threads() == 1) {
+		foreach(const boost::function<void()>& job, jobs) {
+			job();
+		}
+
+		return;
+	}
+
+	batch b = { &jobs, 0, static_cast<int>(jobs.size()) };
+
+	{
+		threading::lock lck(*pool_mutex);
+		batches.push_back(&b);
+		jobs_available->notify_all();
+	}
+
+	//work on our own jobs until they have all been taken.
+	for(;;) {
+		const boost::function<void()>* job = NULL;
+		{
+			threading::lock lck(*pool_mutex);
+			if(b.next == jobs.size()) {
+				break;
+			}
+
+			job = &take_job(&b);
+		}
+
+		(*job)();
+		finish_job(&b);
+	}
+
+	threading::lock lck(*pool_mutex);
+	while(b.remaining > 0) {
+		batch_finished->wait(*pool_mutex);
+	}
+}
+
+}
+
+namespace {
+void add_square(const std::vector<int>* input, std::vector<int>* output, int n)
+{
+	(*output)[n] = (*input)[n]*(*input)[n];
+}
+}
+
+UNIT_TEST(worker_pool_runs_every_job)
+{
+	std::vector<int> input, output(1000);
+	std::vector<boost::function<void()> > jobs;
+	for(int n = 0; n != 1000; ++n) {
+		input.push_back(n);
+		jobs.push_back(boost::bind(add_square, &input, &output, n));
+	}
+
+	worker_pool::run(jobs);
+	for(int n = 0; n != 1000; ++n) {
+		CHECK_EQ(output[n], n*n);
+	}
+}
@@ -0,0 +1,39 @@
+/*
+	Copyright (C) 2003-2013 by David White <davewx7@gmail.com>
+	
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef WORKER_POOL_HPP_INCLUDED
+#define WORKER_POOL_HPP_INCLUDED
+
+#include <vector>
+
+#include <boost/function.hpp>
+
+//A pool of worker threads shared by the whole game for work which can be
+//divided into independent jobs, such as building the tiles of a level.
+namespace worker_pool
+{
+
+//runs the jobs on the pool and waits for them all to finish. The calling
+//thread works on the jobs too, so this may be called from any thread. Jobs
+//must not write to anything another job reads or writes.
+void run(const std::vector<boost::function<void()> >& jobs);
+
+//the number of threads jobs are run on, including the calling thread.
+int num_threads();
+
+}
+
+#endif